@@ -7,9 +7,37 @@ gcc -c `ls ../src/miniupnpc/*.c` -DMINIUPNP_STATICLIB -DNDEBUG -Wall -s -O2
 cd ..
 ar rcs miniupnpc.a `ls obj/*.o` 
 
-# Build tincanphone
+# Build the phone engine (everything but the GUI) as a standalone library, miniupnpc included
+cd obj
+g++ -c `ls ../src/*.cpp` -I../src/ `pkg-config --cflags opus portaudio-2.0` -DMINIUPNP_STATICLIB -DNDEBUG -Wall -fexceptions -O2
+cd ..
 mkdir -p bin
-g++ -o bin/tincanphone `ls src/*.cpp` `ls src/Gtk/*.cpp` -Isrc/ miniupnpc.a `pkg-config --cflags --libs gtk+-3.0 opus portaudio-2.0` -DMINIUPNP_STATICLIB -DNDEBUG -Wall -fexceptions -s -O2
+ar rcs bin/libtincanphone.a `ls obj/*.o`
+
+# Build tincanphone
+g++ -o bin/tincanphone `ls src/Gtk/*.cpp` -Isrc/ bin/libtincanphone.a `pkg-config --cflags --libs gtk+-3.0 opus portaudio-2.0` -DMINIUPNP_STATICLIB -DNDEBUG -Wall -fexceptions -s -O2
+
+# Build tincanphone-cli, the headless frontend
+g++ -o bin/tincanphone-cli `ls src/Cli/*.cpp` -Isrc/ bin/libtincanphone.a `pkg-config --cflags --libs opus portaudio-2.0` -DMINIUPNP_STATICLIB -DNDEBUG -Wall -fexceptions -s -O2 -pthread
+
+# Build tincanphone-conference, the mixing host for conference calls
+g++ -o bin/tincanphone-conference `ls src/Conference/*.cpp` -Isrc/ bin/libtincanphone.a `pkg-config --cflags --libs opus portaudio-2.0` -DMINIUPNP_STATICLIB -DNDEBUG -Wall -fexceptions -s -O2 -pthread
+
+# Build tincanphone-relay, for phones that can't map a port
+g++ -o bin/tincanphone-relay `ls src/Relay/*.cpp` -Isrc/ bin/libtincanphone.a -DNDEBUG -Wall -fexceptions -s -O2 -pthread
+
+# Build benchmarks
+g++ -o bin/datagram_bench src/Bench/DatagramBench.cpp src/DatagramBatch.cpp src/Socket.cpp src/Clock.cpp -Isrc/ -DNDEBUG -Wall -s -O2
+g++ -o bin/portmap_bench src/Bench/PortMapBench.cpp src/Bench/NatPmpGateway.cpp src/NatPmp.cpp src/Socket.cpp src/Clock.cpp src/Thread.cpp -Isrc/ -DNDEBUG -Wall -s -O2 -pthread
+g++ -o bin/router_bench src/Bench/RouterBench.cpp src/Bench/IgdSimulator.cpp src/Router.cpp src/PortMapper.cpp src/Socket.cpp src/Clock.cpp src/Thread.cpp -Isrc/ miniupnpc.a -DMINIUPNP_STATICLIB -DNDEBUG -Wall -s -O2 -pthread
+g++ -o bin/quality_bench src/Bench/QualityBench.cpp -Isrc/ bin/libtincanphone.a `pkg-config --cflags --libs opus portaudio-2.0` -DMINIUPNP_STATICLIB -DNDEBUG -Wall -fexceptions -s -O2 -pthread
+g++ -o bin/soak_sim src/Bench/SoakSim.cpp -Isrc/ bin/libtincanphone.a `pkg-config --cflags --libs opus portaudio-2.0` -DMINIUPNP_STATICLIB -DNDEBUG -Wall -fexceptions -s -O2 -pthread
+g++ -o bin/alloc_check src/Bench/AllocCheck.cpp -Isrc/ bin/libtincanphone.a `pkg-config --cflags --libs opus portaudio-2.0` -DMINIUPNP_STATICLIB -DNDEBUG -Wall -fexceptions -s -O2 -pthread
+g++ -o bin/codec_bench src/Bench/CodecBench.cpp -Isrc/ bin/libtincanphone.a `pkg-config --cflags --libs opus portaudio-2.0` -DMINIUPNP_STATICLIB -DNDEBUG -Wall -fexceptions -s -O2 -pthread
+g++ -o bin/relay_bench src/Bench/RelayBench.cpp src/RelayServer.cpp src/DatagramBatch.cpp src/Socket.cpp src/Clock.cpp src/Thread.cpp src/Mutex.cpp -Isrc/ -DNDEBUG -Wall -s -O2 -pthread
+g++ -o bin/conference_bench src/Bench/ConferenceBench.cpp -Isrc/ bin/libtincanphone.a `pkg-config --cflags --libs opus portaudio-2.0` -DMINIUPNP_STATICLIB -DNDEBUG -Wall -fexceptions -s -O2 -pthread
+g++ -o bin/rate_sim src/Bench/RateSim.cpp -Isrc/ bin/libtincanphone.a `pkg-config --cflags --libs opus portaudio-2.0` -DMINIUPNP_STATICLIB -DNDEBUG -Wall -fexceptions -s -O2 -pthread
+g++ -o bin/load_gen src/Bench/LoadGenerator.cpp -Isrc/ bin/libtincanphone.a `pkg-config --cflags --libs opus portaudio-2.0` -DMINIUPNP_STATICLIB -DNDEBUG -Wall -fexceptions -s -O2 -pthread
 
 # Clean up
 rm obj/*.o
@@ -0,0 +1,47 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+
+namespace tincan {
+
+
+// A full duplex stream of 16-bit mono samples: a sound card, or a stand-in for tests and benchmarks
+class AudioDevice
+{
+public:
+	// Runs in the device's own thread for each buffer: input holds frames captured samples, output needs frames to play
+	// time is the stream time (see getTime) when input was captured; overflow is set if capture was lost before it
+	typedef void (*Callback)(const int16* input, int16* output, ulong frames, double time, bool overflow, void* arg);
+
+	virtual ~AudioDevice()  {} //Stops the stream
+
+	// Names of the devices in use, for the log
+	virtual string getInputName() const = 0;
+	virtual string getOutputName() const = 0;
+
+	// FALSE once start() has settled for playing only, when input is all silence
+	virtual bool hasInput() const  {return true;}
+
+	// Opens and starts the stream, throws on failure; framesPerBuffer 0 lets the device choose
+	// With a callback it drives the audio; without one use read() and write(), which wait on the device
+	virtual void start(uint sampleRate, ulong framesPerBuffer, Callback callback, void* arg) = 0;
+
+	// Seconds on the stream's clock
+	virtual double getTime() const = 0;
+
+	// Blocking mode only: samples read() can return without waiting
+	virtual long readAvailable() = 0;
+
+	// Blocking mode only: waits for frames samples of input, throws on error
+	virtual void read(int16* buffer, ulong frames) = 0;
+
+	// Blocking mode only: waits for room to queue frames samples of output, throws on error
+	// Returns false if the output ran dry since the last write
+	virtual bool write(const int16* buffer, ulong frames) = 0;
+};
+
+
+}
@@ -0,0 +1,239 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "AudioMixer.h"
+#include <algorithm>
+
+// The vector paths are compiled for their instruction sets function by function, so the rest of the
+// program needs no -msse2/-mavx2 and still runs on CPUs without them
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#	define TINCAN_MIXER_X86 1
+#	define TINCAN_TARGET(isa) __attribute__((target(isa)))
+#	include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#	define TINCAN_MIXER_X86 1
+#	define TINCAN_TARGET(isa)
+#	include <immintrin.h>
+#	include <intrin.h>
+#endif
+
+namespace tincan {
+
+
+static inline int16 saturate(int32 x)
+{
+	return int16(std::min(32767, std::max(-32768, x)));
+}
+
+// Each path sums a block of samples across all the frames in registers, then stores it once
+static void mixScalar(int32* sums, const int16* const* frames, uint count, uint begin, uint end)
+{
+	for (uint i = begin; i < end; ++i)
+	{
+		int32 sum = 0;
+		for (uint f = 0; f < count; ++f)
+			sum += frames[f][i];
+		sums[i] = sum;
+	}
+}
+
+static void outputScalar(const int32* sums, const int16* own, int16* out, uint begin, uint end)
+{
+	for (uint i = begin; i < end; ++i)
+		out[i] = saturate(own ? sums[i] - own[i] : sums[i]);
+}
+
+#ifdef TINCAN_MIXER_X86
+
+// SSE2 has no sign extension, so each sample goes into the top half of a 32-bit lane and is shifted down
+TINCAN_TARGET("sse2")
+static void mixSse2(int32* sums, const int16* const* frames, uint count, uint samples)
+{
+	const uint vectorEnd = samples & ~7u;
+	for (uint i = 0; i < vectorEnd; i += 8)
+	{
+		__m128i lo = _mm_setzero_si128();
+		__m128i hi = _mm_setzero_si128();
+		for (uint f = 0; f < count; ++f)
+		{
+			const __m128i x = _mm_loadu_si128((const __m128i*)(frames[f] + i));
+			lo = _mm_add_epi32(lo, _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+			hi = _mm_add_epi32(hi, _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+		}
+		_mm_storeu_si128((__m128i*)(sums + i), lo);
+		_mm_storeu_si128((__m128i*)(sums + i + 4), hi);
+	}
+	mixScalar(sums, frames, count, vectorEnd, samples);
+}
+
+TINCAN_TARGET("sse2")
+static void outputSse2(const int32* sums, const int16* own, int16* out, uint samples)
+{
+	const uint vectorEnd = samples & ~7u;
+	for (uint i = 0; i < vectorEnd; i += 8)
+	{
+		__m128i lo = _mm_loadu_si128((const __m128i*)(sums + i));
+		__m128i hi = _mm_loadu_si128((const __m128i*)(sums + i + 4));
+		if (own)
+		{
+			const __m128i x = _mm_loadu_si128((const __m128i*)(own + i));
+			lo = _mm_sub_epi32(lo, _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+			hi = _mm_sub_epi32(hi, _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+		}
+		_mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi32(lo, hi)); //Saturates
+	}
+	outputScalar(sums, own, out, vectorEnd, samples);
+}
+
+TINCAN_TARGET("avx2")
+static void mixAvx2(int32* sums, const int16* const* frames, uint count, uint samples)
+{
+	const uint vectorEnd = samples & ~15u;
+	for (uint i = 0; i < vectorEnd; i += 16)
+	{
+		__m256i lo = _mm256_setzero_si256();
+		__m256i hi = _mm256_setzero_si256();
+		for (uint f = 0; f < count; ++f)
+		{
+			lo = _mm256_add_epi32(lo, _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(frames[f] + i))));
+			hi = _mm256_add_epi32(hi, _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(frames[f] + i + 8))));
+		}
+		_mm256_storeu_si256((__m256i*)(sums + i), lo);
+		_mm256_storeu_si256((__m256i*)(sums + i + 8), hi);
+	}
+	mixScalar(sums, frames, count, vectorEnd, samples);
+}
+
+TINCAN_TARGET("avx2")
+static void outputAvx2(const int32* sums, const int16* own, int16* out, uint samples)
+{
+	const uint vectorEnd = samples & ~15u;
+	for (uint i = 0; i < vectorEnd; i += 16)
+	{
+		__m256i lo = _mm256_loadu_si256((const __m256i*)(sums + i));
+		__m256i hi = _mm256_loadu_si256((const __m256i*)(sums + i + 8));
+		if (own)
+		{
+			lo = _mm256_sub_epi32(lo, _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(own + i))));
+			hi = _mm256_sub_epi32(hi, _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(own + i + 8))));
+		}
+		// Packing works within each 128-bit half, so put the 64-bit quarters back in order after
+		const __m256i packed = _mm256_packs_epi32(lo, hi);
+		_mm256_storeu_si256((__m256i*)(out + i), _mm256_permute4x64_epi64(packed, 0xD8));
+	}
+	outputScalar(sums, own, out, vectorEnd, samples);
+}
+
+#endif
+
+
+AudioMixer::AudioMixer(uint maxSamples)
+: path(bestPath()),
+  samples(0),
+  sums(maxSamples, 0)
+{
+}
+
+AudioMixer::Path AudioMixer::bestPath()
+{
+	if (isSupported(AVX2))
+		return AVX2;
+	if (isSupported(SSE2))
+		return SSE2;
+	return SCALAR;
+}
+
+bool AudioMixer::isSupported(Path path)
+{
+	switch (path)
+	{
+	case SCALAR:
+		return true;
+
+#if defined(TINCAN_MIXER_X86) && !defined(_MSC_VER)
+	case SSE2:
+		return __builtin_cpu_supports("sse2");
+	case AVX2:
+		return __builtin_cpu_supports("avx2");
+
+#elif defined(TINCAN_MIXER_X86)
+	case SSE2:
+	{
+		int info[4];
+		__cpuid(info, 1);
+		return (info[3] >> 26) & 1;
+	}
+	case AVX2:
+	{
+		// The OS has to save the AVX registers too
+		int info[4];
+		__cpuid(info, 1);
+		if (!((info[2] >> 27) & 1) || (_xgetbv(0) & 6) != 6)
+			return false;
+		__cpuidex(info, 7, 0);
+		return (info[1] >> 5) & 1;
+	}
+#endif
+
+	default:
+		return false;
+	}
+}
+
+const char* AudioMixer::pathName(Path path)
+{
+	switch (path)
+	{
+	case SSE2: return "SSE2";
+	case AVX2: return "AVX2";
+	default:   return "scalar";
+	}
+}
+
+void AudioMixer::setPath(Path newPath)
+{
+	if (!isSupported(newPath))
+		throw std::runtime_error(string("This CPU or build can't mix with ") + pathName(newPath));
+	path = newPath;
+}
+
+void AudioMixer::mix(const int16* const* frames, uint count, uint frameSamples)
+{
+	if (frameSamples > sums.size())
+		throw std::runtime_error("Frame of " + toString(frameSamples) + " samples is too long to mix");
+	samples = frameSamples;
+
+	switch (path)
+	{
+#ifdef TINCAN_MIXER_X86
+	case AVX2: mixAvx2(&sums[0], frames, count, samples); break;
+	case SSE2: mixSse2(&sums[0], frames, count, samples); break;
+#endif
+	default:   mixScalar(&sums[0], frames, count, 0, samples); break;
+	}
+}
+
+void AudioMixer::getMix(int16* out) const
+{
+	output(NULL, out);
+}
+
+void AudioMixer::getMixWithout(const int16* own, int16* out) const
+{
+	output(own, out);
+}
+
+void AudioMixer::output(const int16* own, int16* out) const
+{
+	switch (path)
+	{
+#ifdef TINCAN_MIXER_X86
+	case AVX2: outputAvx2(&sums[0], own, out, samples); break;
+	case SSE2: outputSse2(&sums[0], own, out, samples); break;
+#endif
+	default:   outputScalar(&sums[0], own, out, 0, samples); break;
+	}
+}
+
+
+}
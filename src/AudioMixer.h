@@ -0,0 +1,49 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+
+namespace tincan {
+
+
+// Mixes a conference's 16-bit PCM: the sum of the speakers' frames, and for each speaker that sum less
+// their own voice, which is what they should hear (an N-1 mix). Sums are kept in 32 bits, so nothing
+// clips until the output is saturated back to 16 bits. SSE2 and AVX2 paths are picked at runtime,
+// on x86 with GCC, Clang or MSVC; anything else uses the scalar path
+class AudioMixer
+{
+public:
+	enum Path { SCALAR, SSE2, AVX2 };
+
+	explicit AudioMixer(uint maxSamples);
+
+	// The fastest path this build and CPU support, which new mixers use
+	static Path bestPath();
+	static bool isSupported(Path path);
+	static const char* pathName(Path path);
+
+	// For benchmarks; throws if the path isn't supported
+	void setPath(Path path);
+	Path getPath() const  {return path;}
+
+	// Sum count frames of samples each (at most maxSamples); count may be 0 for silence
+	void mix(const int16* const* frames, uint count, uint samples);
+
+	// What the last mix() summed, saturated
+	void getMix(int16* out) const;
+
+	// The same without own, one of the frames given to mix()
+	void getMixWithout(const int16* own, int16* out) const;
+
+protected:
+	Path          path;
+	uint          samples;
+	vector<int32> sums;
+
+	void output(const int16* own, int16* out) const;
+};
+
+
+}
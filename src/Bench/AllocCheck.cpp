@@ -0,0 +1,283 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "Phone.h"
+#include "LoopbackNetwork.h"
+#include "VirtualAudioDevice.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+// Checks a LIVE call never touches the heap: two Phones in one thread call each other over a LoopbackNetwork on a
+// virtual clock, and every operator new they (or their audio callbacks) make between both going LIVE and the
+// hangup is counted. The simulated network's own allocations don't count. Runs the call on a perfect network and
+// then on a lossy, jittery one, so concealment, FEC and rate adaptation get their turn, and exits with
+// EXIT_ALLOCATED if anything was allocated
+using namespace tincan;
+
+enum {
+	DEFAULT_MINUTES = 5,
+	LOG_MS = 1000,        //How often the Phones' logs are read, outside the counted part
+	TALK_MS = 2000,       //The microphones talk this long, then pause for PAUSE_MS, so DTX gets exercised too
+	PAUSE_MS = 1000,
+	START_TIME = 1000000, //Virtual Clock start, anything nonzero
+	EXIT_ALLOCATED = 2
+};
+
+static const char DEFAULT_IMPAIRMENT[] = "loss=2,burst-start=1,burst-end=30,jitter=15,reorder=1";
+
+static const char USAGE[] =
+	"Usage: alloc_check [options]\n"
+	"  -m, --minutes N            Simulated length of each call (default 5)\n"
+	"  -f, --frame MS             Packet duration of the calls (default 20)\n"
+	"  -i, --impair SPEC          The impaired network for the second call (default loss=2,burst-start=1,\n"
+	"                             burst-end=30,jitter=15,reorder=1), see soak_sim --help for the keys\n"
+	"  -a, --abort                Abort at the first allocation, for a debugger's backtrace\n";
+
+
+// Counted only while a Phone is running in the LIVE part of the call
+static bool   counting = false;
+static bool   armed = false;
+static ulong  allocations = 0;
+static size_t allocatedBytes = 0;
+static bool   abortOnAllocation = false;
+
+void* operator new(size_t size)
+{
+	if (counting)
+	{
+		if (abortOnAllocation)
+			abort();
+		++allocations;
+		allocatedBytes += size;
+	}
+	void* block = malloc(size ? size : 1);
+	if (!block)
+		throw std::bad_alloc();
+	return block;
+}
+
+void operator delete(void* ptr) throw()
+{
+	// Through a volatile, or GCC sees what operator new returned going to free() and warns
+	void* volatile block = ptr;
+	free(block);
+}
+
+void* operator new[](size_t size)                   {return operator new(size);}
+void  operator delete[](void* ptr) throw()          {operator delete(ptr);}
+void  operator delete(void* ptr, size_t) throw()    {operator delete(ptr);}
+void  operator delete[](void* ptr, size_t) throw()  {operator delete(ptr);}
+
+// Counts allocations for as long as it's in scope, if the LIVE part has begun
+struct Counted
+{
+	Counted()   {counting = armed;}
+	~Counted()  {counting = false;}
+};
+
+// Stops counting for as long as it's in scope
+struct Uncounted
+{
+	bool was;
+	Uncounted() : was(counting)  {counting = false;}
+	~Uncounted()  {counting = was;}
+};
+
+
+// The simulated network allocates for every datagram, which is the simulation rather than the Phone
+class UncountedTransport : public Transport
+{
+public:
+	explicit UncountedTransport(Transport* inner) : inner(inner)  {}
+	~UncountedTransport()  {delete inner;}
+
+	uint16 bind(uint16 firstPort, uint16 lastPort)  {Uncounted u; return inner->bind(firstPort, lastPort);}
+	SOCKET getFd() const  {return inner->getFd();}
+	int receive(DatagramBatch& batch)  {Uncounted u; return inner->receive(batch);}
+	int send(DatagramBatch& batch)  {Uncounted u; return inner->send(batch);}
+	int sendTo(const void* data, uint size, const sockaddr_storage& to)  {Uncounted u; return inner->sendTo(data, size, to);}
+
+protected:
+	Transport* inner;
+};
+
+
+// Talks a wobbling tone for TALK_MS, then is silent for PAUSE_MS
+class TalkingAudioDevice : public VirtualAudioDevice
+{
+public:
+	TalkingAudioDevice(double hz) : hz(hz), sample(0)  {}
+	string getInputName() const   {return "virtual";}
+	string getOutputName() const  {return "virtual";}
+
+protected:
+	double hz;
+	uint64 sample;
+
+	void capture(int16* buffer, ulong frames)
+	{
+		const uint64 period = uint64(TALK_MS + PAUSE_MS) * SAMPLE_RATE / 1000;
+		for (ulong s = 0; s < frames; ++s, ++sample)
+		{
+			const double t = double(sample) / SAMPLE_RATE;
+			const bool talking = (sample % period) < uint64(TALK_MS) * SAMPLE_RATE / 1000;
+			buffer[s] = talking ? int16(8000 * sin(2 * 3.14159265 * hz * t * (1 + 0.1 * sin(2 * 3.14159265 * 3 * t)))) : 0;
+		}
+	}
+
+	void play(const int16*, ulong)  {}
+};
+
+
+// Returns the allocations made while LIVE, or throws if the call didn't connect or dropped
+static ulong runCall(uint minutes, uint frameMs, const Impairment* impairment)
+{
+	Clock::setVirtual(START_TIME);
+	allocations = 0;
+	allocatedBytes = 0;
+
+	LoopbackNetwork network(false);
+	if (impairment)
+		network.setImpairment(*impairment);
+
+	Phone caller, callee;
+	TalkingAudioDevice* callerAudio = new TalkingAudioDevice(200);
+	TalkingAudioDevice* calleeAudio = new TalkingAudioDevice(330);
+	caller.setAudioDevice(callerAudio);
+	callee.setAudioDevice(calleeAudio);
+	caller.setTransport(new UncountedTransport(network.createEndpoint("10.0.0.1")));
+	callee.setTransport(new UncountedTransport(network.createEndpoint("10.0.0.2")));
+	caller.disablePortMapping();
+	callee.disablePortMapping();
+	Phone::CallParams params;
+	params.frameMs = frameMs;
+	caller.setCallParams(params);
+
+	caller.startup();
+	callee.startup();
+	caller.setCommand(Phone::CMD_CALL, "10.0.0.2");
+
+	const uint64 length = uint64(minutes) * 60 * 1000 * Clock::MS;
+	uint64 liveSince = 0, nextLog = 0;
+	bool answered = false;
+	for (uint64 now = START_TIME; ; )
+	{
+		{
+			Counted c;
+			caller.step();
+			callee.step();
+		}
+
+		// Reading the logs allocates, as a frontend would in its own thread
+		if (now >= nextLog)
+		{
+			caller.readLog();
+			callee.readLog();
+			nextLog = now + LOG_MS * Clock::MS;
+		}
+
+		const Phone::State callerState = caller.getState(), calleeState = callee.getState();
+		if (!liveSince)
+		{
+			if (calleeState == Phone::RINGING && !answered)
+				answered = callee.setCommand(Phone::CMD_ANSWER);
+			if (callerState == Phone::LIVE && calleeState == Phone::LIVE)
+			{
+				// From the next step on, everything the Phones do counts
+				liveSince = now;
+				armed = true;
+			}
+			else if (now - START_TIME > 10 * 1000 * Clock::MS)
+				throw std::runtime_error("The call didn't connect");
+		}
+		else if (callerState != Phone::LIVE || calleeState != Phone::LIVE)
+		{
+			armed = false;
+			throw std::runtime_error("The call dropped after " + toString((now - liveSince) / (1000 * Clock::MS)) + "s");
+		}
+		else if (now >= liveSince + length)
+			break;
+
+		// Move the clock on to whatever happens next
+		const uint64 arrival = network.deliver();
+		uint64 next = std::min(callerAudio->getNextTick(), calleeAudio->getNextTick());
+		if (arrival && arrival < next)
+			next = arrival;
+		if (next > now)
+		{
+			now = next;
+			Clock::advance(now);
+		}
+
+		Counted c;
+		if (callerAudio->getNextTick() <= now)
+			callerAudio->tick();
+		if (calleeAudio->getNextTick() <= now)
+			calleeAudio->tick();
+		Uncounted u;
+		network.deliver();
+	}
+
+	armed = false;
+	caller.setCommand(Phone::CMD_HANGUP);
+	caller.setCommand(Phone::CMD_EXIT);
+	callee.setCommand(Phone::CMD_EXIT);
+	caller.step();
+	callee.step();
+	return allocations;
+}
+
+int main(int argc, char* argv[])
+{
+	uint minutes = DEFAULT_MINUTES;
+	uint frameMs = PACKET_MS;
+	string impairSpec = DEFAULT_IMPAIRMENT;
+	for (int i = 1; i < argc; ++i)
+	{
+		const string arg = argv[i];
+		const bool hasValue = (i + 1 < argc);
+		if ((arg == "-m" || arg == "--minutes") && hasValue)
+			minutes = uint(atoi(argv[++i]));
+		else if ((arg == "-f" || arg == "--frame") && hasValue)
+			frameMs = uint(atoi(argv[++i]));
+		else if ((arg == "-i" || arg == "--impair") && hasValue)
+			impairSpec = argv[++i];
+		else if (arg == "-a" || arg == "--abort")
+			abortOnAllocation = true;
+		else
+		{
+			const bool help = (arg == "-h" || arg == "--help");
+			fputs(USAGE, help ? stdout : stderr);
+			return help ? 0 : 1;
+		}
+	}
+
+	int result = 0;
+	try
+	{
+		Phone::CallParams params;
+		params.frameMs = frameMs;
+		if (!minutes || !params.isValid())
+			throw std::runtime_error("Invalid option, see --help");
+		const Impairment impairment = Impairment::parse(impairSpec);
+
+		for (int impaired = 0; impaired < 2; ++impaired)
+		{
+			const ulong count = runCall(minutes, frameMs, impaired ? &impairment : NULL);
+			printf("%u minute %ums call, %s: %lu allocations (%lu bytes) while LIVE%s\n", minutes, frameMs,
+			       impaired ? ("network " + impairSpec).c_str() : "perfect network", count, ulong(allocatedBytes),
+			       count ? ", run with --abort in a debugger to see where" : "");
+			if (count)
+				result = EXIT_ALLOCATED;
+		}
+	}
+	catch (std::exception& ex)
+	{
+		fprintf(stderr, "Error: %s\n", ex.what());
+		return 1;
+	}
+	return result;
+}
@@ -0,0 +1,532 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "Phone.h"
+#include "JitterBuffer.h"
+#include "LoopbackNetwork.h"
+#include "VirtualAudioDevice.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+// Times the per-packet work of a call, one core, no network: opus encode and decode at each complexity
+// and bitrate, the JitterBuffer with packets in order, reordered and lost, Phone's receive path from
+// datagram to jitter buffer, and ringtone playout. Reports ns per packet and how many calls that leaves
+// room for on one core
+using namespace tincan;
+
+enum {
+	DEFAULT_FRAMES = 1000,  //Packets timed per case
+	WARMUP_FRAMES = 50,
+	BATCH = 100,            //Cheap operations are timed this many at a time
+	REORDER_PERCENT = 10,
+	LOSS_PERCENT = 5
+};
+
+static const int BITRATES[] = { 12000, 24000, 32000, 64000 };
+static const uint BITRATE_COUNT = sizeof(BITRATES) / sizeof(BITRATES[0]);
+
+static const char USAGE[] =
+	"Usage: codec_bench [options]\n"
+	"  -n, --frames N             Packets timed per case (default 1000)\n"
+	"  -f, --frame MS             Packet duration (default 20)\n"
+	"  -l, --low-delay            Use OPUS_APPLICATION_RESTRICTED_LOWDELAY like a low delay call\n";
+
+
+// Clock only has microseconds, too coarse for most of what's timed here
+static uint64 nowNs()
+{
+	return uint64(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+static double percentile(vector<double> samples, uint percent)
+{
+	if (samples.empty())
+		return 0;
+	std::sort(samples.begin(), samples.end());
+	return samples[std::min(samples.size() - 1, samples.size() * percent / 100)];
+}
+
+static double mean(const vector<double>& samples)
+{
+	double sum = 0;
+	for (size_t i = 0; i < samples.size(); ++i)
+		sum += samples[i];
+	return samples.empty() ? 0 : sum / samples.size();
+}
+
+static void printHeader(const char* title)
+{
+	printf("\n%-30s %10s %10s %10s %10s %10s\n", title, "mean ns", "p50", "p95", "p99", "max");
+}
+
+// Returns the mean
+static double report(const string& name, const vector<double>& ns, const string& detail = "")
+{
+	const double avg = mean(ns);
+	printf("%-30s %10.0f %10.0f %10.0f %10.0f %10.0f  %s\n", name.c_str(), avg, percentile(ns, 50),
+	       percentile(ns, 95), percentile(ns, 99), percentile(ns, 100), detail.c_str());
+	return avg;
+}
+
+// Linear congruential, so every run encodes the same signal; returns [0, 1)
+static double nextRandom(uint32& state)
+{
+	state = state * 1664525u + 1013904223u;
+	return double(state >> 8) / double(1 << 24);
+}
+
+// Voiced syllables with gaps, like QualityBench's reference but cheaper to make; the gaps matter since
+// opus spends far less on silence (and DTX) than on speech
+static void synthesizeSpeech(vector<int16>& out, size_t samples)
+{
+	const double PI = 3.14159265358979;
+	out.assign(samples, 0);
+
+	uint32 rng = 12345;
+	size_t pos = 0;
+	while (pos < samples)
+	{
+		const size_t length = size_t((0.08 + 0.22 * nextRandom(rng)) * SAMPLE_RATE);
+		const size_t gap = size_t((0.02 + 0.13 * nextRandom(rng)) * SAMPLE_RATE);
+		const double pitch = 90 + 160 * nextRandom(rng);
+
+		double phase = 0;
+		for (size_t s = 0; s < length && pos + s < samples; ++s)
+		{
+			phase += 2 * PI * pitch / SAMPLE_RATE;
+			const double t = double(s) / length;
+			double sample = 0;
+			for (uint h = 1; h <= 8; ++h)
+				sample += sin(h * phase) / h;
+			sample += 0.05 * (nextRandom(rng) - 0.5);
+			out[pos + s] = int16(sample * sqrt(sin(PI * t)) * 8000);
+		}
+		pos += length + gap;
+	}
+}
+
+
+struct Encoded
+{
+	vector<byte> data;
+	vector<uint> sizes;
+	uint         maxBytes;
+	Encoded() : maxBytes(ENCODED_MAX_BYTES)  {}
+	const byte* packet(uint i) const  {return &data[i * maxBytes];}
+};
+
+static void checkOpus(int err, const char* what)
+{
+	if (err < 0)
+		throw std::runtime_error(string(what) + " error: " + opus_strerror(err));
+}
+
+// Set up like Phone::initEncoder
+static OpusEncoder* createEncoder(int application, int complexity, int bitrate)
+{
+	int err = OPUS_OK;
+	OpusEncoder* encoder = opus_encoder_create(SAMPLE_RATE, CHANNELS, application, &err);
+	checkOpus(err, "opus_encoder_create");
+	checkOpus(opus_encoder_ctl(encoder, OPUS_SET_INBAND_FEC(1)), "opus_encoder_ctl");
+	checkOpus(opus_encoder_ctl(encoder, OPUS_SET_PACKET_LOSS_PERC(EXPECTED_LOSS_PERC)), "opus_encoder_ctl");
+	checkOpus(opus_encoder_ctl(encoder, OPUS_SET_DTX(1)), "opus_encoder_ctl");
+	checkOpus(opus_encoder_ctl(encoder, OPUS_SET_COMPLEXITY(complexity)), "opus_encoder_ctl");
+	checkOpus(opus_encoder_ctl(encoder, OPUS_SET_BITRATE(bitrate)), "opus_encoder_ctl");
+	return encoder;
+}
+
+// Returns ns per packet; keeps the packets for the decode benchmarks
+static vector<double> benchEncode(const vector<int16>& speech, uint frameSamples, uint frames, int application,
+                                  int complexity, int bitrate, Encoded& encoded, double& meanBytes)
+{
+	OpusEncoder* encoder = createEncoder(application, complexity, bitrate);
+	encoded.data.resize(size_t(frames) * encoded.maxBytes);
+	encoded.sizes.resize(frames);
+
+	const uint packetsInSpeech = uint(speech.size() / frameSamples);
+	vector<double> ns;
+	ns.reserve(frames);
+	double bytes = 0;
+	for (uint i = 0; i < WARMUP_FRAMES + frames; ++i)
+	{
+		const int16* pcm = &speech[(i % packetsInSpeech) * frameSamples];
+		byte* out = (i < WARMUP_FRAMES) ? &encoded.data[0] : &encoded.data[(i - WARMUP_FRAMES) * encoded.maxBytes];
+
+		const uint64 start = nowNs();
+		const opus_int32 size = opus_encode(encoder, pcm, frameSamples, out, encoded.maxBytes);
+		const uint64 elapsed = nowNs() - start;
+		checkOpus(size, "opus_encode");
+
+		if (i >= WARMUP_FRAMES)
+		{
+			ns.push_back(double(elapsed));
+			encoded.sizes[i - WARMUP_FRAMES] = uint(size);
+			bytes += size;
+		}
+	}
+	opus_encoder_destroy(encoder);
+	meanBytes = bytes / frames;
+	return ns;
+}
+
+enum DecodeMode { DECODE_NORMAL, DECODE_FEC, DECODE_PLC };
+
+static vector<double> benchDecode(const Encoded& encoded, uint frameSamples, DecodeMode mode)
+{
+	int err = OPUS_OK;
+	OpusDecoder* decoder = opus_decoder_create(SAMPLE_RATE, CHANNELS, &err);
+	checkOpus(err, "opus_decoder_create");
+
+	const uint frames = uint(encoded.sizes.size());
+	vector<opus_int16> pcm(PACKET_SAMPLES_MAX);
+	vector<double> ns;
+	ns.reserve(frames);
+	for (uint i = 0; i < frames; ++i)
+	{
+		// FEC decodes a lost packet from the one after it, PLC has nothing to go on, as in Phone::decodeReceivedAudio
+		const uint64 start = nowNs();
+		opus_int32 ret;
+		if (mode == DECODE_NORMAL)
+			ret = opus_decode(decoder, encoded.packet(i), encoded.sizes[i], &pcm[0], PACKET_SAMPLES_MAX, 0);
+		else if (mode == DECODE_FEC && i + 1 < frames)
+			ret = opus_decode(decoder, encoded.packet(i + 1), encoded.sizes[i + 1], &pcm[0], frameSamples, 1);
+		else
+			ret = opus_decode(decoder, NULL, 0, &pcm[0], frameSamples, 0);
+		const uint64 elapsed = nowNs() - start;
+		checkOpus(ret, "opus_decode");
+		ns.push_back(double(elapsed));
+	}
+	opus_decoder_destroy(decoder);
+	return ns;
+}
+
+
+// Arrival order of seqs 0..count-1 (some missing) for one of the JitterBuffer cases
+static vector<uint32> arrivalOrder(uint count, uint reorderPercent, uint lossPercent)
+{
+	uint32 rng = 777;
+	vector<uint32> order;
+	for (uint32 seq = 0; seq < count; ++seq)
+		if (nextRandom(rng) * 100 >= lossPercent)
+			order.push_back(seq);
+
+	// A reordered packet swaps places with the one after it
+	for (size_t i = 0; i + 1 < order.size(); ++i)
+	{
+		if (nextRandom(rng) * 100 < reorderPercent)
+		{
+			std::swap(order[i], order[i + 1]);
+			++i;
+		}
+	}
+	return order;
+}
+
+// Insert as packets arrive, and as each arrives take one off the front the way decodeReceivedAudio does,
+// with the buffer kept a few packets deep; ns per packet, timed BATCH packets at a time
+static vector<double> benchJitterBuffer(const vector<uint32>& order, uint frameMs, uint32 firstSeq, const byte* payload, uint payloadSize)
+{
+	JitterBuffer buffer(JITTER_BUFFER_PACKETS, ENCODED_MAX_BYTES);
+	buffer.reset(firstSeq, frameMs);
+
+	const uint64 frameUs = uint64(frameMs) * Clock::MS;
+	uint64 arrival = 1000000;
+	ulong found = 0;
+	vector<double> ns;
+	for (size_t i = 0; i + BATCH <= order.size(); i += BATCH)
+	{
+		const uint64 start = nowNs();
+		for (size_t j = i; j < i + BATCH; ++j)
+		{
+			arrival += frameUs;
+			buffer.insert(firstSeq + order[j], payload, payloadSize, arrival);
+			if (buffer.buffered() > buffer.targetDelay())
+			{
+				uint size = 0;
+				found += (buffer.get(buffer.frontSeq(), size) || buffer.get(buffer.frontSeq() + 1, size)) ? 1 : 0;
+				buffer.pop();
+			}
+		}
+		ns.push_back(double(nowNs() - start) / BATCH);
+	}
+
+	if (!found)
+		throw std::runtime_error("JitterBuffer benchmark played nothing");
+	return ns;
+}
+
+
+// A silent sound card that only runs when ticked, which the benchmarks never do, so Phone's rings
+// are left alone for them
+class IdleAudioDevice : public VirtualAudioDevice
+{
+public:
+	string getInputName() const  {return "(idle)";}
+	string getOutputName() const  {return "(idle)";}
+
+protected:
+	void capture(int16* buffer, ulong frames)  {memset(buffer, 0, frames * sizeof(int16));}
+	void play(const int16*, ulong)  {}
+};
+
+// Reaches into Phone for the parts the benchmarks time
+class BenchPhone : public Phone
+{
+public:
+	explicit BenchPhone(LoopbackNetwork& network)
+	{
+		setAudioDevice(new IdleAudioDevice);
+		setTransport(network.createEndpoint("10.0.0.1"));
+		disablePortMapping();
+		startup();
+	}
+
+	// LIVE with peer without the call setup handshake
+	void goLive(const sockaddr_storage& peer, uint frameMs, bool lowDelay)
+	{
+		if (state != HUNGUP)
+			hangup();
+		address = peer;
+		callParams.frameMs = frameMs;
+		callParams.lowDelay = lowDelay;
+		Phone::goLive();
+	}
+
+	// Same as run() does for each datagram, then play the front packet like decodeReceivedAudio (but without decoding)
+	void receive(byte* datagram, uint size, const sockaddr_storage& from)
+	{
+		receiveDatagram(datagram, size, from);
+		if (audiobuf.buffered() > audiobuf.targetDelay())
+			audiobuf.pop();
+	}
+
+	ulong buffered() const  {return audiobuf.buffered();}
+
+	void ring()
+	{
+		if (state != HUNGUP)
+			hangup();
+		startRinging();
+	}
+
+	// One packet of ringtone, then empty the playout ring as the audio callback would
+	void ringtone()
+	{
+		playRingtone();
+		playoutRing.discard(playoutRing.readAvailable());
+	}
+
+	void tones()  {generateTones();}
+
+	static uint32 audioHeader()  {return Packet::AUDIO;}
+	static uint audioHeaderSize()  {return offsetof(Packet, data);}
+};
+
+static sockaddr_storage makeAddress(const char* ip, uint16 port)
+{
+	sockaddr_storage storage;
+	memset(&storage, 0, sizeof(storage));
+	sockaddr_in& addr = reinterpret_cast<sockaddr_in&>(storage);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	inet_pton(AF_INET, ip, &addr.sin_addr);
+	return storage;
+}
+
+// AUDIO datagrams as they come off the wire, through Phone's receive path; ns per packet
+static vector<double> benchReceive(BenchPhone& phone, const vector<uint32>& order, uint32 firstSeq,
+                                   const sockaddr_storage& peer, const byte* payload, uint payloadSize)
+{
+	// Aligned for Packet, since receiveDatagram byte swaps the header in place
+	const uint datagramSize = BenchPhone::audioHeaderSize() + payloadSize;
+	const uint stride = (datagramSize + 7) & ~7u;
+	vector<uint64> datagrams(size_t(BATCH) * stride / sizeof(uint64));
+
+	vector<double> ns;
+	for (size_t i = 0; i + BATCH <= order.size(); i += BATCH)
+	{
+		// Build the next batch as the peer would have sent it, outside the timing
+		for (uint j = 0; j < BATCH; ++j)
+		{
+			byte* datagram = (byte*)&datagrams[0] + j * stride;
+			const uint32 header = htonl(BenchPhone::audioHeader()), seq = htonl(firstSeq + order[i + j]);
+			memcpy(datagram, &header, sizeof(header));
+			memcpy(datagram + sizeof(header), &seq, sizeof(seq));
+			memcpy(datagram + BenchPhone::audioHeaderSize(), payload, payloadSize);
+		}
+
+		const uint64 start = nowNs();
+		for (uint j = 0; j < BATCH; ++j)
+			phone.receive((byte*)&datagrams[0] + j * stride, datagramSize, peer);
+		ns.push_back(double(nowNs() - start) / BATCH);
+	}
+
+	if (!phone.buffered())
+		throw std::runtime_error("Phone didn't buffer any AUDIO packets");
+	return ns;
+}
+
+static vector<double> benchRingtone(BenchPhone& phone, uint frames)
+{
+	phone.ring();
+
+	vector<double> ns;
+	for (uint i = 0; i + BATCH <= frames; i += BATCH)
+	{
+		const uint64 start = nowNs();
+		for (uint j = 0; j < BATCH; ++j)
+			phone.ringtone();
+		ns.push_back(double(nowNs() - start) / BATCH);
+	}
+	return ns;
+}
+
+static vector<double> benchTones(BenchPhone& phone, uint rounds)
+{
+	vector<double> ns;
+	for (uint i = 0; i < rounds; ++i)
+	{
+		const uint64 start = nowNs();
+		phone.tones();
+		ns.push_back(double(nowNs() - start));
+	}
+	return ns;
+}
+
+
+struct Options
+{
+	uint frames;
+	uint frameMs;
+	bool lowDelay;
+	Options() : frames(DEFAULT_FRAMES), frameMs(PACKET_MS), lowDelay(false)  {}
+};
+
+static int bench(const Options& options)
+{
+	const uint frameSamples = options.frameMs * (SAMPLE_RATE / 1000);
+	const double frameNs = options.frameMs * 1e6;
+	const int application = options.lowDelay ? OPUS_APPLICATION_RESTRICTED_LOWDELAY : OPUS_APPLICATION_VOIP;
+
+	vector<int16> speech;
+	synthesizeSpeech(speech, 10 * SAMPLE_RATE);
+
+	printf("%ums packets, %u timed per case, %s; calls/core counts one encode and one decode per packet\n",
+	       options.frameMs, options.frames, options.lowDelay ? "low delay" : "VoIP");
+
+	// Every complexity at every bitrate; decoding barely depends on the encoder's complexity,
+	// so it's timed once per bitrate with the packets from complexity 10
+	vector<Encoded> decodeInput(BITRATE_COUNT);
+	vector<double> encodeMeans(BITRATE_COUNT * 11);
+	for (uint b = 0; b < BITRATE_COUNT; ++b)
+	{
+		char title[64];
+		snprintf(title, sizeof(title), "opus_encode %dkbps", BITRATES[b] / 1000);
+		printHeader(title);
+		for (int complexity = 0; complexity <= 10; ++complexity)
+		{
+			Encoded encoded;
+			double bytes = 0;
+			const vector<double> ns = benchEncode(speech, frameSamples, options.frames, application, complexity, BITRATES[b], encoded, bytes);
+			encodeMeans[b * 11 + complexity] = report("  complexity " + toString(complexity), ns, toString(int(bytes + 0.5)) + " bytes/packet");
+			if (complexity == 10)
+				decodeInput[b] = encoded;
+		}
+	}
+
+	printHeader("opus_decode");
+	vector<double> decodeMeans(BITRATE_COUNT);
+	for (uint b = 0; b < BITRATE_COUNT; ++b)
+		decodeMeans[b] = report("  " + toString(BITRATES[b] / 1000) + "kbps", benchDecode(decodeInput[b], frameSamples, DECODE_NORMAL));
+	report("  lost, from FEC (24kbps)", benchDecode(decodeInput[1], frameSamples, DECODE_FEC));
+	report("  lost, concealed", benchDecode(decodeInput[1], frameSamples, DECODE_PLC));
+
+	// Payloads the size a call at 24kbps sends
+	const Encoded& typical = decodeInput[1];
+	const byte* payload = typical.packet(0);
+	const uint payloadSize = typical.sizes[0];
+	const uint packets = std::max<uint>(options.frames, BATCH) * 10;
+	const uint32 firstSeq = 0xFFFFFFFFu - packets / 2; //Sequence numbers wrap halfway through
+
+	const vector<uint32> inOrder = arrivalOrder(packets, 0, 0);
+	const vector<uint32> reordered = arrivalOrder(packets, REORDER_PERCENT, 0);
+	const vector<uint32> lossy = arrivalOrder(packets, 0, LOSS_PERCENT);
+
+	printHeader("JitterBuffer insert+pop");
+	const double bufferNs = report("  in order", benchJitterBuffer(inOrder, options.frameMs, firstSeq, payload, payloadSize));
+	report("  " + toString(int(REORDER_PERCENT)) + "% reordered", benchJitterBuffer(reordered, options.frameMs, firstSeq, payload, payloadSize));
+	report("  " + toString(int(LOSS_PERCENT)) + "% lost", benchJitterBuffer(lossy, options.frameMs, firstSeq, payload, payloadSize));
+
+	LoopbackNetwork network;
+	double receiveNs = 0;
+	{
+		BenchPhone phone(network);
+		const sockaddr_storage peer = makeAddress("10.0.0.2", 56780);
+
+		printHeader("Phone receive, parse+buffer");
+		phone.goLive(peer, options.frameMs, options.lowDelay);
+		receiveNs = report("  in order", benchReceive(phone, inOrder, firstSeq, peer, payload, payloadSize));
+		phone.goLive(peer, options.frameMs, options.lowDelay);
+		report("  " + toString(int(REORDER_PERCENT)) + "% reordered", benchReceive(phone, reordered, firstSeq, peer, payload, payloadSize));
+		phone.goLive(peer, options.frameMs, options.lowDelay);
+		report("  " + toString(int(LOSS_PERCENT)) + "% lost", benchReceive(phone, lossy, firstSeq, peer, payload, payloadSize));
+
+		printHeader("Tones");
+		report("  playRingtone", benchRingtone(phone, packets), "per 20ms packet");
+		report("  generateTones", benchTones(phone, std::max<uint>(options.frames / 10, 10)), "once per startup");
+	}
+
+	// What one core can carry, if it did nothing else
+	printf("\nPer packet, both directions\n");
+	for (uint b = 0; b < BITRATE_COUNT; ++b)
+	{
+		const double fastest = encodeMeans[b * 11] + decodeMeans[b] + receiveNs;
+		const double best = encodeMeans[b * 11 + 10] + decodeMeans[b] + receiveNs;
+		printf("  %2dkbps: %6.0fns at complexity 10 (%5.0f calls/core), %6.0fns at 0 (%5.0f calls/core)\n",
+		       BITRATES[b] / 1000, best, frameNs / best, fastest, frameNs / fastest);
+	}
+	printf("  of which JitterBuffer %.0fns and the rest of the receive path %.0fns\n", bufferNs, std::max(receiveNs - bufferNs, 0.0));
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+	try
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			const string arg = argv[i];
+			const char* value = (i + 1 < argc) ? argv[i + 1] : NULL;
+			if ((arg == "-n" || arg == "--frames") && value)
+				options.frames = uint(atoi(argv[++i]));
+			else if ((arg == "-f" || arg == "--frame") && value)
+				options.frameMs = uint(atoi(argv[++i]));
+			else if (arg == "-l" || arg == "--low-delay")
+				options.lowDelay = true;
+			else
+			{
+				const bool help = (arg == "-h" || arg == "--help");
+				fputs(USAGE, help ? stdout : stderr);
+				return help ? 0 : 1;
+			}
+		}
+
+		Phone::CallParams params;
+		params.frameMs = options.frameMs;
+		params.lowDelay = options.lowDelay;
+		if (!options.frames || !params.isValid())
+			throw std::runtime_error("Invalid option, see --help");
+
+		return bench(options);
+	}
+	catch (std::exception& ex)
+	{
+		fprintf(stderr, "Error: %s\n", ex.what());
+		return 1;
+	}
+}
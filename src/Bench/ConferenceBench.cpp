@@ -0,0 +1,408 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "Conference.h"
+#include "AudioMixer.h"
+#include "Clock.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+// How many participants one core can host: first the AudioMixer alone on each of its paths, summing every
+// participant's frame and making each one's N-1 mix; then a whole Conference over loopback UDP with everyone
+// talking, where decoding and encoding cost far more than mixing. The Conference is fed its clock one frame at a
+// time as fast as it can go, and its thread's CPU time per 20ms frame is how much of a core it needs. Exits
+// with 1 before timing anything if a vector mixer path doesn't give exactly what the scalar one does
+using namespace tincan;
+
+enum {
+	DEFAULT_FRAMES = 500,     //Conference frames timed per case (10 seconds of audio)
+	WARMUP_FRAMES = 25,
+	ENCODED_FRAMES = 50,      //Distinct packets each participant replays, so the bench doesn't spend its time encoding
+	MIXER_MIN_NS = 20000000,  //Time each mixer case at least this long
+	TONE_AMPLITUDE = 3000
+};
+
+static const uint MIXER_PARTICIPANTS[] = { 3, 5, 10, 32, 100, 300 };
+static const uint CONFERENCE_PARTICIPANTS[] = { 3, 10, 32, 100 };
+
+static const char USAGE[] =
+	"Usage: conference_bench [options]\n"
+	"  -n, --participants N[,N...] Conference sizes to time (default 3,10,32,100)\n"
+	"  -f, --frames N              Conference frames timed per size (default 500)\n"
+	"  -s, --speakers N            Loudest voices mixed (default 3)\n";
+
+
+// Clock only has microseconds, too coarse for mixing one frame
+static uint64 nowNs()
+{
+	return uint64(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// Everyone sounds different, so no two N-1 mixes are alike
+static void makeTone(uint participant, uint frame, int16* pcm)
+{
+	const double pi2 = 6.283185307179586;
+	const double hz = 200 + 37 * participant;
+	for (uint s = 0; s < PACKET_SAMPLES; ++s)
+	{
+		const double t = double(frame * PACKET_SAMPLES + s) / SAMPLE_RATE;
+		pcm[s] = int16(TONE_AMPLITUDE * sin(pi2 * hz * t));
+	}
+}
+
+// ns per frame to mix count participants and make each one's N-1 mix
+static double timeMixer(AudioMixer::Path path, uint count)
+{
+	vector<int16> pcm(count * PACKET_SAMPLES);
+	vector<const int16*> frames(count);
+	for (uint p = 0; p < count; ++p)
+	{
+		makeTone(p, 0, &pcm[p * PACKET_SAMPLES]);
+		frames[p] = &pcm[p * PACKET_SAMPLES];
+	}
+
+	AudioMixer mixer(PACKET_SAMPLES);
+	mixer.setPath(path);
+	int16 out[PACKET_SAMPLES];
+	uint64 checksum = 0;
+	ulong runs = 0;
+	const uint64 start = nowNs();
+	uint64 elapsed = 0;
+	while (elapsed < MIXER_MIN_NS)
+	{
+		mixer.mix(&frames[0], count, PACKET_SAMPLES);
+		for (uint p = 0; p < count; ++p)
+		{
+			mixer.getMixWithout(frames[p], out);
+			checksum += uint16(out[runs % PACKET_SAMPLES]);
+		}
+		++runs;
+		elapsed = nowNs() - start;
+	}
+
+	// Keep the work from being optimized away
+	if (checksum == 1)
+		printf(" ");
+	return double(elapsed) / runs;
+}
+
+// Odd lengths leave samples over after the vector blocks, for the scalar tail to finish
+static const uint CHECK_SAMPLES[] = { 1, 7, 8, 15, 17, 33, PACKET_SAMPLES - 1, PACKET_SAMPLES, PACKET_SAMPLES + 3 };
+static const uint CHECK_PARTICIPANTS[] = { 0, 1, 2, 3, 5, 32, 300 };
+
+static uint32 nextRandom(uint32& state)
+{
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+// Every vector path must mix exactly what the scalar one does, on random input and on input loud enough that the
+// sums saturate; returns how many mixes didn't
+static ulong checkMixer()
+{
+	const uint maxSamples = PACKET_SAMPLES + 3;
+	const uint maxCount = 300;
+	vector<int16> pcm(maxCount * maxSamples);
+	vector<const int16*> frames(maxCount);
+	for (uint p = 0; p < maxCount; ++p)
+		frames[p] = &pcm[p * maxSamples];
+
+	AudioMixer scalar(maxSamples), fast(maxSamples);
+	int16 expected[maxSamples], got[maxSamples];
+	uint32 random = 1;
+	ulong mixes = 0, mismatches = 0;
+	for (int p = AudioMixer::SSE2; p <= AudioMixer::AVX2; ++p)
+	{
+		if (!AudioMixer::isSupported(AudioMixer::Path(p)))
+			continue;
+		fast.setPath(AudioMixer::Path(p));
+
+		for (int loud = 0; loud < 2; ++loud)
+		{
+			for (size_t i = 0; i < pcm.size(); ++i)
+			{
+				const uint32 r = nextRandom(random);
+				pcm[i] = loud ? ((r & 1) ? 32767 - int16(r >> 28) : -32768 + int16(r >> 28)) : int16(r >> 16);
+			}
+
+			for (uint c = 0; c < sizeof(CHECK_PARTICIPANTS) / sizeof(uint); ++c)
+			{
+				for (uint n = 0; n < sizeof(CHECK_SAMPLES) / sizeof(uint); ++n)
+				{
+					const uint count = CHECK_PARTICIPANTS[c], samples = CHECK_SAMPLES[n];
+					scalar.mix(&frames[0], count, samples);
+					fast.mix(&frames[0], count, samples);
+
+					// The whole mix, then each participant's N-1 mix (just the first few of a big conference)
+					for (uint own = 0; own <= std::min(count, 5u); ++own)
+					{
+						if (own == 0)
+						{
+							scalar.getMix(expected);
+							fast.getMix(got);
+						}
+						else
+						{
+							scalar.getMixWithout(frames[own - 1], expected);
+							fast.getMixWithout(frames[own - 1], got);
+						}
+						++mixes;
+						if (memcmp(expected, got, samples * sizeof(int16)))
+						{
+							if (!mismatches)
+								printf("%s differs from scalar: %u participants, %u samples, %s input\n",
+								       AudioMixer::pathName(AudioMixer::Path(p)), count, samples, loud ? "saturating" : "random");
+							++mismatches;
+						}
+					}
+				}
+			}
+		}
+	}
+
+	printf("Mixer paths checked against scalar: %lu mixes, %lu wrong\n\n", mixes, mismatches);
+	return mismatches;
+}
+
+static void benchMixer()
+{
+	AudioMixer::Path paths[3];
+	uint pathCount = 0;
+	for (int p = AudioMixer::SCALAR; p <= AudioMixer::AVX2; ++p)
+	{
+		if (AudioMixer::isSupported(AudioMixer::Path(p)))
+			paths[pathCount++] = AudioMixer::Path(p);
+	}
+
+	printf("Mixer alone: ns per %dms frame to sum everyone and make each one's N-1 mix\n", PACKET_MS);
+	printf("%-14s", "participants");
+	for (uint p = 0; p < pathCount; ++p)
+		printf("%12s", AudioMixer::pathName(paths[p]));
+	printf("\n");
+
+	vector<double> perParticipant(pathCount);
+	const uint sizes = sizeof(MIXER_PARTICIPANTS) / sizeof(MIXER_PARTICIPANTS[0]);
+	for (uint i = 0; i < sizes; ++i)
+	{
+		printf("%-14u", MIXER_PARTICIPANTS[i]);
+		for (uint p = 0; p < pathCount; ++p)
+		{
+			const double ns = timeMixer(paths[p], MIXER_PARTICIPANTS[i]);
+			perParticipant[p] = ns / MIXER_PARTICIPANTS[i];
+			printf("%12.0f", ns);
+		}
+		printf("\n");
+	}
+
+	// Linear in participants, so the largest size tells
+	printf("Participants one core could mix every %dms, codecs aside:", PACKET_MS);
+	for (uint p = 0; p < pathCount; ++p)
+		printf("  %s %.0f", AudioMixer::pathName(paths[p]), PACKET_MS * 1e6 / perParticipant[p]);
+	printf("\n");
+}
+
+
+static SOCKET openSocket()
+{
+	SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (s == -1)
+		throw std::runtime_error("Failed to create socket: " + Socket::getErrorString());
+
+	sockaddr_in in = {};
+	in.sin_family = AF_INET;
+	in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(s, (sockaddr*)&in, sizeof(in)))
+		throw std::runtime_error("Failed to bind loopback socket: " + Socket::getErrorString());
+	Socket::setBlocking(s, false);
+	return s;
+}
+
+struct Result
+{
+	double cpuMsPerFrame;
+	double encodesPerFrame;
+	ulong  concealed;
+};
+
+static Result benchConference(uint count, uint speakers, uint frames, const vector<vector<byte> >& encoded)
+{
+	Conference conference(count, speakers);
+	const uint16 port = conference.bind(Conference::PORT_DEFAULT, Conference::PORT_DEFAULT + 100);
+	sockaddr_in to = {};
+	to.sin_family = AF_INET;
+	to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	to.sin_port = htons(port);
+
+	vector<SOCKET> socks(count);
+	for (uint p = 0; p < count; ++p)
+		socks[p] = openSocket();
+
+	std::ostringstream log;
+	uint64 now = Clock::now();
+
+	// Everyone calls in
+	Phone::Packet packet;
+	packet.header = htonl(Phone::Packet::RING);
+	packet.seq = 0;
+	packet.data[0] = PACKET_MS;
+	packet.data[1] = 0;
+	for (uint p = 0; p < count; ++p)
+		sendto(socks[p], (const char*)&packet, offsetof(Phone::Packet,data) + 2, 0, (const sockaddr*)&to, sizeof(to));
+	conference.step(now, log);
+	if (conference.getStats().participants != count)
+		throw std::runtime_error("Only " + toString(conference.getStats().participants) + " of " + toString(count) + " joined");
+
+	byte discard[sizeof(Phone::Packet)];
+	double cpuMs = 0;
+	Conference::Stats before;
+	for (uint f = 0; f < WARMUP_FRAMES + frames; ++f)
+	{
+		if (f == WARMUP_FRAMES)
+			before = conference.getStats();
+
+		// Each participant's packet for this frame, replayed from what was encoded up front
+		for (uint p = 0; p < count; ++p)
+		{
+			const vector<byte>& data = encoded[(p * ENCODED_FRAMES + f % ENCODED_FRAMES) % encoded.size()];
+			packet.header = htonl(Phone::Packet::AUDIO);
+			packet.seq = htonl(Conference::FIRST_SEQ + f);
+			memcpy(packet.data, &data[0], data.size());
+			sendto(socks[p], (const char*)&packet, offsetof(Phone::Packet,data) + data.size(), 0, (const sockaddr*)&to, sizeof(to));
+		}
+
+		// The whole frame's work, as the host's thread would do it
+		now += uint64(PACKET_MS) * Clock::MS;
+		const double cpuStart = Thread::getCpuTimeMs();
+		conference.step(now, log);
+		if (f >= WARMUP_FRAMES)
+			cpuMs += Thread::getCpuTimeMs() - cpuStart;
+
+		for (uint p = 0; p < count; ++p)
+		{
+			while (recv(socks[p], (char*)discard, sizeof(discard), 0) > 0)
+				;
+		}
+	}
+
+	const Conference::Stats after = conference.getStats();
+	for (uint p = 0; p < count; ++p)
+		Socket::close(socks[p]);
+
+	Result result;
+	result.cpuMsPerFrame = cpuMs / frames;
+	result.encodesPerFrame = double(after.encodes - before.encodes) / (after.frames - before.frames);
+	result.concealed = after.concealed - before.concealed;
+	return result;
+}
+
+// What each participant replays: their own tone, encoded like a phone would
+static vector<vector<byte> > encodeTones(uint participants)
+{
+	int opusErr = OPUS_OK;
+	OpusEncoder* encoder = opus_encoder_create(SAMPLE_RATE, CHANNELS, OPUS_APPLICATION_VOIP, &opusErr);
+	if (!encoder || opusErr != OPUS_OK)
+		throw std::runtime_error(string("opus_encoder_create error: ") + opus_strerror(opusErr));
+
+	vector<vector<byte> > encoded;
+	int16 pcm[PACKET_SAMPLES];
+	byte data[ENCODED_MAX_BYTES];
+	for (uint p = 0; p < participants; ++p)
+	{
+		opus_encoder_ctl(encoder, OPUS_RESET_STATE);
+		for (uint f = 0; f < ENCODED_FRAMES; ++f)
+		{
+			makeTone(p, f, pcm);
+			const opus_int32 size = opus_encode(encoder, pcm, PACKET_SAMPLES, data, PACKET_MS * ENCODED_BYTES_PER_MS);
+			if (size < 0)
+				throw std::runtime_error(string("opus_encode error: ") + opus_strerror(size));
+			encoded.push_back(vector<byte>(data, data + size));
+		}
+	}
+	opus_encoder_destroy(encoder);
+	return encoded;
+}
+
+int main(int argc, char* argv[])
+{
+	vector<uint> sizes(CONFERENCE_PARTICIPANTS, CONFERENCE_PARTICIPANTS + sizeof(CONFERENCE_PARTICIPANTS) / sizeof(uint));
+	uint frames = DEFAULT_FRAMES;
+	uint speakers = Conference::SPEAKERS_DEFAULT;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		const string arg = argv[i];
+		const bool hasValue = (i + 1 < argc);
+		if ((arg == "-n" || arg == "--participants") && hasValue)
+		{
+			sizes.clear();
+			std::istringstream list(argv[++i]);
+			string item;
+			while (std::getline(list, item, ','))
+			{
+				if (atoi(item.c_str()) > 0)
+					sizes.push_back(uint(atoi(item.c_str())));
+			}
+		}
+		else if ((arg == "-f" || arg == "--frames") && hasValue)
+			frames = uint(atoi(argv[++i]));
+		else if ((arg == "-s" || arg == "--speakers") && hasValue)
+			speakers = uint(atoi(argv[++i]));
+		else
+		{
+			fputs(USAGE, stderr);
+			return 1;
+		}
+	}
+	if (sizes.empty() || !frames || !speakers)
+	{
+		fputs(USAGE, stderr);
+		return 1;
+	}
+
+	try
+	{
+		if (checkMixer())
+			return 1;
+		benchMixer();
+
+		const uint largest = *std::max_element(sizes.begin(), sizes.end());
+		const vector<vector<byte> > encoded = encodeTones(largest);
+
+		printf("\nWhole conference over loopback, everyone talking: CPU per %dms frame to receive, decode, mix, encode and send\n", PACKET_MS);
+		printf("%-14s %-22s %10s %12s %10s %10s\n", "participants", "mixed", "encodes", "ms/frame", "of a core", "concealed");
+		double sharedPerParticipant = 0, unsharedPerParticipant = 0;
+		for (size_t i = 0; i < sizes.size(); ++i)
+		{
+			// The loudest few, as hosted; then everyone mixed for everyone else, with no encode shared
+			for (int all = 0; all < 2; ++all)
+			{
+				const uint mixed = all ? sizes[i] : std::min(speakers, sizes[i]);
+				const Result result = benchConference(sizes[i], mixed, frames, encoded);
+				const string label = all ? "everyone (no sharing)" : "loudest " + toString(mixed);
+				printf("%-14u %-22s %10.1f %12.3f %9.1f%% %10lu\n", sizes[i], label.c_str(), result.encodesPerFrame,
+				       result.cpuMsPerFrame, 100 * result.cpuMsPerFrame / PACKET_MS, result.concealed);
+				if (sizes[i] == largest && all)
+					unsharedPerParticipant = result.cpuMsPerFrame / sizes[i];
+				else if (sizes[i] == largest)
+					sharedPerParticipant = result.cpuMsPerFrame / sizes[i];
+			}
+		}
+
+		// Roughly linear in participants past the first few, so the largest size tells
+		printf("One core sustains about %.0f participants mixing the loudest %u, or %.0f mixing everyone\n",
+		       sharedPerParticipant > 0 ? PACKET_MS / sharedPerParticipant : 0.0, speakers,
+		       unsharedPerParticipant > 0 ? PACKET_MS / unsharedPerParticipant : 0.0);
+	}
+	catch (std::exception& ex)
+	{
+		fprintf(stderr, "Error: %s\n", ex.what());
+		return 1;
+	}
+	return 0;
+}
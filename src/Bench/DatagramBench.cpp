@@ -0,0 +1,119 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "DatagramBatch.h"
+#include "Clock.h"
+#include <cstdio>
+#include <cstdlib>
+#ifndef _WIN32
+#	include <netinet/in.h>
+#endif
+
+// Compares per-datagram recvfrom/sendto against recvmmsg/sendmmsg over loopback,
+// sending bursts the size of a Phone AUDIO packet like after a stall
+using namespace tincan;
+
+enum {
+	PACKET_BYTES = 88,   //Header + seq + a typical 20ms Opus frame
+	BURST = 16,
+	DEFAULT_PACKETS = 1000000
+};
+
+static SOCKET openSocket(sockaddr_storage& addr)
+{
+	SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (s == -1)
+		throw std::runtime_error("Failed to create socket");
+
+	int bufsize = 4 * 1024 * 1024;
+	setsockopt(s, SOL_SOCKET, SO_RCVBUF, (const char*)&bufsize, sizeof(bufsize));
+	setsockopt(s, SOL_SOCKET, SO_SNDBUF, (const char*)&bufsize, sizeof(bufsize));
+
+	sockaddr_in& in = (sockaddr_in&)addr;
+	memset(&addr, 0, sizeof(addr));
+	in.sin_family = AF_INET;
+	in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(in);
+	if (bind(s, (sockaddr*)&in, len) || getsockname(s, (sockaddr*)&in, &len))
+		throw std::runtime_error("Failed to bind loopback socket: " + Socket::getErrorString());
+
+	Socket::setBlocking(s, false);
+	return s;
+}
+
+static void run(const char* name, bool mmsg, ulong packets)
+{
+	sockaddr_storage fromAddr, toAddr;
+	SOCKET from = openSocket(fromAddr);
+	SOCKET to = openSocket(toAddr);
+
+	DatagramBatch sendBatch(BURST, PACKET_BYTES, mmsg);
+	DatagramBatch recvBatch(BURST, PACKET_BYTES, mmsg);
+
+	ulong received = 0, dropped = 0;
+	const uint64 start = Clock::now();
+
+	for (ulong sent = 0; sent < packets; sent += BURST)
+	{
+		for (uint i = 0; i < BURST; ++i)
+		{
+			byte* data = sendBatch.add(toAddr);
+			memset(data, int(i), PACKET_BYTES);
+			sendBatch.setSize(i, PACKET_BYTES);
+		}
+		if (sendBatch.send(from) != BURST)
+			throw std::runtime_error("send failed: " + Socket::getErrorString());
+
+		// Drain the burst, giving up on anything the kernel dropped
+		uint burstReceived = 0;
+		while (burstReceived < BURST)
+		{
+			int n = recvBatch.receive(to);
+			if (n < 0)
+			{
+				if (Socket::getError() != EWOULDBLOCK)
+					throw std::runtime_error("receive failed: " + Socket::getErrorString());
+				pollfd pfd = {to, POLLIN, 0};
+				if (Socket::poll(&pfd, 1, 100) == 0)
+				{
+					dropped += BURST - burstReceived;
+					break;
+				}
+				continue;
+			}
+			burstReceived += n;
+		}
+		received += burstReceived;
+	}
+
+	const double secs = double(Clock::now() - start) / 1e6;
+	const ulong syscalls = sendBatch.getSyscalls() + recvBatch.getSyscalls();
+	printf("%-12s %10.0f packets/sec  %6.3f syscalls/packet  (%lu received, %lu dropped)\n",
+	       name, received / secs, double(syscalls) / received, received, dropped);
+
+	Socket::close(from);
+	Socket::close(to);
+}
+
+int main(int argc, char* argv[])
+{
+	ulong packets = (argc > 1) ? strtoul(argv[1], NULL, 10) : DEFAULT_PACKETS;
+
+	try
+	{
+		printf("%lu packets of %d bytes in bursts of %d over loopback\n", packets, PACKET_BYTES, BURST);
+		run("per-packet", false, packets);
+#ifdef TINCAN_HAVE_MMSG
+		run("mmsg", true, packets);
+#else
+		printf("recvmmsg/sendmmsg not available on this platform\n");
+#endif
+	}
+	catch (std::exception& ex)
+	{
+		fprintf(stderr, "Error: %s\n", ex.what());
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,300 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "IgdSimulator.h"
+#include <cstdio>
+#ifndef _WIN32
+#	include <netinet/in.h>
+#endif
+
+namespace tincan {
+
+
+const char* const IgdSimulator::MULTICAST_IF = "127.0.0.1";
+const char* const IgdSimulator::WAN_ADDRESS = "203.0.113.2"; //TEST-NET-3, since Router rejects private WAN addresses
+
+enum {
+	SSDP_PORT = 1900,
+	HTTP_MAX = 8192
+};
+
+static const char SSDP_GROUP[] = "239.255.255.250";
+static const char DEVICE_TYPE[] = "urn:schemas-upnp-org:device:InternetGatewayDevice:1";
+static const char SERVICE_TYPE[] = "urn:schemas-upnp-org:service:WANIPConnection:1";
+
+static const char ROOT_DESC[] =
+	"<?xml version=\"1.0\"?>\r\n"
+	"<root xmlns=\"urn:schemas-upnp-org:device-1-0\">"
+	"<specVersion><major>1</major><minor>0</minor></specVersion>"
+	"<device><deviceType>urn:schemas-upnp-org:device:InternetGatewayDevice:1</deviceType>"
+	"<friendlyName>Tin Can Phone IGD simulator</friendlyName>"
+	"<deviceList><device><deviceType>urn:schemas-upnp-org:device:WANDevice:1</deviceType>"
+	"<serviceList><service><serviceType>urn:schemas-upnp-org:service:WANCommonInterfaceConfig:1</serviceType>"
+	"<serviceId>urn:upnp-org:serviceId:WANCommonIFC1</serviceId><controlURL>/ctl/CmnIfCfg</controlURL>"
+	"<eventSubURL>/evt/CmnIfCfg</eventSubURL><SCPDURL>/WANCfg.xml</SCPDURL></service></serviceList>"
+	"<deviceList><device><deviceType>urn:schemas-upnp-org:device:WANConnectionDevice:1</deviceType>"
+	"<serviceList><service><serviceType>urn:schemas-upnp-org:service:WANIPConnection:1</serviceType>"
+	"<serviceId>urn:upnp-org:serviceId:WANIPConn1</serviceId><controlURL>/ctl/IPConn</controlURL>"
+	"<eventSubURL>/evt/IPConn</eventSubURL><SCPDURL>/WANIPCn.xml</SCPDURL></service></serviceList>"
+	"</device></deviceList></device></deviceList></device></root>\r\n";
+
+static string soapEnvelope(const string& body)
+{
+	return "<?xml version=\"1.0\"?>\r\n"
+	       "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+	       "<s:Body>" + body + "</s:Body></s:Envelope>\r\n";
+}
+
+static string soapResponse(const string& action, const string& args)
+{
+	return soapEnvelope("<u:" + action + "Response xmlns:u=\"" + SERVICE_TYPE + "\">" + args + "</u:" + action + "Response>");
+}
+
+static string soapFault(int code, const char* description)
+{
+	return soapEnvelope("<s:Fault><faultcode>s:Client</faultcode><faultstring>UPnPError</faultstring><detail>"
+	                    "<UPnPError xmlns=\"urn:schemas-upnp-org:control-1-0\"><errorCode>" + toString(code) +
+	                    "</errorCode><errorDescription>" + description + "</errorDescription></UPnPError></detail></s:Fault>");
+}
+
+// Case-insensitive search for an HTTP header's value
+static string getHeader(const string& request, const char* name)
+{
+	string lower(request), key = string("\r\n") + name + ":";
+	for (size_t i = 0; i < lower.size(); ++i)
+		lower[i] = char(tolower(lower[i]));
+	for (size_t i = 0; i < key.size(); ++i)
+		key[i] = char(tolower(key[i]));
+
+	size_t start = lower.find(key);
+	if (start == string::npos)
+		return string();
+	start += key.size();
+	size_t end = request.find("\r\n", start);
+	while (start < end && request[start] == ' ')
+		++start;
+	return request.substr(start, end - start);
+}
+
+
+IgdSimulator::IgdSimulator(const Config& config)
+: config(config),
+  ssdpSock(-1),
+  httpSock(-1),
+  httpPort(0),
+  stopping(false),
+  ssdpRequests(0),
+  soapRequests(0),
+  mappings(0),
+  conflictsLeft(config.conflicts)
+{
+	// SSDP: listen on the multicast group, on loopback only
+	ssdpSock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	int reuse = 1;
+	setsockopt(ssdpSock, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(SSDP_PORT);
+	ip_mreq group = {};
+	inet_pton(AF_INET, SSDP_GROUP, &group.imr_multiaddr);
+	inet_pton(AF_INET, MULTICAST_IF, &group.imr_interface);
+	if (bind(ssdpSock, (sockaddr*)&addr, sizeof(addr)) ||
+	    setsockopt(ssdpSock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&group, sizeof(group)))
+	{
+		string error = Socket::getErrorString();
+		Socket::close(ssdpSock);
+		throw std::runtime_error("Could not listen for SSDP on loopback: " + error);
+	}
+
+	// HTTP: any free port on loopback
+	httpSock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+	socklen_t len = sizeof(addr);
+	if (bind(httpSock, (sockaddr*)&addr, len) || listen(httpSock, 8) || getsockname(httpSock, (sockaddr*)&addr, &len))
+	{
+		string error = Socket::getErrorString();
+		Socket::close(ssdpSock);
+		Socket::close(httpSock);
+		throw std::runtime_error("Could not listen for HTTP on loopback: " + error);
+	}
+	httpPort = ntohs(addr.sin_port);
+
+	thread.start(&threadMain, this);
+}
+
+IgdSimulator::~IgdSimulator()
+{
+	stopping = true;
+	stopper.signal();
+	thread.join();
+	Socket::close(ssdpSock);
+	Socket::close(httpSock);
+}
+
+void IgdSimulator::setConfig(const Config& newConfig)
+{
+	// The simulator thread is idle between requests, and Router calls are synchronous, so this is safe to do between them
+	config = newConfig;
+	conflictsLeft = config.conflicts;
+}
+
+void IgdSimulator::threadMain(void* simulator)
+{
+	reinterpret_cast<IgdSimulator*>(simulator)->serve();
+}
+
+void IgdSimulator::serve()
+{
+	while (!stopping)
+	{
+		pollfd fds[3] = {};
+		fds[0].fd = ssdpSock;
+		fds[0].events = POLLIN;
+		fds[1].fd = httpSock;
+		fds[1].events = POLLIN;
+		fds[2].fd = stopper.getFd();
+		fds[2].events = POLLIN;
+		if (Socket::poll(fds, 3, -1) <= 0)
+			continue;
+
+		if (fds[0].revents)
+			answerSearch();
+		if (fds[1].revents)
+			answerHttp();
+	}
+}
+
+void IgdSimulator::answerSearch()
+{
+	char request[1500];
+	sockaddr_storage from;
+	socklen_t fromLen = sizeof(from);
+	int size = recvfrom(ssdpSock, request, sizeof(request) - 1, 0, (sockaddr*)&from, &fromLen);
+	if (size <= 0)
+		return;
+	request[size] = '\0';
+
+	if (strncmp(request, "M-SEARCH", 8) != 0)
+		return;
+	++ssdpRequests;
+
+	// Like a real IGD, only answer searches for things we are
+	string st = getHeader(request, "ST");
+	if (config.silent || (st != DEVICE_TYPE && st != SERVICE_TYPE && st != "upnp:rootdevice" && st != "ssdp:all"))
+		return;
+
+	if (config.ssdpDelayMs)
+		Thread::sleep(config.ssdpDelayMs);
+
+	string reply = "HTTP/1.1 200 OK\r\n"
+	               "CACHE-CONTROL: max-age=120\r\n"
+	               "ST: " + st + "\r\n"
+	               "USN: uuid:00000000-7a1c-4a9e-0000-000000000001::" + st + "\r\n"
+	               "EXT:\r\n"
+	               "SERVER: TinCanPhone/1.0 UPnP/1.0 IgdSimulator/1.0\r\n"
+	               "LOCATION: http://" + string(MULTICAST_IF) + ":" + toString(httpPort) + "/rootDesc.xml\r\n"
+	               "\r\n";
+	sendto(ssdpSock, reply.data(), int(reply.size()), 0, (sockaddr*)&from, fromLen);
+}
+
+void IgdSimulator::answerHttp()
+{
+	SOCKET client = accept(httpSock, NULL, NULL);
+	if (client == -1)
+		return;
+
+	// Read headers, then the body if any
+	string request;
+	char buffer[1024];
+	size_t headerEnd = string::npos;
+	size_t wanted = 0;
+	while (request.size() < HTTP_MAX)
+	{
+		int got = recv(client, buffer, sizeof(buffer), 0);
+		if (got <= 0)
+			break;
+		request.append(buffer, got);
+
+		if (headerEnd == string::npos && (headerEnd = request.find("\r\n\r\n")) != string::npos)
+			wanted = headerEnd + 4 + atoi(getHeader(request, "Content-Length").c_str());
+		if (headerEnd != string::npos && request.size() >= wanted)
+			break;
+	}
+
+	if (config.soapDelayMs)
+		Thread::sleep(config.soapDelayMs);
+
+	int status = 200;
+	string body;
+	if (request.compare(0, 4, "GET ") == 0 && request.find(" /rootDesc.xml ") != string::npos)
+	{
+		body = ROOT_DESC;
+	}
+	else if (request.compare(0, 5, "POST ") == 0 && request.find(" /ctl/IPConn ") != string::npos && headerEnd != string::npos)
+	{
+		++soapRequests;
+		// SOAPAction: "urn:schemas-upnp-org:service:WANIPConnection:1#AddPortMapping"
+		string action = getHeader(request, "SOAPAction");
+		size_t hash = action.find('#');
+		action = (hash == string::npos) ? string() : action.substr(hash + 1, action.find('"', hash) - hash - 1);
+		body = control(action, status);
+	}
+	else
+	{
+		status = 404;
+	}
+
+	string response = "HTTP/1.1 " + toString(status) + (status == 200 ? " OK" : status == 500 ? " Internal Server Error" : " Not Found") + "\r\n"
+	                  "Content-Type: text/xml; charset=\"utf-8\"\r\n"
+	                  "Connection: close\r\n"
+	                  "Content-Length: " + toString(body.size()) + "\r\n"
+	                  "\r\n" + body;
+	send(client, response.data(), int(response.size()), 0);
+	Socket::close(client);
+}
+
+string IgdSimulator::control(const string& action, int& status)
+{
+	if (action == "GetStatusInfo")
+	{
+		return soapResponse(action, "<NewConnectionStatus>Connected</NewConnectionStatus>"
+		                            "<NewLastConnectionError>ERROR_NONE</NewLastConnectionError><NewUptime>1000</NewUptime>");
+	}
+	else if (action == "GetExternalIPAddress")
+	{
+		return soapResponse(action, string("<NewExternalIPAddress>") + WAN_ADDRESS + "</NewExternalIPAddress>");
+	}
+	else if (action == "AddPortMapping")
+	{
+		status = 500;
+		if (config.failMapping)
+			return soapFault(501, "ActionFailed");
+		if (conflictsLeft)
+		{
+			--conflictsLeft;
+			return soapFault(718, "ConflictInMappingEntry");
+		}
+		status = 200;
+		++mappings;
+		return soapResponse(action, "");
+	}
+	else if (action == "DeletePortMapping")
+	{
+		if (!mappings)
+		{
+			status = 500;
+			return soapFault(714, "NoSuchEntryInArray");
+		}
+		--mappings;
+		return soapResponse(action, "");
+	}
+
+	status = 500;
+	return soapFault(401, "Invalid Action");
+}
+
+
+}
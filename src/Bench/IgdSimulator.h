@@ -0,0 +1,65 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+#include "Socket.h"
+#include "Thread.h"
+#include <atomic>
+
+namespace tincan {
+
+
+// Stand-in UPnP Internet Gateway Device on loopback, for benchmarking Router without a real router
+// Answers SSDP M-SEARCH on 239.255.255.250:1900 (pass MULTICAST_IF to Router), and serves the device
+// description and a WANIPConnection control endpoint over HTTP
+class IgdSimulator
+{
+public:
+	struct Config
+	{
+		uint ssdpDelayMs;  //Before answering each M-SEARCH
+		uint soapDelayMs;  //Before answering each HTTP request
+		uint conflicts;    //AddPortMapping requests answered with 718 ConflictInMappingEntry before one succeeds
+		bool failMapping;  //Answer AddPortMapping with 501 ActionFailed
+		bool silent;       //Don't answer M-SEARCH, like a router with UPnP turned off
+		Config() : ssdpDelayMs(0), soapDelayMs(0), conflicts(0), failMapping(false), silent(false)  {}
+	};
+
+	// The interface address Router should discover on to find us
+	static const char* const MULTICAST_IF;
+	static const char* const WAN_ADDRESS;
+
+	explicit IgdSimulator(const Config& config);
+	~IgdSimulator();
+
+	// Takes effect for the next request
+	void setConfig(const Config& config);
+
+	ulong getSsdpRequests() const  {return ssdpRequests;}
+	ulong getSoapRequests() const  {return soapRequests;}
+	uint  getMappings() const      {return mappings;}
+
+protected:
+	Config             config;
+	SOCKET             ssdpSock;
+	SOCKET             httpSock;
+	uint16             httpPort;
+	Waker              stopper;
+	Thread             thread;
+	std::atomic<bool>  stopping;
+	std::atomic<ulong> ssdpRequests;
+	std::atomic<ulong> soapRequests;
+	std::atomic<uint>  mappings;
+	uint               conflictsLeft;
+
+	static void threadMain(void* simulator);
+	void serve();
+	void answerSearch();
+	void answerHttp();
+	string control(const string& action, int& status);
+};
+
+
+}
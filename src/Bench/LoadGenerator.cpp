@@ -0,0 +1,845 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "Clock.h"
+#include "Conference.h"
+#include "Phone.h"
+#include "RelayTransport.h"
+#include "Seqlock.h"
+#include "Thread.h"
+#include "UdpTransport.h"
+#include "WavAudioDevice.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+
+// Call load for sizing a relay or conference host: thousands of simulated phones in one process, each with its
+// own UDP socket, speaking Phone's packets (RING, AUDIO with seq, HANGUP) but replaying audio encoded once at
+// startup, so nearly all the CPU goes on the network. Calls arrive at random at a given rate and last a random
+// time around a given mean. Pairs of endpoints call each other directly or through a relay, or every endpoint
+// calls a conference host. Reports how long calls took to set up, the packet rate achieved, and the loss,
+// reordering and duplicates the receiving ends saw
+using namespace tincan;
+
+enum {
+	DEFAULT_ENDPOINTS = 1000,
+	DEFAULT_CALL_RATE = 20,      //Calls per second
+	DEFAULT_HOLD_SECONDS = 30,
+	DEFAULT_SECONDS = 60,
+	DEFAULT_REPORT_SECONDS = 5,
+	DEFAULT_RELAY_ID = 100000,
+	RING_TIMEOUT_MS = 10000,     //Give up on a call nobody answers
+	REGISTER_TIMEOUT_MS = 10000, //For every endpoint to register with the relay
+	DRAIN_MS = 500,              //After hanging up at the end, how long to wait for the last HANGUPs to land
+	ENCODED_FRAMES = 250,        //Pre-encoded audio replayed by every endpoint (5 seconds)
+	PUBLISH_MS = 100,            //How often each thread publishes its counters
+	SETUP_SAMPLES_MAX = 1 << 20  //Setup times kept per thread
+};
+
+static const char USAGE[] =
+	"Usage: load_gen [options]\n"
+	"  -e, --endpoints N          Simulated phones, each with its own socket (default 1000)\n"
+	"  -c, --calls-per-sec N      New calls per second, arriving at random (default 20)\n"
+	"  -H, --hold SECONDS         Mean call length, exponentially distributed (default 30)\n"
+	"      --fixed-hold           Every call lasts exactly --hold\n"
+	"  -d, --seconds N            How long to place calls; calls still up then are hung up (default 60)\n"
+	"  -l, --loss PERCENT         Drop this share of AUDIO packets before sending, to check loss detection\n"
+	"  -t, --threads N            Threads sharing the endpoints (default 1)\n"
+	"      --relay HOST[:PORT]    Call through a tincanphone-relay; endpoints register IDs from --relay-id on\n"
+	"      --relay-id ID          First relay ID (default 100000)\n"
+	"      --conference HOST[:PORT] Every call goes to a tincanphone-conference host (default port 56791)\n"
+	"      --wav FILE             Replay FILE (16-bit mono 48kHz) instead of generated talk spurts\n"
+	"  -r, --report SECONDS       How often to print progress, 0 for never (default 5)\n"
+	"Without --relay or --conference, pairs of endpoints call each other over loopback.\n"
+	"Each endpoint needs a file descriptor, so more than about 1000 may need ulimit -n raised.\n";
+
+
+struct Options
+{
+	uint             endpoints;
+	double           callsPerSec;
+	double           holdSeconds;
+	bool             fixedHold;
+	uint             seconds;
+	double           lossPercent;
+	uint             threads;
+	string           relay;
+	uint32           relayId;
+	string           conference;
+	sockaddr_storage conferenceAddr;
+	string           wav;
+	uint             reportSeconds;
+	Options() : endpoints(DEFAULT_ENDPOINTS), callsPerSec(DEFAULT_CALL_RATE), holdSeconds(DEFAULT_HOLD_SECONDS),
+	            fixedHold(false), seconds(DEFAULT_SECONDS), lossPercent(0), threads(1), relayId(DEFAULT_RELAY_ID),
+	            conferenceAddr(), reportSeconds(DEFAULT_REPORT_SECONDS)  {}
+	bool pairs() const  {return conference.empty();}
+};
+
+// Counts per thread, or summed over them
+struct Stats
+{
+	ulong  attempted;
+	ulong  connected;
+	ulong  busy;
+	ulong  unanswered; //Nothing back before RING_TIMEOUT_MS
+	ulong  blocked;    //No idle endpoint when the call arrived
+	ulong  dropped;    //No AUDIO for DISCONNNECT_TIMEOUT while live
+	ulong  active;     //Calls dialing or live right now, counted by their callers
+	ulong  due;        //AUDIO packets that should have been sent by now
+	ulong  sent;
+	ulong  injected;   //Dropped on purpose by --loss
+	ulong  sendErrors;
+	ulong  received;   //AUDIO packets, including duplicates
+	ulong  lost;       //Seq numbers never received, counted when each call ends
+	ulong  reordered;  //Arrived after a higher seq
+	ulong  duplicates;
+	double setupMsSum;
+	Stats() : attempted(0), connected(0), busy(0), unanswered(0), blocked(0), dropped(0), active(0), due(0), sent(0),
+	          injected(0), sendErrors(0), received(0), lost(0), reordered(0), duplicates(0), setupMsSum(0)  {}
+	Stats& operator += (const Stats& rhs)
+	{
+		attempted += rhs.attempted; connected += rhs.connected; busy += rhs.busy; unanswered += rhs.unanswered;
+		blocked += rhs.blocked; dropped += rhs.dropped; active += rhs.active; due += rhs.due; sent += rhs.sent;
+		injected += rhs.injected; sendErrors += rhs.sendErrors; received += rhs.received; lost += rhs.lost;
+		reordered += rhs.reordered; duplicates += rhs.duplicates; setupMsSum += rhs.setupMsSum;
+		return *this;
+	}
+};
+
+// A simulated phone
+struct Endpoint
+{
+	enum State { IDLE, DIALING, LIVE };
+
+	Transport*       transport;
+	RelayTransport*  relay;      //transport, if it goes through a relay
+	sockaddr_storage address;    //How its partner reaches it
+	uint             partner;    //In pairs, the index of the endpoint it calls
+	bool             caller;     //Places the calls; in pairs, the even one
+	State            state;
+	sockaddr_storage peer;
+	uint64           setupStart; //First RING
+	uint64           ringTime;   //DIALING: when to send the next RING
+	uint64           hangupTime; //Caller, LIVE: when to hang up
+	uint64           nextSend;   //LIVE: when the next AUDIO is due
+	uint64           lastHeard;  //LIVE: last AUDIO from the peer
+	uint64           serviceTime; //When the transport wants service(), 0 for never
+	uint32           sendseq;
+	uint             payload;    //Next pre-encoded frame to replay
+
+	// What the current call has received
+	bool             heard;
+	uint32           highestSeq;
+	uint64           seen;       //Bit n set if highestSeq - n arrived, to spot duplicates
+	ulong            unique;
+
+	Endpoint() : transport(NULL), relay(NULL), address(), partner(0), caller(true), state(IDLE), peer(), setupStart(0),
+	             ringTime(0), hangupTime(0), nextSend(0), lastHeard(0), serviceTime(1), sendseq(1), payload(0),
+	             heard(false), highestSeq(0), seen(0), unique(0)  {}
+};
+
+
+// Runs the calls of a share of the endpoints: whole pairs, or single endpoints calling a conference
+class LoadThread
+{
+public:
+	LoadThread(const Options& options, vector<Endpoint>& endpoints, uint begin, uint end,
+	           const vector<vector<byte> >& payloads, uint32 seed)
+	: options(options), endpoints(endpoints), begin(begin), end(end), payloads(payloads), random(seed | 1),
+	  cursor(begin), idleCallers(0), stopping(false),
+	  recvBatch(RECV_BATCH_PACKETS, sizeof(Phone::Packet) + TRANSPORT_HEADER_MAX), nextTimer(0), done(false)
+	{
+		setupUs.reserve(std::min<size_t>(SETUP_SAMPLES_MAX, size_t(options.callsPerSec * options.seconds) + 1000));
+	}
+
+	void   start()  {thread.start(&threadMain, this);}
+	void   join()   {thread.join();}
+	bool   isDone() const  {return done;}
+	Stats  getStats() const  {return statsOut.load();}
+	string getError() const  {return error;}
+	const vector<uint32>& getSetupUs() const  {return setupUs;} //After join
+
+protected:
+	typedef Phone::Packet Packet;
+
+	const Options&               options;
+	vector<Endpoint>&            endpoints;
+	uint                         begin, end;
+	const vector<vector<byte> >& payloads;
+	uint32                       random;
+	uint                         cursor;      //Where to look for an idle caller next
+	uint                         idleCallers;
+	bool                         stopping;    //Hanging up at the end
+	DatagramBatch                recvBatch;
+	vector<pollfd>               fds;
+	uint64                       nextTimer;   //Earliest thing any endpoint has to do
+	std::ostringstream           transportLog;
+	Stats                        stats;
+	Seqlock<Stats>               statsOut;
+	vector<uint32>               setupUs;
+	Thread                       thread;
+	string                       error;
+	std::atomic<bool>            done;
+
+	static void threadMain(void* arg)
+	{
+		LoadThread& load = *reinterpret_cast<LoadThread*>(arg);
+		try
+		{
+			load.run();
+		}
+		catch (std::exception& ex)
+		{
+			load.error = ex.what();
+		}
+		load.statsOut.store(load.stats);
+		load.done = true;
+	}
+
+	// Uniform in (0, 1]
+	double uniform()
+	{
+		random ^= random << 13;
+		random ^= random >> 17;
+		random ^= random << 5;
+		return (double(random) + 1) / 4294967296.0;
+	}
+
+	void run();
+	void waitForRegistration();
+	void startCall(uint64 now);
+	uint64 sweep(uint64 now);
+	void receive(Endpoint& ep, uint64 now);
+	void handlePacket(Endpoint& ep, const Packet& packet, uint size, const sockaddr_storage& from, uint64 now);
+	void goLive(Endpoint& ep, const sockaddr_storage& peer, uint64 now);
+	void endCall(Endpoint& ep);
+	void sendAudio(Endpoint& ep);
+	void sendHeader(Endpoint& ep, Packet::Header header, const sockaddr_storage& to);
+	void wake(uint64 when)  {nextTimer = std::min(nextTimer, when);}
+};
+
+void LoadThread::run()
+{
+	for (uint e = begin; e < end; ++e)
+	{
+		pollfd pfd = {endpoints[e].transport->getFd(), POLLIN, 0};
+		fds.push_back(pfd);
+		if (endpoints[e].caller)
+			++idleCallers;
+	}
+	waitForRegistration();
+
+	const uint64 start = Clock::now();
+	const uint64 stopTime = start + uint64(options.seconds) * 1000 * Clock::MS;
+	const double callsPerUs = options.callsPerSec / options.threads / (1000.0 * Clock::MS);
+	uint64 nextArrival = start + uint64(-log(uniform()) / callsPerUs);
+	uint64 drainTime = 0;
+	uint64 publishTime = start;
+	nextTimer = start;
+
+	for (;;)
+	{
+		const uint64 now = Clock::now();
+
+		// Calls arrive at random, a Poisson process
+		while (!stopping && now >= nextArrival)
+		{
+			startCall(now);
+			nextArrival += uint64(-log(uniform()) / callsPerUs) + 1;
+		}
+
+		if (!stopping && now >= stopTime)
+		{
+			// Time's up: callers hang up, then wait a moment for the HANGUPs to land
+			stopping = true;
+			for (uint e = begin; e < end; ++e)
+			{
+				if (endpoints[e].caller && endpoints[e].state == Endpoint::LIVE)
+					sendHeader(endpoints[e], Packet::HANGUP, endpoints[e].peer);
+				if (endpoints[e].caller && endpoints[e].state != Endpoint::IDLE)
+					endCall(endpoints[e]);
+			}
+			drainTime = now + uint64(DRAIN_MS) * Clock::MS;
+		}
+		if (stopping && now >= drainTime)
+		{
+			// Any callee whose HANGUP went missing is done anyway
+			for (uint e = begin; e < end; ++e)
+			{
+				if (endpoints[e].state != Endpoint::IDLE)
+					endCall(endpoints[e]);
+			}
+			return;
+		}
+
+		if (now >= nextTimer)
+			nextTimer = sweep(now);
+
+		if (now >= publishTime)
+		{
+			statsOut.store(stats);
+			publishTime = now + uint64(PUBLISH_MS) * Clock::MS;
+			transportLog.str("");
+		}
+
+		// Sleep until a packet arrives or something is due
+		uint64 wakeTime = std::min(nextTimer, stopping ? drainTime : std::min(nextArrival, stopTime));
+		const uint64 after = Clock::now();
+		const int timeout = (wakeTime > after) ? int((wakeTime - after + Clock::MS - 1) / Clock::MS) : 0;
+		const int ready = Socket::poll(&fds[0], uint(fds.size()), timeout);
+		if (ready < 0 && Socket::getError() != EINTR)
+			throw std::runtime_error("poll error: " + Socket::getErrorString());
+
+		for (size_t f = 0; f < fds.size() && ready > 0; ++f)
+		{
+			if (fds[f].revents)
+				receive(endpoints[begin + f], Clock::now());
+		}
+	}
+}
+
+void LoadThread::waitForRegistration()
+{
+	if (options.relay.empty())
+		return;
+
+	const uint64 giveUp = Clock::now() + uint64(REGISTER_TIMEOUT_MS) * Clock::MS;
+	for (;;)
+	{
+		const uint64 now = Clock::now();
+		uint registered = 0;
+		for (uint e = begin; e < end; ++e)
+		{
+			Endpoint& ep = endpoints[e];
+			if (ep.serviceTime && now >= ep.serviceTime)
+				ep.serviceTime = ep.transport->service(now, transportLog);
+			receive(ep, now);
+			registered += ep.relay->isRegistered();
+		}
+		transportLog.str("");
+		if (registered == end - begin)
+			return;
+		if (now >= giveUp)
+			throw std::runtime_error(toString(end - begin - registered) + " endpoints couldn't register with the relay");
+		Thread::sleep(10);
+	}
+}
+
+void LoadThread::startCall(uint64 now)
+{
+	++stats.attempted;
+	if (!idleCallers)
+	{
+		++stats.blocked;
+		return;
+	}
+
+	// Take the next idle caller; in pairs its partner is idle too, having hung up or timed out
+	uint e = cursor;
+	while (!endpoints[e].caller || endpoints[e].state != Endpoint::IDLE ||
+	       (options.pairs() && endpoints[endpoints[e].partner].state != Endpoint::IDLE))
+	{
+		e = (e + 1 < end) ? e + 1 : begin;
+		if (e == cursor)
+		{
+			++stats.blocked; //Idle callers whose partners haven't heard the HANGUP yet
+			return;
+		}
+	}
+	cursor = (e + 1 < end) ? e + 1 : begin;
+
+	Endpoint& ep = endpoints[e];
+	ep.state = Endpoint::DIALING;
+	ep.peer = options.pairs() ? endpoints[ep.partner].address : options.conferenceAddr;
+	ep.setupStart = now;
+	ep.ringTime = now;
+	--idleCallers;
+	++stats.active;
+	wake(now);
+}
+
+uint64 LoadThread::sweep(uint64 now)
+{
+	const uint64 frameTime = uint64(PACKET_MS) * Clock::MS;
+	uint64 next = now + frameTime;
+
+	for (uint e = begin; e < end; ++e)
+	{
+		Endpoint& ep = endpoints[e];
+
+		if (ep.serviceTime && now >= ep.serviceTime)
+			ep.serviceTime = ep.transport->service(now, transportLog);
+		if (ep.serviceTime)
+			next = std::min(next, ep.serviceTime);
+
+		if (ep.state == Endpoint::DIALING)
+		{
+			if (now >= ep.setupStart + uint64(RING_TIMEOUT_MS) * Clock::MS)
+			{
+				++stats.unanswered;
+				endCall(ep);
+				continue;
+			}
+			if (now >= ep.ringTime)
+			{
+				// Like Phone::sendRing, asking for PACKET_MS frames
+				Packet ring;
+				ring.header = htonl(Packet::RING);
+				ring.seq = 0;
+				ring.data[0] = PACKET_MS;
+				ring.data[1] = 0;
+				if (ep.transport->sendTo(&ring, offsetof(Packet,data) + 2, ep.peer) < 0)
+					++stats.sendErrors;
+				ep.ringTime = now + uint64(RING_PACKET_INTERVAL) * Clock::MS;
+			}
+			next = std::min(next, ep.ringTime);
+		}
+		else if (ep.state == Endpoint::LIVE)
+		{
+			if (now >= ep.lastHeard + uint64(DISCONNNECT_TIMEOUT) * Clock::MS)
+			{
+				++stats.dropped;
+				endCall(ep);
+				continue;
+			}
+			if (ep.hangupTime && now >= ep.hangupTime)
+			{
+				sendHeader(ep, Packet::HANGUP, ep.peer);
+				endCall(ep);
+				continue;
+			}
+
+			// Catch up on every frame due, as a phone's audio device would have captured them
+			while (now >= ep.nextSend)
+			{
+				sendAudio(ep);
+				ep.nextSend += frameTime;
+			}
+			next = std::min(next, ep.nextSend);
+			if (ep.hangupTime)
+				next = std::min(next, ep.hangupTime);
+		}
+	}
+	return next;
+}
+
+void LoadThread::receive(Endpoint& ep, uint64 now)
+{
+	for (;;)
+	{
+		const int received = ep.transport->receive(recvBatch);
+		if (received < 0)
+		{
+			const int error = Socket::getError();
+			if (error == EWOULDBLOCK)
+				break;
+			if (error == ECONNREFUSED || error == ECONNRESET)
+				continue; //The other end's port closed
+			throw std::runtime_error("recvfrom error: " + Socket::getErrorString());
+		}
+
+		for (int i = 0; i < received; ++i)
+		{
+			if (recvBatch.size(i) < sizeof(uint32))
+				continue;
+			Packet& packet = *reinterpret_cast<Packet*>(recvBatch.data(i));
+			packet.header = ntohl(packet.header);
+			packet.seq = (recvBatch.size(i) >= offsetof(Packet,data)) ? ntohl(packet.seq) : 0;
+			handlePacket(ep, packet, recvBatch.size(i), recvBatch.addr(i), now);
+		}
+
+		if (received < int(recvBatch.capacity()))
+			break;
+	}
+}
+
+void LoadThread::handlePacket(Endpoint& ep, const Packet& packet, uint size, const sockaddr_storage& from, uint64 now)
+{
+	switch (packet.header)
+	{
+	case Packet::RING:
+		// Callees answer at once; anyone else is busy
+		if (ep.state == Endpoint::IDLE && !ep.caller)
+			goLive(ep, from, now);
+		else if (ep.state == Endpoint::IDLE || from != ep.peer)
+			sendHeader(ep, Packet::BUSY, from);
+		break;
+
+	case Packet::BUSY:
+		if (ep.state == Endpoint::DIALING && from == ep.peer)
+		{
+			++stats.busy;
+			endCall(ep);
+		}
+		break;
+
+	case Packet::AUDIO:
+		if (ep.state == Endpoint::IDLE || from != ep.peer || size <= offsetof(Packet,data))
+			break; //Stragglers from a call that's over
+
+		if (ep.state == Endpoint::DIALING)
+		{
+			// Answered: the setup time is from the first RING
+			const uint64 setup = now - ep.setupStart;
+			++stats.connected;
+			stats.setupMsSum += double(setup) / Clock::MS;
+			if (setupUs.size() < setupUs.capacity())
+				setupUs.push_back(uint32(std::min<uint64>(setup, 0xFFFFFFFFu)));
+			goLive(ep, from, now);
+			const double hold = options.fixedHold ? options.holdSeconds : -log(uniform()) * options.holdSeconds;
+			ep.hangupTime = now + uint64(hold * 1000 * Clock::MS) + 1;
+			wake(ep.hangupTime);
+		}
+
+		++stats.received;
+		ep.lastHeard = now;
+		if (!ep.heard)
+		{
+			ep.heard = true;
+			ep.highestSeq = packet.seq;
+			ep.seen = 1;
+			ep.unique = 1;
+		}
+		else if (int32(packet.seq - ep.highestSeq) > 0)
+		{
+			const uint32 ahead = packet.seq - ep.highestSeq;
+			ep.seen = (ahead < 64) ? (ep.seen << ahead) | 1 : 1;
+			ep.highestSeq = packet.seq;
+			++ep.unique;
+		}
+		else
+		{
+			const uint32 behind = ep.highestSeq - packet.seq;
+			if (behind < 64 && (ep.seen >> behind) & 1)
+			{
+				++stats.duplicates;
+			}
+			else
+			{
+				if (behind < 64)
+					ep.seen |= uint64(1) << behind;
+				++stats.reordered;
+				++ep.unique;
+			}
+		}
+		break;
+
+	case Packet::HANGUP:
+		if (ep.state != Endpoint::IDLE && from == ep.peer)
+			endCall(ep);
+		break;
+
+	default:
+		//REPORTs and anything else are ignored, like a phone too old to know them
+		break;
+	}
+}
+
+void LoadThread::goLive(Endpoint& ep, const sockaddr_storage& peer, uint64 now)
+{
+	ep.state = Endpoint::LIVE;
+	ep.peer = peer;
+	ep.sendseq = Conference::FIRST_SEQ;
+	ep.payload = uint(&ep - &endpoints[0]) % ENCODED_FRAMES; //Everyone starts somewhere else in the recording
+	ep.nextSend = now;
+	ep.lastHeard = now;
+	ep.hangupTime = 0;
+	ep.heard = false;
+	ep.unique = 0;
+	wake(now);
+}
+
+void LoadThread::endCall(Endpoint& ep)
+{
+	// Seqs from the first heard to the highest that never arrived; losses at the very end can't be told apart
+	if (ep.heard)
+		stats.lost += ulong(uint32(ep.highestSeq - Conference::FIRST_SEQ + 1)) - std::min<ulong>(ep.unique, uint32(ep.highestSeq - Conference::FIRST_SEQ + 1));
+	ep.heard = false;
+	ep.state = Endpoint::IDLE;
+	if (ep.caller)
+	{
+		--stats.active;
+		++idleCallers;
+	}
+}
+
+void LoadThread::sendAudio(Endpoint& ep)
+{
+	++stats.due;
+	const uint32 seq = ep.sendseq++;
+	const vector<byte>& payload = payloads[ep.payload];
+	ep.payload = (ep.payload + 1) % payloads.size();
+
+	if (options.lossPercent > 0 && uniform() * 100 <= options.lossPercent)
+	{
+		++stats.injected;
+		return;
+	}
+
+	Packet packet;
+	packet.header = htonl(Packet::AUDIO);
+	packet.seq = htonl(seq);
+	memcpy(packet.data, &payload[0], payload.size());
+	if (ep.transport->sendTo(&packet, uint(offsetof(Packet,data) + payload.size()), ep.peer) < 0)
+		++stats.sendErrors;
+	else
+		++stats.sent;
+}
+
+void LoadThread::sendHeader(Endpoint& ep, Packet::Header header, const sockaddr_storage& to)
+{
+	const uint32 netheader = htonl(header);
+	if (ep.transport->sendTo(&netheader, sizeof(netheader), to) < 0)
+		++stats.sendErrors;
+}
+
+
+// Talk spurts: a few syllables of a gliding tone, then a pause, so the encoder sees speech and silence like a call
+static void makeSpeech(vector<int16>& samples)
+{
+	const double pi2 = 6.283185307179586;
+	samples.resize(ENCODED_FRAMES * PACKET_SAMPLES);
+	double phase = 0;
+	for (size_t s = 0; s < samples.size(); ++s)
+	{
+		const double t = double(s) / SAMPLE_RATE;
+		const double spurt = fmod(t, 2.5);
+		const double hz = 150 + 60 * sin(pi2 * 0.7 * t);
+		const double envelope = (spurt < 1.5) ? fabs(sin(pi2 * 2.5 * t)) : 0;
+		phase += pi2 * hz / SAMPLE_RATE;
+		samples[s] = int16(6000 * envelope * (sin(phase) + 0.3 * sin(3 * phase)));
+	}
+}
+
+// Encoded once, like a phone would with its default settings, so replaying them costs no CPU
+static vector<vector<byte> > encodePayloads(const string& wav)
+{
+	vector<int16> samples;
+	if (wav.empty())
+		makeSpeech(samples);
+	else
+		WavAudioDevice::readFile(wav, SAMPLE_RATE, samples);
+	samples.resize(std::max<size_t>(samples.size() / PACKET_SAMPLES, 1) * PACKET_SAMPLES, 0);
+
+	int opusErr = OPUS_OK;
+	OpusEncoder* encoder = opus_encoder_create(SAMPLE_RATE, CHANNELS, OPUS_APPLICATION_VOIP, &opusErr);
+	if (!encoder || opusErr != OPUS_OK)
+		throw std::runtime_error(string("opus_encoder_create error: ") + opus_strerror(opusErr));
+	opus_encoder_ctl(encoder, OPUS_SET_INBAND_FEC(1));
+	opus_encoder_ctl(encoder, OPUS_SET_PACKET_LOSS_PERC(EXPECTED_LOSS_PERC));
+	opus_encoder_ctl(encoder, OPUS_SET_DTX(1));
+
+	vector<vector<byte> > payloads;
+	byte data[ENCODED_MAX_BYTES];
+	for (size_t f = 0; f < ENCODED_FRAMES; ++f)
+	{
+		const size_t offset = (f * PACKET_SAMPLES) % samples.size();
+		const opus_int32 size = opus_encode(encoder, &samples[offset], PACKET_SAMPLES, data, PACKET_MS * ENCODED_BYTES_PER_MS);
+		if (size < 0)
+			throw std::runtime_error(string("opus_encode error: ") + opus_strerror(size));
+		payloads.push_back(vector<byte>(data, data + size));
+	}
+	opus_encoder_destroy(encoder);
+	return payloads;
+}
+
+static sockaddr_storage loopbackAddress(uint16 port)
+{
+	sockaddr_storage addr = {};
+	sockaddr_in& in = (sockaddr_in&)addr;
+	in.sin_family = AF_INET;
+	in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	in.sin_port = htons(port);
+	return addr;
+}
+
+static void createEndpoints(const Options& options, vector<Endpoint>& endpoints)
+{
+	const sockaddr_storage relay = options.relay.empty() ? sockaddr_storage() : RelayTransport::resolve(options.relay);
+	for (uint e = 0; e < endpoints.size(); ++e)
+	{
+		Endpoint& ep = endpoints[e];
+		UdpTransport* udp = new UdpTransport();
+		ep.transport = udp;
+		if (!options.relay.empty())
+		{
+			ep.relay = new RelayTransport(relay, options.relayId + e, udp);
+			ep.transport = ep.relay;
+			ep.address = relayPeerAddress(options.relayId + e);
+		}
+
+		// Port 0 picks a free one, so ask what it was
+		ep.transport->bind(0, 0);
+		sockaddr_in local = {};
+		socklen_t localLen = sizeof(local);
+		if (getsockname(ep.transport->getFd(), (sockaddr*)&local, &localLen))
+			throw std::runtime_error("getsockname failed: " + Socket::getErrorString());
+		if (!ep.relay)
+			ep.address = loopbackAddress(ntohs(local.sin_port));
+
+		ep.partner = options.pairs() ? (e ^ 1) : e;
+		ep.caller = !options.pairs() || !(e & 1);
+	}
+}
+
+static double percentileMs(const vector<uint32>& sorted, double percent)
+{
+	if (sorted.empty())
+		return 0;
+	return sorted[std::min(sorted.size() - 1, size_t(sorted.size() * percent / 100))] / double(Clock::MS);
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+	for (int i = 1; i < argc; ++i)
+	{
+		const string arg = argv[i];
+		const bool hasValue = (i + 1 < argc);
+		if ((arg == "-e" || arg == "--endpoints") && hasValue)
+			options.endpoints = uint(atoi(argv[++i]));
+		else if ((arg == "-c" || arg == "--calls-per-sec") && hasValue)
+			options.callsPerSec = atof(argv[++i]);
+		else if ((arg == "-H" || arg == "--hold") && hasValue)
+			options.holdSeconds = atof(argv[++i]);
+		else if (arg == "--fixed-hold")
+			options.fixedHold = true;
+		else if ((arg == "-d" || arg == "--seconds") && hasValue)
+			options.seconds = uint(atoi(argv[++i]));
+		else if ((arg == "-l" || arg == "--loss") && hasValue)
+			options.lossPercent = atof(argv[++i]);
+		else if ((arg == "-t" || arg == "--threads") && hasValue)
+			options.threads = uint(atoi(argv[++i]));
+		else if (arg == "--relay" && hasValue)
+			options.relay = argv[++i];
+		else if (arg == "--relay-id" && hasValue)
+			options.relayId = uint32(strtoul(argv[++i], NULL, 10));
+		else if (arg == "--conference" && hasValue)
+			options.conference = argv[++i];
+		else if (arg == "--wav" && hasValue)
+			options.wav = argv[++i];
+		else if ((arg == "-r" || arg == "--report") && hasValue)
+			options.reportSeconds = uint(atoi(argv[++i]));
+		else
+		{
+			const bool help = (arg == "-h" || arg == "--help");
+			fputs(USAGE, help ? stdout : stderr);
+			return help ? 0 : 1;
+		}
+	}
+
+	// In pairs, each thread gets whole pairs
+	const uint unit = options.pairs() ? 2 : 1;
+	options.threads = std::max(1u, std::min(options.threads, options.endpoints / unit));
+	if (options.endpoints < unit || options.callsPerSec <= 0 || options.holdSeconds <= 0 || !options.seconds ||
+	    options.lossPercent < 0 || options.lossPercent > 100 || !options.relayId)
+	{
+		fputs(USAGE, stderr);
+		return 1;
+	}
+	options.endpoints -= options.endpoints % unit;
+
+	vector<Endpoint> endpoints(options.endpoints);
+	vector<LoadThread*> threads;
+	int result = 0;
+	try
+	{
+		if (!options.conference.empty())
+		{
+			// Same form as a relay's address, with the conference's default port
+			options.conferenceAddr = RelayTransport::resolve(options.conference.find(':') == string::npos ?
+				options.conference + ":" + toString(Conference::PORT_DEFAULT) : options.conference);
+		}
+
+		const vector<vector<byte> > payloads = encodePayloads(options.wav);
+		createEndpoints(options, endpoints);
+
+		const double erlangs = options.callsPerSec * options.holdSeconds;
+		printf("%u endpoints %s, %g calls/s held %s%gs (about %.0f at once, %.0f AUDIO packets/s), %u thread%s, %u seconds\n",
+		       options.endpoints, !options.conference.empty() ? ("calling conference " + options.conference).c_str() :
+		       !options.relay.empty() ? ("in pairs through relay " + options.relay).c_str() : "in pairs over loopback",
+		       options.callsPerSec, options.fixedHold ? "" : "a mean ", options.holdSeconds, erlangs,
+		       erlangs * 1000 / PACKET_MS * unit, options.threads, options.threads == 1 ? "" : "s", options.seconds);
+		fflush(stdout);
+
+		const uint units = options.endpoints / unit;
+		for (uint t = 0; t < options.threads; ++t)
+		{
+			threads.push_back(new LoadThread(options, endpoints, unit * (units * t / options.threads),
+			                                 unit * (units * (t + 1) / options.threads), payloads, 2654435761u * (t + 1)));
+		}
+		for (uint t = 0; t < options.threads; ++t)
+			threads[t]->start();
+
+		// Progress while the threads run
+		const uint64 start = Clock::now();
+		uint64 lastTime = start, reportTime = start + uint64(options.reportSeconds) * 1000 * Clock::MS;
+		Stats last;
+		for (;;)
+		{
+			bool running = false;
+			for (uint t = 0; t < options.threads; ++t)
+				running = running || !threads[t]->isDone();
+			if (!running)
+				break;
+			Thread::sleep(PUBLISH_MS);
+
+			const uint64 now = Clock::now();
+			if (!options.reportSeconds || now < reportTime)
+				continue;
+			Stats total;
+			for (uint t = 0; t < options.threads; ++t)
+				total += threads[t]->getStats();
+			const double seconds = double(now - lastTime) / (1000 * Clock::MS);
+			printf("%5.0fs  %5lu calls up  %lu connected  %.0f packets/s sent (%.0f due)  %.0f received  %lu lost so far\n",
+			       double(now - start) / (1000 * Clock::MS), total.active, total.connected, (total.sent - last.sent) / seconds,
+			       (total.due - last.due) / seconds, (total.received - last.received) / seconds, total.lost);
+			fflush(stdout);
+			last = total;
+			lastTime = now;
+			reportTime += uint64(options.reportSeconds) * 1000 * Clock::MS;
+		}
+		const double seconds = double(Clock::now() - start) / (1000 * Clock::MS);
+
+		Stats total;
+		vector<uint32> setupUs;
+		string error;
+		for (uint t = 0; t < options.threads; ++t)
+		{
+			threads[t]->join();
+			total += threads[t]->getStats();
+			setupUs.insert(setupUs.end(), threads[t]->getSetupUs().begin(), threads[t]->getSetupUs().end());
+			if (error.empty())
+				error = threads[t]->getError();
+		}
+		if (!error.empty())
+			throw std::runtime_error(error);
+		std::sort(setupUs.begin(), setupUs.end());
+
+		const ulong expected = total.received - total.duplicates + total.lost;
+		printf("\nCalls: %lu attempted, %lu connected, %lu busy, %lu unanswered, %lu blocked (no idle endpoint), %lu dropped (no audio for %ds)\n",
+		       total.attempted, total.connected, total.busy, total.unanswered, total.blocked, total.dropped, DISCONNNECT_TIMEOUT / 1000);
+		printf("Setup:   p50 %.2fms  p90 %.2fms  p99 %.2fms  max %.2fms  mean %.2fms\n", percentileMs(setupUs, 50),
+		       percentileMs(setupUs, 90), percentileMs(setupUs, 99), percentileMs(setupUs, 100),
+		       total.connected ? total.setupMsSum / total.connected : 0.0);
+		printf("Packets: %lu sent (%.0f/s, %.1f%% of the %lu due), %lu received (%.0f/s), %lu dropped by --loss, %lu send errors\n",
+		       total.sent, total.sent / seconds, total.due ? 100.0 * (total.sent + total.injected) / total.due : 100.0,
+		       total.due, total.received, total.received / seconds, total.injected, total.sendErrors);
+		printf("Received: %.3f%% lost (%lu), %.3f%% reordered (%lu), %lu duplicates\n",
+		       expected ? 100.0 * total.lost / expected : 0.0, total.lost, expected ? 100.0 * total.reordered / expected : 0.0,
+		       total.reordered, total.duplicates);
+	}
+	catch (std::exception& ex)
+	{
+		fprintf(stderr, "Error: %s\n", ex.what());
+		result = 1;
+	}
+
+	for (size_t t = 0; t < threads.size(); ++t)
+		delete threads[t];
+	for (size_t e = 0; e < endpoints.size(); ++e)
+		delete endpoints[e].transport; //A RelayTransport deletes its UdpTransport
+	return result;
+}
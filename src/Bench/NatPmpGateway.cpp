@@ -0,0 +1,154 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "NatPmpGateway.h"
+#ifndef _WIN32
+#	include <netinet/in.h>
+#endif
+
+namespace tincan {
+
+
+static const byte WAN_ADDRESS[4] = { 203, 0, 113, 1 }; //TEST-NET-3
+
+static void put16(byte* p, uint16 v)  {p[0] = byte(v >> 8); p[1] = byte(v);}
+static void put32(byte* p, uint32 v)  {put16(p, uint16(v >> 16)); put16(p + 2, uint16(v));}
+static uint16 get16(const byte* p)  {return uint16((p[0] << 8) | p[1]);}
+
+
+NatPmpGateway::NatPmpGateway(Mode mode, uint delayMs)
+: mode(mode),
+  delayMs(delayMs),
+  sock(-1),
+  stopping(false),
+  requests(0)
+{
+	sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock == -1)
+		throw std::runtime_error("Failed to create socket");
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	if (bind(sock, (sockaddr*)&addr, len) || getsockname(sock, (sockaddr*)&addr, &len))
+	{
+		Socket::close(sock);
+		throw std::runtime_error("Failed to bind loopback socket: " + Socket::getErrorString());
+	}
+
+	thread.start(&threadMain, this);
+}
+
+NatPmpGateway::~NatPmpGateway()
+{
+	stopping = true;
+	stopper.signal();
+	thread.join();
+	Socket::close(sock);
+}
+
+void NatPmpGateway::threadMain(void* gateway)
+{
+	reinterpret_cast<NatPmpGateway*>(gateway)->serve();
+}
+
+void NatPmpGateway::serve()
+{
+	while (!stopping)
+	{
+		pollfd fds[2] = {};
+		fds[0].fd = sock;
+		fds[0].events = POLLIN;
+		fds[1].fd = stopper.getFd();
+		fds[1].events = POLLIN;
+		if (Socket::poll(fds, 2, -1) <= 0 || !fds[0].revents)
+			continue;
+
+		byte request[1100], response[1100];
+		sockaddr_storage from;
+		socklen_t fromLen = sizeof(from);
+		int size = recvfrom(sock, (char*)request, sizeof(request), 0, (sockaddr*)&from, &fromLen);
+		if (size < 2)
+			continue;
+
+		++requests;
+		uint responseSize = reply(request, uint(size), response);
+		if (!responseSize)
+			continue;
+
+		if (delayMs)
+			Thread::sleep(delayMs);
+		sendto(sock, (const char*)response, responseSize, 0, (sockaddr*)&from, fromLen);
+	}
+}
+
+uint NatPmpGateway::reply(const byte* request, uint size, byte* response)
+{
+	if (mode == SPEAK_SILENT)
+		return 0;
+
+	const byte version = request[0];
+	const byte opcode = request[1];
+
+	if (version == 2 && mode == SPEAK_PCP && size >= 24)
+	{
+		// Echo the request (and MAP payload) back, then fill in the reply fields
+		const uint replySize = (opcode == 1 && size >= 60) ? 60 : 24;
+		memcpy(response, request, replySize);
+		response[1] = byte(0x80 | opcode);
+		response[2] = 0;
+		response[3] = (opcode <= 1) ? 0 : 4; //Success, or unsupported opcode
+		put32(response + 8, 0); //Epoch
+		memset(response + 12, 0, 12);
+
+		if (opcode == 1 && replySize == 60)
+		{
+			byte* op = response + 24;
+			if (!get16(op + 18))
+				memcpy(op + 18, op + 16, 2); //No suggested port, so give the internal one
+			memset(op + 20, 0, 10);
+			op[30] = op[31] = 0xff;
+			memcpy(op + 32, WAN_ADDRESS, 4);
+		}
+		return replySize;
+	}
+
+	if (version != 0)
+	{
+		// How a NAT-PMP-only gateway answers PCP
+		response[0] = 0;
+		response[1] = byte(0x80 | opcode);
+		put16(response + 2, 1); //Unsupported version
+		put32(response + 4, 0);
+		return 8;
+	}
+
+	response[0] = 0;
+	response[1] = byte(0x80 | opcode);
+	put16(response + 2, 0);
+	put32(response + 4, 0); //Epoch
+
+	if (opcode == 0)
+	{
+		memcpy(response + 8, WAN_ADDRESS, 4);
+		return 12;
+	}
+	else if ((opcode == 1 || opcode == 2) && size >= 12)
+	{
+		memcpy(response + 8, request + 4, 2);  //Internal port
+		memcpy(response + 10, request + 6, 2); //External port
+		if (!get16(response + 10))
+			memcpy(response + 10, request + 4, 2);
+		memcpy(response + 12, request + 8, 4); //Lifetime
+		return 16;
+	}
+	else
+	{
+		put16(response + 2, 5); //Unsupported opcode
+		return 8;
+	}
+}
+
+
+}
@@ -0,0 +1,49 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+#include "Socket.h"
+#include "Thread.h"
+#include <atomic>
+
+namespace tincan {
+
+
+// Stand-in for a router's NAT-PMP/PCP server on loopback, for benchmarking without a real router
+// Mappings always succeed and get the port asked for (or the local port if none was suggested)
+class NatPmpGateway
+{
+public:
+	enum Mode {
+		SPEAK_PCP,    //Like a current router, answers both protocols
+		SPEAK_NATPMP, //Like an older router, answers PCP with "unsupported version"
+		SPEAK_SILENT  //Like a router without either, never answers
+	};
+
+	NatPmpGateway(Mode mode, uint delayMs = 0);
+	~NatPmpGateway();
+
+	// Where NatPmp should send its requests
+	const sockaddr_in& getAddress() const  {return addr;}
+
+	ulong getRequests() const  {return requests;}
+
+protected:
+	Mode               mode;
+	uint               delayMs;
+	SOCKET             sock;
+	sockaddr_in        addr;
+	Waker              stopper;
+	Thread             thread;
+	std::atomic<bool>  stopping;
+	std::atomic<ulong> requests;
+
+	static void threadMain(void* gateway);
+	void serve();
+	uint reply(const byte* request, uint size, byte* response);
+};
+
+
+}
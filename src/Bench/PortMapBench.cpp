@@ -0,0 +1,88 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "NatPmp.h"
+#include "NatPmpGateway.h"
+#include "Clock.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+// Measures how long NatPmp takes to find out the protocol, map a port and delete it again,
+// against a stand-in gateway on loopback speaking PCP, NAT-PMP only, or nothing
+using namespace tincan;
+
+enum {
+	DEFAULT_ROUNDS = 200,
+	TIMEOUT_MS = 2000,
+	LOCAL_PORT = 56780
+};
+
+static double percentile(vector<double>& samples, double p)
+{
+	std::sort(samples.begin(), samples.end());
+	return samples[size_t(p * (samples.size() - 1))];
+}
+
+static void run(const char* name, NatPmpGateway::Mode mode, uint delayMs, uint rounds)
+{
+	NatPmpGateway gateway(mode, delayMs);
+
+	vector<double> probeMs, mapMs, totalMs;
+	string error, protocol;
+	for (uint i = 0; i < rounds; ++i)
+	{
+		const uint64 start = Clock::now();
+		try
+		{
+			NatPmp natpmp(TIMEOUT_MS, &gateway.getAddress());
+			const uint64 probed = Clock::now();
+			natpmp.setPortMapping(LOCAL_PORT, LOCAL_PORT, PortMapper::MAP_UDP, "Tin Can Phone");
+			const uint64 mapped = Clock::now();
+
+			protocol = natpmp.getName();
+			probeMs.push_back(double(probed - start) / Clock::MS);
+			mapMs.push_back(double(mapped - probed) / Clock::MS);
+		}
+		catch (std::exception& ex)
+		{
+			error = ex.what();
+		}
+		totalMs.push_back(double(Clock::now() - start) / Clock::MS);
+	}
+
+	if (probeMs.empty())
+	{
+		printf("%-28s failed after %8.2fms median: %s\n", name, percentile(totalMs, 0.5), error.c_str());
+		return;
+	}
+
+	printf("%-28s %-8s probe p50 %7.3fms p99 %7.3fms   map p50 %7.3fms p99 %7.3fms   %lu requests\n", name, protocol.c_str(),
+	       percentile(probeMs, 0.5), percentile(probeMs, 0.99), percentile(mapMs, 0.5), percentile(mapMs, 0.99),
+	       gateway.getRequests());
+}
+
+int main(int argc, char* argv[])
+{
+	uint rounds = (argc > 1) ? uint(atoi(argv[1])) : DEFAULT_ROUNDS;
+	if (!rounds)
+	{
+		fprintf(stderr, "Usage: %s [rounds]\n", argv[0]);
+		return 1;
+	}
+
+	try
+	{
+		run("PCP", NatPmpGateway::SPEAK_PCP, 0, rounds);
+		run("NAT-PMP only", NatPmpGateway::SPEAK_NATPMP, 0, rounds);
+		run("PCP, 5ms gateway", NatPmpGateway::SPEAK_PCP, 5, std::min(rounds, 50u));
+		run("no NAT-PMP or PCP", NatPmpGateway::SPEAK_SILENT, 0, 1);
+	}
+	catch (std::exception& ex)
+	{
+		fprintf(stderr, "Error: %s\n", ex.what());
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,728 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "Phone.h"
+#include "LoopbackNetwork.h"
+#include "TimerAudioDevice.h"
+#include "WavAudioDevice.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+// Calls between two Phones over a LoopbackNetwork for each impairment profile, playing a reference
+// signal into the caller's microphone and recording the callee's speaker, then scores what came out:
+// segmental SNR against the reference, mouth-to-ear latency, and the receiver's jitter buffer counters.
+// Prints JSON so runs before and after a jitter buffer change can be compared by script.
+using namespace tincan;
+
+enum {
+	DEFAULT_SECONDS = 10,
+	REFERENCE_SECONDS = 4,   //Longer than MAX_LATENCY_MS, so there's only one way to line it up
+	POLL_MS = 5,
+	CONNECT_TIMEOUT_MS = 5000,
+	SETTLE_MS = 500,         //Skipped at the start of each call while the jitter buffer fills
+	WINDOW_MS = 200,         //Each window of the recording is lined up with the reference on its own
+	SEGMENT_MS = 20,         //Segmental SNR is averaged over segments this long
+	MAX_LATENCY_MS = 1000,
+	DECIMATION = 6,          //Coarse alignment search at 8kHz
+	SILENCE_RMS = 100,       //Reference segments quieter than this don't count
+	SNR_MIN_DB = -10,        //Per-segment clamps, as usual for segmental SNR
+	SNR_MAX_DB = 35
+};
+
+static const double MATCH_CORRELATION = 0.5; //Below this a window is too garbled to be lined up
+
+static const char USAGE[] =
+	"Usage: quality_bench [options]\n"
+	"  -d, --duration SECONDS     Length of each call (default 10)\n"
+	"  -p, --profile NAME         Run only this profile, can be repeated (default all)\n"
+	"  -i, --impair SPEC          Run a custom profile, SPEC is comma separated key=value with keys\n"
+	"                             loss, burst-start, burst-end, burst-loss (percent), delay, jitter (ms),\n"
+	"                             reorder (percent), rate (kbps), queue (ms) and seed\n"
+	"  -w, --wav FILE             Reference to play, 16-bit mono 48kHz (default synthetic speech)\n"
+	"  -f, --frame MS             Packet duration the caller proposes (default 20)\n"
+	"  -o, --output FILE          Write the JSON here instead of stdout\n"
+	"  -v, --verbose              Print both Phones' logs to stderr\n"
+	"  -l, --list                 List the built-in profiles\n";
+
+
+struct Profile
+{
+	string     name;
+	Impairment impairment;
+};
+
+static vector<Profile> builtinProfiles()
+{
+	vector<Profile> profiles;
+	Profile p;
+
+	p.name = "clean";
+	profiles.push_back(p);
+
+	p = Profile();
+	p.name = "delay-100";
+	p.impairment.delayMs = 100;
+	profiles.push_back(p);
+
+	p = Profile();
+	p.name = "jitter-30";
+	p.impairment.delayMs = 20;
+	p.impairment.jitterMs = 30;
+	profiles.push_back(p);
+
+	p = Profile();
+	p.name = "loss-5";
+	p.impairment.lossPercent = 5;
+	profiles.push_back(p);
+
+	// About 5% loss overall, in bursts of 3-4 packets
+	p = Profile();
+	p.name = "burst";
+	p.impairment.burstStartPercent = 2;
+	p.impairment.burstEndPercent = 30;
+	p.impairment.burstLossPercent = 80;
+	profiles.push_back(p);
+
+	// The delay is long enough that a packet skipping it overtakes the one before
+	p = Profile();
+	p.name = "reorder-10";
+	p.impairment.delayMs = 40;
+	p.impairment.reorderPercent = 10;
+	profiles.push_back(p);
+
+	p = Profile();
+	p.name = "bad-wifi";
+	p.impairment.delayMs = 30;
+	p.impairment.jitterMs = 60;
+	p.impairment.lossPercent = 1;
+	p.impairment.burstStartPercent = 1;
+	p.impairment.burstEndPercent = 25;
+	p.impairment.burstLossPercent = 60;
+	p.impairment.reorderPercent = 1;
+	profiles.push_back(p);
+
+	return profiles;
+}
+
+// Linear congruential, so the reference is the same everywhere; returns [0, 1)
+static double nextRandom(uint32& state)
+{
+	state = state * 1664525u + 1013904223u;
+	return double(state >> 8) / double(1 << 24);
+}
+
+// A rough stand-in for speech: syllables of harmonics with a gliding pitch, shaped by two formants,
+// with gaps between them; deterministic, and never repeating within REFERENCE_SECONDS
+static void synthesizeSpeech(vector<int16>& out)
+{
+	const double PI = 3.14159265358979;
+	vector<double> signal(REFERENCE_SECONDS * SAMPLE_RATE, 0.0);
+
+	uint32 rng = 12345;
+
+	size_t pos = 0;
+	while (pos < signal.size())
+	{
+		const size_t length = size_t((0.08 + 0.22 * nextRandom(rng)) * SAMPLE_RATE);
+		const size_t gap = size_t((0.02 + 0.13 * nextRandom(rng)) * SAMPLE_RATE);
+		const double pitchStart = 90 + 160 * nextRandom(rng);
+		const double pitchEnd = pitchStart * (0.8 + 0.4 * nextRandom(rng));
+		const double formant1 = 300 + 600 * nextRandom(rng);
+		const double formant2 = 900 + 1600 * nextRandom(rng);
+		const double noise = (nextRandom(rng) < 0.3) ? 0.3 : 0.02; //Some syllables start with a fricative
+
+		double phase = 0;
+		for (size_t s = 0; s < length && pos + s < signal.size(); ++s)
+		{
+			const double t = double(s) / length;
+			const double pitch = pitchStart + (pitchEnd - pitchStart) * t;
+			phase += 2 * PI * pitch / SAMPLE_RATE;
+
+			double sample = 0;
+			for (uint h = 1; h * pitch < 4000; ++h)
+			{
+				const double f = h * pitch;
+				const double d1 = (f - formant1) / 150, d2 = (f - formant2) / 250;
+				sample += (exp(-d1 * d1) + 0.5 * exp(-d2 * d2) + 0.05) / h * sin(h * phase);
+			}
+			const double fricative = (t < 0.2) ? noise * (nextRandom(rng) - 0.5) : 0;
+			signal[pos + s] = (sample + fricative) * sqrt(sin(PI * t));
+		}
+		pos += length + gap;
+	}
+
+	double peak = 0;
+	for (size_t s = 0; s < signal.size(); ++s)
+		peak = std::max(peak, fabs(signal[s]));
+
+	out.resize(signal.size());
+	for (size_t s = 0; s < signal.size(); ++s)
+		out[s] = int16(signal[s] / peak * 16000);
+}
+
+
+// Plays the reference into the caller's microphone, on repeat
+class SourceDevice : public TimerAudioDevice
+{
+public:
+	explicit SourceDevice(const vector<int16>& reference) : reference(reference), position(0), started(0)  {}
+	~SourceDevice()  {stop();}
+
+	string getInputName() const   {return "reference";}
+	string getOutputName() const  {return "null";}
+
+	void start(uint rate, ulong frames, Callback callbackFunc, void* arg)
+	{
+		TimerAudioDevice::start(rate, frames, callbackFunc, arg);
+		started = startTime;
+	}
+
+	// Reference sample n was captured at getStartTime() + n / SAMPLE_RATE seconds
+	uint64 getStartTime() const  {return started;}
+
+protected:
+	const vector<int16>& reference;
+	size_t               position;
+	std::atomic<uint64>  started;
+
+	void capture(int16* buffer, ulong frames)
+	{
+		for (ulong s = 0; s < frames; ++s)
+		{
+			buffer[s] = reference[position];
+			if (++position == reference.size())
+				position = 0;
+		}
+	}
+
+	void play(const int16*, ulong)  {}
+};
+
+
+// Records the callee's speaker while recording is on, into memory allocated up front
+class RecordingDevice : public TimerAudioDevice
+{
+public:
+	explicit RecordingDevice(size_t capacity)
+	: samples(capacity), played(0), firstFrame(0), recorded(0), recording(false), started(0)  {}
+	~RecordingDevice()  {stop();}
+
+	string getInputName() const   {return "silence";}
+	string getOutputName() const  {return "recording";}
+
+	void start(uint rate, ulong frames, Callback callbackFunc, void* arg)
+	{
+		TimerAudioDevice::start(rate, frames, callbackFunc, arg);
+		started = startTime;
+	}
+
+	void setRecording(bool on)  {recording = on;}
+
+	// Sample n of the recording was played at getStartTime() + (getFirstFrame() + n) / SAMPLE_RATE seconds
+	size_t       getRecorded() const    {return recorded.load(std::memory_order_acquire);}
+	uint64       getFirstFrame() const  {return firstFrame;}
+	uint64       getStartTime() const   {return started;}
+	const int16* getSamples() const     {return &samples[0];}
+
+protected:
+	vector<int16>       samples;
+	uint64              played;     //Frames so far, only used by the device thread
+	uint64              firstFrame; //Written before the first recorded samples are published
+	std::atomic<size_t> recorded;
+	std::atomic<bool>   recording;
+	std::atomic<uint64> started;
+
+	void capture(int16* buffer, ulong frames)  {memset(buffer, 0, frames * sizeof(int16));}
+
+	void play(const int16* buffer, ulong frames)
+	{
+		const size_t count = recorded.load(std::memory_order_relaxed);
+		if (recording && count < samples.size())
+		{
+			if (count == 0)
+				firstFrame = played;
+			const size_t n = std::min<size_t>(frames, samples.size() - count);
+			memcpy(&samples[count], buffer, n * sizeof(int16));
+			recorded.store(count + n, std::memory_order_release);
+		}
+		played += frames;
+	}
+};
+
+
+struct Quality
+{
+	uint           windows;      //With something in the reference to compare against
+	uint           matched;      //Lined up with the reference well enough to measure latency
+	uint           segments;
+	double         snrDb;        //Mean of per-segment SNRs
+	vector<double> latenciesMs;  //Mouth-to-ear, one per matched window
+	Quality() : windows(0), matched(0), segments(0), snrDb(0)  {}
+};
+
+// Source samples before the source started are silence
+static double sourceAt(const vector<int16>& reference, int64 n)
+{
+	return (n < 0) ? 0.0 : double(reference[size_t(n % int64(reference.size()))]);
+}
+
+static double correlation(const int16* rec, const vector<int16>& reference, int64 sourceStart, uint length)
+{
+	double dot = 0, recEnergy = 0, srcEnergy = 0;
+	for (uint s = 0; s < length; ++s)
+	{
+		const double src = sourceAt(reference, sourceStart + s);
+		dot += rec[s] * src;
+		recEnergy += double(rec[s]) * rec[s];
+		srcEnergy += src * src;
+	}
+	return (recEnergy > 0 && srcEnergy > 0) ? dot / sqrt(recEnergy * srcEnergy) : 0.0;
+}
+
+// Finds how many samples behind the source each window of the recording is, and scores the windows against it
+static Quality analyze(const vector<int16>& reference, const SourceDevice& source, const RecordingDevice& sink)
+{
+	const uint window = SAMPLE_RATE * WINDOW_MS / 1000;
+	const uint segment = SAMPLE_RATE * SEGMENT_MS / 1000;
+	const uint maxLag = SAMPLE_RATE * MAX_LATENCY_MS / 1000;
+	const uint windowD = window / DECIMATION, maxLagD = maxLag / DECIMATION;
+
+	const int16* rec = sink.getSamples();
+	const size_t recorded = sink.getRecorded();
+
+	// Source sample played at the same moment as recorded sample 0, if there were no delay
+	const int64 offset = int64(sink.getFirstFrame()) +
+		(int64(sink.getStartTime()) - int64(source.getStartTime())) * SAMPLE_RATE / (Clock::MS * 1000);
+
+	Quality quality;
+	double snrTotal = 0;
+	int64 lastLag = -1;
+	vector<double> recD(windowD), srcD(windowD + maxLagD), srcPrefix(windowD + maxLagD + 1);
+
+	for (size_t start = SAMPLE_RATE * SETTLE_MS / 1000; start + window <= recorded; start += window)
+	{
+		// Coarse search, decimated by summing, with the source energy in each position from prefix sums
+		const int64 sourceNow = offset + int64(start);
+		const int64 sourceFirst = sourceNow - maxLagD * DECIMATION;
+		double recEnergy = 0;
+		for (uint i = 0; i < windowD; ++i)
+		{
+			double sum = 0;
+			for (uint s = 0; s < DECIMATION; ++s)
+				sum += rec[start + i * DECIMATION + s];
+			recD[i] = sum;
+			recEnergy += sum * sum;
+		}
+		for (uint i = 0; i < srcD.size(); ++i)
+		{
+			double sum = 0;
+			for (uint s = 0; s < DECIMATION; ++s)
+				sum += sourceAt(reference, sourceFirst + i * DECIMATION + s);
+			srcD[i] = sum;
+			srcPrefix[i + 1] = srcPrefix[i] + sum * sum;
+		}
+
+		int64 bestLag = -1;
+		double best = 0;
+		for (uint o = 0; o <= maxLagD && recEnergy > 0; ++o)
+		{
+			const double srcEnergy = srcPrefix[o + windowD] - srcPrefix[o];
+			if (srcEnergy <= 0)
+				continue;
+			double dot = 0;
+			for (uint i = 0; i < windowD; ++i)
+				dot += recD[i] * srcD[o + i];
+			const double corr = dot / sqrt(recEnergy * srcEnergy);
+			if (corr > best)
+			{
+				best = corr;
+				bestLag = int64(maxLagD - o) * DECIMATION;
+			}
+		}
+
+		// Refine at full rate around the coarse peak
+		if (bestLag >= 0)
+		{
+			const int64 coarse = bestLag;
+			best = 0;
+			for (int64 lag = std::max<int64>(0, coarse - DECIMATION); lag <= std::min<int64>(maxLag, coarse + DECIMATION); ++lag)
+			{
+				const double corr = correlation(rec + start, reference, sourceNow - lag, window);
+				if (corr > best)
+				{
+					best = corr;
+					bestLag = lag;
+				}
+			}
+		}
+
+		const bool matched = best >= MATCH_CORRELATION;
+		const int64 lag = matched ? bestLag : lastLag;
+		if (lag < 0)
+			continue; //Nothing to compare against until the first window lines up
+
+		// Score each segment the reference isn't silent in; garbled windows are scored at the last good alignment
+		bool counted = false;
+		for (uint seg = 0; seg + segment <= window; seg += segment)
+		{
+			double signal = 0, noise = 0;
+			for (uint s = seg; s < seg + segment; ++s)
+			{
+				const double src = sourceAt(reference, sourceNow + s - lag);
+				const double diff = src - rec[start + s];
+				signal += src * src;
+				noise += diff * diff;
+			}
+			if (signal < double(SILENCE_RMS) * SILENCE_RMS * segment)
+				continue;
+
+			const double snr = 10 * log10(signal / std::max(noise, 1.0));
+			snrTotal += std::min<double>(SNR_MAX_DB, std::max<double>(SNR_MIN_DB, snr));
+			++quality.segments;
+			counted = true;
+		}
+
+		if (!counted)
+			continue;
+		++quality.windows;
+		if (matched)
+		{
+			++quality.matched;
+			quality.latenciesMs.push_back(lag * 1000.0 / SAMPLE_RATE);
+			lastLag = lag;
+		}
+	}
+
+	if (quality.segments)
+		quality.snrDb = snrTotal / quality.segments;
+	return quality;
+}
+
+
+struct Result
+{
+	Profile                profile;
+	bool                   connected;
+	string                 error;
+	LoopbackNetwork::Stats network;
+	Phone::AudioStats      sender;
+	Phone::AudioStats      receiver;
+	Quality                quality;
+	double                 callSeconds;
+	Result() : connected(false), callSeconds(0)  {}
+};
+
+static bool verbose = false;
+
+static void phoneThread(void* phone)
+{
+	reinterpret_cast<Phone*>(phone)->mainLoop();
+}
+
+// A Phone in its own thread, told to exit when this goes away
+struct RunningPhone
+{
+	const char* name;
+	Phone       phone;
+	Thread      thread;
+
+	explicit RunningPhone(const char* name) : name(name)  {}
+	~RunningPhone()
+	{
+		phone.setCommand(Phone::CMD_EXIT);
+		thread.join();
+		printLog();
+	}
+
+	void printLog()
+	{
+		string log = phone.readLog();
+		if (!verbose || log.empty())
+			return;
+		std::istringstream lines(log);
+		string line;
+		while (std::getline(lines, line))
+			fprintf(stderr, "%s: %s\n", name, line.c_str());
+	}
+
+	Phone::Status status()
+	{
+		Phone::Status status = phone.getStatus();
+		if (status.state == Phone::EXCEPTION)
+			throw std::runtime_error(string(name) + ": " + phone.getErrorMessage());
+		return status;
+	}
+};
+
+// Waits for both Phones to reach the given states; returns false on timeout
+static bool waitFor(RunningPhone& a, Phone::State stateA, RunningPhone& b, Phone::State stateB, uint timeoutMs,
+                    bool audioReady = false)
+{
+	const uint64 deadline = Clock::now() + uint64(timeoutMs) * Clock::MS;
+	for (;;)
+	{
+		const Phone::Status statusA = a.status(), statusB = b.status();
+		a.printLog();
+		b.printLog();
+		if (statusA.state == stateA && statusB.state == stateB &&
+		    (!audioReady || (statusA.startup.audioMs && statusB.startup.audioMs)))
+			return true;
+		if (Clock::now() >= deadline)
+			return false;
+		Thread::sleep(POLL_MS);
+	}
+}
+
+static Result runProfile(const Profile& profile, const vector<int16>& reference, uint seconds, const Phone::CallParams& params)
+{
+	Result result;
+	result.profile = profile;
+
+	LoopbackNetwork network;
+	network.setImpairment(profile.impairment);
+
+	try
+	{
+		RunningPhone caller("caller"), callee("callee");
+		SourceDevice* source = new SourceDevice(reference);
+		caller.phone.setAudioDevice(source);
+		RecordingDevice* sink = new RecordingDevice(size_t(seconds + 1) * SAMPLE_RATE);
+		callee.phone.setAudioDevice(sink);
+
+		caller.phone.setTransport(network.createEndpoint("10.0.0.1"));
+		caller.phone.disablePortMapping();
+		caller.phone.setCallParams(params);
+		callee.phone.setTransport(network.createEndpoint("10.0.0.2"));
+		callee.phone.disablePortMapping();
+
+		caller.thread.start(&phoneThread, &caller.phone);
+		callee.thread.start(&phoneThread, &callee.phone);
+		if (!waitFor(caller, Phone::HUNGUP, callee, Phone::HUNGUP, CONNECT_TIMEOUT_MS, true))
+			throw std::runtime_error("Phones didn't start");
+
+		caller.phone.setCommand(Phone::CMD_CALL, "10.0.0.2");
+		if (!waitFor(caller, Phone::DIALING, callee, Phone::RINGING, CONNECT_TIMEOUT_MS))
+			throw std::runtime_error("Call didn't ring");
+		callee.phone.setCommand(Phone::CMD_ANSWER);
+		if (!waitFor(caller, Phone::LIVE, callee, Phone::LIVE, CONNECT_TIMEOUT_MS))
+			throw std::runtime_error("Call didn't connect");
+		result.connected = true;
+
+		sink->setRecording(true);
+		const uint64 start = Clock::now();
+		while (Clock::now() - start < uint64(seconds) * 1000 * Clock::MS)
+		{
+			if (!waitFor(caller, Phone::LIVE, callee, Phone::LIVE, 0))
+				throw std::runtime_error("Call dropped");
+			Thread::sleep(POLL_MS * 10);
+		}
+		sink->setRecording(false);
+		result.callSeconds = double(Clock::now() - start) / (Clock::MS * 1000.0);
+
+		result.sender = caller.status().audio;
+		result.receiver = callee.status().audio;
+		result.network = network.getStats();
+		result.quality = analyze(reference, *source, *sink);
+
+		caller.phone.setCommand(Phone::CMD_HANGUP);
+		waitFor(caller, Phone::HUNGUP, callee, Phone::HUNGUP, CONNECT_TIMEOUT_MS);
+	}
+	catch (std::exception& ex)
+	{
+		result.error = ex.what();
+		result.network = network.getStats();
+	}
+	return result;
+}
+
+
+static string number(double value)
+{
+	char text[32];
+	snprintf(text, sizeof(text), "%.2f", value);
+	return text;
+}
+
+static string quoted(const string& text)
+{
+	string out = "\"";
+	for (size_t i = 0; i < text.size(); ++i)
+	{
+		if (text[i] == '"' || text[i] == '\\')
+			out += '\\';
+		out += text[i];
+	}
+	return out + '"';
+}
+
+static double percentile(vector<double> samples, uint percent)
+{
+	if (samples.empty())
+		return 0;
+	std::sort(samples.begin(), samples.end());
+	return samples[std::min(samples.size() - 1, samples.size() * percent / 100)];
+}
+
+static string toJson(const vector<Result>& results, uint seconds, const string& referenceName, const Phone::CallParams& params)
+{
+	std::ostringstream json;
+	json << "{\n"
+	     << "  \"reference\": " << quoted(referenceName) << ",\n"
+	     << "  \"callSeconds\": " << seconds << ",\n"
+	     << "  \"frameMs\": " << params.frameMs << ",\n"
+	     << "  \"profiles\": [";
+
+	for (size_t r = 0; r < results.size(); ++r)
+	{
+		const Result& res = results[r];
+		const Impairment& imp = res.profile.impairment;
+		const LoopbackNetwork::Stats& net = res.network;
+		const Phone::AudioStats& rx = res.receiver;
+		const Quality& q = res.quality;
+
+		double meanLatency = 0;
+		for (size_t i = 0; i < q.latenciesMs.size(); ++i)
+			meanLatency += q.latenciesMs[i] / q.latenciesMs.size();
+
+		json << (r ? "," : "") << "\n    {\n"
+		     << "      \"name\": " << quoted(res.profile.name) << ",\n"
+		     << "      \"impairment\": {\"lossPercent\": " << number(imp.lossPercent)
+		     << ", \"burstStartPercent\": " << number(imp.burstStartPercent)
+		     << ", \"burstEndPercent\": " << number(imp.burstEndPercent)
+		     << ", \"burstLossPercent\": " << number(imp.burstLossPercent)
+		     << ", \"delayMs\": " << number(imp.delayMs)
+		     << ", \"jitterMs\": " << number(imp.jitterMs)
+		     << ", \"reorderPercent\": " << number(imp.reorderPercent)
+		     << ", \"seed\": " << imp.seed << "},\n"
+		     << "      \"connected\": " << (res.connected ? "true" : "false") << ",\n";
+		if (!res.error.empty())
+			json << "      \"error\": " << quoted(res.error) << ",\n";
+		json << "      \"network\": {\"sent\": " << net.sent << ", \"lost\": " << net.lost
+		     << ", \"reordered\": " << net.reordered << ", \"delivered\": " << net.delivered << "},\n"
+		     << "      \"receiver\": {\"jitterMs\": " << number(rx.jitterMs)
+		     << ", \"targetDelayMs\": " << rx.targetDelayMs
+		     << ", \"latePackets\": " << rx.latePackets
+		     << ", \"discardedPackets\": " << rx.discardedPackets
+		     << ", \"fecRecovered\": " << rx.fecRecovered
+		     << ", \"concealedFrames\": " << rx.concealed
+		     << ", \"underruns\": " << rx.underruns
+		     << ", \"connectMs\": " << number(rx.connectMs) << "},\n"
+		     << "      \"sender\": {\"captureToSendMs\": " << number(res.sender.latencyMs)
+		     << ", \"overruns\": " << res.sender.overruns << "},\n"
+		     << "      \"quality\": {\"segmentalSnrDb\": " << number(q.snrDb)
+		     << ", \"matchedPercent\": " << number(q.windows ? 100.0 * q.matched / q.windows : 0)
+		     << ", \"windows\": " << q.windows << ", \"segments\": " << q.segments << "},\n"
+		     << "      \"mouthToEarMs\": {\"mean\": " << number(meanLatency)
+		     << ", \"p50\": " << number(percentile(q.latenciesMs, 50))
+		     << ", \"p95\": " << number(percentile(q.latenciesMs, 95))
+		     << ", \"max\": " << number(percentile(q.latenciesMs, 100)) << "}\n"
+		     << "    }";
+	}
+	json << "\n  ]\n}\n";
+	return json.str();
+}
+
+
+int main(int argc, char* argv[])
+{
+	uint seconds = DEFAULT_SECONDS;
+	vector<Profile> profiles;
+	const vector<Profile> builtins = builtinProfiles();
+	string wavFile, outputFile;
+	Phone::CallParams params;
+
+	try
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			const string arg = argv[i];
+			const bool hasValue = i + 1 < argc;
+			if ((arg == "-d" || arg == "--duration") && hasValue)
+			{
+				seconds = uint(atoi(argv[++i]));
+				if (!seconds)
+					throw std::runtime_error("Invalid duration");
+			}
+			else if ((arg == "-p" || arg == "--profile") && hasValue)
+			{
+				const string name = argv[++i];
+				size_t p = 0;
+				while (p < builtins.size() && builtins[p].name != name)
+					++p;
+				if (p == builtins.size())
+					throw std::runtime_error("Unknown profile " + name + ", see --list");
+				profiles.push_back(builtins[p]);
+			}
+			else if ((arg == "-i" || arg == "--impair") && hasValue)
+			{
+				Profile custom;
+				custom.name = "custom";
+				custom.impairment = Impairment::parse(argv[++i]);
+				profiles.push_back(custom);
+			}
+			else if ((arg == "-w" || arg == "--wav") && hasValue)
+				wavFile = argv[++i];
+			else if ((arg == "-f" || arg == "--frame") && hasValue)
+			{
+				params.frameMs = uint(atoi(argv[++i]));
+				if (!params.isValid())
+					throw std::runtime_error(string("Unsupported frame duration ") + argv[i]);
+			}
+			else if ((arg == "-o" || arg == "--output") && hasValue)
+				outputFile = argv[++i];
+			else if (arg == "-v" || arg == "--verbose")
+				verbose = true;
+			else if (arg == "-l" || arg == "--list")
+			{
+				for (size_t p = 0; p < builtins.size(); ++p)
+					printf("%s\n", builtins[p].name.c_str());
+				return 0;
+			}
+			else
+			{
+				fputs(USAGE, arg == "-h" || arg == "--help" ? stdout : stderr);
+				return (arg == "-h" || arg == "--help") ? 0 : 1;
+			}
+		}
+		if (profiles.empty())
+			profiles = builtins;
+
+		vector<int16> reference;
+		if (wavFile.empty())
+			synthesizeSpeech(reference);
+		else
+			WavAudioDevice::readFile(wavFile, SAMPLE_RATE, reference);
+
+		vector<Result> results;
+		for (size_t p = 0; p < profiles.size(); ++p)
+		{
+			results.push_back(runProfile(profiles[p], reference, seconds, params));
+			const Result& res = results.back();
+			fprintf(stderr, "%-12s %s  SNR %6.2fdB  mouth-to-ear p50 %7.2fms  concealed %lu\n", profiles[p].name.c_str(),
+			        res.error.empty() ? "ok    " : "FAILED", res.quality.snrDb, percentile(res.quality.latenciesMs, 50),
+			        res.receiver.concealed);
+		}
+
+		const string json = toJson(results, seconds, wavFile.empty() ? "synthetic" : wavFile, params);
+		if (outputFile.empty())
+		{
+			fputs(json.c_str(), stdout);
+		}
+		else
+		{
+			FILE* file = fopen(outputFile.c_str(), "w");
+			if (!file)
+				throw std::runtime_error("Could not create " + outputFile);
+			fputs(json.c_str(), file);
+			fclose(file);
+		}
+	}
+	catch (std::exception& ex)
+	{
+		fprintf(stderr, "Error: %s\n", ex.what());
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,344 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "Phone.h"
+#include "LoopbackNetwork.h"
+#include "VirtualAudioDevice.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+// Adaptive bitrate on a virtual clock: two Phones in one thread make a call over a LoopbackNetwork whose
+// bottleneck rate steps down and back up, like an uplink shared with an upload that starts and stops.
+// Prints each second's bitrate, queuing and loss, and exits with EXIT_PROBLEMS unless the bitrate settled
+// under every cap without the queue or loss building up, and climbed back once the cap was lifted.
+// Run with --fixed-bitrate to see the same network without the RateController.
+using namespace tincan;
+
+enum {
+	START_TIME = 1000000,    //Virtual Clock start, anything nonzero
+	PRINT_MS = 1000,
+	SETTLE_SECONDS = 10,     //Of each step, before it's checked
+	MAX_QUEUE_MS = 150,      //Worst round trip over the base we accept once settled
+	MAX_LOSS_PERCENT = 3,    //Worst loss in one REPORT once settled
+	EXIT_PROBLEMS = 2
+};
+
+static const char USAGE[] =
+	"Usage: rate_sim [options]\n"
+	"  -c, --caps LIST            Bottleneck rate schedule, comma separated SECONDS:KBPS with 0 for no limit\n"
+	"                             (default 20:0,30:40,30:28,30:0)\n"
+	"  -i, --impair SPEC          Further impairment in both directions, as for soak_sim (rate is overridden)\n"
+	"  -s, --seed N               Seeds the network (default 1)\n"
+	"  -f, --frame MS             Packet duration of the call (default 20)\n"
+	"      --fixed-bitrate        Leave the bitrate alone, for comparison\n"
+	"  -v, --verbose              Print both Phones' logs\n";
+
+
+// Talks without pause, so every packet is full size and the bitrate is what goes on the wire
+class ToneAudioDevice : public VirtualAudioDevice
+{
+public:
+	explicit ToneAudioDevice(const char* name) : VirtualAudioDevice(0), name(name), phase(0), noise(0), rng(1)  {}
+
+	string getInputName() const   {return name;}
+	string getOutputName() const  {return name;}
+
+protected:
+	string name;
+	double phase;
+	double noise;
+	uint32 rng;
+
+	void capture(int16* buffer, ulong frames)
+	{
+		for (ulong s = 0; s < frames; ++s)
+		{
+			rng = rng * 1664525u + 1013904223u;
+			noise += 0.1 * (double(rng >> 8 & 2047) - 1024 - noise);
+			phase += 2 * 3.14159265 * 220 / SAMPLE_RATE;
+			buffer[s] = int16(5000 * sin(phase) + 4 * noise);
+		}
+	}
+
+	void play(const int16*, ulong)  {}
+};
+
+
+struct Step
+{
+	uint   seconds;
+	double capKbps; //0 for no limit
+};
+
+struct Options
+{
+	vector<Step> steps;
+	Impairment   impairment;
+	uint32       seed;
+	uint         frameMs;
+	bool         fixedBitrate;
+	bool         verbose;
+	Options() : seed(1), frameMs(PACKET_MS), fixedBitrate(false), verbose(false)  {}
+};
+
+static vector<Step> parseSteps(const string& list)
+{
+	vector<Step> steps;
+	std::istringstream items(list);
+	string item;
+	while (std::getline(items, item, ','))
+	{
+		Step step;
+		char* end;
+		step.seconds = uint(strtoul(item.c_str(), &end, 10));
+		if (*end != ':')
+			throw std::runtime_error("Expected SECONDS:KBPS in " + item);
+		step.capKbps = strtod(end + 1, &end);
+		if (*end || !step.seconds || step.capKbps < 0)
+			throw std::runtime_error("Expected SECONDS:KBPS in " + item);
+		steps.push_back(step);
+	}
+	if (steps.empty())
+		throw std::runtime_error("No steps in " + list);
+	return steps;
+}
+
+// How one Phone's sending went during the settled part of a step
+struct StepResult
+{
+	double worstQueueMs;
+	double worstLoss;
+	uint   lastBitrate;
+	StepResult() : worstQueueMs(0), worstLoss(0), lastBitrate(0)  {}
+};
+
+static void printLog(const char* name, Phone& phone, bool verbose)
+{
+	string log = phone.readLog();
+	if (!verbose || log.empty())
+		return;
+	std::istringstream lines(log);
+	string line;
+	while (std::getline(lines, line))
+		printf("%s: %s\n", name, line.c_str());
+}
+
+static int simulate(const Options& options)
+{
+	Clock::setVirtual(START_TIME);
+
+	Impairment impairment = options.impairment;
+	impairment.rateKbps = options.steps[0].capKbps;
+	LoopbackNetwork network(false);
+	network.setImpairment(impairment);
+
+	Phone caller, callee;
+	ToneAudioDevice* callerAudio = new ToneAudioDevice("caller");
+	ToneAudioDevice* calleeAudio = new ToneAudioDevice("callee");
+	caller.setAudioDevice(callerAudio);
+	callee.setAudioDevice(calleeAudio);
+	caller.setTransport(network.createEndpoint("10.0.0.1"));
+	callee.setTransport(network.createEndpoint("10.0.0.2"));
+	caller.disablePortMapping();
+	callee.disablePortMapping();
+	if (options.fixedBitrate)
+	{
+		caller.disableAdaptiveBitrate();
+		callee.disableAdaptiveBitrate();
+	}
+	Phone::CallParams params;
+	params.frameMs = options.frameMs;
+	caller.setCallParams(params);
+
+	caller.startup();
+	callee.startup();
+	caller.setCommand(Phone::CMD_CALL, "10.0.0.2");
+
+	printf("  time    cap   | caller sends: kbps  fec   queue  loss    rtt  | callee sends: kbps  fec   queue  loss    rtt\n");
+
+	vector<string> problems;
+	vector<StepResult> results[2];
+	uint64 liveSince = 0, nextPrint = 0, nextLog = 0, stepEnd = 0;
+	double baseRttMs[2] = {1e9, 1e9};
+	bool answered = false;
+	size_t step = 0;
+	Phone* phones[2] = {&caller, &callee};
+
+	for (uint64 now = START_TIME; ; )
+	{
+		caller.step();
+		callee.step();
+
+		if (now >= nextLog)
+		{
+			printLog("caller", caller, options.verbose);
+			printLog("callee", callee, options.verbose);
+			nextLog = now + PRINT_MS * Clock::MS;
+		}
+
+		const Phone::Status status[2] = {caller.getStatus(), callee.getStatus()};
+		if (!liveSince)
+		{
+			if (status[1].state == Phone::RINGING && !answered)
+				answered = callee.setCommand(Phone::CMD_ANSWER);
+			if (status[0].state == Phone::LIVE && status[1].state == Phone::LIVE)
+			{
+				liveSince = now;
+				nextPrint = now + PRINT_MS * Clock::MS;
+				stepEnd = now + uint64(options.steps[0].seconds) * 1000 * Clock::MS;
+				results[0].resize(options.steps.size());
+				results[1].resize(options.steps.size());
+			}
+			else if (now - START_TIME > 10 * 1000 * Clock::MS)
+			{
+				problems.push_back("Call didn't connect");
+				break;
+			}
+		}
+		else if (status[0].state != Phone::LIVE || status[1].state != Phone::LIVE)
+		{
+			problems.push_back("Call dropped at " + toString((now - liveSince) / (1000 * Clock::MS)) + "s");
+			break;
+		}
+		else if (now >= nextPrint)
+		{
+			const uint64 stepStart = stepEnd - uint64(options.steps[step].seconds) * 1000 * Clock::MS;
+			const bool settled = now >= stepStart + uint64(SETTLE_SECONDS) * 1000 * Clock::MS;
+			const double cap = options.steps[step].capKbps;
+			char capText[16] = "none";
+			if (cap > 0)
+				snprintf(capText, sizeof(capText), "%.0fk", cap);
+			printf("%6.0fs  %5s ", double(now - liveSince) / (1000 * Clock::MS), capText);
+
+			for (uint p = 0; p < 2; ++p)
+			{
+				// The peer's REPORTs tell each Phone how its own packets are getting through
+				const Phone::TransportStats& link = status[p].transport;
+				if (link.reportsReceived && link.rttMs > 0)
+					baseRttMs[p] = std::min(baseRttMs[p], link.rttMs);
+				const double queueMs = link.rttMs > 0 ? link.rttMs - std::min(link.rttMs, baseRttMs[p]) : 0;
+				printf(" |              %5.1f  %2u%%  %5.0fms  %4.1f%%  %5.0fms", link.bitrate / 1000.0,
+				       link.fecLossPercent, queueMs, link.sentLossPercent, link.rttMs);
+
+				if (settled)
+				{
+					StepResult& result = results[p][step];
+					result.worstQueueMs = std::max(result.worstQueueMs, queueMs);
+					result.worstLoss = std::max(result.worstLoss, link.sentLossPercent);
+					result.lastBitrate = link.bitrate;
+				}
+			}
+			printf("\n");
+			fflush(stdout);
+			nextPrint += PRINT_MS * Clock::MS;
+
+			if (now >= stepEnd)
+			{
+				if (++step == options.steps.size())
+					break;
+				impairment.rateKbps = options.steps[step].capKbps;
+				network.setImpairment(impairment);
+				stepEnd += uint64(options.steps[step].seconds) * 1000 * Clock::MS;
+			}
+		}
+
+		// Move the clock on to whatever happens next
+		const uint64 arrival = network.deliver();
+		uint64 next = std::min(callerAudio->getNextTick(), calleeAudio->getNextTick());
+		if (arrival && arrival < next)
+			next = arrival;
+
+		if (next > now)
+		{
+			now = next;
+			Clock::advance(now);
+		}
+		if (callerAudio->getNextTick() <= now)
+			callerAudio->tick();
+		if (calleeAudio->getNextTick() <= now)
+			calleeAudio->tick();
+		network.deliver();
+	}
+
+	// Each step, once settled: the queue and loss stay bounded, and the bitrate recovers when the cap goes
+	const char* names[2] = {"caller", "callee"};
+	for (uint p = 0; p < 2 && liveSince; ++p)
+	{
+		for (size_t s = 0; s < results[p].size(); ++s)
+		{
+			const StepResult& result = results[p][s];
+			const string where = string(" from the ") + names[p] + " in step " + toString(s + 1);
+			if (result.worstQueueMs > MAX_QUEUE_MS)
+				problems.push_back("Queued up to " + toString(uint(result.worstQueueMs)) + "ms" + where);
+			if (result.worstLoss > MAX_LOSS_PERCENT)
+				problems.push_back("Lost up to " + toString(uint(result.worstLoss)) + "%" + where);
+			if (!options.fixedBitrate && !options.steps[s].capKbps && s > 0 && result.lastBitrate < uint(RateController::START_BITRATE))
+				problems.push_back("Bitrate only recovered to " + toString(result.lastBitrate) + where);
+		}
+		const Phone::Status status = phones[p]->getStatus();
+		printf("%s: bitrate changed %lu times, %lu packets lost by the peer\n", names[p], status.transport.bitrateChanges,
+		       status.transport.sentLost);
+	}
+
+	caller.setCommand(Phone::CMD_EXIT);
+	callee.setCommand(Phone::CMD_EXIT);
+	caller.step();
+	callee.step();
+
+	const LoopbackNetwork::Stats net = network.getStats();
+	printf("Network: %lu sent, %lu lost, %lu reordered, %lu delivered\n", net.sent, net.lost, net.reordered, net.delivered);
+	for (size_t p = 0; p < problems.size(); ++p)
+		printf("PROBLEM: %s\n", problems[p].c_str());
+	if (problems.empty())
+		printf("No problems\n");
+	return problems.empty() ? 0 : EXIT_PROBLEMS;
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+	try
+	{
+		string caps = "20:0,30:40,30:28,30:0";
+		for (int i = 1; i < argc; ++i)
+		{
+			const string arg = argv[i];
+			const char* value = (i + 1 < argc) ? argv[i + 1] : NULL;
+			if ((arg == "-c" || arg == "--caps") && value)
+				caps = argv[++i];
+			else if ((arg == "-i" || arg == "--impair") && value)
+				options.impairment = Impairment::parse(argv[++i]);
+			else if ((arg == "-s" || arg == "--seed") && value)
+				options.seed = uint32(strtoul(argv[++i], NULL, 10));
+			else if ((arg == "-f" || arg == "--frame") && value)
+				options.frameMs = uint(atoi(argv[++i]));
+			else if (arg == "--fixed-bitrate")
+				options.fixedBitrate = true;
+			else if (arg == "-v" || arg == "--verbose")
+				options.verbose = true;
+			else
+			{
+				const bool help = (arg == "-h" || arg == "--help");
+				fputs(USAGE, help ? stdout : stderr);
+				return help ? 0 : 1;
+			}
+		}
+
+		options.steps = parseSteps(caps);
+		Phone::CallParams params;
+		params.frameMs = options.frameMs;
+		if (!params.isValid())
+			throw std::runtime_error("Invalid option, see --help");
+		if (!options.impairment.seed || options.impairment.seed == Impairment().seed)
+			options.impairment.seed = options.seed;
+
+		return simulate(options);
+	}
+	catch (std::exception& ex)
+	{
+		fprintf(stderr, "Error: %s\n", ex.what());
+		return 1;
+	}
+}
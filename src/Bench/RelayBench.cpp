@@ -0,0 +1,544 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "RelayServer.h"
+#include "Clock.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+// Loads a RelayServer over loopback with calls between pairs of endpoints, each with its own socket and ID like
+// a phone. For each relay thread count: the latency it adds to voice-rate traffic over sending directly, then
+// how many packets it forwards flat out, per thread and per CPU second (latency then is mostly the queue
+// that WINDOW packets in flight per endpoint makes). First checks the ID table keeps taking new IDs as old ones expire
+using namespace tincan;
+
+enum {
+	DEFAULT_CALLS = 200,
+	DEFAULT_SECONDS = 3,        //Per measurement
+	DEFAULT_PACKET_BYTES = 100, //A Phone AUDIO packet at about 32kbps, not counting the relay header
+	WINDOW = 8,                 //Packets each endpoint keeps in flight when going flat out
+	VOICE_INTERVAL_MS = 20,     //One packet per frame otherwise
+	STALL_MS = 50,              //Packets in flight this long without anything arriving are lost
+	REGISTER_TIMEOUT_MS = 5000,
+	MAX_SAMPLES = 1 << 22       //Latencies kept per measurement
+};
+
+static const char USAGE[] =
+	"Usage: relay_bench [options]\n"
+	"  -t, --threads N[,N...]     Relay thread counts to measure (default 1 then doubling up to one per CPU)\n"
+	"  -c, --calls N              Calls, each two endpoints sending to each other (default 200)\n"
+	"  -l, --load-threads N       Threads sending and receiving for the endpoints (default one per two CPUs)\n"
+	"  -d, --seconds N            Length of each measurement (default 3)\n"
+	"  -b, --bytes N              Packet size before the relay header (default 100)\n"
+	"      --pin                  Keep each relay thread on its own CPU\n";
+
+
+// One end of a call
+struct Endpoint
+{
+	SOCKET           sock;
+	sockaddr_storage addr;
+	uint32           id;       //Relay ID
+	uint             peer;     //Index of the other end
+	uint             inFlight; //Sent and not yet arrived, when going flat out
+	uint64           nextSend; //At voice rate
+	Endpoint() : sock(-1), addr(), id(0), peer(0), inFlight(0), nextSend(0)  {}
+};
+
+// What's sent after the RelayHeader
+struct Payload
+{
+	uint64 sent;   //Clock time
+	uint32 sender; //Endpoint index
+};
+
+// One load thread's share of the endpoints, always whole calls
+struct Load
+{
+	vector<Endpoint>* endpoints;
+	uint              begin, end;
+	sockaddr_storage  relay;
+	bool              direct;    //Send straight to the peer instead of through the relay
+	bool              paced;     //At voice rate instead of flat out
+	uint              bytes;
+	uint64            stopTime;
+	ulong             sent;
+	ulong             received;
+	ulong             lost;
+	vector<uint32>    latencyUs; //One way, send to arrival
+	string            error;
+	Thread            thread;
+};
+
+// Latencies in microseconds, summed over the load threads
+struct Result
+{
+	ulong          sent;
+	ulong          received;
+	ulong          lost;
+	vector<uint32> latencyUs;
+	double         seconds;
+	Result() : sent(0), received(0), lost(0), seconds(0)  {}
+};
+
+
+static sockaddr_storage loopbackAddress(uint16 port)
+{
+	sockaddr_storage addr = {};
+	sockaddr_in& in = (sockaddr_in&)addr;
+	in.sin_family = AF_INET;
+	in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	in.sin_port = htons(port);
+	return addr;
+}
+
+static SOCKET openSocket(sockaddr_storage& addr)
+{
+	SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (s == -1)
+		throw std::runtime_error("Failed to create socket: " + Socket::getErrorString());
+
+	// Enough for a window of packets from the peer and a few stray REGISTERED
+	int bufsize = 256 * 1024;
+	setsockopt(s, SOL_SOCKET, SO_RCVBUF, (const char*)&bufsize, sizeof(bufsize));
+
+	addr = loopbackAddress(0);
+	socklen_t len = sizeof(sockaddr_in);
+	if (bind(s, (sockaddr*)&addr, len) || getsockname(s, (sockaddr*)&addr, &len))
+		throw std::runtime_error("Failed to bind loopback socket: " + Socket::getErrorString());
+
+	Socket::setBlocking(s, false);
+	return s;
+}
+
+static double percentile(const vector<uint32>& sorted, double percent)
+{
+	if (sorted.empty())
+		return 0;
+	return sorted[std::min(sorted.size() - 1, size_t(sorted.size() * percent / 100))];
+}
+
+static string latencies(const vector<uint32>& sorted)
+{
+	char text[128];
+	snprintf(text, sizeof(text), "p50 %4.0f  p90 %4.0f  p99 %5.0f  p99.9 %5.0f us", percentile(sorted, 50),
+	         percentile(sorted, 90), percentile(sorted, 99), percentile(sorted, 99.9));
+	return text;
+}
+
+// Register every endpoint, throwing if any isn't answered in time; anything else waiting is thrown away
+static void registerAll(vector<Endpoint>& endpoints, const sockaddr_storage& relay)
+{
+	DatagramBatch batch(WINDOW, RELAY_DATAGRAM_MAX);
+	vector<bool> registered(endpoints.size(), false);
+	size_t remaining = endpoints.size();
+	const uint64 giveUp = Clock::now() + uint64(REGISTER_TIMEOUT_MS) * Clock::MS;
+
+	while (remaining)
+	{
+		if (Clock::now() >= giveUp)
+			throw std::runtime_error(toString(remaining) + " endpoints weren't registered");
+
+		for (size_t e = 0; e < endpoints.size(); ++e)
+		{
+			if (registered[e])
+				continue;
+			RelayHeader header;
+			header.type = htonl(RelayHeader::REGISTER);
+			header.id = htonl(endpoints[e].id);
+			header.other = htonl(1);
+			sendto(endpoints[e].sock, (const char*)&header, sizeof(header), 0, (const sockaddr*)&relay, sizeof(sockaddr_in));
+		}
+		Thread::sleep(100);
+
+		for (size_t e = 0; e < endpoints.size(); ++e)
+		{
+			int n;
+			while ((n = batch.receive(endpoints[e].sock)) > 0)
+			{
+				for (uint i = 0; i < uint(n); ++i)
+				{
+					const RelayHeader& header = *reinterpret_cast<const RelayHeader*>(batch.data(i));
+					if (batch.size(i) >= sizeof(header) && ntohl(header.type) == RelayHeader::REGISTERED && !registered[e])
+					{
+						registered[e] = true;
+						--remaining;
+					}
+				}
+			}
+		}
+	}
+}
+
+static void runLoad(Load& load)
+{
+	vector<Endpoint>& endpoints = *load.endpoints;
+	const uint size = sizeof(RelayHeader) + std::max(load.bytes, uint(sizeof(Payload)));
+	DatagramBatch sendBatch(WINDOW, size);
+	DatagramBatch recvBatch(RelayServer::BATCH_DATAGRAMS, RELAY_DATAGRAM_MAX);
+
+	vector<pollfd> fds(load.end - load.begin);
+	for (uint e = load.begin; e < load.end; ++e)
+	{
+		// Late arrivals from the last measurement would count against this one
+		while (recvBatch.receive(endpoints[e].sock) > 0)
+			;
+		fds[e - load.begin].fd = endpoints[e].sock;
+		fds[e - load.begin].events = POLLIN;
+		endpoints[e].inFlight = 0;
+		// Spread the endpoints over a frame, as calls started at different times would be
+		endpoints[e].nextSend = Clock::now() + uint64(e) * VOICE_INTERVAL_MS * Clock::MS / endpoints.size();
+	}
+
+	for (uint64 now = Clock::now(); now < load.stopTime; now = Clock::now())
+	{
+		uint64 nextSend = load.stopTime;
+		for (uint e = load.begin; e < load.end; ++e)
+		{
+			Endpoint& ep = endpoints[e];
+			uint count = 0;
+			if (!load.paced)
+				count = WINDOW - ep.inFlight;
+			else if (now >= ep.nextSend)
+			{
+				count = 1;
+				ep.nextSend += uint64(VOICE_INTERVAL_MS) * Clock::MS;
+			}
+			nextSend = std::min(nextSend, ep.nextSend);
+			if (!count)
+				continue;
+
+			const Endpoint& peer = endpoints[ep.peer];
+			for (uint i = 0; i < count; ++i)
+			{
+				byte* data = sendBatch.add(load.direct ? peer.addr : load.relay);
+				memset(data, 0, size);
+				RelayHeader& header = *reinterpret_cast<RelayHeader*>(data);
+				header.type = htonl(RelayHeader::DATA);
+				header.id = htonl(peer.id);
+				header.other = htonl(ep.id);
+				Payload& payload = *reinterpret_cast<Payload*>(data + sizeof(RelayHeader));
+				payload.sent = now;
+				payload.sender = e;
+				sendBatch.setSize(i, size);
+			}
+			const int sent = sendBatch.send(ep.sock);
+			if (sent > 0)
+			{
+				load.sent += sent;
+				ep.inFlight += sent;
+			}
+		}
+
+		const int timeout = load.paced ? int((nextSend > now ? nextSend - now + Clock::MS - 1 : 0) / Clock::MS) : STALL_MS;
+		const int ready = Socket::poll(&fds[0], uint(fds.size()), timeout);
+		if (ready < 0 && Socket::getError() != EINTR)
+			throw std::runtime_error("poll error: " + Socket::getErrorString());
+
+		if (!ready && !load.paced)
+		{
+			// Nothing has arrived for a while, so whatever's in flight isn't coming
+			for (uint e = load.begin; e < load.end; ++e)
+			{
+				load.lost += endpoints[e].inFlight;
+				endpoints[e].inFlight = 0;
+			}
+			continue;
+		}
+
+		for (size_t f = 0; f < fds.size() && ready > 0; ++f)
+		{
+			if (!(fds[f].revents & POLLIN))
+				continue;
+			int n;
+			while ((n = recvBatch.receive(fds[f].fd)) > 0)
+			{
+				const uint64 arrived = Clock::now();
+				for (uint i = 0; i < uint(n); ++i)
+				{
+					if (recvBatch.size(i) < sizeof(RelayHeader) + sizeof(Payload))
+						continue;
+					const Payload& payload = *reinterpret_cast<const Payload*>(recvBatch.data(i) + sizeof(RelayHeader));
+					if (payload.sender < load.begin || payload.sender >= load.end)
+						continue;
+					Endpoint& sender = endpoints[payload.sender];
+					if (sender.inFlight)
+						--sender.inFlight;
+					++load.received;
+					if (load.latencyUs.size() < load.latencyUs.capacity())
+						load.latencyUs.push_back(uint32(std::min<uint64>(arrived - payload.sent, 0xFFFFFFFFu)));
+				}
+			}
+		}
+	}
+
+	// Whatever is still in flight missed the end
+	if (!load.paced)
+	{
+		for (uint e = load.begin; e < load.end; ++e)
+			load.lost += endpoints[e].inFlight;
+	}
+}
+
+static void loadMain(void* arg)
+{
+	Load& load = *reinterpret_cast<Load*>(arg);
+	try
+	{
+		runLoad(load);
+	}
+	catch (std::exception& ex)
+	{
+		load.error = ex.what();
+	}
+}
+
+static Result measure(vector<Endpoint>& endpoints, uint loadThreads, const sockaddr_storage& relay, bool direct,
+                      bool paced, uint bytes, uint seconds)
+{
+	const uint calls = uint(endpoints.size() / 2);
+	vector<Load*> loads;
+	const uint64 start = Clock::now();
+	for (uint t = 0; t < loadThreads; ++t)
+	{
+		Load* load = new Load();
+		load->endpoints = &endpoints;
+		load->begin = 2 * (calls * t / loadThreads);
+		load->end = 2 * (calls * (t + 1) / loadThreads);
+		load->relay = relay;
+		load->direct = direct;
+		load->paced = paced;
+		load->bytes = bytes;
+		load->stopTime = start + uint64(seconds) * 1000 * Clock::MS;
+		load->sent = load->received = load->lost = 0;
+		load->latencyUs.reserve(MAX_SAMPLES / loadThreads);
+		loads.push_back(load);
+	}
+	for (uint t = 0; t < loadThreads; ++t)
+		loads[t]->thread.start(&loadMain, loads[t]);
+
+	Result result;
+	string error;
+	for (uint t = 0; t < loadThreads; ++t)
+	{
+		loads[t]->thread.join();
+		result.sent += loads[t]->sent;
+		result.received += loads[t]->received;
+		result.lost += loads[t]->lost;
+		result.latencyUs.insert(result.latencyUs.end(), loads[t]->latencyUs.begin(), loads[t]->latencyUs.end());
+		if (error.empty())
+			error = loads[t]->error;
+		delete loads[t];
+	}
+	result.seconds = double(Clock::now() - start) / (1000 * Clock::MS);
+	if (!error.empty())
+		throw std::runtime_error(error);
+
+	std::sort(result.latencyUs.begin(), result.latencyUs.end());
+	return result;
+}
+
+static void runRelay(vector<Endpoint>& endpoints, uint threads, uint loadThreads, uint bytes, uint seconds, bool pin,
+                     const Result& direct)
+{
+	RelayServer server(uint(endpoints.size()));
+	server.start(0, threads, pin);
+	const sockaddr_storage relay = loopbackAddress(server.getPort());
+	registerAll(endpoints, relay);
+
+	printf("\nRelay with %u thread%s:\n", threads,
+	       threads == 1 ? "" : server.isSharded() ? "s, one socket each" : "s sharing one socket (no SO_REUSEPORT)");
+
+	// Voice rate first, before going flat out leaves anything queued
+	const Result voice = measure(endpoints, loadThreads, relay, false, true, bytes, seconds);
+	printf("  Voice rate  latency     %s, %.2f%% lost\n", latencies(voice.latencyUs).c_str(),
+	       voice.sent ? 100.0 * (voice.sent - std::min(voice.received, voice.sent)) / voice.sent : 0.0);
+
+	char added[128];
+	snprintf(added, sizeof(added), "p50 %4.0f  p90 %4.0f  p99 %5.0f  p99.9 %5.0f us",
+	         percentile(voice.latencyUs, 50) - percentile(direct.latencyUs, 50),
+	         percentile(voice.latencyUs, 90) - percentile(direct.latencyUs, 90),
+	         percentile(voice.latencyUs, 99) - percentile(direct.latencyUs, 99),
+	         percentile(voice.latencyUs, 99.9) - percentile(direct.latencyUs, 99.9));
+	printf("              added       %s\n", added);
+
+	// Counters are published when a thread catches up, so wait for that either side of going flat out
+	Thread::sleep(STALL_MS);
+	vector<RelayServer::Stats> before(threads);
+	for (uint t = 0; t < threads; ++t)
+		before[t] = server.getThreadStats(t);
+
+	const Result flat = measure(endpoints, loadThreads, relay, false, false, bytes, seconds);
+
+	Thread::sleep(STALL_MS);
+	double forwarded = 0, cpuMs = 0;
+	string perThread;
+	for (uint t = 0; t < threads; ++t)
+	{
+		const RelayServer::Stats stats = server.getThreadStats(t);
+		const double threadForwarded = double(stats.forwarded - before[t].forwarded);
+		const double threadCpuMs = stats.cpuMs - before[t].cpuMs;
+		forwarded += threadForwarded;
+		cpuMs += threadCpuMs;
+		perThread += "  " + toString(ulong(threadForwarded / flat.seconds));
+		if (threadCpuMs > 0)
+			perThread += " (" + toString(int(threadCpuMs / (10 * flat.seconds))) + "% CPU)";
+	}
+	if (!server.getError().empty())
+		throw std::runtime_error(server.getError());
+
+	printf("  Flat out    %.0f packets/s forwarded, %.2f%% lost\n", forwarded / flat.seconds,
+	       flat.sent ? 100.0 * flat.lost / flat.sent : 0.0);
+	printf("              per thread:%s\n", perThread.c_str());
+	if (cpuMs > 0)
+		printf("              %.0f packets per CPU second\n", forwarded / (cpuMs / 1000));
+	printf("              latency     %s\n", latencies(flat.latencyUs).c_str());
+
+	server.stop();
+}
+
+// Registers many times the table's capacity of distinct IDs over successive expiry periods, each batch renewed once,
+// and checks every new ID is taken, exactly those still held are found, and a table full of live IDs refuses more
+static bool checkTableChurn()
+{
+	const uint maxClients = 999, batch = maxClients / 3, rounds = 30;
+	const uint64 step = (uint64(RELAY_EXPIRY) / 2 + 1) * Clock::MS; //Each batch expires two rounds after its renewal
+	RelayTable table(maxClients);
+	uint failures = 0;
+
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	for (uint r = 0; r < rounds; ++r)
+	{
+		const uint64 now = Clock::MS + r * step;
+		for (uint b = r ? r - 1 : 0; b <= r; ++b)
+		{
+			for (uint i = 0; i < batch; ++i)
+			{
+				const uint32 id = (b * batch + i) * 7919 + 1;
+				addr.sin_port = htons(uint16(id));
+				const RelayTable::Result result = table.add(id, id, addr, now);
+				failures += (result != ((b < r) ? RelayTable::RENEWED : RelayTable::ADDED));
+			}
+		}
+		for (uint b = (r >= 3) ? r - 3 : 0; b <= r; ++b)
+		{
+			for (uint i = 0; i < batch; ++i)
+			{
+				RelayTable::Client client;
+				failures += (table.find((b * batch + i) * 7919 + 1, now, client) != (b + 3 > r));
+			}
+		}
+	}
+
+	const uint64 now = Clock::MS + (rounds - 1) * step;
+	addr.sin_port = htons(1);
+	failures += (table.add(0xFFFFFFFFu, 1, addr, now) != RelayTable::FULL);
+
+	printf("Table churn: %u IDs through a table for %u, %u wrong results\n", rounds * batch, maxClients, failures);
+	return !failures;
+}
+
+// "1,2,4" to a list; empty on anything but positive numbers
+static vector<uint> parseList(const string& text)
+{
+	vector<uint> list;
+	size_t start = 0;
+	while (start <= text.size())
+	{
+		size_t comma = text.find(',', start);
+		if (comma == string::npos)
+			comma = text.size();
+		const int n = atoi(text.substr(start, comma - start).c_str());
+		if (n <= 0)
+			return vector<uint>();
+		list.push_back(uint(n));
+		start = comma + 1;
+	}
+	return list;
+}
+
+int main(int argc, char* argv[])
+{
+	const uint cpus = Thread::getCpuCount();
+	vector<uint> threadCounts;
+	for (uint t = 1; t <= cpus; t *= 2)
+		threadCounts.push_back(t);
+	if (threadCounts.back() != cpus)
+		threadCounts.push_back(cpus);
+
+	uint calls = DEFAULT_CALLS;
+	uint loadThreads = std::max(1u, cpus / 2);
+	uint seconds = DEFAULT_SECONDS;
+	uint bytes = DEFAULT_PACKET_BYTES;
+	bool pin = false;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		const string arg = argv[i];
+		const bool hasValue = (i + 1 < argc);
+		if ((arg == "-t" || arg == "--threads") && hasValue)
+			threadCounts = parseList(argv[++i]);
+		else if ((arg == "-c" || arg == "--calls") && hasValue)
+			calls = uint(atoi(argv[++i]));
+		else if ((arg == "-l" || arg == "--load-threads") && hasValue)
+			loadThreads = uint(atoi(argv[++i]));
+		else if ((arg == "-d" || arg == "--seconds") && hasValue)
+			seconds = uint(atoi(argv[++i]));
+		else if ((arg == "-b" || arg == "--bytes") && hasValue)
+			bytes = uint(atoi(argv[++i]));
+		else if (arg == "--pin")
+			pin = true;
+		else
+		{
+			fputs(USAGE, stderr);
+			return 1;
+		}
+	}
+	if (threadCounts.empty() || !calls || !loadThreads || !seconds || !bytes ||
+	    bytes + sizeof(RelayHeader) > RELAY_DATAGRAM_MAX)
+	{
+		fputs(USAGE, stderr);
+		return 1;
+	}
+	loadThreads = std::min(loadThreads, calls);
+
+	if (!checkTableChurn())
+		return 1;
+
+	vector<Endpoint> endpoints(calls * 2);
+	try
+	{
+		for (size_t e = 0; e < endpoints.size(); ++e)
+		{
+			endpoints[e].sock = openSocket(endpoints[e].addr);
+			endpoints[e].id = uint32(e + 1);
+			endpoints[e].peer = uint(e ^ 1);
+		}
+
+		printf("%u calls (%u endpoints) on %u load thread%s, %u byte packets, %u seconds each, %u CPU%s\n", calls,
+		       calls * 2, loadThreads, loadThreads == 1 ? "" : "s", bytes, seconds, cpus, cpus == 1 ? "" : "s");
+
+		// The baseline the relay adds to: the same packets sent straight to the other end
+		const Result direct = measure(endpoints, loadThreads, sockaddr_storage(), true, true, bytes, seconds);
+		printf("\nDirect, no relay:\n");
+		printf("  Voice rate  latency     %s\n", latencies(direct.latencyUs).c_str());
+
+		for (size_t i = 0; i < threadCounts.size(); ++i)
+			runRelay(endpoints, threadCounts[i], loadThreads, bytes, seconds, pin, direct);
+	}
+	catch (std::exception& ex)
+	{
+		fprintf(stderr, "Error: %s\n", ex.what());
+		return 1;
+	}
+
+	for (size_t e = 0; e < endpoints.size(); ++e)
+	{
+		if (endpoints[e].sock != SOCKET(-1))
+			Socket::close(endpoints[e].sock);
+	}
+	return 0;
+}
@@ -0,0 +1,169 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "Router.h"
+#include "IgdSimulator.h"
+#include "Clock.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+// Times Router against a stand-in IGD on loopback: discovery, warm start from the cache file,
+// the port mapping retry loop Phone uses (with 718 conflicts injected), clearing, and failures
+using namespace tincan;
+
+enum {
+	DEFAULT_DISCOVERY_MS = 1000,
+	ROUNDS = 20,
+	LOCAL_PORT = 56780,
+	PORT_MAX = 56789     //Same retry range as Phone
+};
+
+static const char CACHE_FILE[] = "routerbench-igd.cache";
+
+static int discoveryMs = DEFAULT_DISCOVERY_MS;
+
+static double msSince(uint64 start)
+{
+	return double(Clock::now() - start) / Clock::MS;
+}
+
+static double median(vector<double> samples)
+{
+	std::sort(samples.begin(), samples.end());
+	return samples[samples.size() / 2];
+}
+
+static void report(const char* name, double ms, const string& detail = "")
+{
+	printf("%-34s %9.2fms  %s\n", name, ms, detail.c_str());
+}
+
+// Cold start: SSDP discovery, which also writes the cache file
+static void benchDiscovery(IgdSimulator& igd)
+{
+	remove(CACHE_FILE);
+
+	uint64 start = Clock::now();
+	Router router(discoveryMs, CACHE_FILE, IgdSimulator::MULTICAST_IF);
+	report("construct, SSDP discovery", msSince(start), toString(igd.getSsdpRequests()) + " M-SEARCHes, WAN " + router.getWanAddress());
+}
+
+// Warm start: validate the cached IGD with one SOAP call
+static void benchCached(const char* name)
+{
+	vector<double> samples;
+	bool cached = true;
+	for (uint i = 0; i < ROUNDS; ++i)
+	{
+		uint64 start = Clock::now();
+		Router router(discoveryMs, CACHE_FILE, IgdSimulator::MULTICAST_IF);
+		samples.push_back(msSince(start));
+		cached = cached && router.isCached();
+	}
+	report(name, median(samples), cached ? "median, from cache" : "median, CACHE NOT USED");
+}
+
+// The retry loop Phone runs at startup, with the first conflicts ports already taken
+static void benchMapping(IgdSimulator& igd, uint conflicts)
+{
+	IgdSimulator::Config config;
+	config.conflicts = conflicts;
+
+	Router router(discoveryMs, CACHE_FILE, IgdSimulator::MULTICAST_IF);
+
+	vector<double> mapSamples, clearSamples;
+	uint16 port = 0;
+	const ulong soapBefore = igd.getSoapRequests();
+	for (uint i = 0; i < ROUNDS; ++i)
+	{
+		igd.setConfig(config);
+
+		uint64 start = Clock::now();
+		port = router.mapAnyPort(LOCAL_PORT, LOCAL_PORT, PORT_MAX, PortMapper::MAP_UDP, "Tin Can Phone");
+		mapSamples.push_back(msSince(start));
+
+		start = Clock::now();
+		router.clearPortMapping();
+		clearSamples.push_back(msSince(start));
+	}
+	igd.setConfig(IgdSimulator::Config());
+
+	string name = "mapAnyPort, " + toString(conflicts) + " x 718";
+	report(name.c_str(), median(mapSamples), "median, got port " + toString(port) + ", " +
+	       toString((igd.getSoapRequests() - soapBefore) / ROUNDS) + " SOAP requests per round");
+	report("clearPortMapping", median(clearSamples), "median");
+}
+
+static void benchFailure(IgdSimulator& igd, const char* name, const IgdSimulator::Config& config, bool useCache)
+{
+	igd.setConfig(config);
+	if (!useCache)
+		remove(CACHE_FILE);
+
+	uint64 start = Clock::now();
+	string result = "no error";
+	try
+	{
+		Router router(discoveryMs, useCache ? CACHE_FILE : "", IgdSimulator::MULTICAST_IF);
+		router.mapAnyPort(LOCAL_PORT, LOCAL_PORT, PORT_MAX, PortMapper::MAP_UDP, "Tin Can Phone");
+	}
+	catch (std::exception& ex)
+	{
+		result = string("threw: ") + ex.what();
+	}
+	report(name, msSince(start), result);
+
+	igd.setConfig(IgdSimulator::Config());
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc > 1)
+		discoveryMs = atoi(argv[1]);
+	if (discoveryMs <= 0)
+	{
+		fprintf(stderr, "Usage: %s [discovery timeout ms]\n", argv[0]);
+		return 1;
+	}
+
+	try
+	{
+		IgdSimulator igd((IgdSimulator::Config()));
+		printf("Discovery timeout %dms\n", discoveryMs);
+
+		benchDiscovery(igd);
+		benchCached("construct, cached IGD");
+
+		IgdSimulator::Config slow;
+		slow.soapDelayMs = 20;
+		igd.setConfig(slow);
+		benchCached("construct, cached IGD, 20ms SOAP");
+		igd.setConfig(IgdSimulator::Config());
+
+		benchMapping(igd, 0);
+		benchMapping(igd, 3);
+		benchMapping(igd, PORT_MAX - LOCAL_PORT);
+
+		IgdSimulator::Config conflicted;
+		conflicted.conflicts = PORT_MAX - LOCAL_PORT + 1;
+		benchFailure(igd, "mapAnyPort, every port 718", conflicted, true);
+
+		IgdSimulator::Config failing;
+		failing.failMapping = true;
+		benchFailure(igd, "mapAnyPort, 501 ActionFailed", failing, true);
+
+		IgdSimulator::Config silent;
+		silent.silent = true;
+		benchFailure(igd, "construct, no IGD answers", silent, false);
+	}
+	catch (std::exception& ex)
+	{
+		fprintf(stderr, "Error: %s\n", ex.what());
+		remove(CACHE_FILE);
+		return 1;
+	}
+
+	remove(CACHE_FILE);
+	return 0;
+}
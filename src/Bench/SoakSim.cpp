@@ -0,0 +1,442 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "Phone.h"
+#include "LoopbackNetwork.h"
+#include "VirtualAudioDevice.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <new>
+
+// Soak test on a virtual clock: two Phones in one thread make a single call lasting hours of simulated
+// time over a LoopbackNetwork, with sound cards whose clocks drift apart and AUDIO sequence numbers that
+// wrap early in the call. Reports heap growth, jitter buffer depth and packet counters as it goes, and
+// exits with EXIT_PROBLEMS if anything crept up. The same options always give the same run, down to the
+// playout hashes, so a failure can be replayed.
+using namespace tincan;
+
+enum {
+	DEFAULT_HOURS = 24,
+	DEFAULT_INTERVAL_MINUTES = 60,
+	DEFAULT_DRIFT_PPM = 100,
+	DEFAULT_WRAP_SECONDS = 60,    //Start seq numbers this long before they wrap
+	SAMPLE_MS = 100,              //How often the Phones' stats are sampled
+	LOG_MS = 1000,                //How often their logs are read, so the event log doesn't fill up
+	START_TIME = 1000000,         //Virtual Clock start, anything nonzero
+	MAX_HEAP_GROWTH = 64 * 1024,  //Bytes the heap may grow after the first interval before it looks like a leak
+	EXIT_PROBLEMS = 2
+};
+
+static const char USAGE[] =
+	"Usage: soak_sim [options]\n"
+	"  -t, --hours HOURS          Simulated length of the call (default 24)\n"
+	"  -r, --report MINUTES       Simulated time between reports (default 60)\n"
+	"  -s, --seed N               Seeds the microphone signals and the network (default 1)\n"
+	"  -d, --drift PPM            How much faster the caller's sound card runs than the callee's (default 100)\n"
+	"  -w, --wrap SECONDS         Start AUDIO sequence numbers this long before they wrap (default 60)\n"
+	"  -f, --frame MS             Packet duration of the call (default 20)\n"
+	"  -i, --impair SPEC          Impair the network, SPEC is comma separated key=value with keys\n"
+	"                             loss, burst-start, burst-end, burst-loss (percent), delay, jitter (ms),\n"
+	"                             reorder (percent), rate (kbps), queue (ms) and seed\n"
+	"  -v, --verbose              Print both Phones' logs\n";
+
+
+// Every C++ allocation is counted, so growth is measured the same way on every run
+static std::atomic<int64> heapBytes(0);
+static std::atomic<int64> heapBlocks(0);
+
+enum { HEAP_HEADER = 16 }; //Keeps the block aligned for anything
+
+void* operator new(size_t size)
+{
+	char* block = (char*)malloc(size + HEAP_HEADER);
+	if (!block)
+		throw std::bad_alloc();
+	*(size_t*)block = size;
+	heapBytes += int64(size);
+	++heapBlocks;
+	return block + HEAP_HEADER;
+}
+
+void operator delete(void* ptr) throw()
+{
+	if (!ptr)
+		return;
+	char* block = (char*)ptr - HEAP_HEADER;
+	heapBytes -= int64(*(size_t*)block);
+	--heapBlocks;
+	free(block);
+}
+
+void* operator new[](size_t size)                   {return operator new(size);}
+void  operator delete[](void* ptr) throw()          {operator delete(ptr);}
+void  operator delete(void* ptr, size_t) throw()    {operator delete(ptr);}
+void  operator delete[](void* ptr, size_t) throw()  {operator delete(ptr);}
+
+static long residentKb()
+{
+#ifdef __linux__
+	long pages = 0, resident = 0;
+	FILE* file = fopen("/proc/self/statm", "r");
+	if (file)
+	{
+		if (fscanf(file, "%ld %ld", &pages, &resident) != 2)
+			resident = 0;
+		fclose(file);
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+#else
+	return 0;
+#endif
+}
+
+
+// Talks in bursts of a few seconds with pauses between, so DTX and the silence paths get exercised too,
+// and hashes everything it plays
+class SimAudioDevice : public VirtualAudioDevice
+{
+public:
+	SimAudioDevice(const char* name, double driftPpm, uint32 seed)
+	: VirtualAudioDevice(driftPpm), name(name), rng(seed), talkLeft(0), pauseLeft(0), voicePos(0),
+	  playHash(2166136261u), nonSilent(0)
+	{
+		// A second of wobbling tone in lowpassed noise, which each talkspurt starts somewhere random in
+		voice.resize(SAMPLE_RATE);
+		double phase = 0, noise = 0;
+		for (size_t s = 0; s < voice.size(); ++s)
+		{
+			phase += 2 * 3.14159265 * (150 + 50 * sin(2 * 3.14159265 * 3 * s / SAMPLE_RATE)) / SAMPLE_RATE;
+			noise += 0.1 * (double(next() % 2001) - 1000 - noise);
+			voice[s] = int16(6000 * sin(phase) + 4 * noise);
+		}
+	}
+
+	string getInputName() const   {return name;}
+	string getOutputName() const  {return name;}
+
+	uint32 getPlayHash() const   {return playHash;}
+	uint64 getNonSilent() const  {return nonSilent;}
+
+protected:
+	string name;
+	uint32 rng;
+	uint64 talkLeft;  //Samples
+	uint64 pauseLeft;
+	vector<int16> voice;
+	size_t voicePos;
+	uint32 playHash;  //FNV-1a
+	uint64 nonSilent;
+
+	uint32 next()  {rng = rng * 1664525u + 1013904223u; return rng >> 8;}
+
+	void capture(int16* buffer, ulong frames)
+	{
+		for (ulong s = 0; s < frames; ++s)
+		{
+			if (!talkLeft && !pauseLeft)
+			{
+				talkLeft = sampleRate + next() % (3 * sampleRate);
+				pauseLeft = sampleRate / 2 + next() % (5 * sampleRate / 2);
+				voicePos = next() % voice.size();
+			}
+
+			if (talkLeft)
+			{
+				--talkLeft;
+				buffer[s] = voice[voicePos];
+				if (++voicePos == voice.size())
+					voicePos = 0;
+			}
+			else
+			{
+				--pauseLeft;
+				buffer[s] = 0;
+			}
+		}
+	}
+
+	void play(const int16* buffer, ulong frames)
+	{
+		for (ulong s = 0; s < frames; ++s)
+		{
+			playHash = (playHash ^ uint16(buffer[s])) * 16777619u;
+			nonSilent += (buffer[s] != 0);
+		}
+	}
+};
+
+
+struct Options
+{
+	double     hours;
+	uint       reportMinutes;
+	uint32     seed;
+	double     driftPpm;
+	uint       wrapSeconds;
+	uint       frameMs;
+	Impairment impairment;
+	bool       impaired;
+	bool       verbose;
+	Options() : hours(DEFAULT_HOURS), reportMinutes(DEFAULT_INTERVAL_MINUTES), seed(1), driftPpm(DEFAULT_DRIFT_PPM),
+	            wrapSeconds(DEFAULT_WRAP_SECONDS), frameMs(PACKET_MS), impaired(false), verbose(false)  {}
+};
+
+// One direction of the call, as its receiver sees it
+struct Direction
+{
+	const char*       name;
+	Phone::AudioStats last;     //At the previous report
+	uint              minBuffered;
+	uint              maxBuffered;
+	uint              worstBuffered;
+	explicit Direction(const char* name) : name(name), minBuffered(~0u), maxBuffered(0), worstBuffered(0)  {}
+
+	void sample(const Phone::AudioStats& stats)
+	{
+		minBuffered = std::min(minBuffered, stats.bufferedMs);
+		maxBuffered = std::max(maxBuffered, stats.bufferedMs);
+		worstBuffered = std::max(worstBuffered, stats.bufferedMs);
+	}
+
+	void report(const Phone::AudioStats& stats, const Phone::TransportStats& transport)
+	{
+		printf("           to %-6s buffered %u-%ums  target %ums  jitter %.2fms  concealed +%lu  late +%lu  discarded +%lu"
+		       "  skipped +%lu  underruns +%lu  lost %lu  rtt %.1fms\n", name, minBuffered, maxBuffered, stats.targetDelayMs,
+		       stats.jitterMs, stats.concealed - last.concealed, stats.latePackets - last.latePackets,
+		       stats.discardedPackets - last.discardedPackets, stats.skippedPackets - last.skippedPackets,
+		       stats.underruns - last.underruns, transport.lost, transport.rttMs);
+		last = stats;
+		minBuffered = ~0u;
+		maxBuffered = 0;
+	}
+};
+
+static string formatTime(uint64 us)
+{
+	const uint64 seconds = us / (Clock::MS * 1000);
+	char text[32];
+	snprintf(text, sizeof(text), "%2u:%02u:%02u", uint(seconds / 3600), uint(seconds / 60 % 60), uint(seconds % 60));
+	return text;
+}
+
+static void printLog(const char* name, Phone& phone, bool verbose)
+{
+	string log = phone.readLog();
+	if (!verbose || log.empty())
+		return;
+	std::istringstream lines(log);
+	string line;
+	while (std::getline(lines, line))
+		printf("%s: %s\n", name, line.c_str());
+}
+
+static int simulate(const Options& options)
+{
+	Clock::setVirtual(START_TIME);
+	const clock_t cpuStart = clock();
+
+	LoopbackNetwork network(false);
+	network.setImpairment(options.impairment);
+
+	Phone caller, callee;
+	SimAudioDevice* callerAudio = new SimAudioDevice("caller", options.driftPpm / 2, options.seed);
+	SimAudioDevice* calleeAudio = new SimAudioDevice("callee", -options.driftPpm / 2, options.seed * 7919 + 1);
+	caller.setAudioDevice(callerAudio);
+	callee.setAudioDevice(calleeAudio);
+	caller.setTransport(network.createEndpoint("10.0.0.1"));
+	callee.setTransport(network.createEndpoint("10.0.0.2"));
+	caller.disablePortMapping();
+	callee.disablePortMapping();
+
+	const uint32 firstSeq = uint32(0u - options.wrapSeconds * 1000 / options.frameMs);
+	caller.setFirstSeq(firstSeq);
+	callee.setFirstSeq(firstSeq);
+	Phone::CallParams params;
+	params.frameMs = options.frameMs;
+	caller.setCallParams(params);
+
+	printf("Simulating %s of call: seed %u, %ums packets, caller's sound card %+.1fppm faster, seq wraps at %s\n",
+	       formatTime(uint64(options.hours * 3600) * 1000 * Clock::MS).c_str(), options.seed, options.frameMs,
+	       options.driftPpm, formatTime(uint64(options.wrapSeconds) * 1000 * Clock::MS).c_str());
+
+	caller.startup();
+	callee.startup();
+	caller.setCommand(Phone::CMD_CALL, "10.0.0.2");
+
+	const uint64 end = START_TIME + uint64(options.hours * 3600 * 1000) * Clock::MS;
+	const uint64 reportInterval = uint64(options.reportMinutes) * 60 * 1000 * Clock::MS;
+	uint64 liveSince = 0, nextSample = 0, nextLog = 0, nextReport = 0;
+	bool answered = false;
+	int64 heapBaseline = -1;
+	Direction toCallee("callee"), toCaller("caller");
+	vector<string> problems;
+
+	for (uint64 now = START_TIME; ; )
+	{
+		caller.step();
+		callee.step();
+
+		if (now >= nextLog)
+		{
+			printLog("caller", caller, options.verbose);
+			printLog("callee", callee, options.verbose);
+			nextLog = now + LOG_MS * Clock::MS;
+		}
+
+		const Phone::Status callerStatus = caller.getStatus(), calleeStatus = callee.getStatus();
+		if (!liveSince)
+		{
+			if (calleeStatus.state == Phone::RINGING && !answered)
+				answered = callee.setCommand(Phone::CMD_ANSWER);
+			if (callerStatus.state == Phone::LIVE && calleeStatus.state == Phone::LIVE)
+			{
+				liveSince = now;
+				nextSample = now + SAMPLE_MS * Clock::MS;
+				nextReport = now + reportInterval;
+			}
+			else if (now - START_TIME > 10 * 1000 * Clock::MS)
+			{
+				problems.push_back("Call didn't connect");
+				break;
+			}
+		}
+		else if (callerStatus.state != Phone::LIVE || calleeStatus.state != Phone::LIVE)
+		{
+			problems.push_back("Call dropped at " + formatTime(now - liveSince));
+			break;
+		}
+		else if (now >= nextSample)
+		{
+			toCallee.sample(calleeStatus.audio);
+			toCaller.sample(callerStatus.audio);
+			nextSample += SAMPLE_MS * Clock::MS;
+
+			if (now >= nextReport)
+			{
+				if (heapBaseline < 0)
+					heapBaseline = heapBytes;
+				printf("[%s] cpu %.1fs  heap %.1fKB in %lld blocks (%+.1fKB)  rss %ldKB\n", formatTime(now - liveSince).c_str(),
+				       double(clock() - cpuStart) / CLOCKS_PER_SEC, heapBytes / 1024.0, (long long)heapBlocks.load(),
+				       (heapBytes - heapBaseline) / 1024.0, residentKb());
+				toCallee.report(calleeStatus.audio, calleeStatus.transport);
+				toCaller.report(callerStatus.audio, callerStatus.transport);
+				fflush(stdout);
+				nextReport += reportInterval;
+			}
+		}
+
+		if (liveSince && now >= liveSince + (end - START_TIME))
+			break;
+
+		// Move the clock on to whatever happens next
+		const uint64 arrival = network.deliver();
+		uint64 next = std::min(callerAudio->getNextTick(), calleeAudio->getNextTick());
+		if (arrival && arrival < next)
+			next = arrival;
+
+		if (next > now)
+		{
+			now = next;
+			Clock::advance(now);
+		}
+		if (callerAudio->getNextTick() <= now)
+			callerAudio->tick();
+		if (calleeAudio->getNextTick() <= now)
+			calleeAudio->tick();
+		network.deliver();
+	}
+
+	// Check the call for anything that crept up
+	const Phone::AudioStats rx[2] = {callee.getStatus().audio, caller.getStatus().audio};
+	const Phone::TransportStats links[2] = {callee.getStatus().transport, caller.getStatus().transport};
+	const Direction* dirs[2] = {&toCallee, &toCaller};
+	if (heapBaseline >= 0 && heapBytes - heapBaseline > MAX_HEAP_GROWTH)
+		problems.push_back("Heap grew " + toString((heapBytes - heapBaseline) / 1024) + "KB after the first report");
+	for (uint d = 0; d < 2 && liveSince; ++d)
+	{
+		const string to = string(" to ") + dirs[d]->name;
+		if (!options.impaired && (rx[d].latePackets || rx[d].discardedPackets))
+			problems.push_back(toString(rx[d].latePackets) + " late and " + toString(rx[d].discardedPackets) +
+			                   " discarded packets" + to + " on a perfect network");
+		if (rx[d].skippedPackets && !options.impaired)
+			problems.push_back("Jitter buffer overflowed " + toString(rx[d].skippedPackets) + " times" + to);
+		if (!links[d].reportsReceived)
+			problems.push_back("No REPORT packets" + to);
+		if (links[d].lost && !options.impaired)
+			problems.push_back(toString(links[d].lost) + " packets lost" + to + " on a perfect network");
+	}
+
+	caller.setCommand(Phone::CMD_EXIT);
+	callee.setCommand(Phone::CMD_EXIT);
+	caller.step();
+	callee.step();
+
+	const double cpu = double(clock() - cpuStart) / CLOCKS_PER_SEC;
+	const double simulated = double(Clock::now() - START_TIME) / (Clock::MS * 1000.0);
+	printf("Simulated %.0fs in %.1fs of CPU (%.0fx realtime)\n", simulated, cpu, cpu > 0 ? simulated / cpu : 0.0);
+	printf("Deepest jitter buffer: to callee %ums, to caller %ums\n", toCallee.worstBuffered, toCaller.worstBuffered);
+	printf("Playout hashes: caller %08x, callee %08x\n", callerAudio->getPlayHash(), calleeAudio->getPlayHash());
+	const LoopbackNetwork::Stats net = network.getStats();
+	printf("Network: %lu sent, %lu lost, %lu reordered, %lu delivered\n", net.sent, net.lost, net.reordered, net.delivered);
+
+	for (size_t p = 0; p < problems.size(); ++p)
+		printf("PROBLEM: %s\n", problems[p].c_str());
+	if (problems.empty())
+		printf("No problems\n");
+	return problems.empty() ? 0 : EXIT_PROBLEMS;
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+	try
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			const string arg = argv[i];
+			const char* value = (i + 1 < argc) ? argv[i + 1] : NULL;
+			if ((arg == "-t" || arg == "--hours") && value)
+				options.hours = atof(argv[++i]);
+			else if ((arg == "-r" || arg == "--report") && value)
+				options.reportMinutes = uint(atoi(argv[++i]));
+			else if ((arg == "-s" || arg == "--seed") && value)
+				options.seed = uint32(strtoul(argv[++i], NULL, 10));
+			else if ((arg == "-d" || arg == "--drift") && value)
+				options.driftPpm = atof(argv[++i]);
+			else if ((arg == "-w" || arg == "--wrap") && value)
+				options.wrapSeconds = uint(atoi(argv[++i]));
+			else if ((arg == "-f" || arg == "--frame") && value)
+				options.frameMs = uint(atoi(argv[++i]));
+			else if ((arg == "-i" || arg == "--impair") && value)
+			{
+				options.impairment = Impairment::parse(argv[++i]);
+				options.impaired = true;
+			}
+			else if (arg == "-v" || arg == "--verbose")
+				options.verbose = true;
+			else
+			{
+				const bool help = (arg == "-h" || arg == "--help");
+				fputs(USAGE, help ? stdout : stderr);
+				return help ? 0 : 1;
+			}
+		}
+
+		Phone::CallParams params;
+		params.frameMs = options.frameMs;
+		if (options.hours <= 0 || !options.reportMinutes || !params.isValid())
+			throw std::runtime_error("Invalid option, see --help");
+		if (!options.impairment.seed || options.impairment.seed == Impairment().seed)
+			options.impairment.seed = options.seed;
+
+		return simulate(options);
+	}
+	catch (std::exception& ex)
+	{
+		fprintf(stderr, "Error: %s\n", ex.what());
+		return 1;
+	}
+}
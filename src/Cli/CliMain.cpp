@@ -0,0 +1,537 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "Phone.h"
+#include "NullAudioDevice.h"
+#include "RelayTransport.h"
+#include "WavAudioDevice.h"
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+// Headless frontend: prints the Phone's log, can answer incoming calls by itself, and can run a
+// script of outgoing calls, so the phone can be left running soak and load tests without anyone there
+using namespace tincan;
+
+enum {
+	POLL_MS = 100,             //How often to check timers when the Phone is quiet
+	DEFAULT_CALL_SECONDS = 10, //How long scripted calls last unless told otherwise
+	DEFAULT_RING_SECONDS = 30, //How long to let an outgoing call ring before giving up
+	EXIT_CALLS_FAILED = 2      //Exit code when some scripted calls did not connect
+};
+
+static const char USAGE[] =
+	"Usage: tincanphone-cli [options] [address...]\n"
+	"  -a, --auto-answer          Answer incoming calls\n"
+	"  -d, --duration SECONDS     Hang up every call after this long (scripted calls default to 10)\n"
+	"  -r, --ring-timeout SECONDS Give up on outgoing calls nobody answers after this long (default 30)\n"
+	"  -g, --gap SECONDS          Pause between scripted calls (default 1)\n"
+	"  -n, --repeat N             Run the script N times (default 1)\n"
+	"  -s, --script FILE          Read the script from FILE, one step per line:\n"
+	"                               call ADDRESS [SECONDS]\n"
+	"                               wait SECONDS\n"
+	"  -f, --frame-ms MS          Packet length of calls we place: 5, 10, 20, 40 or 60 (default 20)\n"
+	"  -l, --low-delay            Use Opus restricted low delay mode for calls we place\n"
+	"  -q, --quiet                Only print call results, not the phone's log\n"
+	"      --null-audio           Use no sound card: capture silence and discard playout\n"
+	"      --wav-in FILE          Take microphone input from FILE (16-bit mono 48kHz WAV, repeated) instead of a sound card\n"
+	"      --wav-out FILE         Record playout to FILE instead of a sound card\n"
+	"      --blocking-audio       Read and write audio in the phone's thread instead of the device's callback\n"
+	"      --no-router            Don't ask the router to forward our port (UPnP, NAT-PMP/PCP), for LAN calls\n"
+	"      --fixed-bitrate        Keep Opus's default bitrate instead of adapting it to loss and queuing delay\n"
+	"      --relay HOST[:PORT]    Register with a tincanphone-relay, so calls can reach us without a port forwarded\n"
+	"      --relay-id ID          Number to register as (1-4294967295); others call @ID, and we can call theirs\n"
+	"  -h, --help                 Show this message\n"
+	"Addresses on the command line are called in order, after any script.\n"
+	"Without a script the phone runs until interrupted.\n";
+
+
+struct Step
+{
+	enum Type { CALL, WAIT };
+	Type   type;
+	string address;
+	double seconds; //CALL: how long to stay LIVE (0 for --duration or the default), WAIT: how long to pause
+};
+
+struct Options
+{
+	bool         autoAnswer;
+	double       duration; //0 means calls not placed by a script never time out
+	double       ringTimeout;
+	double       gap;
+	uint         repeat;
+	bool         quiet;
+	bool         help;
+	bool         nullAudio;
+	string       wavIn;
+	string       wavOut;
+	bool         blockingAudio;
+	bool         noRouter;
+	bool         fixedBitrate;
+	string       relay;
+	uint32       relayId;
+	vector<Step> script;
+	Phone::CallParams callParams;
+	Options() : autoAnswer(false), duration(0), ringTimeout(DEFAULT_RING_SECONDS), gap(1), repeat(1), quiet(false), help(false),
+	            nullAudio(false), blockingAudio(false), noRouter(false), fixedBitrate(false), relayId(0)  {}
+};
+
+
+// Wakes up main() when the Phone's state changes
+class CliUpdateHandler : public UpdateHandler
+{
+public:
+	Waker waker;
+	void sendUpdate()  {waker.signal();}
+};
+
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void interruptHandler(int)
+{
+	interrupted = 1;
+}
+
+static void phoneThread(void* phone)
+{
+	reinterpret_cast<Phone*>(phone)->mainLoop();
+}
+
+static double secondsSince(uint64 time)
+{
+	return double(Clock::now() - time) / (Clock::MS * 1000.0);
+}
+
+static double parseSeconds(const char* text)
+{
+	char* end;
+	double seconds = strtod(text, &end);
+	if (end == text || *end || seconds < 0)
+		throw std::runtime_error(string("Invalid number of seconds: ") + text);
+	return seconds;
+}
+
+// A whole number from min to max; strtoul alone would take "-1" as a huge number and "abc" as 0
+static uint32 parseNumber(const char* text, const char* option, uint32 min, uint32 max)
+{
+	char* end;
+	errno = 0;
+	const unsigned long number = strtoul(text, &end, 10);
+	if (end == text || *end || strchr(text, '-') || errno == ERANGE || number < min || number > max)
+		throw std::runtime_error(string("Invalid ") + option + " " + text + ", it must be from " + toString(min) + " to " + toString(max));
+	return uint32(number);
+}
+
+static void readScript(const char* filename, vector<Step>& script)
+{
+	std::ifstream file(filename);
+	if (!file)
+		throw std::runtime_error(string("Could not open script ") + filename);
+
+	string line;
+	for (uint lineNum = 1; std::getline(file, line); ++lineNum)
+	{
+		std::istringstream words(line);
+		string command, arg, seconds;
+		words >> command >> arg >> seconds;
+		if (command.empty() || command[0] == '#')
+			continue;
+
+		Step step;
+		step.seconds = 0;
+		if (command == "call" && !arg.empty())
+		{
+			step.type = Step::CALL;
+			step.address = arg;
+			if (!seconds.empty())
+				step.seconds = parseSeconds(seconds.c_str());
+		}
+		else if (command == "wait" && !arg.empty() && seconds.empty())
+		{
+			step.type = Step::WAIT;
+			step.seconds = parseSeconds(arg.c_str());
+		}
+		else
+		{
+			throw std::runtime_error(string(filename) + " line " + toString(lineNum) + ": expected \"call ADDRESS [SECONDS]\" or \"wait SECONDS\"");
+		}
+		script.push_back(step);
+	}
+}
+
+static Options parseOptions(int argc, char* argv[])
+{
+	Options options;
+	vector<Step> calls;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		const string arg = argv[i];
+		const bool hasValue = (i + 1 < argc);
+
+		if (arg == "-a" || arg == "--auto-answer")
+			options.autoAnswer = true;
+		else if (arg == "-l" || arg == "--low-delay")
+			options.callParams.lowDelay = true;
+		else if (arg == "-q" || arg == "--quiet")
+			options.quiet = true;
+		else if (arg == "-h" || arg == "--help")
+			options.help = true;
+		else if (arg == "--null-audio")
+			options.nullAudio = true;
+		else if (arg == "--blocking-audio")
+			options.blockingAudio = true;
+		else if (arg == "--no-router")
+			options.noRouter = true;
+		else if (arg == "--fixed-bitrate")
+			options.fixedBitrate = true;
+		else if (arg == "--relay" && hasValue)
+			options.relay = argv[++i];
+		else if (arg == "--relay-id" && hasValue)
+			options.relayId = parseNumber(argv[++i], "--relay-id", 1, 4294967295u);
+		else if (arg == "--wav-in" && hasValue)
+			options.wavIn = argv[++i];
+		else if (arg == "--wav-out" && hasValue)
+			options.wavOut = argv[++i];
+		else if ((arg == "-d" || arg == "--duration") && hasValue)
+			options.duration = parseSeconds(argv[++i]);
+		else if ((arg == "-r" || arg == "--ring-timeout") && hasValue)
+			options.ringTimeout = parseSeconds(argv[++i]);
+		else if ((arg == "-g" || arg == "--gap") && hasValue)
+			options.gap = parseSeconds(argv[++i]);
+		else if ((arg == "-n" || arg == "--repeat") && hasValue)
+			options.repeat = parseNumber(argv[++i], "--repeat", 1, 4294967295u);
+		else if ((arg == "-s" || arg == "--script") && hasValue)
+			readScript(argv[++i], options.script);
+		else if ((arg == "-f" || arg == "--frame-ms") && hasValue)
+			options.callParams.frameMs = atoi(argv[++i]);
+		else if (arg.empty() || arg[0] == '-')
+			throw std::runtime_error("Unknown option " + arg + "\n" + USAGE);
+		else
+		{
+			Step step;
+			step.type = Step::CALL;
+			step.address = arg;
+			step.seconds = 0;
+			calls.push_back(step);
+		}
+	}
+
+	options.script.insert(options.script.end(), calls.begin(), calls.end());
+
+	if (!options.callParams.isValid())
+		throw std::runtime_error("Unsupported frame duration " + toString(options.callParams.frameMs) + "ms");
+	if (options.relay.empty() != !options.relayId)
+		throw std::runtime_error("--relay and --relay-id go together");
+	return options;
+}
+
+
+// Drives the Phone from main(): runs the script, answers and times out calls, and reports each call once it ends
+class CliFrontend
+{
+public:
+	CliFrontend(Phone& phone, const Options& options)
+	: phone(phone), options(options), commandsSent(0), stepIndex(0), stepStarted(false), stepTime(0),
+	  callsBefore(0), connectedBefore(0),
+	  reportedCalls(0), reportedConnected(0), callStart(0), liveStart(0), answerSent(false), hangupSent(false),
+	  scriptedCalls(0), scriptedConnected(0)
+	{}
+
+	// Returns false once there's nothing left to do
+	bool update()
+	{
+		status = phone.getStatus();
+
+		if (status.state == Phone::STARTING || status.state == Phone::EXCEPTION || status.state == Phone::EXITED)
+			return status.state == Phone::STARTING;
+
+		trackCall();
+
+		if (status.state == Phone::RINGING && options.autoAnswer && !answerSent)
+		{
+			sendCommand(Phone::CMD_ANSWER);
+			answerSent = true;
+		}
+
+		return runScript();
+	}
+
+	bool hasScript() const          {return !options.script.empty();}
+	bool allScriptedConnected() const  {return scriptedConnected == scriptedCalls;}
+
+	void printSummary() const
+	{
+		if (hasScript())
+			printf("Scripted calls: %lu placed, %lu connected\n", scriptedCalls, scriptedConnected);
+	}
+
+protected:
+	Phone&         phone;
+	const Options& options;
+	Phone::Status  status;
+	ulong          commandsSent;
+
+	// Script progress
+	size_t         stepIndex; //Counts through every repeat of the script
+	bool           stepStarted;
+	uint64         stepTime;  //When the current step started, or its call was placed
+	ulong          callsBefore;     //Status counts when the current step placed its call
+	ulong          connectedBefore;
+
+	// Current call
+	ulong          reportedCalls;
+	ulong          reportedConnected;
+	uint64         callStart;
+	uint64         liveStart;
+	bool           answerSent;
+	bool           hangupSent;
+
+	ulong          scriptedCalls;
+	ulong          scriptedConnected;
+
+	void sendCommand(Phone::Command command, const string& address = "")
+	{
+		if (phone.setCommand(command, address))
+			++commandsSent;
+	}
+
+	// Have all the commands we sent been handled?
+	bool commandsHandled() const  {return status.commands >= commandsSent;}
+
+	double callSeconds() const
+	{
+		const Step* step = currentStep();
+		if (step && step->type == Step::CALL && stepStarted)
+			return step->seconds ? step->seconds : (options.duration ? options.duration : double(DEFAULT_CALL_SECONDS));
+		return options.duration;
+	}
+
+	const Step* currentStep() const
+	{
+		if (stepIndex >= options.script.size() * options.repeat)
+			return NULL;
+		return &options.script[stepIndex % options.script.size()];
+	}
+
+	void trackCall()
+	{
+		// A new call started since we last looked
+		if (status.calls > reportedCalls && !callStart)
+			callStart = Clock::now();
+		if (status.connectedCalls > reportedConnected && !liveStart)
+			liveStart = Clock::now();
+
+		// Hang up calls that have gone on long enough, or rung for too long
+		if (!hangupSent && commandsHandled())
+		{
+			const double limit = callSeconds();
+			if ((status.state == Phone::LIVE && limit && secondsSince(liveStart) >= limit) ||
+			    (status.state == Phone::DIALING && secondsSince(callStart) >= options.ringTimeout))
+			{
+				sendCommand(Phone::CMD_HANGUP);
+				hangupSent = true;
+			}
+		}
+
+		// Report calls once they've ended
+		if (status.state == Phone::HUNGUP && status.calls > reportedCalls && commandsHandled())
+		{
+			const bool connected = status.connectedCalls > reportedConnected;
+			const Phone::AudioStats& audio = status.audio;
+			const Phone::TransportStats& link = status.transport;
+			std::ostringstream line;
+			line << "Call " << status.calls << " with " << status.peer << ": ";
+			if (connected)
+			{
+				line << "connected in " << audio.connectMs << "ms, lasted " << (liveStart ? secondsSince(liveStart) : 0.0)
+				     << "s, jitter " << audio.jitterMs << "ms, playout delay " << audio.targetDelayMs
+				     << "ms, late " << audio.latePackets << ", discarded " << audio.discardedPackets
+				     << ", FEC recovered " << audio.fecRecovered << ", underruns " << audio.underruns
+				     << ", overruns " << audio.overruns << ", capture latency " << audio.latencyMs << "ms"
+				     << ", lost " << link.lost << " received/" << link.sentLost << " sent, round trip " << link.rttMs << "ms";
+				if (link.bitrate)
+					line << ", bitrate " << link.bitrate / 1000.0 << "kbps (changed " << link.bitrateChanges << " times)";
+			}
+			else
+			{
+				line << "did not connect";
+			}
+			printf("%s\n", line.str().c_str());
+			fflush(stdout);
+
+			reportedCalls = status.calls;
+			reportedConnected = status.connectedCalls;
+			callStart = liveStart = 0;
+			answerSent = hangupSent = false;
+		}
+	}
+
+	bool runScript()
+	{
+		if (!hasScript())
+			return true;
+
+		const Step* step = currentStep();
+		if (!step)
+			return false;
+
+		if (step->type == Step::WAIT)
+		{
+			if (!stepStarted)
+			{
+				stepStarted = true;
+				stepTime = Clock::now();
+			}
+			if (secondsSince(stepTime) >= step->seconds)
+				nextStep(false);
+			return true;
+		}
+
+		// CALL: wait until we're free, place the call, then wait for it to end and be reported
+		if (!stepStarted)
+		{
+			if (status.state != Phone::HUNGUP || !commandsHandled() || status.calls > reportedCalls)
+				return true;
+			if (stepTime && secondsSince(stepTime) < options.gap)
+				return true;
+
+			phone.setCallParams(options.callParams);
+			sendCommand(Phone::CMD_CALL, step->address);
+			stepStarted = true;
+			stepTime = Clock::now();
+			callsBefore = status.calls;
+			connectedBefore = status.connectedCalls;
+			++scriptedCalls;
+		}
+		else if (commandsHandled() && status.state == Phone::HUNGUP && status.calls == reportedCalls)
+		{
+			// Either the call has been reported, or it was never placed (a bad address)
+			if (status.calls == callsBefore)
+				printf("Call to %s could not be placed\n", step->address.c_str());
+			nextStep(status.connectedCalls > connectedBefore);
+		}
+		return true;
+	}
+
+	void nextStep(bool connected)
+	{
+		const Step* step = currentStep();
+		if (step->type == Step::CALL && connected)
+			++scriptedConnected;
+
+		++stepIndex;
+		stepStarted = false;
+		stepTime = (step->type == Step::CALL) ? Clock::now() : 0; //Start the gap after a call
+	}
+};
+
+
+int main(int argc, char* argv[])
+{
+	Options options;
+	try
+	{
+		options = parseOptions(argc, argv);
+	}
+	catch (std::exception& ex)
+	{
+		fprintf(stderr, "%s\n", ex.what());
+		return 1;
+	}
+	if (options.help)
+	{
+		fputs(USAGE, stdout);
+		return 0;
+	}
+
+#ifdef _WIN32
+	WSADATA winsock;
+	if ( WSAStartup(0x0202, &winsock) )
+	{
+		fprintf(stderr, "Could not start network: WSAStartup failed\n");
+		return 1;
+	}
+#endif
+
+	signal(SIGINT, &interruptHandler);
+	signal(SIGTERM, &interruptHandler);
+
+	int exitCode = 0;
+	try
+	{
+		CliUpdateHandler updates;
+		Phone phone;
+		phone.setUpdateHandler(&updates);
+		phone.setCallParams(options.callParams);
+		if (options.blockingAudio)
+			phone.setAudioMode(Phone::AUDIO_BLOCKING);
+		if (options.noRouter)
+			phone.disablePortMapping();
+		if (options.fixedBitrate)
+			phone.disableAdaptiveBitrate();
+		if (!options.relay.empty())
+			phone.setTransport(new RelayTransport(RelayTransport::resolve(options.relay), options.relayId));
+		if (!options.wavIn.empty() || !options.wavOut.empty())
+			phone.setAudioDevice(new WavAudioDevice(options.wavIn, options.wavOut));
+		else if (options.nullAudio)
+			phone.setAudioDevice(new NullAudioDevice());
+
+		Thread thread;
+		thread.start(&phoneThread, &phone);
+
+		CliFrontend frontend(phone, options);
+		bool running = true;
+		while (running && !interrupted)
+		{
+			pollfd fds[1] = {};
+			fds[0].fd = updates.waker.getFd();
+			fds[0].events = POLLIN;
+			if (Socket::poll(fds, 1, POLL_MS) > 0)
+				updates.waker.drain();
+
+			string log = phone.readLog();
+			if (!options.quiet && !log.empty())
+			{
+				fputs(log.c_str(), stdout);
+				fflush(stdout);
+			}
+
+			running = frontend.update();
+		}
+
+		// Hang up any call and stop the Phone thread
+		phone.setCommand(Phone::CMD_EXIT);
+		thread.join();
+		if (!options.quiet)
+			fputs(phone.readLog().c_str(), stdout);
+
+		if (phone.getState() == Phone::EXCEPTION)
+		{
+			fprintf(stderr, "Error: %s\n", phone.getErrorMessage().c_str());
+			exitCode = 1;
+		}
+		else
+		{
+			frontend.printSummary();
+			if (!frontend.allScriptedConnected())
+				exitCode = EXIT_CALLS_FAILED;
+		}
+	}
+	catch (std::exception& ex)
+	{
+		fprintf(stderr, "Error: %s\n", ex.what());
+		exitCode = 1;
+	}
+
+#ifdef _WIN32
+	WSACleanup();
+#endif
+
+	return exitCode;
+}
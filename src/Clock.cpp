@@ -0,0 +1,64 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "Clock.h"
+#include <atomic>
+
+#ifdef _WIN32
+#	define WIN32_LEAN_AND_MEAN
+#	define NOMINMAX
+#	include <Windows.h>
+#else
+#	include <time.h>
+#endif
+
+namespace tincan {
+
+
+static std::atomic<bool>   virtualMode(false);
+static std::atomic<uint64> virtualTime(0);
+
+#ifdef _WIN32
+	uint64 Clock::now()
+	{
+		if (virtualMode.load(std::memory_order_relaxed))
+			return virtualTime.load(std::memory_order_acquire);
+
+		static LARGE_INTEGER freq = {};
+		if (!freq.QuadPart)
+			QueryPerformanceFrequency(&freq);
+		LARGE_INTEGER count;
+		QueryPerformanceCounter(&count);
+		return uint64(count.QuadPart / freq.QuadPart) * 1000000 + uint64(count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+	}
+#else
+	uint64 Clock::now()
+	{
+		if (virtualMode.load(std::memory_order_relaxed))
+			return virtualTime.load(std::memory_order_acquire);
+
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return uint64(ts.tv_sec) * 1000000 + uint64(ts.tv_nsec) / 1000;
+	}
+#endif
+
+void Clock::setVirtual(uint64 start)
+{
+	virtualTime.store(start, std::memory_order_release);
+	virtualMode.store(true);
+}
+
+void Clock::advance(uint64 until)
+{
+	if (until > virtualTime.load(std::memory_order_relaxed))
+		virtualTime.store(until, std::memory_order_release);
+}
+
+bool Clock::isVirtual()
+{
+	return virtualMode.load();
+}
+
+
+}
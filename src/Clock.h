@@ -0,0 +1,28 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+
+namespace tincan {
+
+
+// Monotonic time source for deadlines and measurements
+class Clock
+{
+public:
+	enum { MS = 1000 }; //Clock units (microseconds) per millisecond
+
+	// Microseconds since an arbitrary fixed point, never goes backwards
+	static uint64 now();
+
+	// Simulations swap in a virtual clock for every thread: from setVirtual() on, now() returns
+	// the given time and only moves when advanced, so hours can be simulated in seconds
+	static void setVirtual(uint64 start);
+	static void advance(uint64 until); //Never backwards
+	static bool isVirtual();
+};
+
+
+}
@@ -0,0 +1,427 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "Conference.h"
+#include "UdpTransport.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+namespace tincan {
+
+
+Conference::Participant::Participant()
+: active(false),
+  address(),
+  audiobuf(JITTER_BUFFER_PACKETS, ENCODED_MAX_BYTES),
+  encoderMem(opus_encoder_get_size(CHANNELS)),
+  decoderMem(opus_decoder_get_size(CHANNELS)),
+  encoder(reinterpret_cast<OpusEncoder*>(&encoderMem[0])),
+  decoder(reinterpret_cast<OpusDecoder*>(&decoderMem[0])),
+  application(0),
+  buffering(true),
+  sendseq(FIRST_SEQ),
+  disconnectDeadline(0),
+  level(0),
+  speaking(false)
+{
+}
+
+Conference::Conference(uint maxParticipants, uint maxSpeakers)
+: transport(NULL),
+  maxSpeakers(std::max(1u, maxSpeakers)),
+  mixer(PACKET_SAMPLES),
+  sharedEncoderMem(opus_encoder_get_size(CHANNELS)),
+  sharedEncoder(reinterpret_cast<OpusEncoder*>(&sharedEncoderMem[0])),
+  recvBatch(RECV_BATCH_PACKETS, sizeof(Packet) + TRANSPORT_HEADER_MAX),
+  sendBatch(std::min(maxParticipants, uint(RECV_BATCH_PACKETS * 2)), sizeof(Packet) + TRANSPORT_HEADER_MAX),
+  nextFrame(0),
+  now(0),
+  frameUsSum(0)
+{
+	assert(maxParticipants > 0);
+	for (uint i = 0; i < maxParticipants; ++i)
+		participants.push_back(new Participant());
+	ranked.reserve(maxParticipants);
+	speakerFrames.reserve(this->maxSpeakers);
+
+	for (uint i = 0; i < maxParticipants; ++i)
+	{
+		const int opusErr = opus_decoder_init(participants[i]->decoder, SAMPLE_RATE, CHANNELS);
+		if (opusErr != OPUS_OK)
+			throw std::runtime_error(string("opus_decoder_init error: ") + opus_strerror(opusErr));
+	}
+	initEncoder(sharedEncoder, OPUS_APPLICATION_VOIP);
+}
+
+Conference::~Conference()
+{
+	for (size_t i = 0; i < participants.size(); ++i)
+		delete participants[i];
+	delete transport;
+}
+
+uint16 Conference::bind(uint16 firstPort, uint16 lastPort)
+{
+	if (!transport)
+		transport = new UdpTransport();
+	return transport->bind(firstPort, lastPort);
+}
+
+void Conference::initEncoder(OpusEncoder* encoder, int application)
+{
+	// Set up like Phone's, so listeners' decoders get what they'd get in a 1:1 call
+	int opusErr = opus_encoder_init(encoder, SAMPLE_RATE, CHANNELS, application);
+	if (opusErr == OPUS_OK)
+		opusErr = opus_encoder_ctl(encoder, OPUS_SET_INBAND_FEC(1));
+	if (opusErr == OPUS_OK)
+		opusErr = opus_encoder_ctl(encoder, OPUS_SET_PACKET_LOSS_PERC(EXPECTED_LOSS_PERC));
+	if (opusErr == OPUS_OK)
+		opusErr = opus_encoder_ctl(encoder, OPUS_SET_DTX(1));
+	if (opusErr != OPUS_OK)
+		throw std::runtime_error(string("opus encoder setup error: ") + opus_strerror(opusErr));
+}
+
+uint64 Conference::step(uint64 stepTime, std::ostream& log)
+{
+	now = stepTime;
+
+	// Handle incoming packets, a batch at a time, until EWOULDBLOCK or a partial batch
+	for (;;)
+	{
+		const int received = transport->receive(recvBatch);
+		if (received < 0)
+		{
+			const int error = Socket::getError();
+			if (error == EWOULDBLOCK)
+				break;
+			if (error == ECONNREFUSED || error == ECONNRESET)
+				continue; //A participant's port closed; they'll time out
+			throw std::runtime_error("recvfrom error: " + Socket::getErrorString());
+		}
+
+		for (int i = 0; i < received; ++i)
+			receiveDatagram(recvBatch.data(i), recvBatch.size(i), recvBatch.addr(i), log);
+
+		if (received < int(recvBatch.capacity()))
+			break;
+	}
+
+	const uint64 transportDeadline = transport->service(now, log);
+
+	for (size_t i = 0; i < participants.size(); ++i)
+	{
+		if (participants[i]->active && now >= participants[i]->disconnectDeadline)
+			leave(*participants[i], "timed out", log);
+	}
+
+	if (!stats.participants)
+	{
+		nextFrame = 0;
+		return transportDeadline;
+	}
+
+	// Frames go out on our clock; after a long stall skip ahead rather than burst
+	const uint64 frameTime = uint64(PACKET_MS) * Clock::MS;
+	if (!nextFrame || now >= nextFrame + FALL_BEHIND_FRAMES * frameTime)
+		nextFrame = now;
+	while (now >= nextFrame)
+	{
+		mixFrame();
+		nextFrame += frameTime;
+	}
+
+	return transportDeadline ? std::min(transportDeadline, nextFrame) : nextFrame;
+}
+
+Conference::Stats Conference::getStats() const
+{
+	Stats result = stats;
+	result.frameUs = stats.frames ? frameUsSum / stats.frames : 0;
+	return result;
+}
+
+void Conference::receiveDatagram(byte* data, uint size, const sockaddr_storage& from, std::ostream& log)
+{
+	if (size < sizeof(uint32))
+		return;
+
+	// Byte swap in place; data is aligned for Packet
+	Packet& packet = *reinterpret_cast<Packet*>(data);
+	packet.header = ntohl(packet.header);
+	packet.seq = (size >= offsetof(Packet,data)) ? ntohl(packet.seq) : 0;
+
+	Participant* p = find(from);
+	switch (packet.header)
+	{
+	case Packet::RING:
+	{
+		// Already here: the RINGs stop once our AUDIO reaches them
+		if (p)
+			break;
+
+		// Every participant is mixed at PACKET_MS; like Phone::parseRing, anything unreadable means the default
+		uint frameMs = PACKET_MS;
+		bool lowDelay = false;
+		if (size >= offsetof(Packet,data) + 2)
+		{
+			Phone::CallParams params;
+			params.frameMs = packet.data[0];
+			if (params.isValid())
+			{
+				frameMs = params.frameMs;
+				lowDelay = packet.data[1] != 0;
+			}
+		}
+		if (frameMs != PACKET_MS || !join(from, lowDelay, log))
+		{
+			++stats.busy;
+			sendPacket(Packet::BUSY, from);
+		}
+		break;
+	}
+
+	case Packet::AUDIO:
+		if (!p)
+		{
+			// Not in the conference, tell them we've hung up
+			sendPacket(Packet::HANGUP, from);
+		}
+		else if (size > offsetof(Packet,data))
+		{
+			// Late, duplicate and out of range packets are dropped by the JitterBuffer
+			++stats.received;
+			p->audiobuf.insert(packet.seq, packet.data, size - offsetof(Packet,data), now);
+			p->disconnectDeadline = now + DISCONNNECT_TIMEOUT * Clock::MS;
+		}
+		break;
+
+	case Packet::HANGUP:
+		if (p)
+			leave(*p, "hung up", log);
+		break;
+
+	default:
+		//REPORTs aren't answered, which phones take as a peer that doesn't send them
+		break;
+	}
+}
+
+Conference::Participant* Conference::find(const sockaddr_storage& addr)
+{
+	for (size_t i = 0; i < participants.size(); ++i)
+	{
+		if (participants[i]->active && participants[i]->address == addr)
+			return participants[i];
+	}
+	return NULL;
+}
+
+Conference::Participant* Conference::join(const sockaddr_storage& addr, bool lowDelay, std::ostream& log)
+{
+	Participant* p = NULL;
+	for (size_t i = 0; i < participants.size() && !p; ++i)
+	{
+		if (!participants[i]->active)
+			p = participants[i];
+	}
+	if (!p)
+	{
+		log << "Turned away " << addr << ": the conference is full" << endl;
+		return NULL;
+	}
+
+	p->active = true;
+	p->address = addr;
+	p->audiobuf.reset(FIRST_SEQ, PACKET_MS);
+	p->buffering = true;
+	p->sendseq = FIRST_SEQ;
+	p->disconnectDeadline = now + DISCONNNECT_TIMEOUT * Clock::MS;
+	p->level = 0;
+	p->speaking = false;
+
+	// Their own encoder is reset whenever they start speaking; its application follows their RING like a callee's would
+	const int application = lowDelay ? OPUS_APPLICATION_RESTRICTED_LOWDELAY : OPUS_APPLICATION_VOIP;
+	if (application != p->application)
+	{
+		initEncoder(p->encoder, application);
+		p->application = application;
+	}
+	const int opusErr = opus_decoder_ctl(p->decoder, OPUS_RESET_STATE);
+	if (opusErr != OPUS_OK)
+		throw std::runtime_error(string("opus reset error: ") + opus_strerror(opusErr));
+
+	++stats.participants;
+	++stats.joined;
+	log << "Joined: " << addr << " (" << stats.participants << " in the conference)" << endl;
+	return p;
+}
+
+void Conference::leave(Participant& p, const char* why, std::ostream& log)
+{
+	p.active = false;
+	p.speaking = false;
+	--stats.participants;
+	++stats.left;
+	log << "Left: " << p.address << ' ' << why << " (" << stats.participants << " in the conference)" << endl;
+}
+
+void Conference::mixFrame()
+{
+	const uint64 start = Clock::now();
+
+	// Decode everyone, and rank whoever's loud enough to be a speaker
+	ranked.clear();
+	for (size_t i = 0; i < participants.size(); ++i)
+	{
+		Participant& p = *participants[i];
+		if (!p.active)
+			continue;
+		decode(p);
+
+		double energy = 0;
+		for (uint s = 0; s < PACKET_SAMPLES; ++s)
+			energy += double(p.pcm[s]) * p.pcm[s];
+		p.level = std::max(std::sqrt(energy / PACKET_SAMPLES), p.level * LEVEL_RELEASE_PERCENT / 100);
+		if (p.level >= SPEECH_LEVEL)
+			ranked.push_back(&p);
+	}
+
+	struct Louder
+	{
+		bool operator () (const Participant* lhs, const Participant* rhs) const  {return lhs->level > rhs->level;}
+	};
+	const uint speakers = std::min(maxSpeakers, uint(ranked.size()));
+	std::partial_sort(ranked.begin(), ranked.begin() + speakers, ranked.end(), Louder());
+
+	speakerFrames.clear();
+	for (uint r = 0; r < speakers; ++r)
+	{
+		// A new speaker's own encoder has been idle, or never encoded for them, so start it fresh
+		if (!ranked[r]->speaking && opus_encoder_ctl(ranked[r]->encoder, OPUS_RESET_STATE) != OPUS_OK)
+			throw std::runtime_error("opus_encoder_ctl(OPUS_RESET_STATE) failed");
+		speakerFrames.push_back(ranked[r]->pcm);
+	}
+	for (size_t i = 0; i < participants.size(); ++i)
+		participants[i]->speaking = false;
+	for (uint r = 0; r < speakers; ++r)
+		ranked[r]->speaking = true;
+	mixer.mix(speakerFrames.empty() ? NULL : &speakerFrames[0], speakers, PACKET_SAMPLES);
+	stats.speakers = speakers;
+
+	// Each speaker hears everyone but themselves
+	opus_int16 mixed[PACKET_SAMPLES];
+	const opus_int32 maxBytes = PACKET_MS * ENCODED_BYTES_PER_MS;
+	for (uint r = 0; r < speakers; ++r)
+	{
+		Participant& p = *ranked[r];
+		mixer.getMixWithout(p.pcm, mixed);
+		byte* data = queueAudio(p);
+		const opus_int32 enc = opus_encode(p.encoder, mixed, PACKET_SAMPLES, data, maxBytes);
+		if (enc < 0)
+			throw std::runtime_error(string("opus_encode error: ") + opus_strerror(enc));
+		sendBatch.setSize(sendBatch.count() - 1, offsetof(Packet,data) + enc);
+		++stats.encodes;
+	}
+
+	// Everyone else hears all the speakers, from one encoder; switching a listener between it and their own
+	// encoder costs a glitch no worse than a lost packet, since Opus decoders resync within a frame
+	opus_int32 sharedSize = -1;
+	for (size_t i = 0; i < participants.size(); ++i)
+	{
+		Participant& p = *participants[i];
+		if (!p.active || p.speaking)
+			continue;
+
+		if (sharedSize < 0)
+		{
+			mixer.getMix(mixed);
+			sharedSize = opus_encode(sharedEncoder, mixed, PACKET_SAMPLES, sharedPacket, maxBytes);
+			if (sharedSize < 0)
+				throw std::runtime_error(string("opus_encode error: ") + opus_strerror(sharedSize));
+			++stats.encodes;
+		}
+		memcpy(queueAudio(p), sharedPacket, sharedSize);
+		sendBatch.setSize(sendBatch.count() - 1, offsetof(Packet,data) + sharedSize);
+	}
+	sendQueued();
+
+	++stats.frames;
+	const double us = double(Clock::now() - start);
+	frameUsSum += us;
+	stats.frameMaxUs = std::max(stats.frameMaxUs, us);
+}
+
+void Conference::decode(Participant& p)
+{
+	JitterBuffer& buf = p.audiobuf;
+	if (p.buffering && buf.buffered() >= buf.targetDelay())
+		p.buffering = false;
+
+	int decoded = OPUS_INVALID_PACKET;
+	if (!p.buffering)
+	{
+		// Far too many buffered after a stall: drop the oldest unplayed to catch up, at the cost of a glitch
+		while (buf.buffered() >= buf.targetDelay() + BUFFERED_PACKETS_SKIP)
+		{
+			buf.pop();
+			++stats.skipped;
+		}
+
+		uint size = 0;
+		const byte* front = buf.get(buf.frontSeq(), size);
+		if (front)
+		{
+			decoded = opus_decode(p.decoder, front, size, p.pcm, PACKET_SAMPLES, 0);
+		}
+		else
+		{
+			// The next packet may carry this one as in-band FEC, otherwise it's concealed below
+			const byte* next = buf.get(buf.frontSeq() + 1, size);
+			if (next && Phone::hasFec(next, size))
+				decoded = opus_decode(p.decoder, next, size, p.pcm, PACKET_SAMPLES, 1);
+			if (buf.buffered() <= 1)
+				p.buffering = true;
+		}
+		buf.pop();
+	}
+
+	// A bad packet only costs that participant a frame, concealed like a missing one
+	if (decoded < 0)
+	{
+		++stats.concealed;
+		decoded = opus_decode(p.decoder, NULL, 0, p.pcm, PACKET_SAMPLES, 0);
+	}
+	if (decoded < 0)
+		decoded = 0;
+	std::fill(p.pcm + decoded, p.pcm + PACKET_SAMPLES, opus_int16(0));
+}
+
+byte* Conference::queueAudio(Participant& p)
+{
+	if (sendBatch.count() == sendBatch.capacity())
+		sendQueued();
+
+	Packet& packet = *reinterpret_cast<Packet*>(sendBatch.add(p.address));
+	packet.header = htonl(Packet::AUDIO);
+	packet.seq = htonl(p.sendseq);
+	++p.sendseq;
+	return packet.data;
+}
+
+void Conference::sendQueued()
+{
+	// Whatever the socket won't take is dropped, like a lost packet
+	const int sent = transport->send(sendBatch);
+	if (sent > 0)
+		stats.sent += sent;
+}
+
+void Conference::sendPacket(Packet::Header header, const sockaddr_storage& to)
+{
+	const uint32 netheader = htonl(header);
+	transport->sendTo(&netheader, sizeof(netheader), to);
+}
+
+
+}
@@ -0,0 +1,124 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+#include "AudioMixer.h"
+#include "DatagramBatch.h"
+#include "JitterBuffer.h"
+#include "Phone.h"
+#include "Transport.h"
+#include <opus.h>
+#include <ostream>
+
+namespace tincan {
+
+
+// A mixing host for conference calls: phones call its address like any other phone's, and it answers at once.
+// Every PACKET_MS it decodes each participant and takes the loudest few as speakers. Each speaker is sent the mix
+// without their own voice; everyone else hears the speakers' mix, encoded once and sent to all of them, so a frame
+// costs one decode per participant but only speakers + 1 encodes however many are listening
+class Conference
+{
+public:
+	enum {
+		PORT_DEFAULT = 56791,
+		PARTICIPANTS_DEFAULT = 32,
+		SPEAKERS_DEFAULT = 3,      //More than this talking at once is just noise
+		SPEECH_LEVEL = 100,        //RMS a participant must reach to be a speaker (about -50 dBFS)
+		LEVEL_RELEASE_PERCENT = 95, //How much of a participant's level carries over to the next frame, so speakers don't flicker
+		FALL_BEHIND_FRAMES = 5,    //Frames made up after a stall; beyond this the clock skips ahead
+		FIRST_SEQ = 1              //Where Phone starts AUDIO seq numbers
+	};
+
+	struct Stats
+	{
+		uint   participants;
+		uint   speakers;     //In the last frame
+		ulong  joined;
+		ulong  left;         //Hung up or timed out
+		ulong  busy;         //Calls turned away: full, or framed other than PACKET_MS
+		ulong  frames;
+		ulong  encodes;
+		ulong  received;     //AUDIO packets
+		ulong  sent;
+		ulong  concealed;    //Frames made up for a participant's missing packets
+		ulong  skipped;      //Packets dropped unplayed to catch up after a stall
+		double frameUs;      //Mean time to decode, mix and encode a frame
+		double frameMaxUs;
+		Stats() : participants(0), speakers(0), joined(0), left(0), busy(0), frames(0), encodes(0), received(0),
+		          sent(0), concealed(0), skipped(0), frameUs(0), frameMaxUs(0)  {}
+	};
+
+	// Everything is allocated up front, so nothing is while mixing
+	Conference(uint maxParticipants = PARTICIPANTS_DEFAULT, uint maxSpeakers = SPEAKERS_DEFAULT);
+	~Conference();
+
+	void   setTransport(Transport* t)  {delete transport; transport = t;} //Takes ownership; a UDP socket if not set
+	uint16 bind(uint16 firstPort, uint16 lastPort); //Throws if there's no free port
+	SOCKET getFd() const  {return transport->getFd();}
+
+	// Handle waiting packets and mix whatever frames are due, logging who joins and leaves
+	// Returns when to call again at the latest, 0 if only a packet arriving can give it anything to do
+	uint64 step(uint64 now, std::ostream& log);
+
+	Stats  getStats() const;
+	AudioMixer& getMixer()  {return mixer;} //To pick a path
+
+protected:
+	typedef Phone::Packet Packet;
+
+	struct Participant
+	{
+		bool             active;
+		sockaddr_storage address;
+		JitterBuffer     audiobuf;
+		vector<byte>     encoderMem;
+		vector<byte>     decoderMem;
+		OpusEncoder*     encoder;     //For their own mix while they're a speaker
+		OpusDecoder*     decoder;
+		int              application; //What encoder was last initialized for
+		bool             buffering;   //Concealing until the jitter buffer has filled
+		uint32           sendseq;
+		uint64           disconnectDeadline;
+		double           level;       //RMS of their latest frames, falling slowly once they go quiet
+		bool             speaking;
+		opus_int16       pcm[PACKET_SAMPLES];
+		Participant();
+	};
+
+	Transport*           transport;
+	vector<Participant*> participants; //maxParticipants of them, active or not
+	vector<Participant*> ranked;       //Scratch for picking speakers
+	vector<const int16*> speakerFrames;
+	uint                 maxSpeakers;
+	AudioMixer           mixer;
+	vector<byte>         sharedEncoderMem;
+	OpusEncoder*         sharedEncoder; //For everyone who isn't speaking
+	byte                 sharedPacket[ENCODED_MAX_BYTES]; //What it encoded this frame; not kept in sendBatch, which can be sent mid-frame
+	DatagramBatch        recvBatch;
+	DatagramBatch        sendBatch;
+	uint64               nextFrame;     //0 while nobody is here
+	uint64               now;
+	Stats                stats;
+	double               frameUsSum;
+
+	void receiveDatagram(byte* data, uint size, const sockaddr_storage& from, std::ostream& log);
+	Participant* find(const sockaddr_storage& addr);
+	Participant* join(const sockaddr_storage& addr, bool lowDelay, std::ostream& log);
+	void leave(Participant& p, const char* why, std::ostream& log);
+
+	void mixFrame();
+	void decode(Participant& p);
+	byte* queueAudio(Participant& p);
+	void sendQueued();
+	void sendPacket(Packet::Header header, const sockaddr_storage& to);
+	static void initEncoder(OpusEncoder* encoder, int application);
+
+	Conference(const Conference&);
+	Conference& operator = (const Conference&);
+};
+
+
+}
@@ -0,0 +1,145 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "Conference.h"
+#include "Clock.h"
+#include "RelayTransport.h"
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+// Conference host: phones call it like any other phone, and each hears everyone else (see Conference.h)
+// Runs until interrupted, printing who joins and leaves and its counters now and then
+using namespace tincan;
+
+enum {
+	POLL_MS = 100,             //Longest wait, so a signal is noticed
+	DEFAULT_STATS_SECONDS = 60
+};
+
+static const char USAGE[] =
+	"Usage: tincanphone-conference [options]\n"
+	"  -p, --port PORT            UDP port to listen on (default 56791)\n"
+	"  -n, --participants N       Most phones in the conference at once (default 32)\n"
+	"  -s, --speakers N           Most voices mixed at once, the loudest (default 3)\n"
+	"  -r, --relay HOST[:PORT]    Also take calls through a tincanphone-relay, as @ID\n"
+	"      --relay-id ID          The relay ID to register, 1 to 4294967295\n"
+	"      --scalar               Mix without SSE2/AVX2\n"
+	"      --stats SECONDS        How often to print counters, 0 for never (default 60)\n"
+	"  -h, --help                 Show this message\n"
+	"Phones join by calling HOST:PORT (or @ID through the relay); frames must be 20ms, the default.\n";
+
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void interruptHandler(int)
+{
+	interrupted = 1;
+}
+
+static void printStats(const Conference& conference)
+{
+	const Conference::Stats stats = conference.getStats();
+	printf("%u participants  %u speaking  joined %lu  left %lu  busy %lu  frames %lu  encodes %lu"
+	       "  frame %.0fus (max %.0fus)  received %lu  sent %lu  concealed %lu  skipped %lu\n",
+	       stats.participants, stats.speakers, stats.joined, stats.left, stats.busy, stats.frames, stats.encodes,
+	       stats.frameUs, stats.frameMaxUs, stats.received, stats.sent, stats.concealed, stats.skipped);
+	fflush(stdout);
+}
+
+int main(int argc, char* argv[])
+{
+	uint16 port = Conference::PORT_DEFAULT;
+	uint participants = Conference::PARTICIPANTS_DEFAULT;
+	uint speakers = Conference::SPEAKERS_DEFAULT;
+	string relay;
+	uint32 relayId = 0;
+	bool scalar = false;
+	uint statsSeconds = DEFAULT_STATS_SECONDS;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		const string arg = argv[i];
+		const bool hasValue = (i + 1 < argc);
+		if ((arg == "-p" || arg == "--port") && hasValue)
+			port = uint16(atoi(argv[++i]));
+		else if ((arg == "-n" || arg == "--participants") && hasValue)
+			participants = uint(atoi(argv[++i]));
+		else if ((arg == "-s" || arg == "--speakers") && hasValue)
+			speakers = uint(atoi(argv[++i]));
+		else if ((arg == "-r" || arg == "--relay") && hasValue)
+			relay = argv[++i];
+		else if (arg == "--relay-id" && hasValue)
+			relayId = uint32(strtoul(argv[++i], NULL, 10));
+		else if (arg == "--scalar")
+			scalar = true;
+		else if (arg == "--stats" && hasValue)
+			statsSeconds = uint(atoi(argv[++i]));
+		else
+		{
+			const bool help = (arg == "-h" || arg == "--help");
+			fputs(USAGE, help ? stdout : stderr);
+			return help ? 0 : 1;
+		}
+	}
+	if (!port || !participants || !speakers)
+	{
+		fprintf(stderr, "Error: --port, --participants and --speakers must be at least 1\n");
+		return 1;
+	}
+	if (relay.empty() != !relayId)
+	{
+		fprintf(stderr, "Error: --relay and --relay-id go together\n");
+		return 1;
+	}
+
+	signal(SIGINT, &interruptHandler);
+	signal(SIGTERM, &interruptHandler);
+
+	try
+	{
+		Conference conference(participants, speakers);
+		if (scalar)
+			conference.getMixer().setPath(AudioMixer::SCALAR);
+		if (!relay.empty())
+			conference.setTransport(new RelayTransport(RelayTransport::resolve(relay), relayId));
+
+		const uint16 bound = conference.bind(port, port);
+		printf("Conference on UDP port %u for up to %u phones, mixing the loudest %u with %s\n", bound, participants,
+		       speakers, AudioMixer::pathName(conference.getMixer().getPath()));
+		fflush(stdout);
+
+		uint64 deadline = 0;
+		uint64 statsTime = Clock::now();
+		while (!interrupted)
+		{
+			// Sleep until a packet arrives or the next frame is due
+			const uint64 now = Clock::now();
+			int timeout = POLL_MS;
+			if (deadline)
+				timeout = int(std::min<uint64>(POLL_MS, (deadline > now) ? (deadline - now + Clock::MS - 1) / Clock::MS : 0));
+			pollfd pfd = {conference.getFd(), POLLIN, 0};
+			if (Socket::poll(&pfd, 1, timeout) < 0 && Socket::getError() != EINTR)
+				throw std::runtime_error("poll error: " + Socket::getErrorString());
+
+			deadline = conference.step(Clock::now(), std::cout);
+
+			if (statsSeconds && Clock::now() - statsTime >= uint64(statsSeconds) * 1000 * Clock::MS)
+			{
+				printStats(conference);
+				statsTime = Clock::now();
+			}
+		}
+
+		printStats(conference);
+		printf("Stopped\n");
+	}
+	catch (std::exception& ex)
+	{
+		fprintf(stderr, "Error: %s\n", ex.what());
+		return 1;
+	}
+	return 0;
+}
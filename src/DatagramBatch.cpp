@@ -0,0 +1,181 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "DatagramBatch.h"
+#include "Clock.h"
+#include <cassert>
+#ifdef TINCAN_HAVE_MMSG
+#	include <time.h>
+#endif
+
+namespace tincan {
+
+
+DatagramBatch::DatagramBatch(uint capacity, uint maxSize, bool useMmsg)
+: mmsg(useMmsg),
+  stride((maxSize + 7) / 8),
+  used(0),
+  storage(capacity * stride),
+  sizes(capacity),
+  addrs(capacity),
+  times(capacity),
+  syscalls(0)
+{
+	assert(capacity > 0);
+#ifdef TINCAN_HAVE_MMSG
+	headers.resize(capacity);
+	iovecs.resize(capacity);
+	control.resize(capacity * CONTROL_WORDS);
+#else
+	mmsg = false;
+#endif
+}
+
+byte* DatagramBatch::add(const sockaddr_storage& to)
+{
+	if (used == capacity())
+		return NULL;
+	addrs[used] = to;
+	sizes[used] = 0;
+	times[used] = 0;
+	return data(used++);
+}
+
+void DatagramBatch::move(uint from, uint to)
+{
+	assert(from < used && to < used);
+	memcpy(data(to), data(from), sizes[from]);
+	sizes[to] = sizes[from];
+	addrs[to] = addrs[from];
+	times[to] = times[from];
+}
+
+#ifdef TINCAN_HAVE_MMSG
+void DatagramBatch::setupHeaders(uint n, bool receiving)
+{
+	for (uint i = 0; i < n; ++i)
+	{
+		iovecs[i].iov_base = data(i);
+		iovecs[i].iov_len = receiving ? stride * 8 : sizes[i];
+
+		msghdr& hdr = headers[i].msg_hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.msg_name = &addrs[i];
+		if (receiving)
+			hdr.msg_namelen = sizeof(sockaddr_storage);
+		else
+			hdr.msg_namelen = (addrs[i].ss_family == AF_INET) ? sizeof(sockaddr_in) : sizeof(sockaddr_in6);
+		hdr.msg_iov = &iovecs[i];
+		hdr.msg_iovlen = 1;
+		if (receiving)
+		{
+			hdr.msg_control = &control[i * CONTROL_WORDS];
+			hdr.msg_controllen = CONTROL_WORDS * sizeof(uint64);
+		}
+		headers[i].msg_len = 0;
+	}
+}
+
+void DatagramBatch::readTimes(uint n)
+{
+	// Kernel timestamps are wall clock time, so turn them into how long ago each datagram arrived
+	timespec wall;
+	clock_gettime(CLOCK_REALTIME, &wall);
+	const uint64 wallNow = uint64(wall.tv_sec) * 1000000 + uint64(wall.tv_nsec) / 1000;
+	const uint64 now = Clock::now();
+
+	for (uint i = 0; i < n; ++i)
+	{
+		times[i] = 0;
+#ifdef SCM_TIMESTAMPNS
+		msghdr& hdr = headers[i].msg_hdr;
+		for (cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg))
+		{
+			if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPNS)
+				continue;
+
+			timespec stamp;
+			memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+			const uint64 arrived = uint64(stamp.tv_sec) * 1000000 + uint64(stamp.tv_nsec) / 1000;
+			const uint64 age = (wallNow > arrived) ? wallNow - arrived : 0;
+			times[i] = (now > age) ? now - age : 1;
+		}
+#endif
+	}
+}
+#endif
+
+int DatagramBatch::receive(SOCKET s)
+{
+	used = 0;
+
+#ifdef TINCAN_HAVE_MMSG
+	if (mmsg)
+	{
+		setupHeaders(capacity(), true);
+		++syscalls;
+		int received = recvmmsg(s, &headers[0], capacity(), MSG_DONTWAIT, NULL);
+		if (received < 0)
+			return -1;
+		for (int i = 0; i < received; ++i)
+			sizes[i] = headers[i].msg_len;
+		readTimes(received);
+		used = received;
+		return received;
+	}
+#endif
+
+	while (used < capacity())
+	{
+		socklen_t addrLen = sizeof(sockaddr_storage);
+		++syscalls;
+		int received = recvfrom(s, (char*)data(used), stride * 8, 0, (sockaddr*)&addrs[used], &addrLen);
+		if (received < 0)
+		{
+			// Report errors only if they stopped us getting anything; the caller sees them on the next call
+			if (used)
+				break;
+			return -1;
+		}
+		times[used] = 0;
+		sizes[used++] = received;
+	}
+	return used;
+}
+
+int DatagramBatch::send(SOCKET s)
+{
+	const uint n = used;
+	used = 0;
+	if (!n)
+		return 0;
+
+#ifdef TINCAN_HAVE_MMSG
+	if (mmsg)
+	{
+		setupHeaders(n, false);
+		uint sent = 0;
+		while (sent < n)
+		{
+			++syscalls;
+			int ret = sendmmsg(s, &headers[sent], n - sent, 0);
+			if (ret < 0)
+				return sent ? int(sent) : -1;
+			sent += ret;
+		}
+		return sent;
+	}
+#endif
+
+	for (uint i = 0; i < n; ++i)
+	{
+		const int addrLen = (addrs[i].ss_family == AF_INET) ? sizeof(sockaddr_in) : sizeof(sockaddr_in6);
+		++syscalls;
+		if (sendto(s, (const char*)data(i), sizes[i], 0, (const sockaddr*)&addrs[i], addrLen) < 0)
+			return i ? int(i) : -1;
+	}
+	return n;
+}
+
+
+}
@@ -0,0 +1,83 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+#include "Socket.h"
+
+#ifdef __linux__
+#	define TINCAN_HAVE_MMSG 1
+#endif
+
+namespace tincan {
+
+
+// A set of UDP datagrams sent or received with as few syscalls as possible:
+// one recvmmsg/sendmmsg per batch on Linux, one recvfrom/sendto per datagram elsewhere
+class DatagramBatch
+{
+public:
+	// Each datagram can be up to maxSize bytes; useMmsg=false forces the per-datagram path
+	DatagramBatch(uint capacity, uint maxSize, bool useMmsg = true);
+
+	uint capacity() const  {return uint(sizes.size());}
+	uint count() const     {return used;}
+	void clear()           {used = 0;}
+
+	// Datagram i; data is 8-byte aligned so it can be cast to a packet struct
+	byte*                   data(uint i)        {return (byte*)&storage[i * stride];}
+	uint                    size(uint i) const  {return sizes[i];}
+	const sockaddr_storage& addr(uint i) const  {return addrs[i];}
+	uint                    bufferSize() const  {return stride * sizeof(uint64);} //At least maxSize
+
+	// When received datagram i arrived, in Clock time; 0 if unknown, as it is unless the socket
+	// has Socket::enableTimestamps and recvmmsg is used
+	uint64                  time(uint i) const  {return times[i];}
+	void                    setTime(uint i, uint64 time)  {times[i] = time;}
+
+	// Queue a datagram for send(), fill in the returned buffer then call setSize
+	// Returns NULL if the batch is full
+	byte* add(const sockaddr_storage& to);
+	void  setSize(uint i, uint size)  {sizes[i] = size;}
+
+	// Rework what was received in place, to send it on without copying: readdress datagrams,
+	// move the ones to keep over the ones to drop, then truncate to those kept
+	void  setAddr(uint i, const sockaddr_storage& to)  {addrs[i] = to;}
+	void  move(uint from, uint to);
+	void  truncate(uint n)  {if (n < used) used = n;}
+
+	// Replace contents with up to capacity() datagrams without blocking
+	// Returns how many were received, or -1 with Socket::getError() set (EWOULDBLOCK if none waiting)
+	int receive(SOCKET s);
+
+	// Send everything queued, then clear(); returns how many were sent before any error,
+	// or -1 with Socket::getError() set if the first datagram failed
+	int send(SOCKET s);
+
+	// How many socket syscalls have been made, for benchmarking
+	ulong getSyscalls() const  {return syscalls;}
+
+protected:
+	bool                     mmsg;
+	uint                     stride;  //In uint64 units
+	uint                     used;
+	vector<uint64>           storage;
+	vector<uint>             sizes;
+	vector<sockaddr_storage> addrs;
+	vector<uint64>           times;
+	ulong                    syscalls;
+
+#ifdef TINCAN_HAVE_MMSG
+	enum { CONTROL_WORDS = 8 }; //Room for a timestamp cmsg per datagram, in uint64 units
+
+	vector<mmsghdr>          headers;
+	vector<iovec>            iovecs;
+	vector<uint64>           control;
+	void setupHeaders(uint n, bool receiving);
+	void readTimes(uint n);
+#endif
+};
+
+
+}
@@ -0,0 +1,141 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "EventLog.h"
+#include "Clock.h"
+#include "RateController.h"
+#include <cstdio>
+
+namespace tincan {
+
+
+EventLog::EventLog(size_t capacity)
+: ring(capacity),
+  startTime(Clock::now()),
+  dropped(0),
+  droppedReported(0),
+  textContinues(false)
+{
+}
+
+void EventLog::push(const Event& event)
+{
+	if (!ring.write(&event, 1))
+		++dropped;
+}
+
+void EventLog::write(Code code, uint64 seq, int32 value, int32 value2)
+{
+	Event event;
+	event.time = Clock::now();
+	event.code = code;
+	event.value = value;
+	event.value2 = value2;
+	event.seq = seq;
+	event.peer.ss_family = AF_UNSPEC;
+	event.text[0] = '\0';
+	push(event);
+}
+
+void EventLog::write(Code code, const sockaddr_storage& peer)
+{
+	Event event;
+	event.time = Clock::now();
+	event.code = code;
+	event.value = event.value2 = 0;
+	event.seq = 0;
+	event.peer = peer;
+	event.text[0] = '\0';
+	push(event);
+}
+
+void EventLog::writeText(const char* text, size_t length)
+{
+	// Long text goes in consecutive events that read() joins up again; all of them fit, or none are written
+	const size_t pieces = std::max<size_t>(1, (length + TEXT_MAX - 2) / (TEXT_MAX - 1));
+	if (ring.writeAvailable() < pieces)
+	{
+		++dropped;
+		return;
+	}
+
+	Event event;
+	event.time = Clock::now();
+	event.code = TEXT;
+	event.value2 = 0;
+	event.seq = 0;
+	event.peer.ss_family = AF_UNSPEC;
+	for (size_t p = 0; p < pieces; ++p)
+	{
+		const size_t size = std::min<size_t>(length, TEXT_MAX - 1);
+		memcpy(event.text, text, size);
+		event.text[size] = '\0';
+		text += size;
+		length -= size;
+		event.value = (p + 1 < pieces);
+		push(event);
+	}
+}
+
+string EventLog::read()
+{
+	string out;
+
+	Event event;
+	while (ring.read(&event, 1))
+	{
+		out += textContinues ? string(event.text) : format(event, startTime);
+		textContinues = (event.code == TEXT && event.value);
+		if (!textContinues)
+			out += '\n';
+	}
+
+	const ulong d = dropped;
+	if (d != droppedReported)
+	{
+		out += "(" + toString(d - droppedReported) + " log messages dropped)\n";
+		droppedReported = d;
+	}
+
+	return out;
+}
+
+string EventLog::format(const Event& event, uint64 startTime)
+{
+	char stamp[32];
+	const uint64 ms = (event.time - startTime) / 1000;
+	snprintf(stamp, sizeof(stamp), "[%4u.%03u] ", uint(ms / 1000), uint(ms % 1000));
+
+	std::ostringstream line;
+	line << stamp;
+
+	switch (event.code)
+	{
+	case TEXT:                line << event.text; break;
+	case DIALING:             line << "Dialing " << event.peer; break;
+	case INCOMING_CALL:       line << "*** Incoming call from " << event.peer; break;
+	case MISSED_CALL:         line << "Missed call from " << event.peer; break;
+	case BUSY:                line << "*** " << event.peer << " is busy"; break;
+	case PEER_HUNG_UP:        line << "*** " << event.peer << " has hung up"; break;
+	case HANGING_UP:          line << "Hanging up"; break;
+	case CALL_STARTED:        line << "*** Call started (" << event.value << "ms packets" << (event.value2 ? ", low delay" : "") << ")"; break;
+	case CALL_DISCONNECTED:   line << "*** Call disconnected!"; break;
+	case MISSING_PACKET:      line << "Missing packet " << event.seq; break;
+	case FEC_RECOVERED:       line << "Missing packet " << event.seq << ", recovered with FEC"; break;
+	case CORRUPT_PACKET:      line << "Corrupt packet " << event.seq; break;
+	case BUFFERING_INCREASED: line << "Buffering increased to " << event.value << " packets"; break;
+	case REDUCING_BUFFERING:  line << "Reducing buffering"; break;
+	case NETWORK_ERROR:       line << "Network error: " << Socket::getErrorString(event.value); break;
+	case SEND_ERROR:          line << "sendto error: " << Socket::getErrorString(event.value); break;
+	case OUTPUT_UNDERFLOW:    line << "Pa_WriteStream output underflowed"; break;
+	case INVALID_ADDRESS:     line << "Invalid IP address"; break;
+	case BITRATE_CHANGED:     line << "Bitrate " << event.value / 1000.0 << "kbps, FEC for " << event.value2 << "% loss ("
+	                               << RateController::reasonName(RateController::Reason(event.seq)) << ")"; break;
+	default:                  line << "Unknown event " << event.code; break;
+	}
+
+	return line.str();
+}
+
+
+}
@@ -0,0 +1,77 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+#include "RingBuffer.h"
+#include "Socket.h"
+
+namespace tincan {
+
+
+// Bounded lock-free log of structured events, written by the Phone thread and read by the user thread
+// Writing never locks, allocates or formats; events are only turned into text when read
+class EventLog
+{
+public:
+	enum Code {
+		TEXT,                //Preformatted text, for rare messages; value = 1 if it goes on in the next event
+		DIALING,             //peer
+		INCOMING_CALL,       //peer
+		MISSED_CALL,         //peer
+		BUSY,                //peer
+		PEER_HUNG_UP,        //peer
+		HANGING_UP,
+		CALL_STARTED,        //value = packet ms, value2 = low delay
+		CALL_DISCONNECTED,
+		MISSING_PACKET,      //seq
+		FEC_RECOVERED,       //seq
+		CORRUPT_PACKET,      //seq
+		BUFFERING_INCREASED, //value = target packets
+		REDUCING_BUFFERING,
+		NETWORK_ERROR,       //value = socket error
+		SEND_ERROR,          //value = socket error
+		OUTPUT_UNDERFLOW,
+		INVALID_ADDRESS,
+		BITRATE_CHANGED      //seq = RateController::Reason, value = bits per second, value2 = loss percent for FEC
+	};
+
+	enum { TEXT_MAX = 128 };
+
+	struct Event
+	{
+		uint64           time; //Clock::now()
+		uint32           code;
+		int32            value;
+		int32            value2;
+		uint64           seq;
+		sockaddr_storage peer;
+		char             text[TEXT_MAX];
+	};
+
+	explicit EventLog(size_t capacity);
+
+	// Writer thread only; if the log is full the event is dropped and counted
+	void write(Code code, uint64 seq = 0, int32 value = 0, int32 value2 = 0);
+	void write(Code code, const sockaddr_storage& peer);
+	void writeText(const char* text, size_t length); //Split over as many events as it takes, or dropped whole
+
+	// Reader thread only: remove all pending events, formatted one per line
+	string read();
+
+	// Format a single event, with its time relative to startTime
+	static string format(const Event& event, uint64 startTime);
+
+protected:
+	RingBuffer<Event>  ring;
+	uint64             startTime;
+	std::atomic<ulong> dropped;
+	ulong              droppedReported; //Reader thread only
+	bool               textContinues;   //Reader thread only: the last event read was text that goes on in the next
+
+	void push(const Event& event);
+};
+
+
+}
@@ -27,7 +27,7 @@ static void activateSignal(GtkApplication* app, void* objectsVoid)
 		// Create Phone object, which will run its main loop in the thread created below
 		objects->phone = new Phone();
 
-		// Create Window, which will handle output from and send input to Phone, synchronized via Phone.mutex
+		// Create Window, which will handle output from and send input to Phone through its lock-free queues
 		objects->window = new Window(objects->phone, app);
 
 		// Allow Window to respond to Phone activity
@@ -2,6 +2,7 @@
 	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
 */
 #include "Window.h"
+#include <cstdio>
 
 namespace tincan {
 
@@ -50,6 +51,11 @@ Window::Window(Phone* phone, GtkApplication* app)
 	gtk_text_view_set_left_margin(GTK_TEXT_VIEW(logview), SPACE);
 	gtk_text_view_set_right_margin(GTK_TEXT_VIEW(logview), SPACE);
 
+	// Create call statistics line, empty unless LIVE
+	stats = gtk_label_new(NULL);
+	gtk_widget_set_halign(stats, GTK_ALIGN_START);
+	gtk_box_pack_start(GTK_BOX(mainbox), stats, false, false, 0);
+
 	// Create bottom row of widgets
 	GtkContainer* bottom = GTK_CONTAINER(gtk_button_box_new(GTK_ORIENTATION_HORIZONTAL));
 	gtk_container_add(GTK_CONTAINER(mainbox), GTK_WIDGET(bottom));
@@ -154,12 +160,13 @@ void Window::updateLog()
 		gtk_text_buffer_get_end_iter(buffer, &bufferEnd);
 		gtk_text_buffer_insert(buffer, &bufferEnd, logs.c_str(), logs.size());
 		
-		// Remove old log lines
-		while (gtk_text_buffer_get_line_count(buffer) > LOG_MAX_LINES)
+		// Remove old log lines, all at once
+		int excess = gtk_text_buffer_get_line_count(buffer) - LOG_MAX_LINES;
+		if (excess > 0)
 		{
 			GtkTextIter lineStart, lineEnd;
 			gtk_text_buffer_get_iter_at_line(buffer, &lineStart, 0);
-			gtk_text_buffer_get_iter_at_line(buffer, &lineEnd, 1);
+			gtk_text_buffer_get_iter_at_line(buffer, &lineEnd, excess);
 			gtk_text_buffer_delete(buffer, &lineStart, &lineEnd);
 		}
 		
@@ -168,6 +175,29 @@ void Window::updateLog()
 	}
 }
 
+void Window::updateStats()
+{
+	const Phone::Status status = phone->getStatus();
+	const Phone::TransportStats& link = status.transport;
+
+	char text[256] = "";
+	if (status.state == Phone::LIVE && link.reportsReceived)
+	{
+		int len = snprintf(text, sizeof(text), "Round trip %.0fms     Loss %.1f%% in, %.1f%% out     Jitter %.1fms in, %.1fms out",
+		                   link.rttMs, link.lossPercent, link.sentLossPercent, link.jitterMs, link.sentJitterMs);
+		if (link.bitrate && len > 0 && size_t(len) < sizeof(text))
+			snprintf(text + len, sizeof(text) - len, "     Sending %.0fkbps", link.bitrate / 1000.0);
+	}
+	else if (status.state == Phone::LIVE)
+	{
+		// The peer doesn't send REPORTs (yet), so we only know about our side
+		snprintf(text, sizeof(text), "Lost %lu of %lu packets     Jitter %.1fms", link.lost, link.lost + link.received, link.jitterMs);
+	}
+
+	if (strcmp(text, gtk_label_get_text(GTK_LABEL(stats))))
+		gtk_label_set_text(GTK_LABEL(stats), text);
+}
+
 void Window::onCallSignal(GtkWidget*, gpointer windowVoid)
 {
 	Window* window = reinterpret_cast<Window*>(windowVoid);
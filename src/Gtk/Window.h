@@ -47,6 +47,7 @@ protected:
 	static gboolean onLogUpdateTimer(void* windowVoid)
 	{
 		reinterpret_cast<Window*>(windowVoid)->updateLog();
+		reinterpret_cast<Window*>(windowVoid)->updateStats();
 		
 		// Keep timer going
 		return TRUE;
@@ -55,6 +56,8 @@ protected:
 	void onUpdate();
 	
 	void updateLog();
+
+	void updateStats();
 	
 	static void onCallSignal(GtkWidget*, gpointer windowVoid);
 	
@@ -65,6 +68,7 @@ protected:
 	GtkApplication* app;
 	GtkWidget*      gtkwin;
 	GtkWidget*      logview;
+	GtkWidget*      stats;
 	GtkWidget*      addr;
 	GtkWidget*      call;
 	GtkWidget*      answerHangup;
@@ -0,0 +1,101 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "Impairment.h"
+#include "Clock.h"
+#include <algorithm>
+#include <cstdlib>
+
+namespace tincan {
+
+
+Impairment Impairment::parse(const string& spec)
+{
+	Impairment imp;
+	std::istringstream items(spec);
+	string item;
+	while (std::getline(items, item, ','))
+	{
+		const size_t eq = item.find('=');
+		const string key = item.substr(0, eq);
+		char* end = NULL;
+		const double value = (eq == string::npos) ? 0 : strtod(item.c_str() + eq + 1, &end);
+		if (eq == string::npos || end == item.c_str() + eq + 1 || *end || value < 0)
+			throw std::runtime_error("Invalid impairment " + item);
+
+		if (key == "loss")              imp.lossPercent = value;
+		else if (key == "burst-start")  imp.burstStartPercent = value;
+		else if (key == "burst-end")    imp.burstEndPercent = value;
+		else if (key == "burst-loss")   imp.burstLossPercent = value;
+		else if (key == "delay")        imp.delayMs = value;
+		else if (key == "jitter")       imp.jitterMs = value;
+		else if (key == "reorder")      imp.reorderPercent = value;
+		else if (key == "rate")         imp.rateKbps = value;
+		else if (key == "queue")        imp.queueMs = value;
+		else if (key == "seed")         imp.seed = uint32(value);
+		else throw std::runtime_error("Unknown impairment " + key);
+	}
+	return imp;
+}
+
+
+ImpairedLink::ImpairedLink(const Impairment& impairment)
+: config(impairment),
+  rng(impairment.seed * 0x9E3779B97F4A7C15ULL + 1), //Never 0, which xorshift can't leave
+  bad(false),
+  lastArrival(0),
+  queueFree(0)
+{
+}
+
+void ImpairedLink::reconfigure(const Impairment& impairment)
+{
+	config = impairment;
+}
+
+double ImpairedLink::uniform()
+{
+	// xorshift64*, so runs are the same on every platform
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return double((rng * 0x2545F4914F6CDD1DULL) >> 11) / double(1ULL << 53);
+}
+
+bool ImpairedLink::schedule(uint64 sendTime, uint size, uint64& arrivalTime)
+{
+	// The bottleneck comes first: wait behind whatever is queued, unless the queue is full
+	if (config.rateKbps > 0)
+	{
+		const uint64 start = std::max(sendTime, queueFree);
+		if (start - sendTime > uint64(config.queueMs * Clock::MS))
+			return false;
+		queueFree = start + uint64(size * 8 * 1000.0 / config.rateKbps); //Bits over kbps is ms, times 1000 for Clock units
+		sendTime = queueFree;
+	}
+
+	// Step the two-state chain once per packet, then lose the packet at the current state's rate
+	if (config.burstStartPercent > 0)
+		bad = bad ? !chance(config.burstEndPercent) : chance(config.burstStartPercent);
+
+	if (chance(bad ? config.burstLossPercent : config.lossPercent))
+		return false;
+
+	if (config.reorderPercent > 0 && chance(config.reorderPercent))
+	{
+		// Like netem, a reordered packet goes straight out, ahead of any still delayed
+		arrivalTime = sendTime;
+		return true;
+	}
+
+	double delayMs = config.delayMs;
+	if (config.jitterMs > 0)
+		delayMs += uniform() * config.jitterMs;
+
+	arrivalTime = std::max(sendTime + uint64(delayMs * Clock::MS), lastArrival);
+	lastArrival = arrivalTime;
+	return true;
+}
+
+
+}
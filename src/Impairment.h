@@ -0,0 +1,61 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+
+namespace tincan {
+
+
+// What a network path does to the packets sent over it, modelled on Linux netem
+struct Impairment
+{
+	double lossPercent;       //Chance each packet is lost, independently of the others
+	double burstStartPercent; //Gilbert-Elliott bursty loss: chance per packet of going from the good state to the bad one (0 = off)
+	double burstEndPercent;   //Chance per packet of going back from the bad state to the good one
+	double burstLossPercent;  //Loss while in the bad state (lossPercent applies in the good state)
+	double delayMs;           //One-way delay added to every packet
+	double jitterMs;          //Up to this much more delay at random; packets still arrive in order
+	double reorderPercent;    //Chance a packet skips the delay (and so overtakes the ones before it)
+	double rateKbps;          //Bottleneck like netem's rate: packets queue to go out one after another at this rate (0 = no limit)
+	double queueMs;           //Longest the bottleneck's queue gets; packets that would wait longer are dropped
+	uint32 seed;              //Same seed and packets, same fate for each packet
+
+	Impairment() : lossPercent(0), burstStartPercent(0), burstEndPercent(0), burstLossPercent(100),
+	               delayMs(0), jitterMs(0), reorderPercent(0), rateKbps(0), queueMs(500), seed(1)  {}
+
+	// From a command line spec of comma separated key=value: loss, burst-start, burst-end, burst-loss (percent),
+	// delay, jitter (ms), reorder (percent), rate (kbps), queue (ms) and seed; throws if it's invalid
+	static Impairment parse(const string& spec);
+};
+
+
+// Decides the fate of each packet sent in one direction of a path
+class ImpairedLink
+{
+public:
+	explicit ImpairedLink(const Impairment& impairment);
+
+	// Call for each packet in the order they're sent, times are in Clock units; size counts against rateKbps
+	// Returns false if the packet is lost, otherwise when it arrives
+	bool schedule(uint64 sendTime, uint size, uint64& arrivalTime);
+
+	// Change the impairment from now on; packets already queued or in flight keep their fate
+	void reconfigure(const Impairment& impairment);
+
+	bool isBursting() const  {return bad;}
+
+protected:
+	Impairment config;
+	uint64     rng;
+	bool       bad;         //Gilbert-Elliott state
+	uint64     lastArrival; //Of the last in-order packet, so jitter doesn't reorder
+	uint64     queueFree;   //When the bottleneck will have sent everything queued
+
+	double uniform(); //[0, 1)
+	bool   chance(double percent)  {return uniform() * 100.0 < percent;}
+};
+
+
+}
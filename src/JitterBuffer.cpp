@@ -0,0 +1,136 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "JitterBuffer.h"
+#include <cassert>
+#include <cmath>
+#include <algorithm>
+
+namespace tincan {
+
+
+JitterBuffer::JitterBuffer(uint capacity, uint maxPayload)
+: slots(capacity),
+  payloads(capacity * maxPayload),
+  maxPayload(maxPayload)
+{
+	assert(capacity >= 2);
+	reset(0, 1);
+}
+
+void JitterBuffer::reset(uint32 firstSeq, uint frameMs)
+{
+	for (size_t i = 0; i < slots.size(); ++i)
+		slots[i].size = 0;
+
+	next = firstSeq;
+	end = next;
+	frameUs = frameMs * 1000;
+	target = TARGET_MIN;
+	resyncSeq = 0;
+	haveTransit = false;
+	lastTransit = 0;
+	jitter = 0;
+	late = 0;
+	discarded = 0;
+}
+
+uint64 JitterBuffer::extend(uint32 seq) const
+{
+	// Pick the 64-bit seq closest to the newest one we've seen or expect (see RFC 3550 appendix A.1)
+	const uint64 reference = std::max(end, next);
+	const int32 delta = int32(seq - uint32(reference));
+	if (delta < 0 && uint64(-int64(delta)) > reference)
+		return 0; //Would be before the start of the stream
+	return reference + delta;
+}
+
+bool JitterBuffer::insert(uint32 seq, const byte* data, uint size, uint64 arrival)
+{
+	if (!size || size > maxPayload)
+	{
+		++discarded;
+		return false;
+	}
+
+	const uint64 ext = extend(seq);
+	if (ext < next)
+	{
+		++late;
+		return false;
+	}
+
+	if (ext >= next + slots.size())
+	{
+		// Too far ahead to fit: the sender kept going through an outage longer than we buffer, or the packet is
+		// corrupt or spoofed. Like RFC 3550 A.1's probation, only believe it once the next seq follows it
+		if (ext != resyncSeq)
+		{
+			resyncSeq = ext + 1;
+			++discarded;
+			return false;
+		}
+
+		// Rather than grow, drop what we have and resync so it plays after targetDelay() more packets
+		resyncSeq = 0;
+		for (size_t i = 0; i < slots.size(); ++i)
+			slots[i].size = 0;
+		discarded += buffered();
+		next = ext - std::min<uint64>(ext, target - 1);
+		end = next;
+		haveTransit = false;
+	}
+	else
+	{
+		updateJitter(ext, arrival);
+	}
+
+	Slot& slot = slots[ext % slots.size()];
+	if (slot.size && slot.seq == ext)
+	{
+		++discarded; //Duplicate
+		return false;
+	}
+
+	slot.seq = ext;
+	slot.size = size;
+	memcpy(&payloads[(ext % slots.size()) * maxPayload], data, size);
+
+	end = std::max(end, ext + 1);
+	return true;
+}
+
+const byte* JitterBuffer::get(uint64 seq, uint& size) const
+{
+	const Slot& slot = slots[seq % slots.size()];
+	if (!slot.size || slot.seq != seq)
+		return NULL;
+	size = slot.size;
+	return &payloads[(seq % slots.size()) * maxPayload];
+}
+
+void JitterBuffer::pop()
+{
+	slots[next % slots.size()].size = 0;
+	++next;
+}
+
+void JitterBuffer::updateJitter(uint64 seq, uint64 arrival)
+{
+	// Transit time relative to the sender's clock, which advances frameUs per seq
+	const int64 transit = int64(arrival) - int64(seq * frameUs);
+	if (haveTransit)
+	{
+		const double d = std::fabs(double(transit - lastTransit));
+		jitter += (d - jitter) / 16.0;
+	}
+	lastTransit = transit;
+	haveTransit = true;
+
+	// Enough packets to ride out JITTER_MULTIPLE times the mean deviation, plus the one playing
+	uint packets = 1 + uint(std::ceil(JITTER_MULTIPLE * jitter / frameUs));
+	target = std::max<uint>(TARGET_MIN, std::min<uint>(packets, uint(slots.size() / 2)));
+}
+
+
+}
@@ -0,0 +1,83 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+
+namespace tincan {
+
+
+// Fixed-capacity buffer of received AUDIO payloads, indexed by sequence number modulo capacity
+// Sequence numbers are extended to 64 bits so 32-bit wraparound is handled, and the playout delay
+// follows an RFC 3550 style estimate of the interarrival jitter
+class JitterBuffer
+{
+public:
+	JitterBuffer(uint capacity, uint maxPayload);
+
+	// Empty the buffer and start over expecting firstSeq, for packets of frameMs each
+	void reset(uint32 firstSeq, uint frameMs);
+
+	// Store a received payload; arrival is Clock::now() when it was received
+	// Returns FALSE if the packet was late, a duplicate or otherwise discarded
+	// A packet too far ahead to fit is discarded unless it follows the previous one that was, confirming the jump
+	bool insert(uint32 seq, const byte* data, uint size, uint64 arrival);
+
+	// The extended sequence number of the next packet to play
+	uint64 frontSeq() const  {return next;}
+
+	// Payload for an extended seq, or NULL if it hasn't arrived
+	const byte* get(uint64 seq, uint& size) const;
+
+	// Done with frontSeq(), whether it arrived or not
+	void pop();
+
+	// One past the newest seq received, frontSeq() until anything is
+	uint64 endSeq() const  {return end;}
+
+	// Packets from frontSeq() up to the newest received one, including any not yet arrived
+	uint buffered() const  {return (end > next) ? uint(end - next) : 0;}
+
+	// How many packets should be buffered before playing, given the measured jitter
+	uint targetDelay() const  {return target;}
+
+	double getJitterMs() const  {return jitter / 1000.0;}
+	ulong  getLateCount() const  {return late;}
+	ulong  getDiscardCount() const  {return discarded;}
+
+protected:
+	enum {
+		JITTER_MULTIPLE = 4, //Target delay covers this many times the mean jitter
+		TARGET_MIN = 2       //Never target less than this many packets
+	};
+
+	struct Slot
+	{
+		uint64 seq;
+		uint   size; //0 if empty
+	};
+
+	vector<Slot> slots;
+	vector<byte> payloads; //slots.size() * maxPayload bytes
+	uint   maxPayload;
+	uint64 next;
+	uint64 end;  //One past the newest seq received
+	uint   frameUs;
+	uint   target;
+	uint64 resyncSeq; //Extended seq that would confirm a jump too far ahead to fit, 0 if none is pending
+
+	// Jitter estimator, in microseconds
+	bool   haveTransit;
+	int64  lastTransit;
+	double jitter;
+
+	ulong  late;
+	ulong  discarded;
+
+	uint64 extend(uint32 seq) const;
+	void   updateJitter(uint64 seq, uint64 arrival);
+};
+
+
+}
@@ -0,0 +1,67 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+#include <ostream>
+#include <streambuf>
+
+namespace tincan {
+
+
+// An std::ostream that writes into a fixed-size buffer, so logging never allocates
+// Text that doesn't fit is dropped until reset()
+class LogStream : public std::ostream
+{
+public:
+	explicit LogStream(size_t capacity)
+	: std::ostream(NULL),
+	  buf(capacity)
+	{
+		rdbuf(&buf);
+	}
+
+	const char* data() const  {return buf.data();}
+	size_t      size() const  {return buf.size();}
+	bool        truncated() const  {return buf.truncated;}
+
+	// Empty the buffer and clear any error state from overflowing it
+	void reset()
+	{
+		buf.reset();
+		clear();
+	}
+
+protected:
+	class Buffer : public std::streambuf
+	{
+	public:
+		bool truncated;
+
+		explicit Buffer(size_t capacity) : storage(capacity)  {reset();}
+
+		const char* data() const  {return pbase();}
+		size_t      size() const  {return size_t(pptr() - pbase());}
+
+		void reset()
+		{
+			setp(&storage[0], &storage[0] + storage.size());
+			truncated = false;
+		}
+
+	protected:
+		int_type overflow(int_type)
+		{
+			truncated = true;
+			return traits_type::eof();
+		}
+
+		vector<char> storage;
+	};
+
+	Buffer buf;
+};
+
+
+}
@@ -0,0 +1,290 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "LoopbackNetwork.h"
+#include "Clock.h"
+#include <algorithm>
+
+namespace tincan {
+
+
+static uint64 addressKey(const sockaddr_storage& addr)
+{
+	if (addr.ss_family != AF_INET)
+		return 0;
+	const sockaddr_in& in = (const sockaddr_in&)addr;
+	return (uint64(ntohl(in.sin_addr.s_addr)) << 16) | ntohs(in.sin_port);
+}
+
+
+class LoopbackNetwork::Endpoint : public Transport
+{
+public:
+	Endpoint(LoopbackNetwork& network, const sockaddr_storage& address)
+	: network(network), address(address)  {}
+
+	~Endpoint()  {network.removeEndpoint(this);}
+
+	uint16 bind(uint16 firstPort, uint16 lastPort)
+	{
+		Scopelock lock(network.mutex);
+		sockaddr_in& in = (sockaddr_in&)address;
+		for (uint port = firstPort; port <= lastPort; ++port)
+		{
+			sockaddr_storage candidate = address;
+			((sockaddr_in&)candidate).sin_port = htons(port);
+			if (!network.findEndpoint(candidate))
+			{
+				in.sin_port = htons(port);
+				return port;
+			}
+		}
+		throw std::runtime_error("Could not find an available local port");
+	}
+
+	SOCKET getFd() const  {return arrived.getFd();}
+
+	int receive(DatagramBatch& batch)
+	{
+		Scopelock lock(network.mutex);
+		batch.clear();
+		while (!inbox.empty() && batch.count() < batch.capacity())
+		{
+			Datagram* dgram = inbox.front();
+			inbox.pop_front();
+
+			// Truncated to fit, as recvfrom would
+			const uint size = std::min(uint(dgram->data.size()), batch.bufferSize());
+			const uint i = batch.count();
+			memcpy(batch.add(dgram->from), dgram->data.data(), size);
+			batch.setSize(i, size);
+			batch.setTime(i, dgram->arrival);
+			delete dgram;
+		}
+
+		if (inbox.empty())
+			arrived.drain();
+		return int(batch.count());
+	}
+
+	int send(DatagramBatch& batch)
+	{
+		int sent = 0;
+		for (uint i = 0; i < batch.count(); ++i)
+		{
+			if (sendTo(batch.data(i), batch.size(i), batch.addr(i)) < 0)
+				break;
+			++sent;
+		}
+		batch.clear();
+		return sent;
+	}
+
+	int sendTo(const void* data, uint size, const sockaddr_storage& to)
+	{
+		return network.send(this, data, size, to);
+	}
+
+	LoopbackNetwork&      network;
+	sockaddr_storage      address; //Port is 0 until bound
+	std::deque<Datagram*> inbox;   //Guarded by network.mutex
+	Waker                 arrived; //Readable while inbox isn't empty
+};
+
+
+LoopbackNetwork::LoopbackNetwork(bool threaded)
+: sendCount(0),
+  threaded(threaded),
+  stopping(false)
+{
+	if (threaded)
+		thread.start(&deliveryThread, this);
+}
+
+LoopbackNetwork::~LoopbackNetwork()
+{
+	stopping = true;
+	waker.signal();
+	thread.join();
+
+	assert(endpoints.empty());
+	while (!inFlight.empty())
+	{
+		delete inFlight.top();
+		inFlight.pop();
+	}
+	for (std::map<LinkKey, Link*>::iterator it = links.begin(); it != links.end(); ++it)
+		delete it->second;
+}
+
+void LoopbackNetwork::setImpairment(const Impairment& config)
+{
+	Scopelock lock(mutex);
+	impairment = config;
+	for (std::map<LinkKey, Link*>::iterator it = links.begin(); it != links.end(); ++it)
+		it->second->impairment.reconfigure(linkImpairment(it->first));
+}
+
+// Call with mutex locked
+Impairment LoopbackNetwork::linkImpairment(const LinkKey& key) const
+{
+	// Give each direction its own random sequence so the two aren't correlated
+	Impairment config = impairment;
+	config.seed += uint32(key.first * 31 + key.second);
+	return config;
+}
+
+Transport* LoopbackNetwork::createEndpoint(const string& address)
+{
+	sockaddr_storage addr = {};
+	sockaddr_in& in = (sockaddr_in&)addr;
+	in.sin_family = AF_INET;
+	if (inet_pton(AF_INET, address.c_str(), &in.sin_addr) != 1)
+		throw std::runtime_error("Invalid IPv4 address " + address);
+
+	Endpoint* endpoint = new Endpoint(*this, addr);
+	Scopelock lock(mutex);
+	endpoints.push_back(endpoint);
+	return endpoint;
+}
+
+LoopbackNetwork::Stats LoopbackNetwork::getStats() const
+{
+	Scopelock lock(mutex);
+	return stats;
+}
+
+LoopbackNetwork::Endpoint* LoopbackNetwork::findEndpoint(const sockaddr_storage& addr)
+{
+	const uint64 key = addressKey(addr);
+	for (size_t i = 0; i < endpoints.size(); ++i)
+	{
+		if (addressKey(endpoints[i]->address) == key)
+			return endpoints[i];
+	}
+	return NULL;
+}
+
+int LoopbackNetwork::send(Endpoint* from, const void* data, uint size, const sockaddr_storage& to)
+{
+	const uint64 now = Clock::now();
+	Scopelock lock(mutex);
+	++stats.sent;
+
+	Endpoint* dest = findEndpoint(to);
+	if (!dest)
+	{
+		// Like UDP, nobody listening just means nothing arrives
+		++stats.lost;
+		return int(size);
+	}
+
+	const LinkKey key(addressKey(from->address), addressKey(to));
+	Link*& link = links[key];
+	if (!link)
+		link = new Link(linkImpairment(key));
+
+	const uint64 linkSeq = link->sent++;
+	uint64 arrival;
+	if (!link->impairment.schedule(now, size + HEADER_BYTES, arrival))
+	{
+		++stats.lost;
+		return int(size);
+	}
+
+	Datagram* dgram = new Datagram;
+	dgram->arrival = arrival;
+	dgram->order = sendCount++;
+	dgram->linkSeq = linkSeq;
+	dgram->to = dest;
+	dgram->from = from->address;
+	dgram->data.assign((const byte*)data, (const byte*)data + size);
+
+	const bool earliest = inFlight.empty() || arrival < inFlight.top()->arrival;
+	inFlight.push(dgram);
+	lock.unlock();
+
+	if (earliest && threaded)
+		waker.signal();
+	return int(size);
+}
+
+void LoopbackNetwork::removeEndpoint(Endpoint* endpoint)
+{
+	Scopelock lock(mutex);
+	endpoints.erase(std::remove(endpoints.begin(), endpoints.end(), endpoint), endpoints.end());
+
+	for (size_t i = 0; i < endpoint->inbox.size(); ++i)
+		delete endpoint->inbox[i];
+
+	// Drop anything still on its way there
+	InFlight remaining;
+	while (!inFlight.empty())
+	{
+		Datagram* dgram = inFlight.top();
+		inFlight.pop();
+		if (dgram->to == endpoint)
+			delete dgram;
+		else
+			remaining.push(dgram);
+	}
+	inFlight.swap(remaining);
+}
+
+void LoopbackNetwork::deliveryThread(void* network)
+{
+	reinterpret_cast<LoopbackNetwork*>(network)->runDelivery();
+}
+
+uint64 LoopbackNetwork::deliver()
+{
+	assert(!threaded);
+	Scopelock lock(mutex);
+	return deliverDue(Clock::now());
+}
+
+// Call with mutex locked
+uint64 LoopbackNetwork::deliverDue(uint64 now)
+{
+	while (!inFlight.empty() && inFlight.top()->arrival <= now)
+	{
+		Datagram* dgram = inFlight.top();
+		inFlight.pop();
+
+		Link* link = links[LinkKey(addressKey(dgram->from), addressKey(dgram->to->address))];
+		if (dgram->linkSeq < link->nextExpected)
+			++stats.reordered;
+		else
+			link->nextExpected = dgram->linkSeq + 1;
+		++stats.delivered;
+
+		dgram->to->inbox.push_back(dgram);
+		dgram->to->arrived.signal();
+	}
+
+	return inFlight.empty() ? 0 : inFlight.top()->arrival;
+}
+
+void LoopbackNetwork::runDelivery()
+{
+	while (!stopping)
+	{
+		int timeoutMs = -1;
+		{
+			const uint64 now = Clock::now();
+			Scopelock lock(mutex);
+			const uint64 next = deliverDue(now);
+			if (next)
+				timeoutMs = int((next - now + Clock::MS - 1) / Clock::MS);
+		}
+
+		pollfd fds[1] = {};
+		fds[0].fd = waker.getFd();
+		fds[0].events = POLLIN;
+		if (Socket::poll(fds, 1, timeoutMs) > 0)
+			waker.drain();
+	}
+}
+
+
+}
@@ -0,0 +1,109 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+#include "Impairment.h"
+#include "Mutex.h"
+#include "Thread.h"
+#include "Transport.h"
+#include <atomic>
+#include <deque>
+#include <map>
+#include <queue>
+
+namespace tincan {
+
+
+// An in-process IPv4 network for tests and benchmarks: each endpoint is a Transport with its own
+// address, and every datagram between two endpoints goes through an ImpairedLink for that direction
+class LoopbackNetwork
+{
+public:
+	enum { HEADER_BYTES = 28 }; //IPv4 and UDP headers, which count against Impairment::rateKbps like on a real link
+
+	struct Stats
+	{
+		ulong sent;
+		ulong lost;      //Dropped by the impairment, or sent to an address nobody has bound
+		ulong reordered; //Arrived before a packet sent earlier on the same link
+		ulong delivered;
+		Stats() : sent(0), lost(0), reordered(0), delivered(0)  {}
+	};
+
+	// Without a thread nothing arrives until deliver() is called, for simulations on a virtual Clock
+	explicit LoopbackNetwork(bool threaded = true);
+	~LoopbackNetwork(); //Delete all endpoints first
+
+	// Applies to links used from now on, and changes any already in use, keeping their queues and random sequences
+	void setImpairment(const Impairment& impairment);
+
+	// A Transport at the given dotted IPv4 address, for Phone::setTransport (which takes ownership)
+	Transport* createEndpoint(const string& address);
+
+	Stats getStats() const;
+
+	// Unthreaded: hand over everything due by Clock::now(), then return when the next datagram is due (0 if none are in flight)
+	uint64 deliver();
+
+protected:
+	class Endpoint;
+
+	struct Datagram
+	{
+		uint64           arrival;
+		uint64           order;    //Breaks ties in arrival, so the queue keeps send order
+		uint64           linkSeq;
+		Endpoint*        to;
+		sockaddr_storage from;
+		vector<byte>     data;
+	};
+
+	struct LaterArrival
+	{
+		bool operator () (const Datagram* lhs, const Datagram* rhs) const
+		{
+			return lhs->arrival != rhs->arrival ? lhs->arrival > rhs->arrival : lhs->order > rhs->order;
+		}
+	};
+
+	struct Link
+	{
+		ImpairedLink impairment;
+		uint64       sent;
+		uint64       nextExpected; //Sequence after the highest delivered so far
+		explicit Link(const Impairment& config) : impairment(config), sent(0), nextExpected(0)  {}
+	};
+
+	typedef std::pair<uint64, uint64> LinkKey; //Source and destination, address and port
+	typedef std::priority_queue<Datagram*, vector<Datagram*>, LaterArrival> InFlight;
+
+	// Everything below is guarded by mutex
+	mutable Mutex             mutex;
+	Impairment                impairment;
+	vector<Endpoint*>         endpoints;
+	std::map<LinkKey, Link*>  links;
+	InFlight                  inFlight;
+	uint64                    sendCount;
+	Stats                     stats;
+
+	bool                      threaded;
+	Thread                    thread;
+	Waker                     waker;  //Something new is in flight, or we're stopping
+	std::atomic<bool>         stopping;
+
+	Endpoint* findEndpoint(const sockaddr_storage& addr);
+	Impairment linkImpairment(const LinkKey& key) const;
+	int       send(Endpoint* from, const void* data, uint size, const sockaddr_storage& to);
+	void      removeEndpoint(Endpoint* endpoint);
+	uint64    deliverDue(uint64 now);
+	static void deliveryThread(void* network);
+	void      runDelivery();
+
+	LoopbackNetwork(const LoopbackNetwork&);
+	LoopbackNetwork& operator = (const LoopbackNetwork&);
+};
+
+
+}
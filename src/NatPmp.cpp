@@ -0,0 +1,417 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "NatPmp.h"
+#include "Clock.h"
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef _WIN32
+#	include <iphlpapi.h>
+#	include <bcrypt.h>
+#	ifdef _MSC_VER
+#		pragma comment(lib, "iphlpapi.lib")
+#		pragma comment(lib, "bcrypt.lib")
+#	endif
+#endif
+
+namespace tincan {
+
+
+/*
+	Wire formats, all big-endian. NAT-PMP (version 0):
+	  external address request: version, opcode 0
+	  external address reply:   version, opcode 128, result(16), epoch(32), address(32)
+	  mapping request:          version, opcode 1 UDP/2 TCP, reserved(16), internal port(16), external port(16), lifetime(32)
+	  mapping reply:            version, opcode 128+op, result(16), epoch(32), internal port(16), external port(16), lifetime(32)
+	PCP (version 2), with a 24 byte common header:
+	  request: version, opcode, reserved(16), lifetime(32), client address(128)
+	  reply:   version, 128+opcode, reserved(8), result(8), lifetime(32), epoch(32), reserved(96)
+	  MAP adds: nonce(96), protocol(8), reserved(24), internal port(16), external port(16), external address(128)
+	IPv4 addresses in PCP are IPv4-mapped IPv6 (::ffff:a.b.c.d).
+*/
+enum {
+	NATPMP_VERSION = 0,
+	NATPMP_OP_ADDRESS = 0,
+	NATPMP_OP_MAP_UDP = 1,
+	NATPMP_OP_MAP_TCP = 2,
+	NATPMP_ADDRESS_REPLY_SIZE = 12,
+	NATPMP_MAP_REQUEST_SIZE = 12,
+	NATPMP_MAP_REPLY_SIZE = 16,
+	NATPMP_UNSUPP_VERSION = 1,
+
+	PCP_VERSION = 2,
+	PCP_OP_ANNOUNCE = 0,
+	PCP_OP_MAP = 1,
+	PCP_RESPONSE = 0x80,
+	PCP_HEADER_SIZE = 24,
+	PCP_MAP_SIZE = 60,
+	PCP_PROTO_TCP = 6,
+	PCP_PROTO_UDP = 17,
+
+	REPLY_MAX = 1100 //Largest PCP message
+};
+
+static void put16(byte* p, uint16 v)  {p[0] = byte(v >> 8); p[1] = byte(v);}
+static void put32(byte* p, uint32 v)  {put16(p, uint16(v >> 16)); put16(p + 2, uint16(v));}
+static uint16 get16(const byte* p)  {return uint16((p[0] << 8) | p[1]);}
+static uint32 get32(const byte* p)  {return (uint32(get16(p)) << 16) | get16(p + 2);}
+
+static void putMappedIPv4(byte* p, in_addr addr)
+{
+	memset(p, 0, 10);
+	p[10] = p[11] = 0xff;
+	memcpy(p + 12, &addr, 4);
+}
+
+static void putPcpHeader(byte* p, uint8 opcode, uint32 lifetime, in_addr client)
+{
+	p[0] = PCP_VERSION;
+	p[1] = opcode;
+	put16(p + 2, 0);
+	put32(p + 4, lifetime);
+	putMappedIPv4(p + 8, client);
+}
+
+static string natPmpResultString(uint16 result)
+{
+	switch (result)
+	{
+	case 1:  return "unsupported version";
+	case 2:  return "not authorized";
+	case 3:  return "network failure";
+	case 4:  return "out of resources";
+	case 5:  return "unsupported opcode";
+	default: return toString(result);
+	}
+}
+
+static string pcpResultString(uint8 result)
+{
+	switch (result)
+	{
+	case 1:  return "unsupported version";
+	case 2:  return "not authorized";
+	case 3:  return "malformed request";
+	case 4:  return "unsupported opcode";
+	case 5:  return "unsupported option";
+	case 6:  return "malformed option";
+	case 7:  return "network failure";
+	case 8:  return "no resources";
+	case 9:  return "unsupported protocol";
+	case 10: return "user exceeded quota";
+	case 11: return "cannot provide external";
+	case 12: return "address mismatch";
+	case 13: return "excessive remote peers";
+	default: return toString(result);
+	}
+}
+
+
+NatPmp::NatPmp(int timeoutMs, const sockaddr_in* gateway)
+: sock(-1),
+  timeoutMs(timeoutMs),
+  pcp(false),
+  mappedLocalPort(0),
+  mappedPort(0),
+  mappedProto(MAP_UDP),
+  renewTime(0)
+{
+	wanAddr[0] = '\0';
+
+	// PCP's mapping nonce: only a host that can't guess it is kept from hijacking or deleting our mapping
+	randomBytes(nonce, sizeof(nonce));
+
+	sockaddr_in gatewayAddr;
+	if (gateway)
+		gatewayAddr = *gateway;
+	else if (!getDefaultGateway(gatewayAddr))
+		throw std::runtime_error("Could not find the default gateway");
+
+	// Connecting means we only hear from the gateway, and tells us our address on its network
+	sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock == -1)
+		throw std::runtime_error("Failed to create socket");
+
+	sockaddr_in local;
+	socklen_t localLen = sizeof(local);
+	if (connect(sock, (sockaddr*)&gatewayAddr, sizeof(gatewayAddr)) ||
+	    getsockname(sock, (sockaddr*)&local, &localLen))
+	{
+		string error = Socket::getErrorString();
+		Socket::close(sock);
+		throw std::runtime_error("Could not reach the gateway: " + error);
+	}
+	localAddr = local.sin_addr;
+
+	// Ask in both protocols at once, since some NAT-PMP gateways ignore PCP rather than answering "unsupported version"
+	byte announce[PCP_HEADER_SIZE];
+	putPcpHeader(announce, PCP_OP_ANNOUNCE, 0, localAddr);
+
+	byte address[2] = { NATPMP_VERSION, NATPMP_OP_ADDRESS };
+
+	const byte* requests[2] = { announce, address };
+	const uint sizes[2] = { sizeof(announce), sizeof(address) };
+
+	byte reply[REPLY_MAX];
+	uint size;
+	try
+	{
+		size = transact(requests, sizes, 2, reply, sizeof(reply));
+	}
+	catch (...)
+	{
+		Socket::close(sock);
+		throw;
+	}
+
+	if (reply[0] == PCP_VERSION && reply[1] == (PCP_RESPONSE | PCP_OP_ANNOUNCE) && size >= PCP_HEADER_SIZE && reply[3] == 0)
+	{
+		// PCP only tells us the WAN address once we have a mapping
+		pcp = true;
+	}
+	else if (reply[0] == NATPMP_VERSION && reply[1] == (PCP_RESPONSE | NATPMP_OP_ADDRESS) && size >= NATPMP_ADDRESS_REPLY_SIZE && get16(reply + 2) == 0)
+	{
+		in_addr wan;
+		memcpy(&wan, reply + 8, 4);
+		inet_ntop(AF_INET, &wan, wanAddr, sizeof(wanAddr));
+	}
+	else
+	{
+		Socket::close(sock);
+		if (reply[0] == PCP_VERSION)
+			throw std::runtime_error("PCP error: " + pcpResultString(reply[3]));
+		else
+			throw std::runtime_error("NAT-PMP error: " + natPmpResultString(get16(reply + 2)));
+	}
+}
+
+void NatPmp::randomBytes(byte* out, size_t size)
+{
+#ifdef _WIN32
+	if (BCryptGenRandom(NULL, out, ULONG(size), BCRYPT_USE_SYSTEM_PREFERRED_RNG) != 0)
+		throw std::runtime_error("BCryptGenRandom failed");
+#else
+	FILE* random = fopen("/dev/urandom", "rb");
+	const bool ok = random && fread(out, 1, size, random) == size;
+	if (random)
+		fclose(random);
+	if (!ok)
+		throw std::runtime_error("Could not read /dev/urandom");
+#endif
+}
+
+NatPmp::~NatPmp()
+{
+	try {
+		clearPortMapping();
+	} catch (...) {
+		// Discard exceptions
+	}
+
+	Socket::close(sock);
+}
+
+bool NatPmp::setPortMapping(uint16 localPort, uint16 wanPort, MapProto protocol, const char*)
+{
+	assert(protocol == MAP_TCP || protocol == MAP_UDP);
+	assert(localPort >= 1024 && wanPort >= 1024);
+
+	// Both protocols pick another port rather than fail if wanPort is taken, so this never returns FALSE
+	map(localPort, wanPort, protocol, LIFETIME);
+	return true;
+}
+
+void NatPmp::clearPortMapping()
+{
+	if (!mappedPort)
+		return;
+
+	// A zero lifetime deletes the mapping
+	map(mappedLocalPort, 0, mappedProto, 0);
+	mappedPort = 0;
+	renewTime = 0;
+}
+
+void NatPmp::renewPortMapping()
+{
+	if (!mappedPort)
+		return;
+
+	// Asking again for the port we have extends it; if this fails we try again soon, well before it lapses
+	renewTime = Clock::now() + uint64(RENEW_RETRY) * 1000 * Clock::MS;
+	map(mappedLocalPort, mappedPort, mappedProto, LIFETIME);
+}
+
+void NatPmp::map(uint16 localPort, uint16 wanPort, MapProto protocol, uint32 lifetime)
+{
+	byte request[PCP_MAP_SIZE];
+	byte reply[REPLY_MAX];
+	uint size;
+	uint32 granted; //The gateway may grant a shorter lifetime than we asked for
+
+	if (pcp)
+	{
+		putPcpHeader(request, PCP_OP_MAP, lifetime, localAddr);
+		byte* op = request + PCP_HEADER_SIZE;
+		memcpy(op, nonce, sizeof(nonce));
+		op[12] = (protocol == MAP_TCP) ? PCP_PROTO_TCP : PCP_PROTO_UDP;
+		op[13] = op[14] = op[15] = 0;
+		put16(op + 16, localPort);
+		put16(op + 18, wanPort);
+		in_addr any = {};
+		putMappedIPv4(op + 20, any);
+
+		const byte* requests[1] = { request };
+		const uint sizes[1] = { PCP_MAP_SIZE };
+		size = transact(requests, sizes, 1, reply, sizeof(reply));
+
+		if (size < PCP_MAP_SIZE || reply[0] != PCP_VERSION || reply[1] != (PCP_RESPONSE | PCP_OP_MAP) ||
+		    memcmp(reply + PCP_HEADER_SIZE, nonce, sizeof(nonce)))
+			throw std::runtime_error("Invalid PCP reply");
+		if (reply[3])
+			throw std::runtime_error("PCP error: " + pcpResultString(reply[3]));
+
+		granted = get32(reply + 4);
+		if (lifetime)
+		{
+			mappedPort = get16(reply + PCP_HEADER_SIZE + 18);
+			inet_ntop(AF_INET, reply + PCP_HEADER_SIZE + 20 + 12, wanAddr, sizeof(wanAddr));
+		}
+	}
+	else
+	{
+		const byte opcode = (protocol == MAP_TCP) ? NATPMP_OP_MAP_TCP : NATPMP_OP_MAP_UDP;
+		request[0] = NATPMP_VERSION;
+		request[1] = opcode;
+		put16(request + 2, 0);
+		put16(request + 4, localPort);
+		put16(request + 6, wanPort);
+		put32(request + 8, lifetime);
+
+		const byte* requests[1] = { request };
+		const uint sizes[1] = { NATPMP_MAP_REQUEST_SIZE };
+		size = transact(requests, sizes, 1, reply, sizeof(reply));
+
+		if (size < NATPMP_MAP_REPLY_SIZE || reply[0] != NATPMP_VERSION || reply[1] != (PCP_RESPONSE | opcode))
+			throw std::runtime_error("Invalid NAT-PMP reply");
+		if (get16(reply + 2))
+			throw std::runtime_error("NAT-PMP error: " + natPmpResultString(get16(reply + 2)));
+
+		granted = get32(reply + 12);
+		if (lifetime)
+			mappedPort = get16(reply + 10);
+	}
+
+	if (lifetime)
+		renewTime = Clock::now() + uint64(std::max<uint32>(granted / 2, 1)) * 1000 * Clock::MS;
+
+	mappedLocalPort = localPort;
+	mappedProto = protocol;
+}
+
+uint NatPmp::transact(const byte* const* requests, const uint* sizes, uint count, byte* reply, uint replySize)
+{
+	const uint64 deadline = Clock::now() + uint64(timeoutMs) * Clock::MS;
+	int interval = RETRANSMIT_MS;
+
+	for (;;)
+	{
+		for (uint i = 0; i < count; ++i)
+			::send(sock, (const char*)requests[i], sizes[i], 0);
+
+		// Wait for a reply until it's time to retransmit
+		const uint64 retransmit = std::min(deadline, Clock::now() + uint64(interval) * Clock::MS);
+		for (;;)
+		{
+			const uint64 now = Clock::now();
+			if (now >= retransmit)
+				break;
+
+			pollfd fd = {};
+			fd.fd = sock;
+			fd.events = POLLIN;
+			int ready = Socket::poll(&fd, 1, int((retransmit - now + Clock::MS - 1) / Clock::MS));
+			if (ready < 0 && Socket::getError() != EINTR)
+				throw std::runtime_error("poll error: " + Socket::getErrorString());
+			if (ready <= 0)
+				continue;
+
+			int size = ::recv(sock, (char*)reply, replySize, 0);
+			if (size < 0)
+			{
+				// An ICMP port unreachable means nothing is listening, no point waiting any longer
+				if (Socket::getError() == ECONNREFUSED || Socket::getError() == ECONNRESET)
+					throw std::runtime_error("The gateway does not support NAT-PMP or PCP");
+				throw std::runtime_error("recv error: " + Socket::getErrorString());
+			}
+
+			// Ignore anything that isn't a reply, or is a late reply to an earlier request
+			if (size < 4 || !(reply[1] & PCP_RESPONSE))
+				continue;
+
+			bool matched = false;
+			for (uint i = 0; i < count; ++i)
+				matched = matched || (reply[0] == requests[i][0] && reply[1] == (PCP_RESPONSE | requests[i][1]));
+
+			// "Unsupported version" comes back as NAT-PMP whatever we sent
+			if (reply[0] == NATPMP_VERSION && get16(reply + 2) == NATPMP_UNSUPP_VERSION)
+			{
+				// With several requests out, another one may still get an answer
+				if (count > 1)
+					continue;
+				matched = true;
+			}
+
+			if (matched)
+				return uint(size);
+		}
+
+		if (Clock::now() >= deadline)
+			throw std::runtime_error("The gateway did not answer NAT-PMP or PCP");
+		interval *= 2;
+	}
+}
+
+bool NatPmp::getDefaultGateway(sockaddr_in& gateway)
+{
+	memset(&gateway, 0, sizeof(gateway));
+	gateway.sin_family = AF_INET;
+	gateway.sin_port = htons(PORT);
+
+#if defined(_WIN32)
+	// Route to 0.0.0.0 is the default route
+	MIB_IPFORWARDROW route;
+	if (GetBestRoute(0, 0, &route) != NO_ERROR || !route.dwForwardNextHop)
+		return false;
+	gateway.sin_addr.s_addr = route.dwForwardNextHop;
+	return true;
+#elif defined(__linux__)
+	// Columns are: Iface Destination Gateway Flags ..., with addresses in host order hex
+	FILE* routes = fopen("/proc/net/route", "r");
+	if (!routes)
+		return false;
+
+	bool found = false;
+	char line[256];
+	while (!found && fgets(line, sizeof(line), routes))
+	{
+		char iface[64];
+		unsigned long dest, gw, flags;
+		if (sscanf(line, "%63s %lx %lx %lx", iface, &dest, &gw, &flags) == 4 && dest == 0 && (flags & 0x2)) //RTF_GATEWAY
+		{
+			gateway.sin_addr.s_addr = uint32(gw);
+			found = true;
+		}
+	}
+
+	fclose(routes);
+	return found;
+#else
+	return false;
+#endif
+}
+
+
+}
@@ -0,0 +1,68 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+#include "PortMapper.h"
+#include "Socket.h"
+
+namespace tincan {
+
+
+// Represents a router accessible via PCP (RFC 6887), or NAT-PMP (RFC 6886) which PCP grew out of
+// Both are a UDP request/response with the default gateway, so there is no multicast discovery to wait out
+class NatPmp : public PortMapper
+{
+public:
+	enum {
+		PORT = 5351,              //Where the gateway listens for both protocols
+		LIFETIME = 7200,          //Seconds we ask the gateway to keep a mapping, as RFC 6886 recommends
+		RENEW_RETRY = 60,         //Seconds before trying again after a renewal fails
+		RETRANSMIT_MS = 250       //First retransmit interval, doubled after each try
+	};
+
+	// Finds out which protocol the gateway speaks, throws if it answers neither within timeoutMs
+	// If gateway is NULL the system's default IPv4 gateway is used
+	NatPmp(int timeoutMs, const sockaddr_in* gateway = NULL);
+	~NatPmp();
+
+	// Returns FALSE if there is no default IPv4 gateway
+	static bool getDefaultGateway(sockaddr_in& gateway);
+
+	// Implement PortMapper
+	const char* getName() const  {return pcp ? "PCP" : "NAT-PMP";}
+	string getWanAddress() const  {return wanAddr;}
+	bool setPortMapping(uint16 localPort, uint16 wanPort, MapProto protocol, const char* descript);
+	uint16 getMappedPort() const  {return mappedPort;}
+	void clearPortMapping();
+	uint64 getRenewTime() const  {return renewTime;}
+	void renewPortMapping();
+
+protected:
+	SOCKET      sock;
+	int         timeoutMs;
+	bool        pcp;
+	in_addr     localAddr;  //Our address as the gateway sees it, which PCP requests must include
+	char        wanAddr[INET_ADDRSTRLEN];
+	byte        nonce[12];  //PCP mapping nonce, so only we can renew or delete it
+	uint16      mappedLocalPort;
+	uint16      mappedPort;
+	MapProto    mappedProto;
+	uint64      renewTime;  //Half the lifetime the gateway granted, as both RFCs recommend; 0 without a mapping
+
+	// Send a request until a reply comes back, retransmitting as the RFCs describe; throws on timeout
+	// Several requests can be sent at once, and the first reply to any of them is returned
+	uint transact(const byte* const* requests, const uint* sizes, uint count, byte* reply, uint replySize);
+
+	void map(uint16 localPort, uint16 wanPort, MapProto protocol, uint32 lifetime);
+
+	// From the OS's cryptographic random source; throws if it can't be read
+	static void randomBytes(byte* out, size_t size);
+
+	NatPmp(const NatPmp&);
+	NatPmp& operator = (const NatPmp&);
+};
+
+
+}
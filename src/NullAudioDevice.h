@@ -0,0 +1,27 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+#include "TimerAudioDevice.h"
+
+namespace tincan {
+
+
+// Captures silence and throws away playout, at the pace of a real sound card
+class NullAudioDevice : public TimerAudioDevice
+{
+public:
+	~NullAudioDevice()  {stop();}
+
+	string getInputName() const   {return "null";}
+	string getOutputName() const  {return "null";}
+
+protected:
+	void capture(int16* buffer, ulong frames)  {memset(buffer, 0, frames * sizeof(int16));}
+	void play(const int16*, ulong)  {}
+};
+
+
+}
@@ -2,6 +2,9 @@
 	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
 */
 #include "Phone.h"
+#include "PortAudioDevice.h"
+#include "UdpTransport.h"
+#include <cassert>
 #include <cmath>
 #include <limits>
 #include <algorithm>
@@ -16,84 +19,260 @@ int Phone::mainLoop() throw()
 		startup();
 
 		while ( run() )
-			continue;
+			waitForEvents();
 	}
 	catch (std::exception& ex)
 	{
-		Scopelock lock(mutex);
-		stateOut = state = EXCEPTION;
 		errorMessage = ex.what();
-		if (updateHandler)
-			updateHandler->sendUpdate();
+		state = EXCEPTION;
+		publishOutput();
 		return 1;
 	}
 	catch (...)
 	{
-		Scopelock lock(mutex);
-		stateOut = state = EXCEPTION;
 		errorMessage = "Unknown exception";
-		if (updateHandler)
-			updateHandler->sendUpdate();
+		state = EXCEPTION;
+		publishOutput();
 		return 1;
 	}
 	
-	Scopelock lock(mutex);
-	stateOut = state = EXITED;
+	state = EXITED;
+	publishOutput();
 	return 0;
 }
 
 Phone::Phone()
-: commandIn(CMD_NONE),
-  stateOut(STARTING),
+: commandsIn(COMMAND_QUEUE_SIZE),
+  events(EVENT_LOG_CAPACITY),
+  updateHandler(NULL),
+  log(LOG_CAPACITY),
   state(STARTING),
+  publishedState(STARTING),
   address(),
-  router(NULL),
-  sock(-1),
-  encoder(NULL),
-  decoder(NULL),
-  stream(NULL)
+  audiobuf(JITTER_BUFFER_PACKETS, ENCODED_MAX_BYTES),
+  firstSeq(1),
+  frameSamples(PACKET_SAMPLES),
+  commandCount(0),
+  callCount(0),
+  connectedCount(0),
+  fecRecovered(0),
+  concealed(0),
+  skippedPackets(0),
+  stretcher(STRETCH_HOP, STRETCH_TOLERANCE, STRETCH_CAPACITY),
+  reportDeadline(0),
+  receivedPackets(0),
+  expectedPrior(0),
+  receivedPrior(0),
+  peerTimestamp(0),
+  peerReportTime(0),
+  transitBase(0),
+  transitSum(0),
+  transitCount(0),
+  adaptiveBitrate(true),
+  peerHighestSeq(0),
+  mappingState(MAPPING_NONE),
+  startupTime(0),
+  startupReported(false),
+  localPort(0),
+  portMapping(true),
+  portMapper(NULL),
+  transport(NULL),
+  transportDeadline(0),
+  recvBatch(RECV_BATCH_PACKETS, sizeof(Packet) + TRANSPORT_HEADER_MAX),
+  sendBatch(SEND_BATCH_PACKETS, sizeof(Packet) + TRANSPORT_HEADER_MAX),
+  encoderMem(opus_encoder_get_size(CHANNELS)),
+  decoderMem(opus_decoder_get_size(CHANNELS)),
+  encoder(reinterpret_cast<OpusEncoder*>(&encoderMem[0])),
+  decoder(reinterpret_cast<OpusDecoder*>(&decoderMem[0])),
+  encoderApplication(0),
+  connectMs(0),
+  audio(NULL),
+  audioMode(AUDIO_CALLBACK),
+  outputPrimed(false),
+  streamUse(STREAM_IDLE),
+  captureRing(AUDIO_RING_PACKETS * PACKET_SAMPLES_MAX),
+  playoutRing(AUDIO_RING_PACKETS * PACKET_SAMPLES_MAX),
+  playoutStart(0),
+  underruns(0),
+  overruns(0),
+  captureTime(0),
+  latencySum(0),
+  latencyMax(0),
+  latencyCount(0)
 {
-	// Init portaudio
-	PaError paErr = Pa_Initialize();
-	if (paErr)
-		throw std::runtime_error(string("Could not start audio. Pa_Initialize error: ") + Pa_GetErrorText(paErr));
 }
 
 Phone::~Phone()
 {
-	// Close audio stream (ignore errors)
-	if (stream)
-		Pa_CloseStream(stream);
+	// Wait for any startup phases still running in the background
+	audioStartup.thread.join();
+	upnpStartup.thread.join();
+	natpmpStartup.thread.join();
+	renewal.thread.join();
 
-	// Cleanup opus
-	if (decoder)
-		opus_decoder_destroy(decoder);
-	if (encoder)
-		opus_encoder_destroy(encoder);
+	// Stop audio, so the callback is done with us
+	delete audio;
 
-	// Close socket (ignore errors)
-	if (sock != -1)
-		Socket::close(sock);
+	// Close socket
+	delete transport;
 
 	// Cleanup UPnP
-	delete router;
-	
-	// Cleanup portaudio (ignore errors)
-	Pa_Terminate();
+	delete portMapper;
+	delete upnpStartup.mapper;
+	delete natpmpStartup.mapper;
 }
 
 void Phone::startup()
 {
+	startupTime = Clock::now();
+
+	static const char startingMsg[] = "Starting up, please wait...";
+	events.writeText(startingMsg, sizeof(startingMsg) - 1);
+	if (updateHandler)
+		updateHandler->sendUpdate();
+
+	// Audio isn't needed until a call rings, so initialize it in the background
+	// (but not in a simulation, where nothing can happen outside the virtual clock)
+	if (Clock::isVirtual())
 	{
-		Scopelock lock(mutex);
-		logOut += "Starting up, please wait...\n";
-		if (updateHandler)
-			updateHandler->sendUpdate();
+		audioStartupTask(this);
+		reportAudioStartup();
+	}
+	else
+	{
+		audioStartup.thread.start(&audioStartupTask, this);
 	}
 
 
-	// Generate sound buffers
-	
+	generateTones();
+
+
+	// Initialize opus now, so going LIVE only has to reset it
+	initEncoder(OPUS_APPLICATION_VOIP);
+	int opusErr = opus_decoder_init(decoder, SAMPLE_RATE, CHANNELS);
+	if (opusErr != OPUS_OK)
+		throw std::runtime_error(string("opus_decoder_init error: ") + opus_strerror(opusErr));
+
+
+	// Bind local port
+	if (!transport)
+		transport = new UdpTransport();
+	localPort = transport->bind(PORT_DEFAULT, PORT_MAX);
+	startupTimes.socketMs = double(Clock::now() - startupTime) / Clock::MS;
+
+
+	// Open WAN port in the background, since UPnP discovery can take seconds
+	// NAT-PMP/PCP is a single request to the gateway, so when the router speaks it we're done much sooner
+	if (portMapping)
+	{
+		upnpStartup.thread.start(&upnpStartupTask, this);
+		natpmpStartup.thread.start(&natpmpStartupTask, this);
+	}
+
+
+	// LAN calls work from here on
+	state = HUNGUP;
+	startupTimes.readyMs = double(Clock::now() - startupTime) / Clock::MS;
+	log << "Ready for calls on local port " << localPort << (portMapping ? ", looking for router..." : "") << endl;
+}
+
+void Phone::audioStartupTask(void* phoneVoid)
+{
+	Phone* phone = reinterpret_cast<Phone*>(phoneVoid);
+
+	try
+	{
+		// PortAudio probes every device on some backends, which is slow enough to keep off the Phone thread,
+		// and so is opening the stream, so do it once here rather than every time a call rings or connects
+		if (!phone->audio)
+			phone->audio = new PortAudioDevice();
+		phone->openAudioStream();
+	}
+	catch (std::exception& ex)
+	{
+		phone->audioStartup.error = ex.what();
+	}
+
+	phone->audioStartup.ms = double(Clock::now() - phone->startupTime) / Clock::MS;
+	phone->audioStartup.done = true;
+	phone->waker.signal();
+}
+
+void Phone::upnpStartupTask(void* phoneVoid)
+{
+	Phone* phone = reinterpret_cast<Phone*>(phoneVoid);
+
+	try
+	{
+		phone->mapPort(new Router(UPNP_TIMEOUT_MS, Router::getDefaultCacheFile()), phone->upnpStartup);
+	}
+	catch (std::exception& ex)
+	{
+		phone->upnpStartup.error = string("UPnP: ") + ex.what();
+	}
+
+	phone->upnpStartup.ms = double(Clock::now() - phone->startupTime) / Clock::MS;
+	phone->upnpStartup.done = true;
+	phone->waker.signal();
+}
+
+void Phone::natpmpStartupTask(void* phoneVoid)
+{
+	Phone* phone = reinterpret_cast<Phone*>(phoneVoid);
+
+	try
+	{
+		phone->mapPort(new NatPmp(NATPMP_TIMEOUT_MS), phone->natpmpStartup);
+	}
+	catch (std::exception& ex)
+	{
+		phone->natpmpStartup.error = string("NAT-PMP/PCP: ") + ex.what();
+	}
+
+	phone->natpmpStartup.ms = double(Clock::now() - phone->startupTime) / Clock::MS;
+	phone->natpmpStartup.done = true;
+	phone->waker.signal();
+}
+
+// Called in a port mapping task once it has found the router; takes ownership of mapper
+// Only one task maps at a time, so a router that speaks both protocols doesn't end up with two mappings
+void Phone::mapPort(PortMapper* mapper, StartupTask& task)
+{
+	for (;;)
+	{
+		int expected = MAPPING_NONE;
+		if (mappingState.compare_exchange_strong(expected, MAPPING_BUSY))
+			break;
+
+		// The other task beat us to it
+		if (expected == MAPPING_DONE)
+		{
+			delete mapper;
+			return;
+		}
+
+		// The other task is trying, but it may yet fail
+		Thread::sleep(MAPPING_WAIT_MS);
+	}
+
+	try
+	{
+		mapper->mapAnyPort(localPort, PORT_DEFAULT, PORT_MAX, PortMapper::MAP_UDP, "Tin Can Phone");
+	}
+	catch (...)
+	{
+		delete mapper;
+		mappingState = MAPPING_NONE;
+		throw;
+	}
+
+	task.mapper = mapper;
+	mappingState = MAPPING_DONE;
+}
+
+// Generate sound buffers
+void Phone::generateTones()
+{
 	// The sound of silence - Simon and Garfunkel not required
 	memset(silence, 0, sizeof(silence));
 
@@ -112,282 +291,441 @@ void Phone::startup()
 		float x = float(s) / float(SAMPLE_RATE);
 		ringToneOut[s] = opus_int16( sin(x * 250.f * pi2) * amp16 );
 	}
+}
 
+// Collect any startup tasks that have finished
+void Phone::finishStartup()
+{
+	if (audioStartup.thread.isStarted() && audioStartup.done)
+		finishAudioStartup();
 
-	// Setup socket
-	sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-	if (sock == -1)
-		throw std::runtime_error("Failed to create socket");
-
-	Socket::setBlocking(sock, false);
+	if (upnpStartup.thread.isStarted() && upnpStartup.done)
+		finishPortMapping(upnpStartup);
 
+	if (natpmpStartup.thread.isStarted() && natpmpStartup.done)
+		finishPortMapping(natpmpStartup);
 
-	// Bind local port
-	uint16 localPort = PORT_DEFAULT;
-	for (;;)
+	// Once every phase is done, report how long each took
+	if (!startupReported && startupTimes.audioMs && (startupTimes.routerMs || !portMapping))
 	{
-		sockaddr_in bindaddr;
-		bindaddr.sin_family = AF_INET;
-		bindaddr.sin_addr.s_addr = INADDR_ANY;
-		bindaddr.sin_port = htons(localPort);
-		if ( bind(sock, (sockaddr*)&bindaddr, sizeof(bindaddr)) )
-		{
-			if (Socket::getError() != EADDRINUSE)
-				throw std::runtime_error("Could not bind UDP port " + toString(localPort) + ": " + Socket::getErrorString());
-			++localPort;
-			if (localPort > PORT_MAX)
-				throw std::runtime_error("Could not find an available local port");
-		}
-		else
-		{
-			break;
-		}
+		log << "Startup times: socket " << startupTimes.socketMs << "ms, ready " << startupTimes.readyMs
+		    << "ms, audio " << startupTimes.audioMs << "ms, router " << startupTimes.routerMs << "ms" << endl;
+		startupReported = true;
 	}
+}
 
+// Also called to wait for audio if it's needed before it's done
+void Phone::finishAudioStartup()
+{
+	if (!audioStartup.thread.isStarted())
+		return;
+	audioStartup.thread.join();
+	reportAudioStartup();
+}
 
-	// Open WAN port via Router
-	uint16 wanPort = PORT_DEFAULT;
-	try
+void Phone::reportAudioStartup()
+{
+	// Without audio there's no phone
+	if (!audioStartup.error.empty())
+		throw std::runtime_error(audioStartup.error);
+
+	startupTimes.audioMs = audioStartup.ms;
+	log << "Sound in: " << audio->getInputName() << endl;
+	log << "Sound out: " << audio->getOutputName() << endl;
+	if (!audio->hasInput())
+		log << "*** ERROR: Could not open sound input, calls will only send silence" << endl;
+}
+
+void Phone::finishPortMapping(StartupTask& task)
+{
+	task.thread.join();
+
+	if (task.mapper)
 	{
-		router = new Router(UPNP_TIMEOUT_MS);
+		portMapper = task.mapper;
+		task.mapper = NULL;
+		startupTimes.routerMs = task.ms;
 
-		for (;;)
-		{
-			// Returns FALSE if port in use
-			if ( !router->setPortMapping(localPort, wanPort, Router::MAP_UDP, "Tin Can Phone") )
-			{
-				wanPort++;
-				if (wanPort > PORT_MAX)
-					throw std::runtime_error("Could not find an available port on router");
-			}
-			else
-			{
-				break;
-			}
-		}
+		// Only specify port in log if it's not the default
+		wanAddress = portMapper->getWanAddress();
+		if (portMapper->getMappedPort() != PORT_DEFAULT)
+			wanAddress += string(":") + toString(portMapper->getMappedPort());
+
+		log << "Ready! Your IP address is: " << wanAddress << " (via " << portMapper->getName() << ")" << endl;
 	}
-	catch (std::runtime_error& ex)
+	else if (!portMapper && !upnpStartup.thread.isStarted() && !natpmpStartup.thread.isStarted())
 	{
-		// Log error but complete startup
-		log << "*** ERROR: " << ex.what() << ". You may need to forward UDP port " << localPort << " manually." << endl;
-		state = HUNGUP;
-		return;
+		// Both failed; log errors but keep going, calls can still be made with manual port forwarding
+		startupTimes.routerMs = std::max(upnpStartup.ms, natpmpStartup.ms);
+		log << "*** ERROR: " << upnpStartup.error << "; " << natpmpStartup.error
+		    << ". You may need to forward UDP port " << localPort << " manually." << endl;
 	}
-
-
-	// Only specify port in log if it's not the default
-	string portstr;
-	if (wanPort != PORT_DEFAULT)
-		portstr = string(":") + toString(wanPort);
-	
-	// Done starting up
-	state = HUNGUP;
-	log << "Ready! Your IP address is: " << router->getWanAddress() << portstr << endl;
 }
 
-bool Phone::run()
+// Start renewing the port mapping when it's due, and report how that went once it's done
+void Phone::renewPortMapping(uint64 now)
 {
-	Command command;
-
-	// Synchronize input and output
+	if (renewal.thread.isStarted())
 	{
-		Scopelock lock(mutex);
-		
-		// Set logOut and clear log
-		logOut += log.str();
-		log.str(string());
+		if (!renewal.done)
+			return;
+		renewal.thread.join();
 
-		// Set stateOut, and notify updateHandler
-		if (stateOut != state)
+		if (!renewal.error.empty())
 		{
-			stateOut = state;
-			if (updateHandler)
-				updateHandler->sendUpdate();
+			log << "*** ERROR: Could not renew the port mapping (" << portMapper->getName() << ": " << renewal.error
+			    << "), trying again in a minute" << endl;
+			return;
 		}
-		
-		// Get commandIn and clear
-		command = commandIn;
-		commandIn = CMD_NONE;
-		
-		// Get addressIn when CMD_CALL
-		if (command == CMD_CALL)
-		{
-			addrinfo hints = {};
-			hints.ai_flags = AI_NUMERICHOST; //"suppresses any potentially lengthy network host address lookups"
-			hints.ai_family = AF_UNSPEC;     //Allow AF_INET or AF_INET6
-			hints.ai_socktype = SOCK_DGRAM;
-			hints.ai_protocol = IPPROTO_UDP;
-
-			addrinfo* result = NULL;
-
-			string port = toString(PORT_DEFAULT);
-			size_t colon = addressIn.find(':');
-			if (colon != string::npos) {
-				port = addressIn.substr(colon+1);
-				addressIn.resize(colon);
-				log << addressIn << ' ' << port << endl;
-			}
 
-			int error = getaddrinfo(addressIn.c_str(), port.c_str(), &hints, &result);
-			if (!error)
-			{
-				// Set 'address'
-				assert(result->ai_addrlen <= sizeof address);
-				memcpy(&address, result->ai_addr, result->ai_addrlen);
-			}
-			else
-			{
-				log << "Invalid IP address" << endl;
-				command = CMD_NONE; //Cancel command since input invalid
-			}
-
-			freeaddrinfo(result);
+		// The router may have given us another port, or its WAN address changed
+		string renewed = portMapper->getWanAddress();
+		if (portMapper->getMappedPort() != PORT_DEFAULT)
+			renewed += string(":") + toString(portMapper->getMappedPort());
+		if (renewed != wanAddress)
+		{
+			wanAddress = renewed;
+			log << "Port mapping renewed, your IP address is now: " << wanAddress << endl;
 		}
 	}
 
-	// Handle commands
-	if (command == CMD_CALL && (state == HUNGUP || state == RINGING))
+	if (portMapper && portMapper->getRenewTime() && now >= portMapper->getRenewTime())
 	{
-		dial();
+		renewal.done = false;
+		renewal.error.clear();
+		renewal.thread.start(&renewalTask, this);
 	}
-	else if (command == CMD_ANSWER && state == RINGING)
+}
+
+void Phone::renewalTask(void* phoneVoid)
+{
+	Phone* phone = reinterpret_cast<Phone*>(phoneVoid);
+
+	try
 	{
-		goLive();
+		phone->portMapper->renewPortMapping();
 	}
-	else if (command == CMD_HANGUP && (state == DIALING || state == LIVE))
+	catch (std::exception& ex)
 	{
-		hangup();
+		phone->renewal.error = ex.what();
 	}
-	else if (command == CMD_EXIT)
+
+	phone->renewal.done = true;
+	phone->waker.signal();
+}
+
+bool Phone::run()
+{
+	// Pick up background startup phases as they finish
+	finishStartup();
+
+	// Publish what startup() or the previous iteration left behind
+	publishOutput();
+
+	// Get callParamsIn for the next call we place
+	localParams = callParamsIn.load();
+
+	// Handle queued commands in the order they were given
+	CommandMsg msg;
+	while (commandsIn.read(&msg, 1))
 	{
-		if (state == LIVE)
-			hangup();
-		
-		return false;
+		if (!handleCommand(msg))
+			return false;
 	}
 
 
-	// Handle incoming packets
-	Packet packet = {};
-	
-	// Loop until EWOULDBLOCK
+	// Handle incoming packets, a batch at a time
+	// Loop until EWOULDBLOCK or a partial batch
 	for (;;)
 	{
-		sockaddr_storage fromAddr = {};
-		socklen_t fromAddrLen = sizeof(fromAddr);
-		int received = recvfrom(sock, (char*)&packet, sizeof(packet), 0, (sockaddr*)&fromAddr, &fromAddrLen);
-		if (received >= int(sizeof(packet.header)))
-		{
-			packet.header = ntohl(packet.header);
-			packet.seq =    ntohl(packet.seq);
-			receivePacket(packet, received, fromAddr);
-		}
-		else if (received < 0)
+		int received = transport->receive(recvBatch);
+		if (received < 0)
 		{
 			if (Socket::getError() == EWOULDBLOCK)
 				break;
 		
 			if (Socket::getError() == ECONNABORTED || Socket::getError() == ECONNRESET)
 			{
-				log << "Network error: " << Socket::getErrorString() << endl;
+				events.write(EventLog::NETWORK_ERROR, 0, Socket::getError());
 				hangup();
+				continue;
 			}
 			else
 			{
 				throw std::runtime_error("recvfrom error: " + Socket::getErrorString());
 			}
 		}
+
+		for (int i = 0; i < received; ++i)
+			receiveDatagram(recvBatch.data(i), recvBatch.size(i), recvBatch.addr(i), recvBatch.time(i));
+
+		if (received < int(recvBatch.capacity()))
+			break;
 	}
 
 
-	if (state == DIALING)
+	// Handle expired timers
+	const uint64 now = Clock::now();
+	transportDeadline = transport->service(now, log);
+	renewPortMapping(now);
+
+	if (state == DIALING && now >= ringPacketDeadline)
 	{
 		// Send RING packet repeatedly
-		if (ringPacketTimer >= RING_PACKET_INTERVAL)
-		{
-			ringPacketTimer = 0;
-			sendPacket(Packet::RING, address);
-		}
-
-		// Audio playblack is blocking
-		playRingtone();
-
-		ringPacketTimer += PACKET_MS;
+		sendRing(address);
+		ringPacketDeadline = now + RING_PACKET_INTERVAL * Clock::MS;
 	}
-	else if (state == RINGING)
+	else if (state == RINGING && now >= ringPacketDeadline)
 	{
 		// Stop ringing if we're no longer getting packets
-		if (ringPacketTimer > RING_PACKET_INTERVAL*2)
-		{
-			log << "Missed call from " << address << endl;
-			endAudioStream();
-			state = HUNGUP;
-		}
-		else
-		{
-			// Audio playblack is blocking
-			playRingtone();
+		events.write(EventLog::MISSED_CALL, address);
+		useAudioStream(STREAM_IDLE);
+		state = HUNGUP;
+	}
+	else if (state == LIVE && now >= disconnectDeadline)
+	{
+		events.write(EventLog::CALL_DISCONNECTED);
+		hangup();
+	}
 
-			ringPacketTimer += PACKET_MS;
-		}
+	if (state == LIVE && now >= reportDeadline)
+	{
+		sendReport();
+		reportDeadline = now + REPORT_INTERVAL * Clock::MS;
+	}
+
+
+	if (state == DIALING || state == RINGING)
+	{
+		for (uint n = audioPacketsWanted(); n; --n)
+			playRingtone();
 	}
 	else if (state == LIVE)
 	{
 		// Read microphone stream and send packets
-		while (Pa_GetStreamReadAvailable(stream) >= PACKET_SAMPLES)
+		opus_int16 microphone[PACKET_SAMPLES_MAX];
+		while (readAudioStream(microphone, frameSamples))
 		{
-			// The 'frames' param of Pa_ReadStream should match 'framesPerBuffer' param of Pa_OpenStream
-			opus_int16 microphone[PACKET_SAMPLES];
-			PaError paErr = Pa_ReadStream(stream, microphone, PACKET_SAMPLES);
-			if (paErr && paErr != paInputOverflowed)
-				throw std::runtime_error(string("Pa_ReadStream error: ") + Pa_GetErrorText(paErr));
-
-			// Compress and send
-			Packet sendbuf;
+			// Compress into the send batch, so a backlog of frames goes out in one syscall
+			if (sendBatch.count() == sendBatch.capacity())
+				sendQueuedPackets();
+
+			Packet& sendbuf = *reinterpret_cast<Packet*>(sendBatch.add(address));
 			sendbuf.header = htonl(Packet::AUDIO);
 			sendbuf.seq =    htonl(sendseq);
 			
 			++sendseq;
 
-			opus_int32 enc = opus_encode(encoder, microphone, PACKET_SAMPLES, sendbuf.data, sizeof(sendbuf.data));
+			opus_int32 enc = opus_encode(encoder, microphone, frameSamples, sendbuf.data, callParams.frameMs * ENCODED_BYTES_PER_MS);
 			if (enc < 0)
 				throw std::runtime_error(string("opus_encode error: ") + opus_strerror(enc));
 			
-			int sendsize = sizeof(packet.header) + sizeof(packet.seq) + enc;
-			sendPacket((char*)&sendbuf, sendsize, address);
+			sendBatch.setSize(sendBatch.count() - 1, offsetof(Packet,data) + enc);
 		}
+		sendQueuedPackets();
 
 		// Play any downloaded and buffered audio
-		playReceivedAudio();
+		for (uint n = audioPacketsWanted(); n && state == LIVE; --n)
+			playReceivedAudio();
 	}
-	else
+
+	// Publish before sleeping, since nothing else may wake us for a while
+	publishOutput();
+	return true;
+}
+
+bool Phone::handleCommand(CommandMsg& msg)
+{
+	Command command = msg.command;
+	++commandCount;
+
+	// Parse the address when CMD_CALL, unless it's one the transport has its own form for
+	if (command == CMD_CALL && !transport->parseAddress(msg.address, address))
 	{
-		// If no blocking audio calls to do, sleep instead
-		Pa_Sleep(PACKET_MS);
-	
-		return true;
+		addrinfo hints = {};
+		hints.ai_flags = AI_NUMERICHOST; //"suppresses any potentially lengthy network host address lookups"
+		hints.ai_family = AF_UNSPEC;     //Allow AF_INET or AF_INET6
+		hints.ai_socktype = SOCK_DGRAM;
+		hints.ai_protocol = IPPROTO_UDP;
+
+		addrinfo* result = NULL;
+
+		string port = toString(PORT_DEFAULT);
+		char* colon = strchr(msg.address, ':');
+		if (colon) {
+			*colon = '\0';
+			port = colon + 1;
+			log << msg.address << ' ' << port << endl;
+		}
+
+		int error = getaddrinfo(msg.address, port.c_str(), &hints, &result);
+		if (!error)
+		{
+			// Set 'address'
+			assert(result->ai_addrlen <= sizeof address);
+			memcpy(&address, result->ai_addr, result->ai_addrlen);
+			freeaddrinfo(result);
+		}
+		else
+		{
+			events.write(EventLog::INVALID_ADDRESS);
+			command = CMD_NONE; //Cancel command since input invalid
+		}
 	}
-	
+
+	if (command == CMD_CALL && (state == HUNGUP || state == RINGING))
+	{
+		dial();
+	}
+	else if (command == CMD_ANSWER && state == RINGING)
+	{
+		goLive();
+	}
+	else if (command == CMD_HANGUP && (state == DIALING || state == LIVE))
+	{
+		hangup();
+	}
+	else if (command == CMD_EXIT)
+	{
+		if (state == LIVE)
+			hangup();
+		
+		return false;
+	}
+
 	return true;
 }
 
+void Phone::publishOutput()
+{
+	// Move complete lines of free-form log text into the event log
+	const char* text = log.data();
+	const char* end = text + log.size();
+	while (text < end)
+	{
+		const char* eol = std::find(text, end, '\n');
+		events.writeText(text, eol - text);
+		text = eol + 1;
+	}
+	if (log.truncated())
+	{
+		static const char truncatedMsg[] = "(log truncated)";
+		events.writeText(truncatedMsg, sizeof(truncatedMsg) - 1);
+	}
+	log.reset();
+
+	// Publish the status snapshot
+	Status status;
+	status.state = state;
+	status.peer = address;
+	status.audio.underruns = underruns;
+	status.audio.overruns = overruns;
+	status.audio.latencyMs = latencyCount ? latencySum / latencyCount : 0;
+	status.audio.latencyMaxMs = latencyMax;
+	status.audio.jitterMs = audiobuf.getJitterMs();
+	status.audio.targetDelayMs = audiobuf.targetDelay() * callParams.frameMs;
+	status.audio.bufferedMs = audiobuf.buffered() * callParams.frameMs;
+	status.audio.latePackets = audiobuf.getLateCount();
+	status.audio.discardedPackets = audiobuf.getDiscardCount();
+	status.audio.fecRecovered = fecRecovered;
+	status.audio.concealed = concealed;
+	status.audio.skippedPackets = skippedPackets;
+	status.audio.connectMs = connectMs;
+	status.transport = transportStats;
+	status.transport.received = receivedPackets;
+	status.transport.lost = lostPackets();
+	status.transport.jitterMs = audiobuf.getJitterMs();
+	if (adaptiveBitrate)
+	{
+		const RateController::Decision& rate = rateControl.current();
+		status.transport.bitrate = rate.bitrate;
+		status.transport.fecLossPercent = rate.lossPercent;
+		status.transport.queuingMs = rate.queuingMs;
+		status.transport.bitrateChanges = rateControl.getChanges();
+	}
+	status.commands = commandCount;
+	status.calls = callCount;
+	status.connectedCalls = connectedCount;
+	status.startup = startupTimes;
+	statusOut.store(status);
+
+	// Notify updateHandler of state changes
+	if (publishedState != state)
+	{
+		publishedState = state;
+		if (updateHandler)
+			updateHandler->sendUpdate();
+	}
+}
+
+void Phone::waitForEvents()
+{
+	// Blocking audio writes already paced this iteration, so don't wait for anything else
+	if (streamUse != STREAM_IDLE && audioMode == AUDIO_BLOCKING)
+		return;
+
+	// Otherwise sleep until a packet arrives, the waker is signalled, or the next deadline
+	uint64 deadline = 0;
+	if (state == DIALING || state == RINGING)
+		deadline = ringPacketDeadline;
+	else if (state == LIVE)
+		deadline = std::min(disconnectDeadline, reportDeadline);
+	if (transportDeadline && (!deadline || transportDeadline < deadline))
+		deadline = transportDeadline;
+	const uint64 renewTime = (portMapper && !renewal.thread.isStarted()) ? portMapper->getRenewTime() : 0;
+	if (renewTime && (!deadline || renewTime < deadline))
+		deadline = renewTime;
+
+	int timeoutMs = -1;
+	if (deadline)
+	{
+		const uint64 now = Clock::now();
+		timeoutMs = (deadline > now) ? int((deadline - now + Clock::MS - 1) / Clock::MS) : 0;
+	}
+
+	pollfd fds[2] = {};
+	fds[0].fd = transport->getFd();
+	fds[0].events = POLLIN;
+	fds[1].fd = waker.getFd();
+	fds[1].events = POLLIN;
+
+	if (Socket::poll(fds, 2, timeoutMs) < 0 && Socket::getError() != EINTR)
+		throw std::runtime_error("poll error: " + Socket::getErrorString());
+
+	if (fds[1].revents)
+		waker.drain();
+}
+
 void Phone::hangup()
 {
 	assert(state != HUNGUP);
 
-	log << "Hanging up" << endl;
+	events.write(EventLog::HANGING_UP);
 
-	if (stream)
-		endAudioStream();
+	useAudioStream(STREAM_IDLE);
 
 	if (state == LIVE)
 	{
-		opus_decoder_destroy(decoder);
-		decoder = NULL;
-		opus_encoder_destroy(encoder);
-		encoder = NULL;
-
-		audiobuf.clear();
+		if (audioMode == AUDIO_CALLBACK)
+		{
+			log << "Audio underruns: " << underruns << ", overruns: " << overruns
+			    << ", callback-to-wire latency: " << (latencyCount ? latencySum / latencyCount : 0)
+			    << "ms avg, " << latencyMax << "ms max" << endl;
+		}
+		log << "Jitter: " << audiobuf.getJitterMs() << "ms, playout delay: " << audiobuf.targetDelay() * callParams.frameMs
+		    << "ms, late packets: " << audiobuf.getLateCount() << ", discarded: " << audiobuf.getDiscardCount()
+		    << ", recovered with FEC: " << fecRecovered << ", concealed: " << concealed << endl;
+		if (transportStats.reportsReceived)
+		{
+			log << "Round trip: " << transportStats.rttMs << "ms (" << transportStats.rttMaxMs << "ms max), packets lost: "
+			    << lostPackets() << " received, " << transportStats.sentLost << " sent, peer's jitter: "
+			    << transportStats.sentJitterMs << "ms" << endl;
+		}
+		if (adaptiveBitrate)
+		{
+			log << "Bitrate: " << rateControl.current().bitrate / 1000.0 << "kbps, changed " << rateControl.getChanges()
+			    << " times" << endl;
+		}
 	}
 
 	state = HUNGUP;
@@ -396,71 +734,170 @@ void Phone::hangup()
 void Phone::dial()
 {
 	assert(state != DIALING);
-	log << "Dialing " << address << endl;
+	events.write(EventLog::DIALING, address);
+	callParams = localParams;
+	frameSamples = PACKET_SAMPLES;
 	ringToneTimer = 0;
-	ringPacketTimer = 0;
+	ringPacketDeadline = Clock::now(); //Send first RING right away
 	state = DIALING;
-	beginAudioStream(false, true);
+	++callCount;
+	useAudioStream(STREAM_RINGING);
 }
 
 void Phone::startRinging()
 {
 	assert(state != RINGING);
-	log << "*** Incoming call from " << address << endl;
+	events.write(EventLog::INCOMING_CALL, address);
+	frameSamples = PACKET_SAMPLES;
 	ringToneTimer = 0;
-	ringPacketTimer = 0;
+	ringPacketDeadline = Clock::now() + RING_PACKET_INTERVAL*2 * Clock::MS;
 	state = RINGING;
-	beginAudioStream(false, true);
+	++callCount;
+	useAudioStream(STREAM_RINGING);
+}
+
+void Phone::initEncoder(int application)
+{
+	int opusErr = opus_encoder_init(encoder, SAMPLE_RATE, CHANNELS, application);
+	if (opusErr != OPUS_OK)
+		throw std::runtime_error(string("opus_encoder_init error: ") + opus_strerror(opusErr));
+
+	// In-band FEC lets the receiver rebuild a lost frame from the packet after it (not available in low delay mode)
+	// DTX shrinks silent frames to a byte or two; they are still sent so seq numbering stays contiguous
+	opusErr = opus_encoder_ctl(encoder, OPUS_SET_INBAND_FEC(1));
+	if (opusErr == OPUS_OK)
+		opusErr = opus_encoder_ctl(encoder, OPUS_SET_PACKET_LOSS_PERC(EXPECTED_LOSS_PERC));
+	if (opusErr == OPUS_OK)
+		opusErr = opus_encoder_ctl(encoder, OPUS_SET_DTX(1));
+	if (opusErr != OPUS_OK)
+		throw std::runtime_error(string("opus_encoder_ctl error: ") + opus_strerror(opusErr));
+
+	encoderApplication = application;
+}
+
+void Phone::applyBitrate()
+{
+	static const int bandwidths[] = {
+		OPUS_BANDWIDTH_NARROWBAND, OPUS_BANDWIDTH_WIDEBAND, OPUS_BANDWIDTH_SUPERWIDEBAND, OPUS_BANDWIDTH_FULLBAND
+	};
+
+	const RateController::Decision& rate = rateControl.current();
+	int opusErr = opus_encoder_ctl(encoder, OPUS_SET_BITRATE(rate.bitrate));
+	if (opusErr == OPUS_OK)
+		opusErr = opus_encoder_ctl(encoder, OPUS_SET_PACKET_LOSS_PERC(rate.lossPercent));
+	if (opusErr == OPUS_OK)
+		opusErr = opus_encoder_ctl(encoder, OPUS_SET_MAX_BANDWIDTH(bandwidths[rate.bandwidth]));
+	if (opusErr != OPUS_OK)
+		throw std::runtime_error(string("opus_encoder_ctl error: ") + opus_strerror(opusErr));
+
+	events.write(EventLog::BITRATE_CHANGED, rate.reason, rate.bitrate, rate.lossPercent);
 }
 
 void Phone::goLive()
 {
 	assert(state != LIVE);
 
-	sendseq = 1;
-	audiobuf.resize(1);
-	audiobuf.front().seq = 1;
-	disconnectTimer = 0;
+	const uint64 connectStart = Clock::now();
+	sendseq = firstSeq;
+	frameSamples = callParams.frameMs * (SAMPLE_RATE / 1000);
+	audiobuf.reset(firstSeq, callParams.frameMs);
+	stretcher.reset();
+	disconnectDeadline = Clock::now() + DISCONNNECT_TIMEOUT * Clock::MS;
 	increaseBuffering = true;
 	missedPackets = 0;
-
-	// Initialize opus
-	int opusErr;
-	encoder = opus_encoder_create(SAMPLE_RATE, CHANNELS, OPUS_APPLICATION_VOIP, &opusErr);
+	fecRecovered = 0;
+	concealed = 0;
+	skippedPackets = 0;
+	underruns = 0;
+	overruns = 0;
+	latencySum = latencyMax = 0;
+	latencyCount = 0;
+	reportDeadline = Clock::now() + REPORT_INTERVAL * Clock::MS;
+	receivedPackets = 0;
+	expectedPrior = 0;
+	receivedPrior = 0;
+	peerReportTime = 0;
+	transportStats = TransportStats();
+	transitSum = 0;
+	transitCount = 0;
+	peerHighestSeq = firstSeq - 1;
+
+	// Reset opus, keeping its settings; the application can only be changed by initializing it again
+	const int application = callParams.lowDelay ? OPUS_APPLICATION_RESTRICTED_LOWDELAY : OPUS_APPLICATION_VOIP;
+	int opusErr = OPUS_OK;
+	if (application != encoderApplication)
+		initEncoder(application);
+	else
+		opusErr = opus_encoder_ctl(encoder, OPUS_RESET_STATE);
+	if (opusErr == OPUS_OK)
+		opusErr = opus_decoder_ctl(decoder, OPUS_RESET_STATE);
 	if (opusErr != OPUS_OK)
-		throw std::runtime_error(string("opus_encoder_create error: ") + opus_strerror(opusErr));
+		throw std::runtime_error(string("opus reset error: ") + opus_strerror(opusErr));
 
-	decoder = opus_decoder_create(SAMPLE_RATE, CHANNELS, &opusErr);
-	if (opusErr != OPUS_OK)
-		throw std::runtime_error(string("opus_decoder_create error: ") + opus_strerror(opusErr));
+	// Every call starts from the same bitrate, then the peer's REPORTs steer it
+	rateControl.reset();
+	if (adaptiveBitrate)
+		applyBitrate();
 
-	// Start portaudio stream
-	log << "*** Call started" << endl;
-	log << "Sound in: " << Pa_GetDeviceInfo( Pa_GetDefaultInputDevice() )->name << endl;
-	log << "Sound out: " << Pa_GetDeviceInfo( Pa_GetDefaultOutputDevice() )->name << endl;
-	beginAudioStream(true, true);
+	// Start sending the microphone over the already running stream, and have the callback drop any ringtone still
+	// queued, so the call doesn't start behind it
+	events.write(EventLog::CALL_STARTED, 0, callParams.frameMs, callParams.lowDelay);
+	playoutStart = playoutRing.mark();
+	useAudioStream(STREAM_LIVE);
 
 	// Now LIVE
 	state = LIVE;
+	++connectedCount;
+	connectMs = double(Clock::now() - connectStart) / Clock::MS;
+	log << "Connected in " << connectMs << "ms" << endl;
+}
+
+void Phone::receiveDatagram(byte* data, uint size, const sockaddr_storage& fromAddr, uint64 arrival)
+{
+	if (size < sizeof(uint32))
+		return;
+
+	// Without a timestamp from the transport, it arrived as far as we know now
+	if (arrival)
+		transportStats.timestamped = true;
+	else
+		arrival = Clock::now();
+
+	// Byte swap in place; data is aligned for Packet
+	Packet& packet = *reinterpret_cast<Packet*>(data);
+	packet.header = ntohl(packet.header);
+	packet.seq =    ntohl(packet.seq);
+	receivePacket(packet, size, fromAddr, arrival);
 }
 
-void Phone::receivePacket(const Packet& packet, uint packetSize, const sockaddr_storage& fromAddr)
+void Phone::receivePacket(const Packet& packet, uint packetSize, const sockaddr_storage& fromAddr, uint64 arrival)
 {
 	switch (packet.header)
 	{
 	case Packet::RING:
 		if (state == HUNGUP)
 		{
-			// Incoming call!
+			// Incoming call! Use whatever framing the caller asked for
 			address = fromAddr;
+			callParams = parseRing(packet, packetSize);
 			startRinging();
 		}
 		else if (fromAddr == address)
 		{
 			if (state == RINGING)
-				ringPacketTimer = 0; //Reset timer
+			{
+				ringPacketDeadline = Clock::now() + RING_PACKET_INTERVAL*2 * Clock::MS; //Reset timer
+			}
 			else if (state == DIALING)
-				goLive(); //We're both dialing each other at the same time?
+			{
+				// We're both dialing each other at the same time? Both sides must settle on the same framing
+				CallParams theirs = parseRing(packet, packetSize);
+				callParams.frameMs = std::max(callParams.frameMs, theirs.frameMs);
+				callParams.lowDelay = callParams.lowDelay && theirs.lowDelay;
+				// Our RINGs may all have been lost, so tell them what we settled on before our AUDIO gets there
+				sendRing(address);
+				goLive();
+			}
 		}
 		else
 		{
@@ -472,7 +909,7 @@ void Phone::receivePacket(const Packet& packet, uint packetSize, const sockaddr_
 	case Packet::BUSY:
 		if (state == DIALING && fromAddr == address)
 		{
-			log << "*** " << address << " is busy" << endl;
+			events.write(EventLog::BUSY, address);
 			hangup();
 		}
 		break;
@@ -485,22 +922,30 @@ void Phone::receivePacket(const Packet& packet, uint packetSize, const sockaddr_
 		}
 		else if (state == DIALING)
 		{
+			// Answered, or they dialed us too and went LIVE on our RING before theirs got here; either way they
+			// send with the framing they settled on, which may not be what we asked for
+			callParams = parseAudioFraming(packet, packetSize);
 			goLive();
-			bufferReceivedAudio(packet, packetSize);
+			bufferReceivedAudio(packet, packetSize, arrival);
 		}
 		else if (state == LIVE)
 		{
-			bufferReceivedAudio(packet, packetSize);
+			bufferReceivedAudio(packet, packetSize, arrival);
 		}
 		break;
 		
 	case Packet::HANGUP:
 		if (state != HUNGUP && fromAddr == address)
 		{
-			log << "*** " << address << " has hung up" << endl;
+			events.write(EventLog::PEER_HUNG_UP, address);
 			hangup();
 		}
 		break;
+
+	case Packet::REPORT:
+		if (state == LIVE && fromAddr == address)
+			receiveReport(packet, packetSize, arrival);
+		break;
 		
 	default:
 		//Ignore packet
@@ -508,88 +953,135 @@ void Phone::receivePacket(const Packet& packet, uint packetSize, const sockaddr_
 	}
 }
 
-void Phone::bufferReceivedAudio(const Packet& packet, uint packetSize)
+void Phone::bufferReceivedAudio(const Packet& packet, uint packetSize, uint64 arrival)
 {
 	// Discard packet if too small
 	if (packetSize <= offsetof(Packet,data))
 		return;
 
-	// Discard late packets
-	if (packet.seq < audiobuf.front().seq)
-		return;
+	// One-way transit on the peer's clock, for the next REPORT; only differences matter, so 32-bit wraparound cancels out
+	const uint32 transit = uint32(arrival) - packet.seq * uint32(callParams.frameMs * Clock::MS);
+	if (!transitCount)
+		transitBase = transit;
+	transitSum += int32(transit - transitBase);
+	++transitCount;
 
-	// Make sure audio buffer is expanded to packet.seq
-	while (audiobuf.back().seq < packet.seq)
-	{
-		uint32 prevseq = audiobuf.back().seq;
-		audiobuf.resize(audiobuf.size() + 1);
-		audiobuf.back().seq = prevseq + 1;
-	}
-
-	// Find position in buffer for packet.seq and memcpy the packet into place
-	AudioBuffer::iterator p = std::find(audiobuf.begin(), audiobuf.end(), packet.seq);
-	p->datasize = packetSize - offsetof(Packet,data);
-	memcpy(p->data, packet.data, p->datasize);
+	// Late, duplicate and out of range packets are counted and dropped by the JitterBuffer
+	++receivedPackets;
+	audiobuf.insert(packet.seq, packet.data, packetSize - offsetof(Packet,data), arrival);
 }
 
 void Phone::playReceivedAudio()
 {
-	if (increaseBuffering && audiobuf.size() < BUFFERED_PACKETS_MAX)
+	// Decode packets into the time stretcher until it has a whole packet of output for us
+	while (stretcher.available() < frameSamples)
 	{
-		if (audiobuf.size() == 1 && !audiobuf.front().datasize)
+		opus_int16 decoded[PACKET_SAMPLES_MAX];
+		double speed;
+		uint samples = decodeReceivedAudio(decoded, speed);
+		if (!stretcher.process(decoded, samples, speed))
 		{
-			disconnectTimer += PACKET_MS;
-			if (disconnectTimer > DISCONNNECT_TIMEOUT)
-			{
-				log << "*** Call disconnected!" << endl;
-				hangup();
-				return;
-			}
+			// No room, which only a peer sending far longer packets than negotiated can cause: rather than decode
+			// forever, start the stretcher over and play a packet's worth of this one as it is
+			stretcher.reset();
+			if (samples < frameSamples)
+				memset(&decoded[samples], 0, (frameSamples - samples) * sizeof(opus_int16));
+			writeAudioStream(decoded, frameSamples);
+			return;
 		}
-		else
-		{
-			log << "Buffering increased" << endl;
-			increaseBuffering = false;
-		}
-		
-		writeAudioStream(silence, PACKET_SAMPLES);
-		return;
 	}
 
-	opus_int16 decoded[PACKET_SAMPLES];
+	opus_int16 output[PACKET_SAMPLES_MAX];
+	stretcher.read(output, frameSamples);
+	writeAudioStream(output, frameSamples);
+}
+
+bool Phone::hasFec(const byte* payload, uint size)
+{
+	const byte* frames[48];
+	opus_int16 sizes[48];
+	byte toc;
+	if (!size || (payload[0] & 0x80)) //CELT-only packets have no SILK layer
+		return false;
+	if (opus_packet_parse(payload, opus_int32(size), &toc, frames, sizes, NULL) <= 0 || !sizes[0])
+		return false;
+
+	// The first SILK frame starts with a VAD flag per 20ms, then the LBRR flag, for each channel
+	const int ms = opus_packet_get_samples_per_frame(payload, 1000);
+	const int silkFrames = (ms > 20) ? ms / 20 : 1;
+	if ((frames[0][0] >> (7 - silkFrames)) & 1)
+		return true;
+	return opus_packet_get_nb_channels(payload) == 2 && ((frames[0][0] >> (6 - 2 * silkFrames)) & 1);
+}
+
+uint Phone::decodeReceivedAudio(opus_int16* decoded, double& speed)
+{
 	opus_int32 decodeRet;
 
-	if (audiobuf.front().datasize)
+	if (increaseBuffering)
 	{
-		// Decode a packet from the front of the buffer
-		AudioPacket& front = audiobuf.front();
-		decodeRet = opus_decode(decoder, front.data, front.datasize, decoded, PACKET_SAMPLES, 0);
-		if (decodeRet == OPUS_INVALID_PACKET)
+		if (audiobuf.buffered() < audiobuf.targetDelay())
 		{
-			log << "Corrupt packet " << front.seq << endl;
+			// Let the decoder conceal the gap (it fades to silence) while packets build up
+			decodeRet = opus_decode(decoder, NULL, 0, decoded, frameSamples, 0);
+			++concealed;
+			if (decodeRet < 0)
+				throw std::runtime_error(string("opus_decode failed: ") + opus_strerror(decodeRet));
+			speed = 1.0;
+			return decodeRet;
+		}
+
+		events.write(EventLog::BUFFERING_INCREASED, 0, audiobuf.targetDelay());
+		increaseBuffering = false;
+	}
+
+	uint frontSize = 0;
+	const byte* front = audiobuf.get(audiobuf.frontSeq(), frontSize);
+	if (front)
+	{
+		// Decode a packet from the front of the buffer (allowing for any frame length we support, in case the peer
+		// didn't negotiate); whatever the peer sends, a packet that won't decode only costs a concealed frame
+		decodeRet = opus_decode(decoder, front, frontSize, decoded, PACKET_SAMPLES_MAX, 0);
+		if (decodeRet <= 0)
+		{
+			events.write(EventLog::CORRUPT_PACKET, audiobuf.frontSeq());
 			// Try again by treating the packet as lost
-			decodeRet = opus_decode(decoder, NULL, 0, decoded, PACKET_SAMPLES, 0);
+			decodeRet = opus_decode(decoder, NULL, 0, decoded, frameSamples, 0);
+			++concealed;
 		}
 		else
 		{
 			// Successfully played an audio packet
 			missedPackets = 0;
-			disconnectTimer = 0;
+			disconnectDeadline = Clock::now() + DISCONNNECT_TIMEOUT * Clock::MS;
 		}
 	}
 	else
 	{
-		// No data for packet at this seq
-		
-		log << "Missing packet " << audiobuf.front().seq << endl;
+		// No data for packet at this seq, but if the next packet is here it may carry a copy as in-band FEC
+		uint nextSize = 0;
+		const byte* next = audiobuf.get(audiobuf.frontSeq() + 1, nextSize);
+		decodeRet = OPUS_INVALID_PACKET;
+		if (next && hasFec(next, nextSize))
+			decodeRet = opus_decode(decoder, next, nextSize, decoded, frameSamples, 1);
+
+		if (decodeRet > 0)
+		{
+			events.write(EventLog::FEC_RECOVERED, audiobuf.frontSeq());
+			++fecRecovered;
+		}
+		else
+		{
+			events.write(EventLog::MISSING_PACKET, audiobuf.frontSeq());
+			decodeRet = opus_decode(decoder, NULL, 0, decoded, frameSamples, 0);
+			++concealed;
+		}
 
 		++missedPackets;
 
-		// Start buffering if we're below the minimum, or there are 2 consecutive missed packets
-		if (audiobuf.size() < BUFFERED_PACKETS_MIN || (missedPackets > 1 && audiobuf.size() < BUFFERED_PACKETS_MAX))
+		// Start buffering if nothing is queued behind this packet, or there are 2 consecutive missed packets
+		if (audiobuf.buffered() <= 1 || (missedPackets > 1 && audiobuf.buffered() < audiobuf.targetDelay()))
 			increaseBuffering = true;
-
-		decodeRet = opus_decode(decoder, NULL, 0, decoded, PACKET_SAMPLES, 0);
 	}
 
 	// Check for Opus error from above
@@ -597,28 +1089,28 @@ void Phone::playReceivedAudio()
 		throw std::runtime_error(string("opus_decode failed: ") + opus_strerror(decodeRet));
 
 	// Pop the packet we just decoded
-	if (audiobuf.size() == 1)
-	{
-		// Leave at least one space in buffer at correct seq
-		audiobuf.front().datasize = 0;
-		audiobuf.front().seq++;
-	}
-	else
-	{
-		audiobuf.pop_front();
-	}
+	audiobuf.pop();
 
-	// If too many packets are buffered, "skip ahead" to reduce latency
+	// If far too many packets are buffered (after a stall), "skip ahead" to reduce latency
 	// Note that the packet has been decoded (as opus requires), but we don't play it
-	if (audiobuf.size() >= BUFFERED_PACKETS_MAX)
+	if (audiobuf.buffered() >= audiobuf.targetDelay() + BUFFERED_PACKETS_SKIP)
 	{
-		log << "Reducing buffering" << endl;
-		playReceivedAudio(); //Play the next packet immediately
-		return;
+		events.write(EventLog::REDUCING_BUFFERING);
+		++skippedPackets;
+		return decodeReceivedAudio(decoded, speed); //Decode the next packet over this one
 	}
 
-	// Play the decoded packet
-	writeAudioStream(decoded, PACKET_SAMPLES);
+	// Otherwise steer toward the target delay by playing this packet slightly faster or slower
+	// (queued is after the pop, so slow down as soon as it's short of the target, before the sound cards' drift
+	// can empty it)
+	const uint queued = audiobuf.buffered();
+	speed = 1.0;
+	if (queued > audiobuf.targetDelay())
+		speed = 1.0 + STRETCH_PERCENT / 100.0;
+	else if (queued < audiobuf.targetDelay())
+		speed = 1.0 - STRETCH_PERCENT / 100.0;
+
+	return decodeRet;
 }
 
 void Phone::playRingtone()
@@ -635,59 +1127,310 @@ void Phone::playRingtone()
 	ringToneTimer += PACKET_MS;
 }
 
+uint64 Phone::expectedPackets() const
+{
+	return audiobuf.endSeq() - firstSeq;
+}
+
+ulong Phone::lostPackets() const
+{
+	// Duplicates can make it look like we got more than were sent
+	const uint64 expected = expectedPackets();
+	return (expected > receivedPackets) ? ulong(expected - receivedPackets) : 0;
+}
+
+void Phone::sendReport()
+{
+	const uint64 now = Clock::now();
+	const uint64 expected = expectedPackets();
+
+	// Loss since the last report, from how far the seq numbers got and how many packets came
+	const uint64 expectedInterval = expected - expectedPrior;
+	const uint64 receivedInterval = receivedPackets - receivedPrior;
+	const uint64 lostInterval = (expectedInterval > receivedInterval) ? expectedInterval - receivedInterval : 0;
+	const uint32 fraction = expectedInterval ? uint32(lostInterval * 65536 / expectedInterval) : 0;
+	expectedPrior = expected;
+	receivedPrior = receivedPackets;
+	transportStats.lossPercent = fraction * 100.0 / 65536;
+
+	Packet packet;
+	packet.header = htonl(Packet::REPORT);
+	packet.seq = htonl(uint32(++transportStats.reportsSent));
+
+	Report report;
+	report.highestSeq =    htonl(uint32(audiobuf.endSeq() - 1));
+	report.lost =          htonl(uint32(lostPackets()));
+	report.fractionLost =  htonl(fraction);
+	report.jitterUs =      htonl(uint32(audiobuf.getJitterMs() * 1000));
+	report.timestamp =     htonl(uint32(now));
+	report.echoTimestamp = htonl(peerReportTime ? peerTimestamp : 0);
+	report.echoDelayUs =   htonl(peerReportTime ? uint32(now - std::min(now, peerReportTime)) : 0);
+	report.transitUs =     htonl(transitCount ? transitBase + uint32(transitSum / int64(transitCount)) : 0);
+	memcpy(packet.data, &report, sizeof(report));
+	transitSum = 0;
+	transitCount = 0;
+
+	sendPacket((char*)&packet, offsetof(Packet,data) + sizeof(report), address);
+}
+
+void Phone::receiveReport(const Packet& packet, uint packetSize, uint64 arrival)
+{
+	if (packetSize < offsetof(Packet,data) + sizeof(Report))
+		return;
+
+	Report report;
+	memcpy(&report, packet.data, sizeof(report));
+
+	// Echo this one back in our next report
+	peerTimestamp = ntohl(report.timestamp);
+	peerReportTime = arrival;
+
+	++transportStats.reportsReceived;
+	transportStats.sentLost = ntohl(report.lost);
+	transportStats.sentLossPercent = ntohl(report.fractionLost) * 100.0 / 65536;
+	transportStats.sentJitterMs = ntohl(report.jitterUs) / 1000.0;
+
+	// Round trip from when our report went out to when the answer came back, less the time the peer held it
+	const uint32 echoTimestamp = ntohl(report.echoTimestamp);
+	if (echoTimestamp)
+	{
+		const uint32 rttUs = uint32(arrival) - echoTimestamp - ntohl(report.echoDelayUs);
+		if (rttUs <= uint64(RTT_MAX_MS) * Clock::MS)
+		{
+			transportStats.rttMs = double(rttUs) / Clock::MS;
+			transportStats.rttMaxMs = std::max(transportStats.rttMaxMs, transportStats.rttMs);
+		}
+	}
+
+	// Steer the encoder by how our packets are getting through
+	if (adaptiveBitrate)
+	{
+		const uint32 highestSeq = ntohl(report.highestSeq);
+		RateController::Feedback feedback;
+		feedback.lossPercent = transportStats.sentLossPercent;
+		feedback.rttMs = transportStats.rttMs;
+		feedback.haveTransit = highestSeq != peerHighestSeq;
+		feedback.transitUs = ntohl(report.transitUs);
+		peerHighestSeq = highestSeq;
+
+		if (rateControl.update(feedback, Clock::now()))
+			applyBitrate();
+	}
+}
+
 void Phone::sendPacket(char* buffer, int size, const sockaddr_storage& to)
 {
-	const int tosize = (to.ss_family == AF_INET) ? sizeof(sockaddr_in) : sizeof(sockaddr_in6);
-	int sent = sendto(sock, buffer, size, 0, (sockaddr*)&to, tosize);
+	int sent = transport->sendTo(buffer, size, to);
 	if (sent < 0)
 	{
-		log << "sendto error: " << Socket::getErrorString() << endl;
+		events.write(EventLog::SEND_ERROR, 0, Socket::getError());
 		int error = Socket::getError();
 		if (error != EWOULDBLOCK && error != ECONNABORTED && error != ECONNRESET)
 			throw std::runtime_error("sendto error: " + Socket::getErrorString());
 	}
 }
 
-void Phone::beginAudioStream(bool input, bool output)
+void Phone::sendQueuedPackets()
 {
-	assert(input || output);
+	if (!sendBatch.count())
+		return;
 
-	if (stream)
-		endAudioStream();
+	const uint queued = sendBatch.count();
+	int sent = transport->send(sendBatch);
+	if (sent < int(queued))
+	{
+		events.write(EventLog::SEND_ERROR, 0, Socket::getError());
+		int error = Socket::getError();
+		if (error != EWOULDBLOCK && error != ECONNABORTED && error != ECONNRESET)
+			throw std::runtime_error("sendto error: " + Socket::getErrorString());
+	}
 
-	const int inChannels = input ? CHANNELS : 0;
-	const int outChannels = output ? CHANNELS : 0;
+	measureCaptureLatency();
+}
 
-	PaError paErr;
-	paErr = Pa_OpenDefaultStream(&stream, inChannels, outChannels, paInt16, SAMPLE_RATE, PACKET_SAMPLES, NULL, NULL);
-	if (paErr)
-		throw std::runtime_error(string("Pa_OpenDefaultStream error: ") + Pa_GetErrorText(paErr));
+void Phone::sendRing(const sockaddr_storage& to)
+{
+	// Older versions send and expect just the header, and ignore the rest
+	Packet ring;
+	ring.header = htonl(Packet::RING);
+	ring.seq = 0;
+	ring.data[0] = byte(callParams.frameMs);
+	ring.data[1] = callParams.lowDelay;
+	sendPacket((char*)&ring, offsetof(Packet,data) + 2, to);
+}
 
-	paErr = Pa_StartStream(stream);
-	if (paErr)
-		throw std::runtime_error(string("Pa_StartStream error: ") + Pa_GetErrorText(paErr));
+Phone::CallParams Phone::parseRing(const Packet& packet, uint packetSize) const
+{
+	CallParams params;
+	if (packetSize >= offsetof(Packet,data) + 2)
+	{
+		params.frameMs = packet.data[0];
+		params.lowDelay = packet.data[1] != 0;
+		if (!params.isValid())
+			params = CallParams();
+	}
+	return params;
 }
 
-void Phone::writeAudioStream(void* buffer, ulong samples)
+Phone::CallParams Phone::parseAudioFraming(const Packet& packet, uint packetSize) const
 {
-	assert(stream);
-	PaError paErr = Pa_WriteStream(stream, buffer, samples);
-	if (paErr != paNoError)
+	// The frame duration is in every Opus packet, and only SILK or hybrid packets say low delay mode is off
+	CallParams params = callParams;
+	if (packetSize > offsetof(Packet,data))
 	{
-		if (paErr == paOutputUnderflowed)
-			log << "Pa_WriteStream output underflowed" << endl;
+		const opus_int32 size = opus_int32(packetSize - offsetof(Packet,data));
+		const int samples = opus_packet_get_nb_samples(packet.data, size, SAMPLE_RATE);
+		CallParams theirs = params;
+		theirs.frameMs = (samples > 0) ? uint(samples) / (SAMPLE_RATE / 1000) : 0;
+		if (theirs.isValid())
+			params.frameMs = theirs.frameMs;
+		if (!(packet.data[0] & 0x80))
+			params.lowDelay = false;
+	}
+	return params;
+}
+
+// Called by audioStartupTask, before the Phone thread can use the stream
+void Phone::openAudioStream()
+{
+	if (audioMode == AUDIO_CALLBACK)
+		audio->start(SAMPLE_RATE, 0, &audioCallback, this); //Let the device run at its own period
+	else
+		audio->start(SAMPLE_RATE, STREAM_BUFFER_SAMPLES, NULL, NULL);
+}
+
+void Phone::useAudioStream(StreamUse use)
+{
+	// The first ring can come in before audio has finished starting up
+	if (use != STREAM_IDLE)
+		finishAudioStartup();
+
+	// Until the audio task is joined, the stream isn't ours to use (it can only be unused anyway)
+	if (audioStartup.thread.isStarted() || !audio || use == streamUse)
+		return;
+
+	if (use == STREAM_LIVE)
+	{
+		// Throw away whatever the microphone picked up before the call
+		// (in callback mode nothing more is captured until streamUse is STREAM_LIVE)
+		if (audioMode == AUDIO_CALLBACK)
+		{
+			captureRing.discard(captureRing.readAvailable());
+		}
 		else
-			throw std::runtime_error(string("Pa_WriteStream failed: ") + Pa_GetErrorText(paErr));
+		{
+			opus_int16 stale[PACKET_SAMPLES_MAX];
+			long available;
+			while ((available = audio->readAvailable()) > 0)
+				audio->read(stale, std::min(available, long(PACKET_SAMPLES_MAX)));
+		}
+	}
+
+	// Nothing was written while idle, so the first blocking write is bound to underflow
+	if (streamUse == STREAM_IDLE)
+		outputPrimed = false;
+
+	streamUse = use;
+}
+
+bool Phone::readAudioStream(opus_int16* buffer, ulong samples)
+{
+	assert(audio);
+
+	if (audioMode == AUDIO_CALLBACK)
+	{
+		if (captureRing.readAvailable() < samples)
+			return false;
+		captureRing.read(buffer, samples);
+		return true;
+	}
+
+	if (audio->readAvailable() < long(samples))
+		return false;
+
+	// Every frame length is a whole number of the STREAM_BUFFER_SAMPLES the stream was opened with
+	audio->read(buffer, samples);
+	return true;
+}
+
+void Phone::writeAudioStream(void* buffer, ulong samples)
+{
+	assert(audio);
+
+	if (audioMode == AUDIO_CALLBACK)
+	{
+		// run() only produces as much audio as audioPacketsWanted() says there's room for
+		size_t written = playoutRing.write((const opus_int16*)buffer, samples);
+		assert(written == samples);
+		(void)written;
+		return;
 	}
+
+	if (!audio->write((const opus_int16*)buffer, samples) && outputPrimed)
+		events.write(EventLog::OUTPUT_UNDERFLOW);
+	outputPrimed = true;
+}
+
+uint Phone::audioPacketsWanted() const
+{
+	// In blocking mode each write waits for the device, so one packet per run()
+	if (audioMode == AUDIO_BLOCKING)
+		return 1;
+
+	// In callback mode keep AUDIO_QUEUE_PACKETS queued ahead of the callback
+	const size_t queued = playoutRing.readAvailable();
+	const size_t target = AUDIO_QUEUE_PACKETS * frameSamples;
+	return (queued < target) ? uint((target - queued) / frameSamples) : 0;
+}
+
+void Phone::measureCaptureLatency()
+{
+	if (audioMode != AUDIO_CALLBACK)
+		return;
+
+	// The newest sample just sent was captured captureRing.readAvailable() samples before captureTime
+	const double captured = captureTime.load() - double(captureRing.readAvailable()) / SAMPLE_RATE;
+	const double ms = (audio->getTime() - captured) * 1000.0;
+
+	latencySum += ms;
+	latencyMax = std::max(latencyMax, ms);
+	++latencyCount;
 }
 
-void Phone::endAudioStream()
+void Phone::audioCallback(const int16* input, int16* output, ulong frames, double time, bool overflow, void* phoneVoid)
 {
-	assert(stream);
-	PaError paErr = Pa_CloseStream(stream);
-	if (paErr)
-		throw std::runtime_error(string("Pa_CloseStream error: ") + Pa_GetErrorText(paErr));
-	stream = NULL;
+	// This runs in the audio device's realtime thread: no locks, allocations, logging or exceptions
+	// (Waker::signal is a single non-blocking write)
+	Phone* phone = reinterpret_cast<Phone*>(phoneVoid);
+	const int use = phone->streamUse.load();
+
+	if (use == STREAM_LIVE)
+	{
+		if (phone->captureRing.write(input, frames) < frames || overflow)
+			++phone->overruns;
+		phone->captureTime.store(time);
+		if (phone->captureRing.readAvailable() >= phone->frameSamples)
+			phone->waker.signal();
+	}
+
+	if (use == STREAM_IDLE)
+	{
+		// Between calls play silence, and drop anything the last call left queued
+		phone->playoutRing.discard(phone->playoutRing.readAvailable());
+		memset(output, 0, frames * sizeof(int16));
+	}
+	else
+	{
+		phone->playoutRing.discardUntil(phone->playoutStart.load());
+		size_t played = phone->playoutRing.read(output, frames);
+		if (played < frames)
+		{
+			memset(output + played, 0, (frames - played) * sizeof(int16));
+			++phone->underruns;
+		}
+		if (phone->playoutRing.readAvailable() < AUDIO_QUEUE_PACKETS * phone->frameSamples)
+			phone->waker.signal();
+	}
 }
 
 
@@ -4,12 +4,22 @@
 #pragma once
 
 #include "PhoneCommon.h"
-#include "Mutex.h"
+#include "AudioDevice.h"
+#include "Clock.h"
+#include "DatagramBatch.h"
+#include "EventLog.h"
+#include "JitterBuffer.h"
+#include "LogStream.h"
+#include "RingBuffer.h"
+#include "Seqlock.h"
+#include "Thread.h"
+#include "NatPmp.h"
+#include "RateController.h"
 #include "Router.h"
 #include "Socket.h"
-#include <deque>
+#include "Transport.h"
+#include "TimeStretch.h"
 #include <opus.h>
-#include <portaudio.h>
 
 namespace tincan {
 
@@ -19,14 +29,35 @@ enum Constants {
 	PORT_MAX     = 56789,
 	CHANNELS = 1,               //1 channel (mono) audio
 	SAMPLE_RATE = 48000,        //48kHz, the number of 16-bit samples per second
-	PACKET_MS = 20,             //How long a single packet of samples is (20ms recommended by Opus)
-	PACKET_SAMPLES = 960,       //Samples per packet (48kHz * 0.020s = 960 samples)
-	ENCODED_MAX_BYTES = 240,    //Max size of a single packet's data once compressed (capacity of opus_encode buffer)
-	BUFFERED_PACKETS_MIN = 2,   //How many packets to build up before we start playing audio
-	BUFFERED_PACKETS_MAX = 5,   //When too many packets have built up and we start skipping them to speed up playback
+	PACKET_MS = 20,             //Default length of a packet of samples (20ms recommended by Opus), also used for ringtones
+	PACKET_SAMPLES = 960,       //Samples per default packet (48kHz * 0.020s = 960 samples)
+	PACKET_MS_MAX = 60,         //Longest packet a call can negotiate (see Phone::CallParams)
+	PACKET_SAMPLES_MAX = 2880,  //Samples in the longest packet (48kHz * 0.060s)
+	ENCODED_BYTES_PER_MS = 12,  //Max compressed data per ms of audio (240 bytes per 20ms packet)
+	ENCODED_MAX_BYTES = 720,    //Max size of a single packet's data once compressed (PACKET_MS_MAX * ENCODED_BYTES_PER_MS)
+	JITTER_BUFFER_PACKETS = 64, //Capacity of the received audio JitterBuffer
+	BUFFERED_PACKETS_SKIP = 10, //Last resort when this many packets beyond JitterBuffer::targetDelay build up: skip them
+	STRETCH_PERCENT = 5,        //How much faster/slower than realtime to play to drain/grow the jitter buffer
+	STRETCH_HOP = 240,          //TimeStretch splice interval (5ms)
+	STRETCH_TOLERANCE = 240,    //How far TimeStretch searches for a good splice (5ms)
+	STRETCH_CAPACITY = 5760,    //TimeStretch queue size (2 of the longest packets)
+	EXPECTED_LOSS_PERC = 10,    //Packet loss the encoder's in-band FEC is tuned for
 	DISCONNNECT_TIMEOUT = 5000, //How long to wait for valid AUDIO packets before we time out and disconnect
 	RING_PACKET_INTERVAL = 500, //How often to repeat RING packet
-	UPNP_TIMEOUT_MS = 8000      //Timeout to use when doing UPnP discovery
+	REPORT_INTERVAL = 1000,     //How often to send a REPORT packet during a call
+	RTT_MAX_MS = 10000,         //Longer round trips than this are taken to be a mismatched echo and ignored
+	AUDIO_RING_PACKETS = 8,     //Capacity of each callback mode PCM ring, in packets
+	AUDIO_QUEUE_PACKETS = 2,    //How many packets of playout we queue ahead of the audio callback
+	STREAM_BUFFER_SAMPLES = 240, //Blocking mode device buffer (5ms, the shortest frame, so every frame is a whole number)
+	RECV_BATCH_PACKETS = 16,    //Max packets read per recvmmsg call
+	SEND_BATCH_PACKETS = 8,     //Max AUDIO packets sent per sendmmsg call
+	LOG_CAPACITY = 8192,        //Bytes of free-form log text the Phone thread can write between run() iterations
+	EVENT_LOG_CAPACITY = 1024,  //Events kept until readLog() is called, beyond that they are dropped
+	COMMAND_QUEUE_SIZE = 16,    //Commands setCommand can queue before the Phone thread gets to them
+	ADDRESS_MAX = 64,           //Longest address setCommand accepts, including the port
+	UPNP_TIMEOUT_MS = 8000,     //Timeout to use when doing UPnP discovery
+	NATPMP_TIMEOUT_MS = 2000,   //How long to retransmit NAT-PMP/PCP requests before giving up on the gateway
+	MAPPING_WAIT_MS = 10        //How often a port mapping task checks if the other one finished trying
 };
 
 
@@ -39,123 +70,351 @@ public:
 };
 
 
+// The phone engine; frontends (Gtk, Windows and the headless Cli) only use its public methods
 class Phone
 {
 public:
 	enum State { STARTING, HUNGUP, DIALING, RINGING, LIVE, EXITED, EXCEPTION };
 
+	enum AudioMode {
+		AUDIO_BLOCKING, //AudioDevice::read/write in the Phone thread
+		AUDIO_CALLBACK  //AudioDevice callback exchanging PCM with the Phone thread via lock-free rings
+	};
+
+	struct AudioStats
+	{
+		ulong  underruns;    //Output callbacks that found less than a buffer of playout ready
+		ulong  overruns;     //Input callbacks that found the capture ring full
+		double latencyMs;    //Average time from capture callback to sendto, over the current/last call
+		double latencyMaxMs;
+		double jitterMs;         //Interarrival jitter of received AUDIO packets
+		uint   targetDelayMs;    //Playout delay the jitter buffer is aiming for
+		uint   bufferedMs;       //Playout delay it has right now
+		ulong  latePackets;      //Received after their turn to play
+		ulong  discardedPackets; //Duplicates, oversized or too far ahead
+		ulong  fecRecovered;     //Missing packets rebuilt from the next packet's in-band FEC
+		ulong  concealed;        //Frames the decoder made up, for missing or corrupt packets or while buffering
+		ulong  skippedPackets;   //Dropped unplayed to catch up after too many built up
+		double connectMs;        //How long going LIVE took, from the answer or first AUDIO packet
+		AudioStats() : underruns(0), overruns(0), latencyMs(0), latencyMaxMs(0),
+		               jitterMs(0), targetDelayMs(0), bufferedMs(0), latePackets(0), discardedPackets(0), fecRecovered(0), concealed(0),
+		               skippedPackets(0), connectMs(0)  {}
+	};
+
+	// Link quality of the current/last call, from the REPORT packets the two ends exchange every REPORT_INTERVAL
+	// The sent* fields are the peer's view of the packets we send it; they stay 0 if the peer doesn't send REPORTs
+	struct TransportStats
+	{
+		double rttMs;           //Round trip time, from the latest REPORT; 0 until measured
+		double rttMaxMs;
+		ulong  received;        //AUDIO packets received, including late and duplicate ones
+		ulong  lost;            //AUDIO packets never received, as far as the sequence numbers tell
+		double lossPercent;     //Over the last REPORT_INTERVAL
+		double jitterMs;        //Interarrival jitter of the AUDIO packets we receive
+		ulong  sentLost;
+		double sentLossPercent;
+		double sentJitterMs;
+		ulong  reportsSent;
+		ulong  reportsReceived;
+		bool   timestamped;     //Arrival times come from the kernel (SO_TIMESTAMPNS), not from when we read the packet
+		uint   bitrate;         //What RateController has the encoder send, 0 if adaptive bitrate is off
+		uint   fecLossPercent;  //Loss the encoder's in-band FEC is set to cover
+		double queuingMs;       //Queuing delay on the way to the peer, as estimated from its REPORTs
+		ulong  bitrateChanges;
+		TransportStats() : rttMs(0), rttMaxMs(0), received(0), lost(0), lossPercent(0), jitterMs(0),
+		                   sentLost(0), sentLossPercent(0), sentJitterMs(0), reportsSent(0), reportsReceived(0), timestamped(false),
+		                   bitrate(0), fecLossPercent(0), queuingMs(0), bitrateChanges(0)  {}
+	};
+
+	// Per-call audio framing, proposed by the caller in its RING packets
+	struct CallParams
+	{
+		uint frameMs;  //5, 10, 20, 40 or 60; short frames cut latency, long ones cut packet overhead
+		bool lowDelay; //OPUS_APPLICATION_RESTRICTED_LOWDELAY instead of OPUS_APPLICATION_VOIP
+		CallParams() : frameMs(PACKET_MS), lowDelay(false)  {}
+		bool isValid() const  {return frameMs == 5 || frameMs == 10 || frameMs == 20 || frameMs == 40 || frameMs == 60;}
+	};
+
+	// What goes over the wire, public for hosts that talk to phones (see Conference)
+	// header and seq are in network byte order on the wire
+	struct Packet
+	{
+		enum Header { RING = 4000, BUSY, AUDIO, HANGUP, REPORT }; //Older versions ignore REPORT
+		uint32 header;
+		uint32 seq; //AUDIO packet sequence number, wraparound is handled by JitterBuffer; REPORT count
+		byte   data[ENCODED_MAX_BYTES]; //AUDIO packet payload, RING packet CallParams (frameMs, lowDelay), or a Report
+	};
+
+	// Whether an AUDIO payload carries the frame before it as in-band FEC (SILK's LBRR)
+	// Without it opus_decode's FEC mode just conceals; same as opus_packet_has_lbrr, which libopus only has from 1.5
+	static bool hasFec(const byte* payload, uint size);
+
 	enum Command {
 		CMD_NONE,
-		CMD_CALL,   //Send outgoing call to addressIn when HUNGUP or RINGING
+		CMD_CALL,   //Send outgoing call to the given address when HUNGUP or RINGING
 		CMD_ANSWER, //Answer incoming call when RINGING
 		CMD_HANGUP, //End call when LIVE or DIALING
 		CMD_EXIT    //Exit the phone thread
 	};
 
-	// These methods should only be called by the user thread, note that they lock Phone.mutex
-	Phone::State getState() const
+	// Wall time of each startup phase, measured from the start of startup(); 0 until the phase is done
+	struct StartupTimes
 	{
-		Scopelock lock(mutex);
-		return stateOut;
-	}
-	
-	void setCommand(Command cmd, const string& addr = "")
+		double socketMs; //Local UDP port bound
+		double readyMs;  //HUNGUP, so LAN calls can be made
+		double audioMs;  //PortAudio initialized and devices found (in the background)
+		double routerMs; //Router port mapping by UPnP or NAT-PMP/PCP finished or failed (in the background)
+		StartupTimes() : socketMs(0), readyMs(0), audioMs(0), routerMs(0)  {}
+	};
+
+	// Everything the user thread can see of the Phone thread, published as one consistent snapshot
+	struct Status
 	{
-		Scopelock lock(mutex);
-		commandIn = cmd;
-		addressIn = addr;
-	}
+		State            state;
+		sockaddr_storage peer;  //Who we are calling, ringing or talking to
+		AudioStats       audio;
+		TransportStats   transport;
+		StartupTimes     startup;
+		// Running counts, so a frontend that polls can tell what happened even if it missed a state
+		ulong            commands;       //Commands handled, including ones that were ignored
+		ulong            calls;          //Calls dialed or rung
+		ulong            connectedCalls; //Calls that went LIVE
+		Status() : state(STARTING), peer(), commands(0), calls(0), connectedCalls(0)  {}
+	};
+
+	// These methods should only be called by the user thread; none of them lock or wait on the Phone thread
+	Status getStatus() const  {return statusOut.load();}
+	Phone::State getState() const  {return statusOut.load().state;}
+	AudioStats getAudioStats() const  {return statusOut.load().audio;}
+	TransportStats getTransportStats() const  {return statusOut.load().transport;}
 	
-	string readLog()
+	// Commands are queued and handled in order; returns false if the queue is full and cmd was dropped
+	bool setCommand(Command cmd, const string& addr = "")
 	{
-		Scopelock lock(mutex);
-		string copy = logOut;
-		logOut.clear();
-		return copy;
+		CommandMsg msg;
+		msg.command = cmd;
+		msg.address[0] = '\0';
+		if (addr.size() < sizeof(msg.address)) //Too long to be valid, so leave empty to be rejected
+			memcpy(msg.address, addr.c_str(), addr.size() + 1);
+
+		if (!commandsIn.write(&msg, 1))
+			return false;
+		waker.signal();
+		return true;
 	}
 	
+	// Lock-free, formats any new events; only one thread may read the log
+	string readLog()  {return events.read();}
+	
+	// Only set once the state is EXCEPTION
 	string getErrorMessage() const
 	{
-		Scopelock lock(mutex);
-		return errorMessage;
+		return (getState() == EXCEPTION) ? errorMessage : string();
+	}
+
+	// Takes effect from the next call we place
+	void setCallParams(const CallParams& params)
+	{
+		if (!params.isValid())
+			throw std::runtime_error("Unsupported frame duration " + toString(params.frameMs) + "ms");
+		callParamsIn.store(params);
 	}
 
 	// This loop runs in its own thread
 	int mainLoop() throw();
 
+	// Simulations call these from their own thread instead of mainLoop, with Clock::setVirtual:
+	// startup() once, then step() whenever the clock, network or audio device has moved on
+	// step() handles whatever is due without waiting, and returns false once CMD_EXIT is handled; errors are thrown
+	void startup();
+	bool step()  {return run();}
+
 	// These are called before/after the Phone.mainLoop thread runs
 	void setUpdateHandler(UpdateHandler* handler)  {updateHandler = handler;}
+	void setAudioMode(AudioMode mode)  {audioMode = mode;}
+	void setAudioDevice(AudioDevice* device)  {delete audio; audio = device;} //Takes ownership; PortAudio if not set
+	void disablePortMapping()  {portMapping = false;} //Skip UPnP and NAT-PMP/PCP, for LAN use or a port forwarded by hand
+	void disableAdaptiveBitrate()  {adaptiveBitrate = false;} //Leave the encoder at Opus's default bitrate whatever the network does
+	void setTransport(Transport* t)  {delete transport; transport = t;} //Takes ownership; a UDP socket if not set
+	void setFirstSeq(uint32 seq)  {firstSeq = seq;} //AUDIO seq numbers start here instead of 1, both ends must agree; lets a simulation reach wraparound
 	
 	Phone();
 	~Phone();
 
 protected:
-	mutable Mutex mutex;
+	struct CommandMsg
+	{
+		Command command;
+		char    address[ADDRESS_MAX]; //CMD_CALL address as typed by the user
+	};
 
-	// Must lock mutex before using these members!
-	Command      commandIn;
-	string       addressIn;
-	State        stateOut;
-	string       logOut;
-	string       errorMessage;
+	// Shared with the user thread, all lock-free
+	RingBuffer<CommandMsg> commandsIn;   //Written by setCommand, drained every run()
+	Seqlock<CallParams>    callParamsIn;
+	Seqlock<Status>        statusOut;    //Published by publishOutput()
+	string                 errorMessage; //Written before EXCEPTION is published, never changed after
+	EventLog               events;       //Written by the Phone thread and read by readLog()
 
-	// The rest do not have public accessors so no mutex requirement
+	// Signalled by setCommand (and the audio callback) to wake up the Phone thread
+	Waker        waker;
+
+	// The rest are only used by the Phone thread
 
 	UpdateHandler*     updateHandler;
-	std::ostringstream log;
+	LogStream          log;
 	State              state;
+	State              publishedState;
 	sockaddr_storage   address;
 
-	struct Packet
-	{
-		enum Header { RING = 4000, BUSY, AUDIO, HANGUP };
-		uint32 header;
-		uint32 seq; //AUDIO packet sequence number, 32 bits is enough for ~1000 days of 20ms packets
-		byte   data[ENCODED_MAX_BYTES]; //AUDIO packet payload
-	};
-
-	struct AudioPacket
+	// REPORT packet data, a receiver report in the spirit of RTCP's; all in network byte order
+	// The echo lets the peer work out the round trip time: now - echoTimestamp - echoDelayUs
+	struct Report
 	{
-		uint32 seq;
-		byte   data[ENCODED_MAX_BYTES];
-		uint   datasize;
-		AudioPacket() : datasize(0)  {}
-		bool operator == (uint32 rhs)  {return seq == rhs;} //For std::find
+		uint32 highestSeq;    //Newest AUDIO seq received
+		uint32 lost;          //AUDIO packets lost over the whole call
+		uint32 fractionLost;  //Of the packets expected since the previous REPORT, in 1/65536ths
+		uint32 jitterUs;      //Interarrival jitter of AUDIO packets
+		uint32 timestamp;     //Sender's Clock when sent (the low 32 bits)
+		uint32 echoTimestamp; //timestamp of the last REPORT received, 0 if none yet
+		uint32 echoDelayUs;   //How long before sending this one it arrived
+		uint32 transitUs;     //Mean arrival time less seq times packet duration, of the AUDIO packets since the previous REPORT
 	};
 
-	typedef std::deque<AudioPacket> AudioBuffer;
-	AudioBuffer  audiobuf;
+	JitterBuffer audiobuf;
+	uint32       firstSeq;
 	uint32       sendseq;
+	CallParams   localParams; //What we propose when dialing
+	CallParams   callParams;  //What the current call uses
+	std::atomic<uint> frameSamples; //Samples per packet of the audio stream: callParams when LIVE, PACKET_SAMPLES when ringing
 
 	uint         ringToneTimer;
-	uint         ringPacketTimer;
-	uint         disconnectTimer;
+	uint64       ringPacketDeadline; //DIALING: when to send the next RING, RINGING: when to give up on the caller
+	uint64       disconnectDeadline; //LIVE: when to give up waiting for AUDIO packets
+	ulong        commandCount;
+	ulong        callCount;
+	ulong        connectedCount;
 	bool         increaseBuffering;
 	uint         missedPackets;
-
-	Router*      router;
-	SOCKET       sock;
+	ulong        fecRecovered;
+	ulong        concealed;
+	ulong        skippedPackets;
+	TimeStretch  stretcher;
+
+	// REPORT packets and what they tell us, see sendReport
+	uint64       reportDeadline;  //LIVE: when to send the next REPORT
+	ulong        receivedPackets;
+	uint64       expectedPrior;   //Expected and received AUDIO packets when the previous REPORT was sent
+	ulong        receivedPrior;
+	uint32       peerTimestamp;   //From the peer's last REPORT, to echo
+	uint64       peerReportTime;  //When that arrived, 0 if none has
+	TransportStats transportStats;
+
+	// Transit times of AUDIO packets since the last REPORT we sent, relative to the first
+	uint32       transitBase;
+	int64        transitSum;
+	uint         transitCount;
+
+	// Sets the encoder's bitrate, FEC and bandwidth from the peer's REPORTs
+	RateController rateControl;
+	bool         adaptiveBitrate;
+	uint32       peerHighestSeq; //From the peer's last REPORT, so we can tell if it got anything since
+
+	// Slow startup phases run in their own threads, so the phone is usable as soon as the socket is bound
+	// A task only touches its own members until it sets done; the Phone thread then joins it
+	struct StartupTask
+	{
+		Thread            thread;
+		std::atomic<bool> done;
+		string            error;
+		double            ms;
+		PortMapper*       mapper; //Port mapping tasks: set if this one mapped our port
+		StartupTask() : done(false), ms(0), mapper(NULL)  {}
+	};
+	StartupTask  audioStartup;  //Audio device setup, opening the stream
+	StartupTask  upnpStartup;   //Router discovery and port mapping by UPnP...
+	StartupTask  natpmpStartup; //...raced against NAT-PMP/PCP; the first to map a port wins
+	StartupTask  renewal;       //Renewing portMapper's mapping, off the Phone thread too since the router may be slow
+
+	// Which port mapping task holds the claim to map our port; the other waits while it tries
+	enum MappingState { MAPPING_NONE, MAPPING_BUSY, MAPPING_DONE };
+	std::atomic<int> mappingState;
+
+	uint64       startupTime;
+	StartupTimes startupTimes;
+	bool         startupReported;
+	uint16       localPort;
+
+	bool         portMapping;
+	PortMapper*  portMapper; //Whichever of the port mapping tasks won
+	string       wanAddress; //Where peers reach us through it, as last logged
+	Transport*   transport;
+	uint64       transportDeadline; //When the transport's own timers need transport->service(), 0 if never
+	DatagramBatch recvBatch;
+	DatagramBatch sendBatch;
+
+	// The codecs live in memory allocated once; startup() initializes them and each call just resets them
+	vector<byte> encoderMem;
+	vector<byte> decoderMem;
 	OpusEncoder* encoder;
 	OpusDecoder* decoder;
-	PaStream*    stream;
+	int          encoderApplication; //What the encoder was last initialized for
+	double       connectMs;
+
+	// One stream is opened during audio startup and runs until we exit, full duplex unless only output would open
+	// streamUse tells audioCallback what it's for; between calls it plays silence and ignores the microphone
+	enum StreamUse { STREAM_IDLE, STREAM_RINGING, STREAM_LIVE };
+	AudioDevice* audio;
+	AudioMode    audioMode;
+	bool         outputPrimed; //Blocking mode: set by the first write since the stream was idle
+
+	// Shared with audioCallback, which runs in the audio device's (realtime) thread
+	std::atomic<int>       streamUse;
+	RingBuffer<opus_int16> captureRing;
+	RingBuffer<opus_int16> playoutRing;
+	std::atomic<size_t>    playoutStart; //playoutRing.mark() when the call went LIVE; the ringtone before it is dropped
+	std::atomic<ulong>     underruns;
+	std::atomic<ulong>     overruns;
+	std::atomic<double>    captureTime; //Stream time of the latest sample put in captureRing
+
+	// Callback-to-wire latency accumulated by the Phone thread
+	double       latencySum;
+	double       latencyMax;
+	ulong        latencyCount;
 
 	opus_int16   silence[PACKET_SAMPLES];
 	opus_int16   ringToneIn[PACKET_SAMPLES];
 	opus_int16   ringToneOut[PACKET_SAMPLES];
 
 
-	void startup();
+	void generateTones();
+	void finishStartup();
+	void finishAudioStartup();
+	void reportAudioStartup();
+	void finishPortMapping(StartupTask& task);
+	void renewPortMapping(uint64 now);
+	static void renewalTask(void* phone);
+	static void audioStartupTask(void* phone);
+	static void upnpStartupTask(void* phone);
+	static void natpmpStartupTask(void* phone);
+	void mapPort(PortMapper* mapper, StartupTask& task);
 	bool run();
+	bool handleCommand(CommandMsg& msg);
+	void publishOutput();
+	void waitForEvents();
 
+	void initEncoder(int application);
+	void applyBitrate();
 	void hangup();
 	void dial();
 	void startRinging();
 	void goLive();
 
-	void receivePacket(const Packet& packet, uint packetSize, const sockaddr_storage& fromAddr);
-	void bufferReceivedAudio(const Packet& packet, uint packetSize);
+	void receiveDatagram(byte* data, uint size, const sockaddr_storage& fromAddr, uint64 arrival = 0);
+	void receivePacket(const Packet& packet, uint packetSize, const sockaddr_storage& fromAddr, uint64 arrival);
+	void bufferReceivedAudio(const Packet& packet, uint packetSize, uint64 arrival);
 
 	void playReceivedAudio();
+	uint decodeReceivedAudio(opus_int16* decoded, double& speed);
 	void playRingtone();
 
 	void sendPacket(Packet::Header header, const sockaddr_storage& to)
@@ -165,10 +424,25 @@ protected:
 	}
 
 	void sendPacket(char* buffer, int size, const sockaddr_storage& to);
+	void sendQueuedPackets();
+
+	void       sendRing(const sockaddr_storage& to);
+	CallParams parseRing(const Packet& packet, uint packetSize) const;
+	CallParams parseAudioFraming(const Packet& packet, uint packetSize) const;
 
-	void beginAudioStream(bool input, bool output);
+	void       sendReport();
+	void       receiveReport(const Packet& packet, uint packetSize, uint64 arrival);
+	uint64     expectedPackets() const;
+	ulong      lostPackets() const;
+
+	void openAudioStream();
+	void useAudioStream(StreamUse use);
+	bool readAudioStream(opus_int16* buffer, ulong samples);
 	void writeAudioStream(void* buffer, ulong samples);
-	void endAudioStream();
+	uint audioPacketsWanted() const;
+	void measureCaptureLatency();
+
+	static void audioCallback(const int16* input, int16* output, ulong frames, double time, bool overflow, void* phoneVoid);
 };
 
 
@@ -13,6 +13,8 @@ namespace tincan {
 	typedef signed short   int16;
 	typedef unsigned int   uint32;
 	typedef signed int     int32;
+	typedef unsigned long long uint64;
+	typedef signed long long   int64;
 }
 #else
 #include <stdint.h>
@@ -24,6 +26,8 @@ namespace tincan {
 	typedef int16_t        int16;
 	typedef uint32_t       uint32;
 	typedef int32_t        int32;
+	typedef uint64_t       uint64;
+	typedef int64_t        int64;
 }
 #endif
 
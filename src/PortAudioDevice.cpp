@@ -0,0 +1,128 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "PortAudioDevice.h"
+#include <algorithm>
+
+namespace tincan {
+
+
+PortAudioDevice::PortAudioDevice()
+: stream(NULL),
+  callback(NULL),
+  callbackArg(NULL),
+  input(true),
+  silent(0)
+{
+	PaError paErr = Pa_Initialize();
+	if (paErr)
+		throw std::runtime_error(string("Could not start audio. Pa_Initialize error: ") + Pa_GetErrorText(paErr));
+
+	// Backends like ALSA probe every device here
+	const PaDeviceInfo* in = Pa_GetDeviceInfo( Pa_GetDefaultInputDevice() );
+	const PaDeviceInfo* out = Pa_GetDeviceInfo( Pa_GetDefaultOutputDevice() );
+	inputName = in ? in->name : "(none)";
+	outputName = out ? out->name : "(none)";
+}
+
+PortAudioDevice::~PortAudioDevice()
+{
+	// Close stream and cleanup portaudio (ignore errors)
+	if (stream)
+		Pa_CloseStream(stream);
+	Pa_Terminate();
+}
+
+void PortAudioDevice::start(uint sampleRate, ulong framesPerBuffer, Callback callbackFunc, void* arg)
+{
+	callback = callbackFunc;
+	callbackArg = arg;
+
+	PaError paErr = paNoDevice;
+	if (Pa_GetDefaultInputDevice() != paNoDevice)
+		paErr = Pa_OpenDefaultStream(&stream, 1, 1, paInt16, sampleRate, framesPerBuffer,
+		                             callback ? &streamCallback : NULL, this);
+	if (paErr)
+	{
+		// No microphone, or it won't open with the speakers: calls can still be heard, and send silence
+		const string duplexError = Pa_GetErrorText(paErr);
+		stream = NULL;
+		input = false;
+		silence.assign(SILENCE_FRAMES, 0);
+		paErr = Pa_OpenDefaultStream(&stream, 0, 1, paInt16, sampleRate, framesPerBuffer,
+		                             callback ? &streamCallback : NULL, this);
+		if (paErr)
+		{
+			stream = NULL;
+			throw std::runtime_error("Could not open audio stream: " + duplexError + ", or output alone: " + Pa_GetErrorText(paErr));
+		}
+	}
+
+	paErr = Pa_StartStream(stream);
+	if (paErr)
+		throw std::runtime_error(string("Could not start audio stream: ") + Pa_GetErrorText(paErr));
+}
+
+double PortAudioDevice::getTime() const
+{
+	return Pa_GetStreamTime(stream);
+}
+
+long PortAudioDevice::readAvailable()
+{
+	// Without input, silence is captured as fast as output is played
+	if (!input)
+		return silent;
+	return Pa_GetStreamReadAvailable(stream);
+}
+
+void PortAudioDevice::read(int16* buffer, ulong frames)
+{
+	if (!input)
+	{
+		memset(buffer, 0, frames * sizeof(int16));
+		silent -= std::min(silent, long(frames));
+		return;
+	}
+
+	PaError paErr = Pa_ReadStream(stream, buffer, frames);
+	if (paErr && paErr != paInputOverflowed)
+		throw std::runtime_error(string("Pa_ReadStream error: ") + Pa_GetErrorText(paErr));
+}
+
+bool PortAudioDevice::write(const int16* buffer, ulong frames)
+{
+	if (!input)
+		silent = std::min(silent + long(frames), long(SILENCE_MAX));
+
+	PaError paErr = Pa_WriteStream(stream, buffer, frames);
+	if (paErr == paOutputUnderflowed)
+		return false;
+	if (paErr)
+		throw std::runtime_error(string("Pa_WriteStream failed: ") + Pa_GetErrorText(paErr));
+	return true;
+}
+
+int PortAudioDevice::streamCallback(const void* input, void* output, ulong frames,
+                                    const PaStreamCallbackTimeInfo* timeInfo, PaStreamCallbackFlags flags, void* deviceVoid)
+{
+	PortAudioDevice* device = reinterpret_cast<PortAudioDevice*>(deviceVoid);
+	if (device->input)
+	{
+		device->callback((const int16*)input, (int16*)output, frames, timeInfo->currentTime, (flags & paInputOverflow) != 0, device->callbackArg);
+		return paContinue;
+	}
+
+	// Output only: hand over silence as the input, as many times as it takes to cover the buffer
+	int16* out = (int16*)output;
+	for (ulong done = 0; done < frames; )
+	{
+		const ulong chunk = std::min(frames - done, ulong(device->silence.size()));
+		device->callback(&device->silence[0], out + done, chunk, timeInfo->currentTime, false, device->callbackArg);
+		done += chunk;
+	}
+	return paContinue;
+}
+
+
+}
@@ -0,0 +1,54 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+#include "AudioDevice.h"
+#include <portaudio.h>
+
+namespace tincan {
+
+
+// The system's default input and output through PortAudio
+class PortAudioDevice : public AudioDevice
+{
+public:
+	// Initializes PortAudio and finds the default devices, which can be slow; throws on failure
+	PortAudioDevice();
+	~PortAudioDevice();
+
+	string getInputName() const   {return inputName;}
+	string getOutputName() const  {return outputName;}
+	bool   hasInput() const  {return input;}
+
+	void   start(uint sampleRate, ulong framesPerBuffer, Callback callback, void* arg);
+	double getTime() const;
+	long   readAvailable();
+	void   read(int16* buffer, ulong frames);
+	bool   write(const int16* buffer, ulong frames);
+
+protected:
+	enum {
+		SILENCE_FRAMES = 1024,  //Output only, callback mode: silence handed over per callback at most
+		SILENCE_MAX = 48000     //Output only, blocking mode: silence queued at most, like a full input buffer
+	};
+
+	PaStream* stream;
+	string    inputName;
+	string    outputName;
+	Callback  callback;
+	void*     callbackArg;
+	bool      input;
+	vector<int16> silence; //Output only: stands in for the input the callback expects
+	long      silent;      //Output only, blocking mode: samples written and not yet read back as silence
+
+	static int streamCallback(const void* input, void* output, ulong frames,
+	                          const PaStreamCallbackTimeInfo* timeInfo, PaStreamCallbackFlags flags, void* device);
+
+	PortAudioDevice(const PortAudioDevice&);
+	PortAudioDevice& operator = (const PortAudioDevice&);
+};
+
+
+}
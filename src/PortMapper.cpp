@@ -0,0 +1,22 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "PortMapper.h"
+
+namespace tincan {
+
+
+uint16 PortMapper::mapAnyPort(uint16 localPort, uint16 firstWanPort, uint16 lastWanPort, MapProto protocol, const char* descript)
+{
+	for (uint wanPort = firstWanPort; wanPort <= lastWanPort; ++wanPort)
+	{
+		// Returns FALSE if port in use
+		if ( setPortMapping(localPort, uint16(wanPort), protocol, descript) )
+			return getMappedPort();
+	}
+
+	throw std::runtime_error("Could not find an available port on router");
+}
+
+
+}
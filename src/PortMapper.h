@@ -0,0 +1,50 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+
+namespace tincan {
+
+
+// A way of asking the router (or other such NAT device) to forward a port to us
+class PortMapper
+{
+public:
+	virtual ~PortMapper()  {}
+
+	// Name of the protocol in use, for the log
+	virtual const char* getName() const = 0;
+
+	// Returns the public IP as reported by the router
+	virtual string getWanAddress() const = 0;
+
+	enum MapProto { MAP_TCP, MAP_UDP };
+
+	// Returns TRUE on success, FALSE if port in use, throws if error
+	// The router may pick a different WAN port than asked for, see getMappedPort()
+	virtual bool setPortMapping(uint16 localPort, uint16 wanPort, MapProto protocol, const char* descript) = 0;
+
+	// WAN port of the current mapping, or 0 if none
+	virtual uint16 getMappedPort() const = 0;
+
+	// Clears previously set port mapping if any, throws if error
+	virtual void clearPortMapping() = 0;
+
+	// When renewPortMapping() must be called to keep the mapping, or 0 if it lasts until cleared
+	virtual uint64 getRenewTime() const  {return 0;}
+
+	// Extends the current mapping, throws if error; the router may move it to another WAN port
+	virtual void renewPortMapping()  {}
+
+	// Tries each WAN port from firstWanPort to lastWanPort until one is free, and returns the one mapped
+	// Throws if they're all in use, or on any other error
+	uint16 mapAnyPort(uint16 localPort, uint16 firstWanPort, uint16 lastWanPort, MapProto protocol, const char* descript);
+
+protected:
+	static const char* getProtoStr(MapProto proto)  {return (proto == MAP_TCP) ? "TCP" : "UDP";}
+};
+
+
+}
@@ -0,0 +1,136 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "RateController.h"
+#include "Clock.h"
+#include <algorithm>
+#include <cmath>
+
+namespace tincan {
+
+
+RateController::RateController()
+: transitHistory(BASE_HISTORY)
+{
+	reset();
+}
+
+void RateController::reset()
+{
+	decision = Decision();
+	decision.bitrate = START_BITRATE;
+	decision.lossPercent = START_LOSS_PERCENT;
+	decision.bandwidth = bandwidthFor(START_BITRATE);
+	changes = 0;
+	holdUntil = 0;
+	smoothedLoss = START_LOSS_PERCENT;
+	haveTransit = false;
+	lastTransit = 0;
+	transit = 0;
+	lastQueuingMs = 0;
+	historyCount = 0;
+}
+
+bool RateController::update(const Feedback& feedback, uint64 now)
+{
+	const Decision previous = decision;
+
+	// Queuing delay is how far transit time is above the least seen lately; only the peer's packets
+	// that arrived since its last REPORT tell us anything new
+	double trendMs = 0;
+	if (feedback.haveTransit)
+	{
+		addTransit(feedback.transitUs);
+		decision.queuingMs = double(transit - baseTransit()) / Clock::MS;
+		trendMs = decision.queuingMs - lastQueuingMs;
+		lastQueuingMs = decision.queuingMs;
+	}
+	decision.trendMs = trendMs;
+
+	const double queuingMs = decision.queuingMs;
+	const double loss = feedback.lossPercent;
+	double bitrate = decision.bitrate;
+
+	if ((queuingMs > QUEUE_TARGET_MS && trendMs > 0) || (queuingMs > QUEUE_MAX_MS && trendMs > -QUEUE_TARGET_MS))
+	{
+		// A queue is building, or a long one isn't draining fast: back off before it's long enough to drop packets
+		decision.reason = DECREASE_DELAY;
+		bitrate *= 1.0 - (queuingMs > QUEUE_MAX_MS ? 2 : 1) * DECREASE_PERCENT / 100.0;
+	}
+	else if (loss > LOSS_HIGH_PERCENT)
+	{
+		decision.reason = DECREASE_LOSS;
+		bitrate *= 1.0 - loss / 200.0;
+	}
+	else if (loss < LOSS_LOW_PERCENT && queuingMs < QUEUE_TARGET_MS && trendMs <= 0 && now >= holdUntil)
+	{
+		decision.reason = INCREASE;
+		bitrate *= 1.0 + INCREASE_PERCENT / 100.0;
+	}
+	else
+	{
+		decision.reason = HOLD;
+	}
+
+	if (decision.reason == DECREASE_DELAY || decision.reason == DECREASE_LOSS)
+		holdUntil = now + (uint64(HOLD_MS) + uint64(feedback.rttMs)) * Clock::MS;
+
+	decision.bitrate = uint(std::max<double>(MIN_BITRATE, std::min<double>(MAX_BITRATE, bitrate)));
+	decision.bandwidth = bandwidthFor(decision.bitrate);
+
+	// Have FEC cover recent loss, smoothed so one bad second doesn't double the overhead for long
+	smoothedLoss += (loss - smoothedLoss) * 0.3;
+	decision.lossPercent = std::min<uint>(MAX_LOSS_PERCENT, uint(std::ceil(smoothedLoss)));
+
+	const bool changed = decision.bitrate != previous.bitrate || decision.lossPercent != previous.lossPercent ||
+	                     decision.bandwidth != previous.bandwidth;
+	if (changed)
+		++changes;
+	return changed;
+}
+
+void RateController::addTransit(uint32 transitUs)
+{
+	// Unwrap, since the peer's clock only fits 32 bits of microseconds
+	if (haveTransit)
+		transit += int32(transitUs - lastTransit);
+	lastTransit = transitUs;
+	haveTransit = true;
+
+	transitHistory[historyCount % transitHistory.size()] = transit;
+	++historyCount;
+}
+
+int64 RateController::baseTransit() const
+{
+	const size_t count = std::min<size_t>(historyCount, transitHistory.size());
+	return *std::min_element(transitHistory.begin(), transitHistory.begin() + count);
+}
+
+RateController::Bandwidth RateController::bandwidthFor(uint bitrate)
+{
+	// Roughly where Opus speech sounds better with the wider band than with fewer bits per Hz
+	if (bitrate >= 24000)
+		return FULLBAND;
+	if (bitrate >= 16000)
+		return SUPERWIDEBAND;
+	if (bitrate >= 12000)
+		return WIDEBAND;
+	return NARROWBAND;
+}
+
+const char* RateController::reasonName(Reason reason)
+{
+	switch (reason)
+	{
+	case START:          return "start";
+	case INCREASE:       return "increase";
+	case HOLD:           return "hold";
+	case DECREASE_LOSS:  return "loss";
+	case DECREASE_DELAY: return "delay";
+	}
+	return "?";
+}
+
+
+}
@@ -0,0 +1,99 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+
+namespace tincan {
+
+
+// Picks the encoder's bitrate, the loss its in-band FEC should cover and its audio bandwidth from what the
+// peer's REPORTs say about the packets we send. Loss is handled like GCC's loss-based controller (RFC draft
+// "A Google Congestion Control Algorithm for Real-Time Communication"), and queuing delay like LEDBAT:
+// the one-way transit time is compared with the least seen lately, and we back off once it builds up,
+// before a congested uplink's queue gets long enough to drop packets
+class RateController
+{
+public:
+	enum Bandwidth { NARROWBAND, WIDEBAND, SUPERWIDEBAND, FULLBAND };
+
+	enum Reason {
+		START,
+		INCREASE,       //Path is clear: little loss, and queuing under QUEUE_TARGET_MS and not growing
+		HOLD,           //Some loss or queuing, but not enough to back off
+		DECREASE_LOSS,  //More than LOSS_HIGH_PERCENT lost
+		DECREASE_DELAY  //Queuing delay over QUEUE_TARGET_MS and growing, or over QUEUE_MAX_MS and not draining fast
+	};
+
+	// From one REPORT
+	struct Feedback
+	{
+		double lossPercent; //Of our packets, since the previous REPORT
+		double rttMs;       //0 if not measured yet
+		bool   haveTransit; //Set if packets arrived since the previous REPORT, so transitUs is new
+		uint32 transitUs;   //Mean arrival time less send time of those packets, on the peer's clock (so only changes matter)
+		Feedback() : lossPercent(0), rttMs(0), haveTransit(false), transitUs(0)  {}
+	};
+
+	struct Decision
+	{
+		Reason    reason;
+		uint      bitrate;     //Bits per second, for OPUS_SET_BITRATE
+		uint      lossPercent; //For OPUS_SET_PACKET_LOSS_PERC, so in-band FEC covers the loss that's been seen
+		Bandwidth bandwidth;   //For OPUS_SET_MAX_BANDWIDTH, as much as the bitrate can carry well
+		double    queuingMs;   //Estimated queuing delay on the way to the peer
+		double    trendMs;     //How much that changed since the previous REPORT
+		Decision() : reason(START), bitrate(0), lossPercent(0), bandwidth(FULLBAND), queuingMs(0), trendMs(0)  {}
+	};
+
+	enum {
+		MIN_BITRATE = 8000,
+		MAX_BITRATE = 48000,    //Speech doesn't get noticeably better beyond this
+		START_BITRATE = 32000,
+		INCREASE_PERCENT = 8,   //Per REPORT while the path is clear
+		DECREASE_PERCENT = 15,  //Per REPORT while queuing delay builds, twice that beyond QUEUE_MAX_MS
+		LOSS_LOW_PERCENT = 2,   //Less loss than this lets the bitrate increase
+		LOSS_HIGH_PERCENT = 10, //More than this backs off in proportion to the loss
+		START_LOSS_PERCENT = 10,
+		MAX_LOSS_PERCENT = 25,
+		QUEUE_TARGET_MS = 30,   //Queuing delay we tolerate as long as it isn't growing
+		QUEUE_MAX_MS = 100,     //Back off beyond this unless it's draining by QUEUE_TARGET_MS per REPORT
+		HOLD_MS = 1500,         //After a decrease, plus an RTT: no increase until a REPORT has seen its effect
+		BASE_HISTORY = 60       //Transit base is the least over this many REPORTs, so clock drift doesn't build up
+	};
+
+	RateController();
+
+	// Start over for a new call
+	void reset();
+
+	// Returns true if the bitrate, loss percent or bandwidth changed; now is Clock::now()
+	bool update(const Feedback& feedback, uint64 now);
+
+	const Decision& current() const  {return decision;}
+	ulong getChanges() const  {return changes;}
+
+	static const char* reasonName(Reason reason);
+
+protected:
+	Decision decision;
+	ulong    changes;
+	uint64   holdUntil;
+	double   smoothedLoss;
+
+	// Transit times, unwrapped from 32 bits
+	bool           haveTransit;
+	uint32         lastTransit;
+	int64          transit;
+	double         lastQueuingMs;
+	vector<int64>  transitHistory; //Ring of the latest BASE_HISTORY
+	uint           historyCount;
+
+	void    addTransit(uint32 transitUs);
+	int64   baseTransit() const;
+	static Bandwidth bandwidthFor(uint bitrate);
+};
+
+
+}
@@ -0,0 +1,123 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "RelayServer.h"
+#include "Clock.h"
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+
+// Relay daemon: passes packets between phones that registered an ID with it (see RelayProtocol.h),
+// for users whose routers won't map a port. Runs until interrupted, printing its counters now and then
+using namespace tincan;
+
+enum {
+	POLL_MS = 100,             //How often to check for a signal or a failed thread
+	DEFAULT_STATS_SECONDS = 60
+};
+
+static const char USAGE[] =
+	"Usage: tincanphone-relay [options]\n"
+	"  -p, --port PORT            UDP port to listen on (default 56790)\n"
+	"  -t, --threads N            Event loops, each with its own socket on the port (default one per CPU)\n"
+	"  -m, --max-clients N        Most IDs registered at once (default 100000)\n"
+	"      --pin                  Keep each thread on its own CPU\n"
+	"  -s, --stats SECONDS        How often to print counters, 0 for never (default 60)\n"
+	"  -h, --help                 Show this message\n"
+	"Phones use it with tincanphone-cli --relay HOST[:PORT] --relay-id ID, and call each other as @ID.\n";
+
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void interruptHandler(int)
+{
+	interrupted = 1;
+}
+
+// Returns the counters printed, for the next rate
+static RelayServer::Stats printStats(const RelayServer& relay, const RelayServer::Stats& last, double seconds)
+{
+	const RelayServer::Stats stats = relay.getStats();
+	printf("%lu IDs  %.0f packets/s  forwarded %lu  registered %lu  refused %lu  unknown %lu  spoofed %lu"
+	       "  invalid %lu  send errors %lu\n", ulong(relay.getTable().getUsed()),
+	       seconds > 0 ? (stats.received - last.received) / seconds : 0.0, stats.forwarded, stats.registrations,
+	       stats.refused, stats.unknown, stats.spoofed, stats.invalid, stats.sendErrors);
+	fflush(stdout);
+	return stats;
+}
+
+int main(int argc, char* argv[])
+{
+	uint16 port = RELAY_PORT_DEFAULT;
+	uint threads = Thread::getCpuCount();
+	uint maxClients = RelayServer::MAX_CLIENTS_DEFAULT;
+	uint statsSeconds = DEFAULT_STATS_SECONDS;
+	bool pin = false;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		const string arg = argv[i];
+		const bool hasValue = (i + 1 < argc);
+		if ((arg == "-p" || arg == "--port") && hasValue)
+			port = uint16(atoi(argv[++i]));
+		else if ((arg == "-t" || arg == "--threads") && hasValue)
+			threads = uint(atoi(argv[++i]));
+		else if ((arg == "-m" || arg == "--max-clients") && hasValue)
+			maxClients = uint(atoi(argv[++i]));
+		else if ((arg == "-s" || arg == "--stats") && hasValue)
+			statsSeconds = uint(atoi(argv[++i]));
+		else if (arg == "--pin")
+			pin = true;
+		else
+		{
+			const bool help = (arg == "-h" || arg == "--help");
+			fputs(USAGE, help ? stdout : stderr);
+			return help ? 0 : 1;
+		}
+	}
+	if (!threads || !maxClients)
+	{
+		fprintf(stderr, "Error: --threads and --max-clients must be at least 1\n");
+		return 1;
+	}
+
+	signal(SIGINT, &interruptHandler);
+	signal(SIGTERM, &interruptHandler);
+
+	try
+	{
+		RelayServer relay(maxClients);
+		relay.start(port, threads, pin);
+		printf("Relaying on UDP port %u with %u thread%s\n", relay.getPort(), relay.getThreads(),
+		       relay.getThreads() == 1 ? "" : relay.isSharded() ? "s, one socket each" : "s sharing one socket (no SO_REUSEPORT)");
+		fflush(stdout);
+
+		RelayServer::Stats last;
+		uint64 lastTime = Clock::now();
+		while (!interrupted)
+		{
+			Thread::sleep(POLL_MS);
+
+			const string error = relay.getError();
+			if (!error.empty())
+				throw std::runtime_error(error);
+
+			const uint64 now = Clock::now();
+			if (statsSeconds && now - lastTime >= uint64(statsSeconds) * 1000 * Clock::MS)
+			{
+				last = printStats(relay, last, double(now - lastTime) / (1000 * Clock::MS));
+				lastTime = now;
+			}
+		}
+
+		printStats(relay, last, double(Clock::now() - lastTime) / (1000 * Clock::MS));
+		relay.stop();
+		printf("Stopped\n");
+	}
+	catch (std::exception& ex)
+	{
+		fprintf(stderr, "Error: %s\n", ex.what());
+		return 1;
+	}
+	return 0;
+}
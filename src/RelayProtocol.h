@@ -0,0 +1,64 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+#include "Socket.h"
+
+namespace tincan {
+
+
+// A relay lets phones that can't get a port forwarded call each other: each registers a numeric ID
+// with it, then sends its packets to the relay with the ID they're for, and the relay passes them on
+enum RelayConstants {
+	RELAY_PORT_DEFAULT = 56790,
+	RELAY_REGISTER_INTERVAL = 15000, //How often a client renews its ID, which also keeps its NAT mapping open
+	RELAY_RETRY_INTERVAL = 1000,     //How often it tries to register until the relay answers
+	RELAY_EXPIRY = 60000,            //How long a registration lasts without being renewed
+	RELAY_DATAGRAM_MAX = 1472        //Largest datagram relayed, what fits in a 1500 byte MTU
+};
+
+
+// Starts every datagram to and from a relay; all in network byte order
+struct RelayHeader
+{
+	enum Type {
+		REGISTER = 5000, //Client to relay: take or renew an ID
+		REGISTERED,      //Relay to client: the ID is ours until RELAY_EXPIRY after the last REGISTER
+		REFUSED,         //Relay to client: someone else has the ID, or the relay is full
+		DATA             //Followed by a packet for the client with the ID, passed on unchanged
+	};
+	uint32 type;
+	uint32 id;    //REGISTER and its reply: the client's ID; DATA: who the packet is for
+	uint32 other; //REGISTER: the client's key, so only it can move the ID to a new address; DATA: the sender's ID
+};
+
+
+// Phone and the logs see a peer reached through a relay as an IPv6 address in the discard-only prefix 100::/64
+// (RFC 6666), which never reaches a real host, with the peer's ID in the low 32 bits; it prints as @ID
+inline sockaddr_storage relayPeerAddress(uint32 id)
+{
+	sockaddr_storage addr = {};
+	sockaddr_in6& in6 = (sockaddr_in6&)addr;
+	in6.sin6_family = AF_INET6;
+	in6.sin6_addr.s6_addr[0] = 0x01;
+	for (uint b = 0; b < 4; ++b)
+		in6.sin6_addr.s6_addr[15 - b] = byte(id >> (8 * b));
+	return addr;
+}
+
+inline bool isRelayPeer(const sockaddr_storage& addr)
+{
+	static const byte prefix[12] = {0x01, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+	return addr.ss_family == AF_INET6 && !memcmp(((const sockaddr_in6&)addr).sin6_addr.s6_addr, prefix, sizeof(prefix));
+}
+
+inline uint32 relayPeerId(const sockaddr_storage& addr)
+{
+	const byte* bytes = ((const sockaddr_in6&)addr).sin6_addr.s6_addr;
+	return uint32(bytes[12]) << 24 | uint32(bytes[13]) << 16 | uint32(bytes[14]) << 8 | bytes[15];
+}
+
+
+}
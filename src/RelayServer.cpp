@@ -0,0 +1,456 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "RelayServer.h"
+#include "Clock.h"
+#include <algorithm>
+#include <cassert>
+
+namespace tincan {
+
+
+sockaddr_storage RelayTable::Client::address() const
+{
+	sockaddr_storage addr = {};
+	sockaddr_in& in = (sockaddr_in&)addr;
+	in.sin_family = AF_INET;
+	in.sin_addr.s_addr = ip;
+	in.sin_port = port;
+	return addr;
+}
+
+RelayTable::RelayTable(uint maxClients)
+: shift(32),
+  maxClients(maxClients),
+  used(0),
+  nextPurge(0)
+{
+	// At least twice as many slots as clients keeps probes short
+	uint size = 1;
+	while (size < maxClients * 2 || size < 16)
+	{
+		size *= 2;
+		--shift;
+	}
+	vector<Slot>(size).swap(slots);
+}
+
+RelayTable::Result RelayTable::add(uint32 id, uint32 key, const sockaddr_in& addr, uint64 now)
+{
+	const uint64 expires = now + uint64(RELAY_EXPIRY) * Clock::MS;
+	const uint mask = uint(slots.size() - 1);
+
+	assert(id);
+
+	// Renewing from the same address needs no lock
+	Client client;
+	if (find(id, now, client) && client.key == key && client.isAt(addr))
+	{
+		for (uint s = slotFor(id), probes = 0; probes < slots.size(); s = (s + 1) & mask, ++probes)
+		{
+			if (slots[s].client.load().id == id)
+			{
+				slots[s].expires.store(expires, std::memory_order_relaxed);
+				return RENEWED;
+			}
+		}
+	}
+
+	// Otherwise look again holding the lock, keeping the first expired slot to reuse if id isn't found
+	Scopelock lock(writer);
+	if (used >= maxClients && now >= nextPurge)
+		purge(now);
+	uint reuse = uint(slots.size());
+	for (uint s = slotFor(id), probes = 0; probes < slots.size(); s = (s + 1) & mask, ++probes)
+	{
+		client = slots[s].client.load();
+		const bool expired = slots[s].expires.load(std::memory_order_relaxed) < now;
+
+		if (client.id == id)
+		{
+			if (!expired && client.key != key)
+				return REFUSED;
+			client.key = key;
+			client.ip = addr.sin_addr.s_addr;
+			client.port = addr.sin_port;
+			slots[s].client.store(client);
+			slots[s].expires.store(expires, std::memory_order_relaxed);
+			return expired ? ADDED : MOVED;
+		}
+
+		if (!client.id)
+		{
+			// id isn't here; take this slot unless an expired one came first
+			if (reuse == slots.size())
+			{
+				if (used >= maxClients)
+					return FULL;
+				reuse = s;
+				++used;
+			}
+			break;
+		}
+
+		if (expired && reuse == slots.size())
+			reuse = s;
+	}
+	if (reuse == slots.size())
+		return FULL;
+
+	// Store the client first: a lookup that catches the old expiry just drops a packet
+	client.id = id;
+	client.key = key;
+	client.ip = addr.sin_addr.s_addr;
+	client.port = addr.sin_port;
+	slots[reuse].client.store(client);
+	slots[reuse].expires.store(expires, std::memory_order_relaxed);
+	return ADDED;
+}
+
+void RelayTable::purge(uint64 now)
+{
+	// Start after an empty slot (there is one, at most half are used), so no probe run wraps past the start
+	const uint mask = uint(slots.size() - 1);
+	uint start = 0;
+	while (slots[start].client.load().id)
+		++start;
+
+	nextPurge = 0;
+	for (uint n = 1; n <= slots.size(); ++n)
+	{
+		const uint s = (start + n) & mask;
+		if (!slots[s].client.load().id)
+			continue;
+		const uint64 expires = slots[s].expires.load(std::memory_order_relaxed);
+		if (expires >= now)
+		{
+			if (!nextPurge || expires < nextPurge)
+				nextPurge = expires + 1;
+			continue;
+		}
+
+		// Look at the slot again: remove may have pulled a later registration back into it
+		remove(s);
+		--used;
+		--n;
+	}
+}
+
+void RelayTable::remove(uint hole)
+{
+	// Backward shift: each later registration in the run moves back into the hole unless that would put it before
+	// its home slot. Moves store the client first, so a lookup racing this only misses (drops a packet) or
+	// finds the same registration twice; a renewal racing it may be lost, and the next one puts that right
+	const uint mask = uint(slots.size() - 1);
+	for (uint s = (hole + 1) & mask; ; s = (s + 1) & mask)
+	{
+		const Client client = slots[s].client.load();
+		if (!client.id)
+			break;
+		if (((s - slotFor(client.id)) & mask) >= ((s - hole) & mask))
+		{
+			slots[hole].client.store(client);
+			slots[hole].expires.store(slots[s].expires.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			hole = s;
+		}
+	}
+
+	const Client empty = {};
+	slots[hole].client.store(empty);
+	slots[hole].expires.store(0, std::memory_order_relaxed);
+}
+
+bool RelayTable::find(uint32 id, uint64 now, Client& client) const
+{
+	if (!id)
+		return false;
+
+	const uint mask = uint(slots.size() - 1);
+	for (uint s = slotFor(id), probes = 0; probes < slots.size(); s = (s + 1) & mask, ++probes)
+	{
+		const Client found = slots[s].client.load();
+		if (!found.id)
+			return false;
+		if (found.id == id)
+		{
+			if (slots[s].expires.load(std::memory_order_relaxed) < now)
+				return false;
+			client = found;
+			return true;
+		}
+	}
+	return false;
+}
+
+
+RelayServer::Stats& RelayServer::Stats::operator += (const Stats& rhs)
+{
+	received += rhs.received;
+	forwarded += rhs.forwarded;
+	registrations += rhs.registrations;
+	refused += rhs.refused;
+	unknown += rhs.unknown;
+	spoofed += rhs.spoofed;
+	invalid += rhs.invalid;
+	sendErrors += rhs.sendErrors;
+	batches += rhs.batches;
+	cpuMs += rhs.cpuMs;
+	return *this;
+}
+
+RelayServer::Worker::Worker(RelayServer* server, uint index)
+: server(server),
+  index(index),
+  sock(-1),
+  ownsSocket(false),
+  pin(false),
+  batch(BATCH_DATAGRAMS, RELAY_DATAGRAM_MAX),
+  done(false)
+{
+}
+
+RelayServer::Worker::~Worker()
+{
+	if (ownsSocket)
+		Socket::close(sock);
+}
+
+RelayServer::RelayServer(uint maxClients)
+: table(maxClients),
+  port(0),
+  sharded(false),
+  stopping(false)
+{
+}
+
+RelayServer::~RelayServer()
+{
+	stop();
+}
+
+SOCKET RelayServer::openSocket(uint16 port, bool reuse)
+{
+	SOCKET sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock == -1)
+		throw std::runtime_error("Failed to create socket");
+
+	// Bigger buffers ride out a burst while the thread is descheduled; the kernel may cap them, which is fine
+	const int bytes = SOCKET_BUFFER_BYTES;
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (const char*)&bytes, sizeof(bytes));
+	setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (const char*)&bytes, sizeof(bytes));
+	Socket::setBlocking(sock, false);
+
+	if (reuse && !Socket::enableReusePort(sock))
+	{
+		Socket::close(sock);
+		return -1;
+	}
+
+	sockaddr_in bindaddr = {};
+	bindaddr.sin_family = AF_INET;
+	bindaddr.sin_addr.s_addr = INADDR_ANY;
+	bindaddr.sin_port = htons(port);
+	if (::bind(sock, (sockaddr*)&bindaddr, sizeof(bindaddr)))
+	{
+		const string error = Socket::getErrorString();
+		Socket::close(sock);
+		throw std::runtime_error("Could not bind UDP port " + toString(port) + ": " + error);
+	}
+	return sock;
+}
+
+void RelayServer::start(uint16 bindPort, uint threads, bool pin)
+{
+	assert(workers.empty() && threads > 0);
+	stopping = false;
+
+	// The first socket settles the port, the rest join it if they can
+	for (uint t = 0; t < threads; ++t)
+		workers.push_back(new Worker(this, t));
+
+	workers[0]->sock = (threads > 1) ? openSocket(bindPort, true) : SOCKET(-1);
+	sharded = (workers[0]->sock != SOCKET(-1));
+	if (!sharded)
+		workers[0]->sock = openSocket(bindPort, false);
+	workers[0]->ownsSocket = true;
+
+	sockaddr_in local = {};
+	socklen_t localLen = sizeof(local);
+	if (getsockname(workers[0]->sock, (sockaddr*)&local, &localLen))
+		throw std::runtime_error("getsockname failed: " + Socket::getErrorString());
+	port = ntohs(local.sin_port);
+
+	for (uint t = 1; t < threads; ++t)
+	{
+		workers[t]->sock = sharded ? openSocket(port, true) : workers[0]->sock;
+		workers[t]->ownsSocket = sharded;
+	}
+
+	for (uint t = 0; t < threads; ++t)
+	{
+		workers[t]->pin = pin;
+		workers[t]->thread.start(&workerMain, workers[t]);
+	}
+}
+
+void RelayServer::stop()
+{
+	stopping = true;
+	for (size_t t = 0; t < workers.size(); ++t)
+		workers[t]->waker.signal();
+	for (size_t t = 0; t < workers.size(); ++t)
+	{
+		workers[t]->thread.join();
+		delete workers[t];
+	}
+	workers.clear();
+}
+
+RelayServer::Stats RelayServer::getStats() const
+{
+	Stats total;
+	for (size_t t = 0; t < workers.size(); ++t)
+		total += workers[t]->statsOut.load();
+	return total;
+}
+
+string RelayServer::getError() const
+{
+	for (size_t t = 0; t < workers.size(); ++t)
+	{
+		if (workers[t]->done && !workers[t]->error.empty())
+			return "Relay thread " + toString(t) + ": " + workers[t]->error;
+	}
+	return string();
+}
+
+void RelayServer::workerMain(void* worker)
+{
+	Worker& w = *reinterpret_cast<Worker*>(worker);
+	try
+	{
+		if (w.pin)
+			Thread::pinToCpu(w.index);
+		w.server->serve(w);
+	}
+	catch (std::exception& ex)
+	{
+		w.error = ex.what();
+	}
+	w.done = true;
+}
+
+void RelayServer::serve(Worker& w)
+{
+	pollfd fds[2] = {};
+	fds[0].fd = w.sock;
+	fds[0].events = POLLIN;
+	fds[1].fd = w.waker.getFd();
+	fds[1].events = POLLIN;
+
+	while (!stopping)
+	{
+		const int received = w.batch.receive(w.sock);
+		if (received <= 0)
+		{
+			const int error = Socket::getError();
+			if (received < 0 && error != EWOULDBLOCK && error != ECONNREFUSED && error != ECONNRESET)
+				throw std::runtime_error("recvmmsg error: " + Socket::getErrorString());
+
+			// Caught up: publish the counters, then sleep until more arrive
+			w.stats.cpuMs = Thread::getCpuTimeMs();
+			w.statsOut.store(w.stats);
+			if (Socket::poll(fds, 2, -1) < 0 && Socket::getError() != EINTR)
+				throw std::runtime_error("poll error: " + Socket::getErrorString());
+			if (fds[1].revents)
+				w.waker.drain();
+			continue;
+		}
+
+		// Readdress what's passed on in place, and close up over what's dropped
+		const uint64 now = Clock::now();
+		uint kept = 0;
+		for (uint i = 0; i < uint(received); ++i)
+		{
+			if (!route(w, i, now))
+				continue;
+			if (kept != i)
+				w.batch.move(i, kept);
+			++kept;
+		}
+		w.batch.truncate(kept);
+
+		// Whatever sendmmsg didn't take is dropped, as a router would
+		const int sent = w.batch.send(w.sock);
+		w.stats.sendErrors += kept - std::max(sent, 0);
+		w.stats.received += received;
+		++w.stats.batches;
+
+		// A full batch means more are likely waiting, so publish only now and then
+		if (uint(received) < w.batch.capacity() || !(w.stats.batches % 64))
+		{
+			w.stats.cpuMs = Thread::getCpuTimeMs();
+			w.statsOut.store(w.stats);
+		}
+	}
+
+	w.stats.cpuMs = Thread::getCpuTimeMs();
+	w.statsOut.store(w.stats);
+}
+
+bool RelayServer::route(Worker& w, uint i, uint64 now)
+{
+	const sockaddr_in& from = (const sockaddr_in&)w.batch.addr(i);
+	if (w.batch.size(i) < sizeof(RelayHeader) || from.sin_family != AF_INET)
+	{
+		++w.stats.invalid;
+		return false;
+	}
+
+	// Data is 8-byte aligned, so the header can be read in place
+	RelayHeader& header = *reinterpret_cast<RelayHeader*>(w.batch.data(i));
+	switch (ntohl(header.type))
+	{
+	case RelayHeader::DATA:
+	{
+		// Only pass on packets from whoever holds the sender's ID, so the relay can't be used to spoof or reflect
+		RelayTable::Client sender, receiver;
+		if (!table.find(ntohl(header.other), now, sender) || !sender.isAt(from))
+		{
+			++w.stats.spoofed;
+			return false;
+		}
+		if (!table.find(ntohl(header.id), now, receiver))
+		{
+			++w.stats.unknown;
+			return false;
+		}
+		w.batch.setAddr(i, receiver.address());
+		++w.stats.forwarded;
+		return true;
+	}
+
+	case RelayHeader::REGISTER:
+	{
+		// Answer in place, back to the sender
+		const uint32 id = ntohl(header.id);
+		const RelayTable::Result result = id ? table.add(id, ntohl(header.other), from, now) : RelayTable::REFUSED;
+		const bool accepted = (result != RelayTable::REFUSED && result != RelayTable::FULL);
+		header.type = htonl(accepted ? RelayHeader::REGISTERED : RelayHeader::REFUSED);
+		header.other = 0;
+		w.batch.setSize(i, sizeof(RelayHeader));
+		if (accepted)
+			++w.stats.registrations;
+		else
+			++w.stats.refused;
+		return true;
+	}
+
+	default:
+		++w.stats.invalid;
+		return false;
+	}
+}
+
+
+}
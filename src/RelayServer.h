@@ -0,0 +1,152 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+#include "DatagramBatch.h"
+#include "Mutex.h"
+#include "RelayProtocol.h"
+#include "Seqlock.h"
+#include "Socket.h"
+#include "Thread.h"
+#include <atomic>
+
+namespace tincan {
+
+
+// Who holds each relay ID, shared by all of a RelayServer's threads
+// Lookups never lock: each slot is a Seqlock, written only under a mutex. Renewing a registration from the
+// same address (the common case) only stores its expiry time; taking or moving an ID locks
+class RelayTable
+{
+public:
+	struct Client
+	{
+		uint32 id;   //0 in an empty slot
+		uint32 key;
+		uint32 ip;   //IPv4, network byte order like sockaddr_in
+		uint16 port; //Network byte order
+		bool     isAt(const sockaddr_in& addr) const  {return ip == addr.sin_addr.s_addr && port == addr.sin_port;}
+		sockaddr_storage address() const;
+	};
+
+	enum Result { ADDED, RENEWED, MOVED, REFUSED, FULL };
+
+	explicit RelayTable(uint maxClients);
+
+	// Register id at addr until RELAY_EXPIRY after now; REFUSED if someone with another key holds it
+	Result add(uint32 id, uint32 key, const sockaddr_in& addr, uint64 now);
+
+	// Returns false if nobody holds id as of now
+	bool find(uint32 id, uint64 now, Client& client) const;
+
+	// Slots holding an ID, including expired ones not purged or taken over yet
+	uint getUsed() const  {return used;}
+
+protected:
+	struct Slot
+	{
+		Seqlock<Client>     client;
+		std::atomic<uint64> expires;
+		Slot() : expires(0)  {}
+	};
+
+	vector<Slot>      slots;  //Open addressing with linear probing, at most half full
+	uint              shift;  //Fibonacci hashing: the top bits of id * 2654435761
+	uint              maxClients;
+	Mutex             writer;
+	std::atomic<uint> used;
+	uint64            nextPurge; //Once used reaches maxClients, no purge frees anything before this
+
+	uint slotFor(uint32 id) const  {return uint((id * 2654435761u) >> shift);}
+	void purge(uint64 now);  //Empty every expired slot; holding writer
+	void remove(uint hole);  //Empty a slot, closing up its probe run behind it; holding writer
+};
+
+
+// A multi-core UDP relay for phones behind NATs that can't map a port (see RelayProtocol.h)
+// Each thread has its own socket on the same port, which the kernel shares out by sender (SO_REUSEPORT),
+// and runs its own event loop: a batch received by recvmmsg is readdressed in place and sent on by sendmmsg,
+// with no locks or allocation per packet. Where SO_REUSEPORT doesn't spread datagrams the threads share one socket
+class RelayServer
+{
+public:
+	// Counts of datagrams, per thread or summed over them
+	struct Stats
+	{
+		ulong  received;
+		ulong  forwarded;     //DATA passed on
+		ulong  registrations; //REGISTERs accepted
+		ulong  refused;       //REGISTERs for an ID someone else holds, or with the table full
+		ulong  unknown;       //DATA for an ID nobody holds
+		ulong  spoofed;       //DATA from an address that doesn't hold the sender's ID
+		ulong  invalid;       //Too short, not IPv4, or not a relay datagram at all
+		ulong  sendErrors;    //Dropped because sendmmsg failed
+		ulong  batches;       //recvmmsg calls that got something
+		double cpuMs;         //CPU time of the thread, where Thread::getCpuTimeMs can tell
+		Stats() : received(0), forwarded(0), registrations(0), refused(0), unknown(0), spoofed(0), invalid(0),
+		          sendErrors(0), batches(0), cpuMs(0)  {}
+		Stats& operator += (const Stats& rhs);
+	};
+
+	enum {
+		BATCH_DATAGRAMS = 32,      //Per recvmmsg/sendmmsg
+		SOCKET_BUFFER_BYTES = 4 << 20,
+		MAX_CLIENTS_DEFAULT = 100000
+	};
+
+	RelayServer(uint maxClients = MAX_CLIENTS_DEFAULT);
+	~RelayServer(); //Stops
+
+	// Bind the port on all interfaces (0 picks a free one) and start a thread for each socket; throws on failure
+	// pin keeps thread i on CPU i
+	void   start(uint16 port, uint threads, bool pin = false);
+	void   stop();
+
+	uint16 getPort() const     {return port;}
+	uint   getThreads() const  {return uint(workers.size());}
+	bool   isSharded() const   {return sharded;}
+
+	// Any thread; a thread that failed has an error, and has stopped
+	Stats  getStats() const;
+	Stats  getThreadStats(uint thread) const  {return workers[thread]->statsOut.load();}
+	string getError() const;
+	const RelayTable& getTable() const  {return table;}
+
+protected:
+	struct Worker
+	{
+		RelayServer*       server;
+		uint               index;
+		SOCKET             sock;
+		bool               ownsSocket;
+		bool               pin;
+		Waker              waker;
+		Thread             thread;
+		DatagramBatch      batch;
+		Stats              stats;    //Only touched by the thread
+		Seqlock<Stats>     statsOut; //Published when caught up, and every 64 batches while busy
+		string             error;    //Set before done
+		std::atomic<bool>  done;
+		Worker(RelayServer* server, uint index);
+		~Worker();
+	};
+
+	RelayTable        table;
+	vector<Worker*>   workers;
+	uint16            port;
+	bool              sharded;
+	std::atomic<bool> stopping;
+
+	SOCKET openSocket(uint16 port, bool reuse);
+	static void workerMain(void* worker);
+	void serve(Worker& w);
+	bool route(Worker& w, uint i, uint64 now);
+
+	RelayServer(const RelayServer&);
+	RelayServer& operator = (const RelayServer&);
+};
+
+
+}
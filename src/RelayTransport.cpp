@@ -0,0 +1,217 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "RelayTransport.h"
+#include "Clock.h"
+#include "UdpTransport.h"
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+
+namespace tincan {
+
+
+RelayTransport::RelayTransport(const sockaddr_storage& relay, uint32 id, Transport* inner, uint32 key)
+: inner(inner ? inner : new UdpTransport()),
+  relay(relay),
+  id(id),
+  key(key),
+  state(UNREGISTERED),
+  logged(UNREGISTERED),
+  registerDeadline(0),
+  registeredTime(0),
+  sendBuffer(RELAY_DATAGRAM_MAX)
+{
+	if (!id)
+		throw std::runtime_error("Relay ID must be from 1 to 4294967295");
+
+	// Only has to differ from whoever else might try our ID
+	if (!this->key)
+		this->key = uint32(Clock::now() * 2654435761u) ^ uint32(size_t(this) >> 4);
+}
+
+RelayTransport::~RelayTransport()
+{
+	delete inner;
+}
+
+sockaddr_storage RelayTransport::resolve(const string& address)
+{
+	string host = address;
+	string port = toString(RELAY_PORT_DEFAULT);
+	const size_t colon = address.rfind(':');
+	if (colon != string::npos)
+	{
+		host = address.substr(0, colon);
+		port = address.substr(colon + 1);
+	}
+
+	addrinfo hints = {};
+	hints.ai_family = AF_INET; //Like UdpTransport
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_protocol = IPPROTO_UDP;
+
+	addrinfo* result = NULL;
+	const int error = getaddrinfo(host.c_str(), port.c_str(), &hints, &result);
+	if (error || !result)
+		throw std::runtime_error("Could not find relay " + address + ": " + gai_strerror(error));
+
+	sockaddr_storage addr = {};
+	memcpy(&addr, result->ai_addr, std::min(size_t(result->ai_addrlen), sizeof(addr)));
+	freeaddrinfo(result);
+	return addr;
+}
+
+uint16 RelayTransport::bind(uint16 firstPort, uint16 lastPort)
+{
+	const uint16 port = inner->bind(firstPort, lastPort);
+	registerDeadline = 0;
+	return port;
+}
+
+int RelayTransport::receive(DatagramBatch& batch)
+{
+	const int received = inner->receive(batch);
+	if (received <= 0)
+		return received;
+
+	// Unwrap what the relay passed on in place, and close up over the relay's own replies
+	uint kept = 0;
+	for (uint i = 0; i < uint(received); ++i)
+	{
+		if (batch.addr(i) == relay && !unwrap(batch, i))
+			continue;
+		if (kept != i)
+			batch.move(i, kept);
+		++kept;
+	}
+	batch.truncate(kept);
+	return int(kept);
+}
+
+bool RelayTransport::unwrap(DatagramBatch& batch, uint i)
+{
+	if (batch.size(i) < sizeof(RelayHeader))
+		return false;
+
+	const RelayHeader& header = *reinterpret_cast<const RelayHeader*>(batch.data(i));
+	if (ntohl(header.id) != id)
+		return false;
+
+	switch (ntohl(header.type))
+	{
+	case RelayHeader::DATA:
+	{
+		// Data stays 8-byte aligned for Phone by moving the packet down over the header
+		const uint32 from = ntohl(header.other);
+		const uint size = batch.size(i) - sizeof(RelayHeader);
+		memmove(batch.data(i), batch.data(i) + sizeof(RelayHeader), size);
+		batch.setSize(i, size);
+		batch.setAddr(i, relayPeerAddress(from));
+		return true;
+	}
+
+	case RelayHeader::REGISTERED:
+		// Settle into renewing
+		state = REGISTERED;
+		registeredTime = Clock::now();
+		registerDeadline = registeredTime + uint64(RELAY_REGISTER_INTERVAL) * Clock::MS;
+		return false;
+
+	case RelayHeader::REFUSED:
+		state = REFUSED;
+		return false;
+
+	default:
+		return false;
+	}
+}
+
+int RelayTransport::send(DatagramBatch& batch)
+{
+	// Each batch has TRANSPORT_HEADER_MAX bytes of room, so the header goes in front in place
+	for (uint i = 0; i < batch.count(); ++i)
+	{
+		if (!isRelayPeer(batch.addr(i)))
+			continue;
+
+		const uint size = batch.size(i);
+		assert(size + sizeof(RelayHeader) <= batch.bufferSize());
+		memmove(batch.data(i) + sizeof(RelayHeader), batch.data(i), size);
+
+		RelayHeader& header = *reinterpret_cast<RelayHeader*>(batch.data(i));
+		header.type = htonl(RelayHeader::DATA);
+		header.id = htonl(relayPeerId(batch.addr(i)));
+		header.other = htonl(id);
+		batch.setSize(i, size + sizeof(RelayHeader));
+		batch.setAddr(i, relay);
+	}
+	return inner->send(batch);
+}
+
+int RelayTransport::sendTo(const void* data, uint size, const sockaddr_storage& to)
+{
+	if (!isRelayPeer(to))
+		return inner->sendTo(data, size, to);
+
+	assert(size + sizeof(RelayHeader) <= sendBuffer.size());
+	RelayHeader& header = *reinterpret_cast<RelayHeader*>(&sendBuffer[0]);
+	header.type = htonl(RelayHeader::DATA);
+	header.id = htonl(relayPeerId(to));
+	header.other = htonl(id);
+	memcpy(&sendBuffer[sizeof(RelayHeader)], data, size);
+
+	const int sent = inner->sendTo(&sendBuffer[0], size + sizeof(RelayHeader), relay);
+	return (sent < 0) ? sent : std::max(0, sent - int(sizeof(RelayHeader)));
+}
+
+bool RelayTransport::parseAddress(const char* text, sockaddr_storage& addr)
+{
+	// @ID, as the logs print relayed peers
+	if (text[0] != '@' || text[1] < '0' || text[1] > '9')
+		return false;
+
+	char* end;
+	const unsigned long long peer = strtoull(text + 1, &end, 10);
+	if (*end || !peer || peer > 0xFFFFFFFFull)
+		return false;
+
+	addr = relayPeerAddress(uint32(peer));
+	return true;
+}
+
+uint64 RelayTransport::service(uint64 now, std::ostream& log)
+{
+	// Without renewals the relay forgets us, so stop counting on it
+	if (state == REGISTERED && now >= registeredTime + uint64(RELAY_EXPIRY) * Clock::MS)
+		state = UNREGISTERED;
+
+	if (state != logged)
+	{
+		if (state == REGISTERED)
+			log << "Ready! Calls can reach you at @" << id << " (via relay " << relay << ')' << endl;
+		else if (state == REFUSED)
+			log << "*** ERROR: Relay " << relay << " refused @" << id << ": someone else has it, or the relay is full" << endl;
+		else
+			log << "*** Lost contact with relay " << relay << ", calls through it won't work until it answers again" << endl;
+		logged = state;
+	}
+
+	if (now >= registerDeadline)
+	{
+		// Errors are like a lost REGISTER: try again later
+		RelayHeader header;
+		header.type = htonl(RelayHeader::REGISTER);
+		header.id = htonl(id);
+		header.other = htonl(key);
+		inner->sendTo(&header, sizeof(header), relay);
+
+		// Retry quickly only while the relay hasn't answered; a refused ID may be freed when its holder's registration expires
+		const uint interval = (state == UNREGISTERED) ? RELAY_RETRY_INTERVAL : RELAY_REGISTER_INTERVAL;
+		registerDeadline = now + uint64(interval) * Clock::MS;
+	}
+	return registerDeadline;
+}
+
+
+}
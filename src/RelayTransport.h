@@ -0,0 +1,56 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+#include "RelayProtocol.h"
+#include "Transport.h"
+
+namespace tincan {
+
+
+// Registers an ID with a relay (see RelayProtocol.h) and talks to peers given as @ID through it, for when
+// no port can be mapped; other addresses are still sent to directly. What the relay passes on arrives
+// looking like it came from @ID, so Phone treats relayed and direct calls alike
+class RelayTransport : public Transport
+{
+public:
+	// Takes ownership of inner, a UdpTransport if NULL; key 0 picks one at random
+	RelayTransport(const sockaddr_storage& relay, uint32 id, Transport* inner = NULL, uint32 key = 0);
+	~RelayTransport();
+
+	// A relay's host[:port], looked up by name if need be; throws if it can't be found
+	static sockaddr_storage resolve(const string& address);
+
+	uint16 bind(uint16 firstPort, uint16 lastPort);
+	SOCKET getFd() const  {return inner->getFd();}
+	int    receive(DatagramBatch& batch);
+	int    send(DatagramBatch& batch);
+	int    sendTo(const void* data, uint size, const sockaddr_storage& to);
+	bool   parseAddress(const char* text, sockaddr_storage& addr);
+	uint64 service(uint64 now, std::ostream& log);
+
+	bool   isRegistered() const  {return state == REGISTERED;}
+
+protected:
+	enum State { UNREGISTERED, REGISTERED, REFUSED };
+
+	Transport*       inner;
+	sockaddr_storage relay;
+	uint32           id;
+	uint32           key;
+	State            state;
+	State            logged;           //What service() last told the user
+	uint64           registerDeadline; //When to send the next REGISTER, 0 to send one right away
+	uint64           registeredTime;   //When the relay last said REGISTERED
+	vector<byte>     sendBuffer;       //For sendTo to add the header
+
+	bool unwrap(DatagramBatch& batch, uint i);
+
+	RelayTransport(const RelayTransport&);
+	RelayTransport& operator = (const RelayTransport&);
+};
+
+
+}
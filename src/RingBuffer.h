@@ -0,0 +1,105 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+#include <algorithm>
+#include <atomic>
+
+namespace tincan {
+
+
+// Lock-free ring buffer for exactly one producer thread and one consumer thread
+// T must be a POD type; capacity is rounded up to a power of 2
+template <typename T>
+class RingBuffer
+{
+public:
+	explicit RingBuffer(size_t minCapacity)
+	: head(0), tail(0)
+	{
+		size_t capacity = 1;
+		while (capacity < minCapacity)
+			capacity <<= 1;
+		buffer.resize(capacity);
+		mask = capacity - 1;
+	}
+
+	size_t capacity() const  {return buffer.size();}
+
+	// Number of elements the consumer can read
+	size_t readAvailable() const
+	{
+		return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+	}
+
+	// Number of elements the producer can write
+	size_t writeAvailable() const  {return capacity() - readAvailable();}
+
+	// Producer only: copies up to count elements in, returns how many were written
+	size_t write(const T* data, size_t count)
+	{
+		const size_t h = head.load(std::memory_order_relaxed);
+		const size_t t = tail.load(std::memory_order_acquire);
+		count = std::min(count, capacity() - (h - t));
+
+		const size_t first = std::min(count, capacity() - (h & mask));
+		memcpy(&buffer[h & mask], data, first * sizeof(T));
+		memcpy(&buffer[0], data + first, (count - first) * sizeof(T));
+
+		head.store(h + count, std::memory_order_release);
+		return count;
+	}
+
+	// Consumer only: copies up to count elements out, returns how many were read
+	size_t read(T* data, size_t count)
+	{
+		const size_t t = tail.load(std::memory_order_relaxed);
+		const size_t h = head.load(std::memory_order_acquire);
+		count = std::min(count, h - t);
+
+		const size_t first = std::min(count, capacity() - (t & mask));
+		memcpy(data, &buffer[t & mask], first * sizeof(T));
+		memcpy(data + first, &buffer[0], (count - first) * sizeof(T));
+
+		tail.store(t + count, std::memory_order_release);
+		return count;
+	}
+
+	// Consumer only: drops up to count elements without copying them, returns how many were dropped
+	size_t discard(size_t count)
+	{
+		const size_t t = tail.load(std::memory_order_relaxed);
+		const size_t h = head.load(std::memory_order_acquire);
+		count = std::min(count, h - t);
+		tail.store(t + count, std::memory_order_release);
+		return count;
+	}
+
+	// Producer only: total elements written so far, a point in the stream to pass to discardUntil
+	size_t mark() const  {return head.load(std::memory_order_relaxed);}
+
+	// Consumer only: drops whatever is left from before the producer's mark, returns how many were dropped
+	size_t discardUntil(size_t mark)
+	{
+		const size_t behind = mark - tail.load(std::memory_order_relaxed);
+		return (behind <= capacity()) ? discard(behind) : 0; //Otherwise it's all been read already
+	}
+
+	// Empty the buffer; only safe while neither side is running
+	void clear()
+	{
+		head.store(0, std::memory_order_relaxed);
+		tail.store(0, std::memory_order_relaxed);
+	}
+
+protected:
+	vector<T>           buffer;
+	size_t              mask;
+	std::atomic<size_t> head; //Total elements written, only modified by producer
+	std::atomic<size_t> tail; //Total elements read, only modified by consumer
+};
+
+
+}
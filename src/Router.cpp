@@ -2,19 +2,43 @@
 	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
 */
 #include "Router.h"
+#include "Socket.h"
 #include <cassert>
+#include <cstdlib>
+#include <fstream>
 #include "miniupnpc/upnpcommands.h"
 #include "miniupnpc/upnperrors.h"
 
 namespace tincan {
 
 
-Router::Router(int discoveryTimeout)
-: upnpUrls(), //Zero init struct
-  mappedPort(0)
+Router::Router(int discoveryTimeout, const string& cacheFile, const char* multicastIf)
+: upnpUrls(), //Zero init structs
+  upnpData(),
+  mappedPort(0),
+  cacheFile(cacheFile),
+  cached(false)
+{
+	localAddr[0] = '\0';
+	wanAddr[0] = '\0';
+
+	// Discovery waits out the whole timeout, so first see if last time's IGD still answers
+	if (!cacheFile.empty() && loadCache())
+	{
+		cached = true;
+	}
+	else
+	{
+		discover(discoveryTimeout, multicastIf);
+	}
+
+	saveCache();
+}
+
+void Router::discover(int discoveryTimeout, const char* multicastIf)
 {
 	int error = 0;
-	UPNPDev* devlist = upnpDiscover(discoveryTimeout, NULL, NULL, UPNP_LOCAL_PORT_ANY, 0, 2, &error);
+	UPNPDev* devlist = upnpDiscover(discoveryTimeout, multicastIf, NULL, UPNP_LOCAL_PORT_ANY, 0, 2, &error);
 
 	if (devlist)
 	{
@@ -52,6 +76,135 @@ Router::Router(int discoveryTimeout)
 	}
 }
 
+/*
+	The cache file is one value per line:
+	tincanphone-igd 1
+	<control URL>
+	<service type>
+	<local address>
+	<WAN address>
+*/
+static const char cacheHeader[] = "tincanphone-igd 1";
+
+bool Router::loadCache()
+{
+	std::ifstream file(cacheFile.c_str());
+	string header, controlURL, serviceType, cachedLocal, cachedWan;
+	if (!std::getline(file, header) || header != cacheHeader ||
+	    !std::getline(file, controlURL) || !std::getline(file, serviceType) ||
+	    !std::getline(file, cachedLocal) || !std::getline(file, cachedWan))
+	{
+		return false;
+	}
+
+	if (serviceType.size() >= sizeof(upnpData.first.servicetype))
+		return false;
+
+	// If we're now on a different network (or got a new LAN address) the cached IGD is no use to us,
+	// even if something at the same address answers. This check sends nothing so it fails fast.
+	if (!getLocalAddressTo(controlURL.c_str(), localAddr, sizeof(localAddr)) || cachedLocal != localAddr)
+		return false;
+
+	upnpUrls.controlURL = strdup(controlURL.c_str());
+	if (!upnpUrls.controlURL)
+		throw std::bad_alloc();
+	strcpy(upnpData.first.servicetype, serviceType.c_str());
+
+	// A single SOAP request both checks the IGD is still there and refreshes wanAddr
+	wanAddr[0] = '\0';
+	if (UPNP_GetExternalIPAddress(upnpUrls.controlURL, upnpData.first.servicetype, wanAddr) || !wanAddr[0])
+	{
+		FreeUPNPUrls(&upnpUrls);
+		localAddr[0] = '\0';
+		wanAddr[0] = '\0';
+		return false;
+	}
+
+	return true;
+}
+
+void Router::saveCache() const
+{
+	if (cacheFile.empty())
+		return;
+
+	// Failing to write the cache only costs us a slower startup next time, so ignore errors
+	std::ofstream file(cacheFile.c_str(), std::ios::trunc);
+	file << cacheHeader << '\n'
+	     << upnpUrls.controlURL << '\n'
+	     << upnpData.first.servicetype << '\n'
+	     << localAddr << '\n'
+	     << wanAddr << '\n';
+}
+
+string Router::getDefaultCacheFile()
+{
+	// Keep it flat in an existing directory, rather than creating one of our own
+#ifdef _WIN32
+	const char* dir = getenv("LOCALAPPDATA");
+	if (dir && *dir)
+		return string(dir) + "\\tincanphone-igd.cache";
+#else
+	const char* dir = getenv("XDG_CACHE_HOME");
+	if (dir && *dir)
+		return string(dir) + "/tincanphone-igd.cache";
+	dir = getenv("HOME");
+	if (dir && *dir)
+		return string(dir) + "/.cache/tincanphone-igd.cache";
+#endif
+	return string();
+}
+
+// Finds which local address we would use to reach the host in url, without sending anything
+bool Router::getLocalAddressTo(const char* url, char* addr, size_t addrSize)
+{
+	// Pick the host out of "http://host:port/path", where host may be an [IPv6] address
+	const char* host = strstr(url, "://");
+	if (!host)
+		return false;
+	host += 3;
+
+	string hostname;
+	if (*host == '[')
+	{
+		const char* end = strchr(host, ']');
+		if (!end)
+			return false;
+		hostname.assign(host + 1, end);
+	}
+	else
+	{
+		hostname.assign(host, host + strcspn(host, ":/"));
+	}
+
+	addrinfo hints = {};
+	hints.ai_flags = AI_NUMERICHOST;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	addrinfo* result = NULL;
+	if (getaddrinfo(hostname.c_str(), "1900", &hints, &result))
+		return false;
+
+	bool found = false;
+	SOCKET sock = socket(result->ai_family, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock != -1)
+	{
+		// Connecting a UDP socket just picks a route and source address
+		sockaddr_storage local;
+		socklen_t localLen = sizeof(local);
+		if (!connect(sock, result->ai_addr, result->ai_addrlen) &&
+		    !getsockname(sock, (sockaddr*)&local, &localLen) &&
+		    !getnameinfo((sockaddr*)&local, localLen, addr, addrSize, NULL, 0, NI_NUMERICHOST))
+		{
+			found = true;
+		}
+		Socket::close(sock);
+	}
+
+	freeaddrinfo(result);
+	return found;
+}
+
 Router::~Router()
 {
 	try {
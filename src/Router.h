@@ -4,6 +4,7 @@
 #pragma once
 
 #include "PhoneCommon.h"
+#include "PortMapper.h"
 #include "miniupnpc/miniupnpc.h"
 
 namespace tincan {
@@ -11,24 +12,28 @@ namespace tincan {
 
 // Represents a router (or other such NAT device) accessible via UPnP
 // This class uses miniupnpc internally
-class Router
+class Router : public PortMapper
 {
 public:
-	Router(int discoveryTimeout);
+	// If cacheFile is given, the IGD found last time is tried first, and discovery only done if it no longer answers
+	// multicastIf picks the interface address to discover on, rather than the one the default route uses
+	Router(int discoveryTimeout, const string& cacheFile = "", const char* multicastIf = NULL);
 	~Router();
 
+	// Where to keep the IGD cache for this user, or empty if there's no suitable directory
+	static string getDefaultCacheFile();
+
+	// Returns TRUE if the router came from the cache file rather than SSDP discovery
+	bool isCached() const  {return cached;}
+
 	// Returns the local IP as reported by UPnP
 	string getLocalAddress() const  {return localAddr;}
 
-	// Returns the public IP as reported by UPnP
+	// Implement PortMapper
+	const char* getName() const  {return "UPnP";}
 	string getWanAddress() const  {return wanAddr;}
-
-	enum MapProto { MAP_TCP, MAP_UDP };
-
-	// Returns TRUE on success, FALSE if port in use, throws if error
 	bool setPortMapping(uint16 localPort, uint16 wanPort, MapProto protocol, const char* descript);
-
-	// Clears previously set port mapping if any, throws if error
+	uint16 getMappedPort() const  {return mappedPort;}
 	void clearPortMapping();
 
 protected:
@@ -38,7 +43,14 @@ protected:
 	char     wanAddr[64];
 	uint16   mappedPort;
 	MapProto mappedProto;
-	static const char* getProtoStr(MapProto proto)  {return (proto == MAP_TCP) ? "TCP" : "UDP";}
+	string   cacheFile;
+	bool     cached;
+
+	void discover(int discoveryTimeout, const char* multicastIf);
+	bool loadCache();
+	void saveCache() const;
+
+	static bool getLocalAddressTo(const char* url, char* addr, size_t addrSize);
 };
 
 
@@ -0,0 +1,70 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+#include <atomic>
+
+namespace tincan {
+
+
+// Publishes a POD value from exactly one writer thread to any number of reader threads without locking
+// The writer never waits; a reader retries if it catches the writer mid-store
+template <typename T>
+class Seqlock
+{
+public:
+	Seqlock()
+	: seq(0)
+	{
+		store(T());
+	}
+
+	// Writer only
+	void store(const T& value)
+	{
+		uint64 copy[WORDS] = {};
+		memcpy(copy, &value, sizeof(T));
+
+		const size_t s = seq.load(std::memory_order_relaxed);
+		seq.store(s + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		for (size_t i = 0; i < WORDS; ++i)
+			words[i].store(copy[i], std::memory_order_relaxed);
+
+		seq.store(s + 2, std::memory_order_release);
+	}
+
+	T load() const
+	{
+		uint64 copy[WORDS];
+		for (;;)
+		{
+			const size_t before = seq.load(std::memory_order_acquire);
+			if (before & 1)
+				continue;
+
+			for (size_t i = 0; i < WORDS; ++i)
+				copy[i] = words[i].load(std::memory_order_relaxed);
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (seq.load(std::memory_order_relaxed) == before)
+				break;
+		}
+
+		T value;
+		memcpy(&value, copy, sizeof(T));
+		return value;
+	}
+
+protected:
+	enum { WORDS = (sizeof(T) + sizeof(uint64) - 1) / sizeof(uint64) };
+
+	std::atomic<size_t> seq; //Odd while a store is in progress
+	std::atomic<uint64> words[WORDS];
+};
+
+
+}
@@ -2,6 +2,7 @@
 	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
 */
 #include "Socket.h"
+#include "RelayProtocol.h"
 #include <cassert>
 
 #ifndef _WIN32
@@ -31,6 +32,60 @@ void Socket::setBlocking(SOCKET s, bool blocking)
 		throw std::runtime_error("Failed setting socket to non-blocking");
 }
 
+bool Socket::enableTimestamps(SOCKET)
+{
+	return false;
+}
+
+bool Socket::enableReusePort(SOCKET)
+{
+	return false;
+}
+
+int Socket::poll(pollfd* fds, uint count, int timeoutMs)
+{
+	return WSAPoll(fds, count, timeoutMs);
+}
+
+Waker::Waker()
+{
+	// Windows can't poll pipes, so use a UDP socket connected to itself on loopback
+	readFd = writeFd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (readFd == INVALID_SOCKET)
+		throw std::runtime_error("Failed to create wakeup socket");
+
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	int addrLen = sizeof(addr);
+	if (bind(readFd, (sockaddr*)&addr, addrLen) || getsockname(readFd, (sockaddr*)&addr, &addrLen) ||
+		connect(readFd, (sockaddr*)&addr, addrLen))
+	{
+		closesocket(readFd);
+		throw std::runtime_error("Failed to setup wakeup socket: " + Socket::getErrorString());
+	}
+
+	Socket::setBlocking(readFd, false);
+}
+
+Waker::~Waker()
+{
+	closesocket(readFd);
+}
+
+void Waker::signal()
+{
+	char b = 0;
+	send(writeFd, &b, 1, 0);
+}
+
+void Waker::drain()
+{
+	char buf[64];
+	while (recv(readFd, buf, sizeof(buf), 0) > 0)
+		continue;
+}
+
 #else
 
 int Socket::getError()
@@ -58,13 +113,78 @@ void Socket::setBlocking(SOCKET s, bool blocking)
 		throw std::runtime_error("Failed setting socket to non-blocking");
 }
 
+bool Socket::enableTimestamps(SOCKET s)
+{
+#ifdef SO_TIMESTAMPNS
+	int on = 1;
+	return setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == 0;
+#else
+	(void)s;
+	return false;
+#endif
+}
+
+bool Socket::enableReusePort(SOCKET s)
+{
+#if defined(__linux__) && defined(SO_REUSEPORT)
+	int on = 1;
+	return setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == 0;
+#else
+	(void)s;
+	return false;
+#endif
+}
+
+int Socket::poll(pollfd* fds, uint count, int timeoutMs)
+{
+	return ::poll(fds, count, timeoutMs);
+}
+
+Waker::Waker()
+{
+	int fds[2];
+	if (pipe(fds))
+		throw std::runtime_error("Failed to create wakeup pipe");
+	readFd = fds[0];
+	writeFd = fds[1];
+
+	// A full pipe already means "wake up", so neither end should ever block
+	Socket::setBlocking(readFd, false);
+	Socket::setBlocking(writeFd, false);
+}
+
+Waker::~Waker()
+{
+	::close(readFd);
+	::close(writeFd);
+}
+
+void Waker::signal()
+{
+	char b = 0;
+	if (write(writeFd, &b, 1) < 0)
+		return; //EWOULDBLOCK: there's already a wakeup pending
+}
+
+void Waker::drain()
+{
+	char buf[64];
+	while (read(readFd, buf, sizeof(buf)) > 0)
+		continue;
+}
+
 #endif
 
 
-// This suits our purposes while keeping things simple
 string Socket::getErrorString()
 {
-	switch (getError())
+	return getErrorString(getError());
+}
+
+// This suits our purposes while keeping things simple
+string Socket::getErrorString(int error)
+{
+	switch (error)
 	{
 	case EWOULDBLOCK:
 		return "EWOULDBLOCK";
@@ -75,7 +195,7 @@ string Socket::getErrorString()
 	case ECONNRESET:
 		return "ECONNRESET";
 	}
-	return toString(getError());
+	return toString(error);
 }
 
 
@@ -84,6 +204,9 @@ std::ostream& operator << (std::ostream& os, const sockaddr_storage& rhs)
 	char host[NI_MAXHOST];
 	char port[NI_MAXSERV];
 
+	if (isRelayPeer(rhs))
+		return os << '@' << relayPeerId(rhs);
+
 	assert(rhs.ss_family == AF_INET || rhs.ss_family == AF_INET6);
 	const socklen_t size = (rhs.ss_family == AF_INET) ? sizeof(sockaddr_in) : sizeof(sockaddr_in6);
 	int e = getnameinfo((const sockaddr*)&rhs, size, host, sizeof(host), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV);
@@ -17,12 +17,15 @@
 #	define EADDRINUSE       WSAEADDRINUSE
 #	define ECONNABORTED     WSAECONNABORTED
 #	define ECONNRESET       WSAECONNRESET
+#	define ECONNREFUSED     WSAECONNREFUSED
 #else
 #	include <unistd.h>
 #	include <errno.h>
 #	include <sys/types.h>
 #	include <sys/socket.h>
 #	include <netdb.h>
+#	include <arpa/inet.h>
+#	include <poll.h>
 	typedef int SOCKET;     //Since Winsock requires SOCKET type for socket fds
 #endif
 
@@ -35,8 +38,43 @@ class Socket
 public:
 	static int    getError();
 	static string getErrorString();
+	static string getErrorString(int error);
 	static int    close(SOCKET s);
 	static void   setBlocking(SOCKET s, bool blocking);
+
+	// Have the kernel stamp each datagram as it arrives (SO_TIMESTAMPNS), see DatagramBatch::time
+	// Returns false where that isn't supported
+	static bool   enableTimestamps(SOCKET s);
+
+	// Let more sockets bind the same UDP port, with the kernel spreading datagrams across them by sender (SO_REUSEPORT)
+	// Call before bind; returns false where the datagrams wouldn't be spread, which is everywhere but Linux
+	static bool   enableReusePort(SOCKET s);
+
+	// poll() or WSAPoll(); timeoutMs of -1 blocks until an fd is ready
+	static int    poll(pollfd* fds, uint count, int timeoutMs);
+};
+
+
+// Wakes up a thread blocked in Socket::poll from any other thread
+// This is a pipe, or a loopback UDP socket sending to itself on Windows
+class Waker
+{
+public:
+	Waker();
+	~Waker();
+
+	// Poll this fd for POLLIN
+	SOCKET getFd() const  {return readFd;}
+
+	// Make getFd() readable, safe to call from any thread
+	void signal();
+
+	// Clear pending signals, call from the polling thread once getFd() is readable
+	void drain();
+
+protected:
+	SOCKET readFd;
+	SOCKET writeFd;
 };
 
 
@@ -0,0 +1,159 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "Thread.h"
+
+#ifdef _WIN32
+#	define WIN32_LEAN_AND_MEAN
+#	define NOMINMAX
+#	include <Windows.h>
+#	include <process.h>
+#else
+#	include <pthread.h>
+#	include <sched.h>
+#	include <time.h>
+#	include <unistd.h>
+#endif
+
+namespace tincan {
+
+
+Thread::Thread()
+: impl(NULL),
+  func(NULL),
+  arg(NULL)
+{
+}
+
+Thread::~Thread()
+{
+	join();
+}
+
+
+#ifdef _WIN32
+	static unsigned __stdcall threadMain(void* thread)
+	{
+		reinterpret_cast<Thread*>(thread)->run();
+		return 0;
+	}
+
+	void Thread::start(Function func, void* arg)
+	{
+		join();
+		this->func = func;
+		this->arg = arg;
+		HANDLE handle = (HANDLE)_beginthreadex(NULL, 0, threadMain, this, 0, NULL);
+		if (!handle)
+			throw std::runtime_error("Could not start thread");
+		impl = (void*)handle;
+	}
+
+	void Thread::join()
+	{
+		if (!impl)
+			return;
+		WaitForSingleObject((HANDLE)impl, INFINITE);
+		CloseHandle((HANDLE)impl);
+		impl = NULL;
+	}
+
+	void Thread::sleep(uint ms)
+	{
+		Sleep(ms);
+	}
+
+	uint Thread::getCpuCount()
+	{
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return info.dwNumberOfProcessors ? uint(info.dwNumberOfProcessors) : 1;
+	}
+
+	bool Thread::pinToCpu(uint cpu)
+	{
+		if (cpu >= sizeof(DWORD_PTR) * 8)
+			return false;
+		return SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu) != 0;
+	}
+
+	double Thread::getCpuTimeMs()
+	{
+		FILETIME creation, exit, kernel, user;
+		if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+			return 0;
+		const uint64 ticks = (uint64(kernel.dwHighDateTime) << 32 | kernel.dwLowDateTime) +
+		                     (uint64(user.dwHighDateTime) << 32 | user.dwLowDateTime);
+		return ticks / 10000.0; //100ns units
+	}
+#else
+	static void* threadMain(void* thread)
+	{
+		reinterpret_cast<Thread*>(thread)->run();
+		return NULL;
+	}
+
+	void Thread::start(Function func, void* arg)
+	{
+		join();
+		this->func = func;
+		this->arg = arg;
+		pthread_t* handle = new pthread_t;
+		if (pthread_create(handle, NULL, threadMain, this))
+		{
+			delete handle;
+			throw std::runtime_error("Could not start thread");
+		}
+		impl = (void*)handle;
+	}
+
+	void Thread::join()
+	{
+		if (!impl)
+			return;
+		pthread_join(*(pthread_t*)impl, NULL);
+		delete (pthread_t*)impl;
+		impl = NULL;
+	}
+
+	void Thread::sleep(uint ms)
+	{
+		usleep(useconds_t(ms) * 1000);
+	}
+
+	uint Thread::getCpuCount()
+	{
+		const long count = sysconf(_SC_NPROCESSORS_ONLN);
+		return count > 0 ? uint(count) : 1;
+	}
+
+	bool Thread::pinToCpu(uint cpu)
+	{
+#ifdef __linux__
+		if (cpu >= CPU_SETSIZE)
+			return false;
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+		(void)cpu;
+		return false;
+#endif
+	}
+
+	double Thread::getCpuTimeMs()
+	{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+		timespec time;
+		if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time))
+			return 0;
+		return time.tv_sec * 1000.0 + time.tv_nsec / 1000000.0;
+#else
+		return 0;
+#endif
+	}
+#endif
+
+
+}
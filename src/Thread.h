@@ -0,0 +1,53 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+
+namespace tincan {
+
+
+// Runs a function in a new thread
+class Thread
+{
+public:
+	typedef void (*Function)(void* arg);
+
+	Thread();
+	~Thread(); //Joins the thread if still running
+
+	// Start running func(arg), throws if the thread couldn't be created
+	void start(Function func, void* arg);
+
+	// Wait for the thread to return; does nothing if it was never started or already joined
+	void join();
+
+	bool isStarted() const  {return impl != NULL;}
+
+	// Called in the new thread
+	void run()  {func(arg);}
+
+	// Sleep the calling thread
+	static void sleep(uint ms);
+
+	// Logical CPUs in the system, at least 1
+	static uint getCpuCount();
+
+	// Keep the calling thread on one CPU; returns false if that's not supported
+	static bool pinToCpu(uint cpu);
+
+	// CPU time the calling thread has used, 0 where that can't be measured
+	static double getCpuTimeMs();
+
+protected:
+	void*    impl;
+	Function func;
+	void*    arg;
+
+	Thread(const Thread&);
+	Thread& operator = (const Thread&);
+};
+
+
+}
@@ -0,0 +1,163 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "TimeStretch.h"
+#include <cassert>
+#include <cmath>
+#include <algorithm>
+
+namespace tincan {
+
+
+TimeStretch::TimeStretch(uint hop, uint tolerance, uint capacity)
+: hop(hop),
+  tolerance(tolerance),
+  in(capacity),
+  out(capacity),
+  fade(hop)
+{
+	assert(capacity >= 2*hop + 2*tolerance);
+
+	static const double pi = 3.14159265358979;
+	for (uint i = 0; i < hop; ++i)
+		fade[i] = float(0.5 - 0.5 * cos(pi * (i + 0.5) / hop));
+
+	reset();
+}
+
+void TimeStretch::reset()
+{
+	inLen = 0;
+	outLen = 0;
+	started = false;
+	prev = 0;
+	nominal = 0;
+}
+
+bool TimeStretch::process(const int16* input, uint samples, double speed)
+{
+	if (samples > in.size() - inLen)
+		return false;
+
+	memcpy(&in[inLen], input, samples * sizeof(int16));
+	inLen += samples;
+
+	while (outLen + hop <= out.size() && step(speed))
+		continue;
+
+	// Drop input we'll never look at again
+	uint keep = prev + hop;
+	if (nominal - tolerance < keep)
+		keep = uint(std::max(0.0, nominal - tolerance));
+	if (keep)
+	{
+		assert(prev >= keep && inLen >= keep);
+		memmove(&in[0], &in[keep], (inLen - keep) * sizeof(int16));
+		inLen -= keep;
+		prev -= keep;
+		nominal -= keep;
+	}
+
+	return true;
+}
+
+uint TimeStretch::read(int16* output, uint samples)
+{
+	samples = std::min(samples, outLen);
+	memcpy(output, &out[0], samples * sizeof(int16));
+	memmove(&out[0], &out[samples], (outLen - samples) * sizeof(int16));
+	outLen -= samples;
+	return samples;
+}
+
+bool TimeStretch::step(double speed)
+{
+	if (!started)
+	{
+		// The first segment has nothing to overlap with
+		if (inLen < 2*hop)
+			return false;
+		memcpy(&out[outLen], &in[0], hop * sizeof(int16));
+		outLen += hop;
+		prev = 0;
+		nominal = 0;
+		started = true;
+		return true;
+	}
+
+	// The previous segment's second half, which we crossfade out of
+	const uint natural = prev + hop;
+	const double target = nominal + hop * speed;
+
+	uint next;
+	if (speed == 1.0 && std::fabs(target - natural) <= tolerance)
+	{
+		// Not stretching: carry on from the previous segment without searching
+		if (natural + hop > inLen)
+			return false;
+		next = natural;
+		nominal = natural;
+	}
+	else
+	{
+		// Search around where the requested speed puts us for the segment most like 'natural'
+		const uint from = uint(std::max(0.0, target - tolerance));
+		const uint to = uint(target + tolerance);
+		if (to + hop > inLen || natural + hop > inLen)
+			return false;
+		next = findSplice(from, to, natural);
+		nominal = target;
+	}
+
+	// Overlap-add the end of the previous segment with the start of the next
+	for (uint i = 0; i < hop; ++i)
+	{
+		const float mixed = float(in[natural + i]) * (1.f - fade[i]) + float(in[next + i]) * fade[i];
+		out[outLen + i] = int16(std::max(-32768.f, std::min(32767.f, mixed)));
+	}
+	outLen += hop;
+	prev = next;
+
+	return true;
+}
+
+uint TimeStretch::findSplice(uint from, uint to, uint natural) const
+{
+	// Normalized cross-correlation, coarse search on every other offset and sample then refined
+	uint best = from;
+	double bestScore = -1e300;
+
+	for (int pass = 0; pass < 2; ++pass)
+	{
+		uint lo = from, hi = to, stride = 2;
+		if (pass == 1)
+		{
+			lo = (best > from) ? best - 1 : from;
+			hi = std::min(best + 1, to);
+			stride = 1;
+		}
+
+		for (uint s = lo; s <= hi; s += stride)
+		{
+			double corr = 0, energy = 1;
+			for (uint i = 0; i < hop; i += 2)
+			{
+				const double b = in[s + i];
+				corr += double(in[natural + i]) * b;
+				energy += b * b;
+			}
+
+			const double score = corr / std::sqrt(energy);
+			if (score > bestScore)
+			{
+				bestScore = score;
+				best = s;
+			}
+		}
+	}
+
+	return best;
+}
+
+
+}
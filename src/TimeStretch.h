@@ -0,0 +1,51 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+
+namespace tincan {
+
+
+// WSOLA (waveform similarity overlap-add) time-scale modification for mono 16-bit audio
+// Audio is played back faster or slower without changing its pitch, by splicing overlapping
+// segments of input together where their waveforms line up best
+class TimeStretch
+{
+public:
+	// hop: output samples per splice, tolerance: how far (in samples) to search for the best splice
+	// capacity: how many input/output samples can be queued at once
+	TimeStretch(uint hop, uint tolerance, uint capacity);
+
+	// Discard all queued audio
+	void reset();
+
+	// Append input, to be played back at the given speed (1 = unchanged, >1 = faster)
+	// Returns FALSE if there isn't room to queue it
+	bool process(const int16* input, uint samples, double speed);
+
+	// Number of output samples ready to be read
+	uint available() const  {return outLen;}
+
+	// Take samples of output; returns how many were read
+	uint read(int16* output, uint samples);
+
+protected:
+	uint hop;
+	uint tolerance;
+	vector<int16> in;
+	vector<int16> out;
+	vector<float> fade;  //Rising half of a Hann window, hop samples long
+	uint   inLen;
+	uint   outLen;
+	bool   started;
+	uint   prev;     //Start of the previous segment in 'in'
+	double nominal;  //Where the previous segment would have started at exactly the requested speed
+
+	bool step(double speed);
+	uint findSplice(uint from, uint to, uint natural) const;
+};
+
+
+}
@@ -0,0 +1,138 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "TimerAudioDevice.h"
+#include "Clock.h"
+#include <algorithm>
+
+namespace tincan {
+
+
+TimerAudioDevice::TimerAudioDevice()
+: startTime(0),
+  sampleRate(0),
+  framesPerBuffer(0),
+  callback(NULL),
+  callbackArg(NULL),
+  stopping(false),
+  framesRead(0),
+  framesWritten(0)
+{
+}
+
+TimerAudioDevice::~TimerAudioDevice()
+{
+	stop();
+}
+
+void TimerAudioDevice::stop()
+{
+	stopping = true;
+	thread.join();
+}
+
+void TimerAudioDevice::start(uint rate, ulong frames, Callback callbackFunc, void* arg)
+{
+	sampleRate = rate;
+	framesPerBuffer = frames ? frames : rate * DEFAULT_BUFFER_MS / 1000;
+	callback = callbackFunc;
+	callbackArg = arg;
+	startTime = Clock::now();
+
+	if (callback)
+		thread.start(&timerThread, this);
+}
+
+double TimerAudioDevice::getTime() const
+{
+	return double(Clock::now() - startTime) / (Clock::MS * 1000.0);
+}
+
+uint64 TimerAudioDevice::framesElapsed() const
+{
+	return (Clock::now() - startTime) * sampleRate / (Clock::MS * 1000);
+}
+
+void TimerAudioDevice::waitForFrame(uint64 frame) const
+{
+	for (uint64 now = framesElapsed(); now < frame; now = framesElapsed())
+	{
+		const uint64 ms = (frame - now) * 1000 / sampleRate;
+		Thread::sleep(uint(ms ? ms : 1));
+	}
+}
+
+long TimerAudioDevice::readAvailable()
+{
+	// A reader that falls too far behind loses the oldest input, as a sound card would
+	const uint64 elapsed = framesElapsed();
+	const uint64 limit = uint64(QUEUE_BUFFERS) * framesPerBuffer;
+	if (elapsed - framesRead > limit)
+	{
+		vector<int16> lost(framesPerBuffer);
+		while (elapsed - framesRead > limit)
+		{
+			const ulong count = ulong(std::min<uint64>(framesPerBuffer, elapsed - framesRead - limit));
+			capture(&lost[0], count);
+			framesRead += count;
+		}
+	}
+	return long(elapsed - framesRead);
+}
+
+void TimerAudioDevice::read(int16* buffer, ulong frames)
+{
+	waitForFrame(framesRead + frames);
+	capture(buffer, frames);
+	framesRead += frames;
+}
+
+bool TimerAudioDevice::write(const int16* buffer, ulong frames)
+{
+	// If the clock has passed everything queued so far, that time was played as silence
+	const uint64 elapsed = framesElapsed();
+	const bool underflow = (framesWritten < elapsed);
+	if (underflow)
+	{
+		vector<int16> silence(framesPerBuffer);
+		while (framesWritten < elapsed)
+		{
+			const ulong count = ulong(std::min<uint64>(framesPerBuffer, elapsed - framesWritten));
+			play(&silence[0], count);
+			framesWritten += count;
+		}
+	}
+
+	// Wait for room in the queue
+	const uint64 limit = uint64(QUEUE_BUFFERS) * framesPerBuffer;
+	if (framesWritten + frames > limit)
+		waitForFrame(framesWritten + frames - limit);
+
+	play(buffer, frames);
+	framesWritten += frames;
+	return !underflow;
+}
+
+void TimerAudioDevice::timerThread(void* device)
+{
+	reinterpret_cast<TimerAudioDevice*>(device)->runTimer();
+}
+
+void TimerAudioDevice::runTimer()
+{
+	vector<int16> input(framesPerBuffer);
+	vector<int16> output(framesPerBuffer);
+
+	for (uint64 frame = framesPerBuffer; !stopping; frame += framesPerBuffer)
+	{
+		// Each buffer is handed over once the clock reaches its end, as a sound card would
+		waitForFrame(frame);
+
+		capture(&input[0], framesPerBuffer);
+		callback(&input[0], &output[0], framesPerBuffer, getTime(), false, callbackArg);
+		play(&output[0], framesPerBuffer);
+	}
+}
+
+
+}
@@ -0,0 +1,62 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+#include "AudioDevice.h"
+#include "Thread.h"
+#include <atomic>
+
+namespace tincan {
+
+
+// Base for devices without hardware: a timer stands in for the sound card's clock,
+// and subclasses supply the captured samples and take the played ones
+class TimerAudioDevice : public AudioDevice
+{
+public:
+	enum {
+		DEFAULT_BUFFER_MS = 10, //Callback period when start() lets the device choose
+		QUEUE_BUFFERS = 4       //How far ahead of the clock blocking writes may queue, and how far behind reads may fall
+	};
+
+	TimerAudioDevice();
+	~TimerAudioDevice(); //Subclasses must call stop() in their own destructors
+
+	void   start(uint sampleRate, ulong framesPerBuffer, Callback callback, void* arg);
+	double getTime() const;
+	long   readAvailable();
+	void   read(int16* buffer, ulong frames);
+	bool   write(const int16* buffer, ulong frames);
+
+protected:
+	// Called in the timer thread (callback mode) or the caller of read()/write() (blocking mode)
+	virtual void capture(int16* buffer, ulong frames) = 0;
+	virtual void play(const int16* buffer, ulong frames) = 0;
+
+	// Stops the timer thread, so capture() and play() aren't called any more
+	void stop();
+
+	uint64 startTime;
+	uint   sampleRate;
+	ulong  framesPerBuffer;
+
+	// Callback mode
+	Callback          callback;
+	void*             callbackArg;
+	Thread            thread;
+	std::atomic<bool> stopping;
+
+	// Blocking mode: samples taken and given so far, compared against the clock
+	uint64 framesRead;
+	uint64 framesWritten;
+
+	uint64 framesElapsed() const;
+	void   waitForFrame(uint64 frame) const;
+	static void timerThread(void* device);
+	void   runTimer();
+};
+
+
+}
@@ -0,0 +1,49 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+#include "DatagramBatch.h"
+#include "Socket.h"
+#include <ostream>
+
+namespace tincan {
+
+
+enum { TRANSPORT_HEADER_MAX = 16 }; //Most a Transport adds to each datagram, so batches need this much room beyond the packet
+
+// Where Phone's datagrams go: a UDP socket, or a stand-in network for tests and benchmarks
+// Errors are reported like the socket calls they stand for: -1 with Socket::getError() set
+class Transport
+{
+public:
+	virtual ~Transport()  {}
+
+	// Binds the first free port from firstPort to lastPort and returns it, throws if there's none
+	virtual uint16 bind(uint16 firstPort, uint16 lastPort) = 0;
+
+	// Readable (POLLIN) when datagrams may be waiting
+	virtual SOCKET getFd() const = 0;
+
+	// Replace the batch's contents with up to its capacity of datagrams without blocking
+	// Returns how many were received: 0, or -1 with EWOULDBLOCK, if none were waiting
+	virtual int receive(DatagramBatch& batch) = 0;
+
+	// Send everything queued in the batch, then clear it; see DatagramBatch::send
+	virtual int send(DatagramBatch& batch) = 0;
+
+	// Send a single datagram; returns the bytes sent, or -1
+	virtual int sendTo(const void* data, uint size, const sockaddr_storage& to) = 0;
+
+	// For addresses only this transport understands (like a relay's client IDs): parse one the user typed
+	// Returns false, leaving addr alone, if text isn't one
+	virtual bool parseAddress(const char* text, sockaddr_storage& addr)  {(void)text; (void)addr; return false;}
+
+	// For transports with timers of their own (like a relay's keepalives): do whatever is due and log
+	// anything the user should know; returns when to call again, 0 for never
+	virtual uint64 service(uint64 now, std::ostream& log)  {(void)now; (void)log; return 0;}
+};
+
+
+}
@@ -0,0 +1,52 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "UdpTransport.h"
+
+namespace tincan {
+
+
+UdpTransport::UdpTransport()
+{
+	sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock == -1)
+		throw std::runtime_error("Failed to create socket");
+
+	Socket::setBlocking(sock, false);
+
+	// Only improves the jitter measurement, so do without if it's not there
+	Socket::enableTimestamps(sock);
+}
+
+UdpTransport::~UdpTransport()
+{
+	// Close socket (ignore errors)
+	Socket::close(sock);
+}
+
+uint16 UdpTransport::bind(uint16 firstPort, uint16 lastPort)
+{
+	for (uint16 port = firstPort; ; ++port)
+	{
+		sockaddr_in bindaddr;
+		bindaddr.sin_family = AF_INET;
+		bindaddr.sin_addr.s_addr = INADDR_ANY;
+		bindaddr.sin_port = htons(port);
+		if ( !::bind(sock, (sockaddr*)&bindaddr, sizeof(bindaddr)) )
+			return port;
+
+		if (Socket::getError() != EADDRINUSE)
+			throw std::runtime_error("Could not bind UDP port " + toString(port) + ": " + Socket::getErrorString());
+		if (port >= lastPort)
+			throw std::runtime_error("Could not find an available local port");
+	}
+}
+
+int UdpTransport::sendTo(const void* data, uint size, const sockaddr_storage& to)
+{
+	const int tosize = (to.ss_family == AF_INET) ? sizeof(sockaddr_in) : sizeof(sockaddr_in6);
+	return sendto(sock, (const char*)data, size, 0, (const sockaddr*)&to, tosize);
+}
+
+
+}
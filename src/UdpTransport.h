@@ -0,0 +1,33 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+#include "Transport.h"
+
+namespace tincan {
+
+
+// A non-blocking IPv4 UDP socket on all interfaces
+class UdpTransport : public Transport
+{
+public:
+	UdpTransport(); //Throws if the socket can't be created
+	~UdpTransport();
+
+	uint16 bind(uint16 firstPort, uint16 lastPort);
+	SOCKET getFd() const  {return sock;}
+	int    receive(DatagramBatch& batch)  {return batch.receive(sock);}
+	int    send(DatagramBatch& batch)     {return batch.send(sock);}
+	int    sendTo(const void* data, uint size, const sockaddr_storage& to);
+
+protected:
+	SOCKET sock;
+
+	UdpTransport(const UdpTransport&);
+	UdpTransport& operator = (const UdpTransport&);
+};
+
+
+}
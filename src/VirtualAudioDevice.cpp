@@ -0,0 +1,74 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "VirtualAudioDevice.h"
+#include "Clock.h"
+
+namespace tincan {
+
+
+VirtualAudioDevice::VirtualAudioDevice(double drift)
+: driftPpm(drift),
+  startTime(0),
+  sampleRate(0),
+  framesPerBuffer(0),
+  tickUs(0),
+  ticks(0),
+  callback(NULL),
+  callbackArg(NULL)
+{
+}
+
+void VirtualAudioDevice::start(uint rate, ulong frames, Callback callbackFunc, void* arg)
+{
+	if (!callbackFunc)
+		throw std::runtime_error("Simulated audio only supports callback mode");
+
+	sampleRate = rate;
+	framesPerBuffer = frames ? frames : rate * DEFAULT_BUFFER_MS / 1000;
+	callback = callbackFunc;
+	callbackArg = arg;
+	input.resize(framesPerBuffer);
+	output.resize(framesPerBuffer);
+
+	// A fast crystal gets through each buffer in a little less time
+	tickUs = double(framesPerBuffer) * Clock::MS * 1000.0 / rate / (1.0 + driftPpm / 1e6);
+	startTime = Clock::now();
+}
+
+double VirtualAudioDevice::getTime() const
+{
+	// The stream's own idea of time, which is off by the drift
+	return double(getFramesPlayed()) / sampleRate;
+}
+
+uint64 VirtualAudioDevice::getNextTick() const
+{
+	return callback ? startTime + uint64((ticks + 1) * tickUs) : 0;
+}
+
+void VirtualAudioDevice::tick()
+{
+	capture(&input[0], framesPerBuffer);
+	++ticks;
+	callback(&input[0], &output[0], framesPerBuffer, getTime(), false, callbackArg);
+	play(&output[0], framesPerBuffer);
+}
+
+long VirtualAudioDevice::readAvailable()
+{
+	throw std::runtime_error("Simulated audio only supports callback mode");
+}
+
+void VirtualAudioDevice::read(int16*, ulong)
+{
+	throw std::runtime_error("Simulated audio only supports callback mode");
+}
+
+bool VirtualAudioDevice::write(const int16*, ulong)
+{
+	throw std::runtime_error("Simulated audio only supports callback mode");
+}
+
+
+}
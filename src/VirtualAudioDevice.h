@@ -0,0 +1,54 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+#include "AudioDevice.h"
+
+namespace tincan {
+
+
+// A sound card for simulations on a virtual Clock: nothing happens on its own, the simulation calls tick()
+// once the clock reaches getNextTick() and one buffer goes through the callback in the simulation's thread
+// Its crystal can be off by some parts per million, like real ones, so two ends' sample rates drift apart
+// Only callback mode is supported; subclasses supply the captured samples and take the played ones
+class VirtualAudioDevice : public AudioDevice
+{
+public:
+	enum { DEFAULT_BUFFER_MS = 10 }; //Callback period when start() lets the device choose
+
+	explicit VirtualAudioDevice(double driftPpm = 0);
+
+	void   start(uint sampleRate, ulong framesPerBuffer, Callback callback, void* arg);
+	double getTime() const;
+	long   readAvailable();
+	void   read(int16* buffer, ulong frames);
+	bool   write(const int16* buffer, ulong frames);
+
+	// 0 until started
+	uint64 getNextTick() const;
+
+	// Run the buffer due at getNextTick()
+	void tick();
+
+	uint64 getFramesPlayed() const  {return ticks * framesPerBuffer;}
+
+protected:
+	virtual void capture(int16* buffer, ulong frames) = 0;
+	virtual void play(const int16* buffer, ulong frames) = 0;
+
+	double         driftPpm;
+	uint64         startTime;
+	uint           sampleRate;
+	ulong          framesPerBuffer;
+	double         tickUs;     //Clock time per buffer, drift included
+	uint64         ticks;
+	Callback       callback;
+	void*          callbackArg;
+	vector<int16>  input;
+	vector<int16>  output;
+};
+
+
+}
@@ -0,0 +1,181 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#include "WavAudioDevice.h"
+#include <algorithm>
+
+namespace tincan {
+
+
+static uint32 getLE32(const byte* data)
+{
+	return uint32(data[0]) | (uint32(data[1]) << 8) | (uint32(data[2]) << 16) | (uint32(data[3]) << 24);
+}
+
+static uint16 getLE16(const byte* data)
+{
+	return uint16(data[0] | (data[1] << 8));
+}
+
+static void putLE32(byte* data, uint32 value)
+{
+	data[0] = byte(value);
+	data[1] = byte(value >> 8);
+	data[2] = byte(value >> 16);
+	data[3] = byte(value >> 24);
+}
+
+static void putLE16(byte* data, uint16 value)
+{
+	data[0] = byte(value);
+	data[1] = byte(value >> 8);
+}
+
+
+WavAudioDevice::WavAudioDevice(const string& inputFile, const string& outputFile)
+: inputName(inputFile.empty() ? "silence" : inputFile),
+  outputName(outputFile.empty() ? "null" : outputFile),
+  inputPos(0),
+  output(NULL),
+  outputFrames(0)
+{
+	if (!outputFile.empty())
+	{
+		output = fopen(outputFile.c_str(), "wb");
+		if (!output)
+			throw std::runtime_error("Could not create " + outputFile);
+	}
+}
+
+WavAudioDevice::~WavAudioDevice()
+{
+	stop();
+
+	// Now that the length is known, fill it in
+	if (output)
+	{
+		writeHeader(sampleRate, outputFrames);
+		fclose(output);
+	}
+}
+
+void WavAudioDevice::start(uint rate, ulong frames, Callback callbackFunc, void* arg)
+{
+	if (inputName != "silence")
+		readFile(inputName, rate, input);
+
+	// Leave room for the header, written again with the real length at the end
+	if (output)
+		writeHeader(rate, 0);
+
+	TimerAudioDevice::start(rate, frames, callbackFunc, arg);
+}
+
+void WavAudioDevice::readFile(const string& filename, uint rate, vector<int16>& samples)
+{
+	samples.clear();
+	FILE* file = fopen(filename.c_str(), "rb");
+	if (!file)
+		throw std::runtime_error("Could not open " + filename);
+
+	// Walk the chunks for "fmt " and "data", skipping anything else
+	byte header[12];
+	bool valid = fread(header, 1, 12, file) == 12 && !memcmp(header, "RIFF", 4) && !memcmp(header + 8, "WAVE", 4);
+	bool formatOk = false;
+	while (valid && samples.empty())
+	{
+		byte chunk[8];
+		if (fread(chunk, 1, 8, file) != 8)
+			break;
+		const uint32 size = getLE32(chunk + 4);
+
+		if (!memcmp(chunk, "fmt ", 4) && size >= 16)
+		{
+			byte fmt[16];
+			valid = fread(fmt, 1, 16, file) == 16 && fseek(file, (size - 16 + 1) & ~1u, SEEK_CUR) == 0;
+			formatOk = getLE16(fmt) == 1 && getLE16(fmt + 2) == 1 && getLE32(fmt + 4) == rate && getLE16(fmt + 14) == 16;
+			if (!formatOk)
+				break;
+		}
+		else if (!memcmp(chunk, "data", 4) && formatOk)
+		{
+			vector<byte> data(size);
+			const size_t got = fread(data.empty() ? NULL : &data[0], 1, size, file);
+			samples.resize(got / 2);
+			for (size_t s = 0; s < samples.size(); ++s)
+				samples[s] = int16(getLE16(&data[s * 2]));
+			if (samples.empty())
+				break;
+		}
+		else
+		{
+			valid = fseek(file, (size + 1) & ~1u, SEEK_CUR) == 0;
+		}
+	}
+	fclose(file);
+
+	if (!formatOk)
+		throw std::runtime_error(filename + " is not a 16-bit mono PCM WAV file at " + toString(rate) + "Hz");
+	if (samples.empty())
+		throw std::runtime_error(filename + " has no audio");
+}
+
+void WavAudioDevice::writeHeader(uint rate, uint64 frames)
+{
+	const uint32 dataSize = uint32(std::min<uint64>(frames * 2, 0xFFFFFFFFu - HEADER_SIZE));
+
+	byte header[HEADER_SIZE];
+	memcpy(header, "RIFF", 4);
+	putLE32(header + 4, HEADER_SIZE - 8 + dataSize);
+	memcpy(header + 8, "WAVEfmt ", 8);
+	putLE32(header + 16, 16);        //fmt chunk size
+	putLE16(header + 20, 1);         //PCM
+	putLE16(header + 22, 1);         //Mono
+	putLE32(header + 24, rate);
+	putLE32(header + 28, rate * 2);  //Bytes per second
+	putLE16(header + 32, 2);         //Bytes per frame
+	putLE16(header + 34, 16);        //Bits per sample
+	memcpy(header + 36, "data", 4);
+	putLE32(header + 40, dataSize);
+
+	fseek(output, 0, SEEK_SET);
+	fwrite(header, 1, HEADER_SIZE, output);
+	fseek(output, 0, SEEK_END);
+}
+
+void WavAudioDevice::capture(int16* buffer, ulong frames)
+{
+	if (input.empty())
+	{
+		memset(buffer, 0, frames * sizeof(int16));
+		return;
+	}
+
+	for (ulong s = 0; s < frames; ++s)
+	{
+		buffer[s] = input[inputPos];
+		if (++inputPos == input.size())
+			inputPos = 0;
+	}
+}
+
+void WavAudioDevice::play(const int16* buffer, ulong frames)
+{
+	if (!output)
+		return;
+
+	byte data[2 * 1024];
+	while (frames)
+	{
+		const ulong count = std::min<ulong>(frames, sizeof(data) / 2);
+		for (ulong s = 0; s < count; ++s)
+			putLE16(&data[s * 2], uint16(buffer[s]));
+		fwrite(data, 2, count, output);
+		outputFrames += count;
+		buffer += count;
+		frames -= count;
+	}
+}
+
+
+}
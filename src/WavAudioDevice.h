@@ -0,0 +1,48 @@
+/*
+	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
+*/
+#pragma once
+
+#include "PhoneCommon.h"
+#include "TimerAudioDevice.h"
+#include <cstdio>
+
+namespace tincan {
+
+
+// Takes its microphone input from a WAV file and records playout to another, at the pace of a real sound card
+// Files are 16-bit mono PCM at the stream's sample rate; the input repeats from the start when it runs out
+class WavAudioDevice : public TimerAudioDevice
+{
+public:
+	// Either filename may be empty, to capture silence or throw away playout; throws if a file can't be opened
+	WavAudioDevice(const string& inputFile, const string& outputFile);
+	~WavAudioDevice(); //Finishes writing the output file
+
+	string getInputName() const   {return inputName;}
+	string getOutputName() const  {return outputName;}
+
+	// Also checks the input file's format against sampleRate, and writes the output file's header
+	void start(uint sampleRate, ulong framesPerBuffer, Callback callback, void* arg);
+
+	// Reads a whole 16-bit mono PCM file, throws if it's some other format or rate, or empty
+	static void readFile(const string& filename, uint sampleRate, vector<int16>& samples);
+
+protected:
+	enum { HEADER_SIZE = 44 }; //Canonical RIFF/WAVE header, as written by this class
+
+	string        inputName;
+	string        outputName;
+	vector<int16> input;     //The whole input file, so capture never waits on the disk
+	size_t        inputPos;
+	FILE*         output;
+	uint64        outputFrames;
+
+	void capture(int16* buffer, ulong frames);
+	void play(const int16* buffer, ulong frames);
+
+	void writeHeader(uint sampleRate, uint64 frames);
+};
+
+
+}
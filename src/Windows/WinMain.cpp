@@ -42,7 +42,7 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE, LPSTR lpCmdLine, int nCmdShow
 		// Create Phone object, which will run its main loop in the thread created below
 		phone = new Phone();
 
-		// Create Window, which will handle output from and send input to Phone, synchronized via Phone.mutex
+		// Create Window, which will handle output from and send input to Phone through its lock-free queues
 		Window::registerClass();
 		window = new Window(phone, nCmdShow);
 
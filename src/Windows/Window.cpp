@@ -2,6 +2,7 @@
 	(C) 2016 Gary Sinitsin. See LICENSE file (MIT license).
 */
 #include "Window.h"
+#include <cstdio>
 
 namespace tincan {
 
@@ -176,17 +177,26 @@ void Window::onCreate()
 		handle, (HMENU)IDC_ANSWER_HANGUP, hInstance, NULL);
 	setupControl(hctl);
 
+	// Call statistics line, empty unless LIVE
+	hctl = CreateWindow(L"STATIC", L"", WS_VISIBLE | WS_CHILD | SS_LEFT,
+		0, 0, WIN_MIN_W, TEXT_H,
+		handle, (HMENU)IDC_STATS, hInstance, NULL);
+	setupControl(hctl);
+
 	onSize();
 }
 
 void Window::onSize()
 {
 	// Fit log in window, leaving space at the bottom for other controls
-	SetWindowPos(hlog, NULL,  1, 1,  width-2, height-MARGIN-BUTTON_H-MARGIN, SWP_NOZORDER);
+	SetWindowPos(hlog, NULL,  1, 1,  width-2, height-MARGIN-BUTTON_H-MARGIN-TEXT_H-SPACE, SWP_NOZORDER);
 
-	// Keep bottom controls at bottom
+	// Keep bottom controls at bottom, with the statistics line just above them
 	const uint nosize = SWP_NOSIZE|SWP_NOZORDER;
 	HWND hctl;
+	hctl = GetDlgItem(handle, IDC_STATS);
+	SetWindowPos(hctl, NULL,  MARGIN, height-MARGIN-BUTTON_H-MARGIN-TEXT_H+SPACE,  width-MARGIN*2, TEXT_H, SWP_NOZORDER);
+
 	hctl = GetDlgItem(handle, IDC_ADDR_LABEL);
 	SetWindowPos(hctl, NULL,  MARGIN, (height-BUTTON_H-MARGIN)+6,  0,0, nosize);
 
@@ -280,6 +290,32 @@ void Window::updateLog()
 	}
 }
 
+void Window::updateStats()
+{
+	const Phone::Status status = phone->getStatus();
+	const Phone::TransportStats& link = status.transport;
+
+	char text[256] = "";
+	if (status.state == Phone::LIVE && link.reportsReceived)
+	{
+		int len = snprintf(text, sizeof(text), "Round trip %.0fms     Loss %.1f%% in, %.1f%% out     Jitter %.1fms in, %.1fms out",
+		                   link.rttMs, link.lossPercent, link.sentLossPercent, link.jitterMs, link.sentJitterMs);
+		if (link.bitrate && len > 0 && size_t(len) < sizeof(text))
+			snprintf(text + len, sizeof(text) - len, "     Sending %.0fkbps", link.bitrate / 1000.0);
+	}
+	else if (status.state == Phone::LIVE)
+	{
+		// The peer doesn't send REPORTs (yet), so we only know about our side
+		snprintf(text, sizeof(text), "Lost %lu of %lu packets     Jitter %.1fms", link.lost, link.lost + link.received, link.jitterMs);
+	}
+
+	// Only touch the control when the text changes, so it doesn't flicker
+	char current[256];
+	GetDlgItemTextA(handle, IDC_STATS, current, sizeof(current));
+	if (strcmp(text, current))
+		SetDlgItemTextA(handle, IDC_STATS, text);
+}
+
 void Window::onCommand(const WORD id)
 {
 	if (id == IDC_CALL)
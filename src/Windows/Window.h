@@ -37,6 +37,7 @@ protected:
 		IDC_ADDR          = 102,
 		IDC_CALL          = IDOK,
 		IDC_ANSWER_HANGUP = 200,
+		IDC_STATS         = 201,
 		
 		LOG_TIMER_ID   = 1,
 		LOG_UPDATE_MS  = 150,  //How often to pull log messages out of the Phone thread
@@ -74,6 +75,7 @@ protected:
 	{
 		assert(sWindow);
 		sWindow->updateLog();
+		sWindow->updateStats();
 	}
 
 	static LRESULT CALLBACK LogWndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam, UINT_PTR uIdSubclass, DWORD_PTR);
@@ -86,6 +88,8 @@ protected:
 
 	void updateLog();
 
+	void updateStats();
+
 	void onCommand(const WORD id);
 
 	void destroy();